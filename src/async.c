@@ -0,0 +1,435 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "async.h"
+
+/* 'Private' helper functions */
+static int submit(struct hashDB_async *, int, int, int, const char *,
+		  hashDB_async_fn, void *);
+
+static void *async_worker(void *);
+
+static struct hashDB_async_req *run_gets(struct hashDB_async *,
+					 struct hashDB_async_req *,
+					 char **, size_t *);
+
+static void complete(struct hashDB_async *, struct hashDB_async_req *,
+		     int, int, char *);
+
+static void signal_efd(struct hashDB_async *);
+
+static void drain_efd(struct hashDB_async *);
+
+
+/*
+ * Starts running async requests on the database. While requests are
+ * running the database must not be used any other way, except through
+ * functions that only read the struct (e.g. hashDB_load_progress).
+ *
+ * Parameter:
+ *	db => database the requests run on
+ *
+ * Returns:
+ *	Pointer to a hashDB_async struct, caller must stop it by calling
+ *	hashDB_async_free, or NULL if there is an error (check errno)
+ */
+struct hashDB_async *hashDB_async_init(struct hashDB *db)
+{
+	struct hashDB_async  *a;
+	int                  err;
+
+	if ((a = calloc(1, sizeof(struct hashDB_async))) == NULL)
+		return NULL;
+
+	a->db = db;
+	if ((a->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		free(a);
+		return NULL;
+	}
+
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->submitted, NULL);
+	pthread_cond_init(&a->completed, NULL);
+
+	if ((err = pthread_create(&a->thread, NULL, async_worker, a)) != 0) {
+		pthread_cond_destroy(&a->completed);
+		pthread_cond_destroy(&a->submitted);
+		pthread_mutex_destroy(&a->lock);
+		close(a->efd);
+		free(a);
+		errno = err;
+		return NULL;
+	}
+
+	return a;
+}
+
+
+/*
+ * Runs every request still queued, then stops the worker. Completions
+ * nobody took from the completion queue are dropped along with their
+ * values. The database is left open.
+ *
+ * Parameter:
+ *	a => struct to free
+ *
+ * Returns:
+ *	void
+ */
+void hashDB_async_free(struct hashDB_async *a)
+{
+	struct hashDB_async_done *d;
+
+	pthread_mutex_lock(&a->lock);
+	a->stop = 1;
+	pthread_cond_signal(&a->submitted);
+	pthread_mutex_unlock(&a->lock);
+	pthread_join(a->thread, NULL);
+
+	while ((d = a->done) != NULL) {
+		a->done = d->next;
+		free(d->c.val);
+		free(d);
+	}
+
+	pthread_cond_destroy(&a->completed);
+	pthread_cond_destroy(&a->submitted);
+	pthread_mutex_destroy(&a->lock);
+	close(a->efd);
+	free(a);
+}
+
+
+/*
+ * Queues a get of the key. Once it has run the completion is handed to
+ * fn, or queued in the completion queue if fn is NULL. res and val of the
+ * completion are what hashDB_get would have returned.
+ *
+ * Parameters:
+ *	a => async struct of the database
+ *	key => key to look up
+ *	fn => callback, called on the worker thread, or NULL
+ *	arg => passed back in the completion
+ *
+ * Returns:
+ *	0 if the request was queued, -1 otherwise (check errno, ENOMEM if
+ *	there is no memory for the request or its completion)
+ */
+int hashDB_get_async(struct hashDB_async *a, int key, hashDB_async_fn fn,
+		     void *arg)
+{
+	return submit(a, HASHDB_ASYNC_GET, key, 0, NULL, fn, arg);
+}
+
+
+/*
+ * Queues a put of the key value pair. The value is copied, the caller may
+ * reuse val as soon as the call returns. Once it has run the completion
+ * is handed to fn, or queued in the completion queue if fn is NULL. res
+ * of the completion is what hashDB_put would have returned.
+ *
+ * Parameters:
+ *	a => async struct of the database
+ *	key => key to put
+ *	val_len => length of the value
+ *	val => value to put
+ *	fn => callback, called on the worker thread, or NULL
+ *	arg => passed back in the completion
+ *
+ * Returns:
+ *	0 if the request was queued, -1 otherwise (check errno, ENOMEM if
+ *	there is no memory for the request or its completion)
+ */
+int hashDB_put_async(struct hashDB_async *a, int key, int val_len,
+		     const char *val, hashDB_async_fn fn, void *arg)
+{
+	return submit(a, HASHDB_ASYNC_PUT, key, val_len, val, fn, arg);
+}
+
+
+/*
+ * Gets the eventfd of the completion queue. It is readable while there
+ * are completions to take, so it can be waited on with poll, select, or
+ * epoll alongside other descriptors. Only hashDB_async_poll and
+ * hashDB_async_wait may read it.
+ *
+ * Returns:
+ *	The file descriptor, owned by the async struct
+ */
+int hashDB_async_fd(struct hashDB_async *a)
+{
+	return a->efd;
+}
+
+
+/*
+ * Takes up to max completions from the completion queue, oldest first,
+ * without waiting
+ *
+ * Parameters:
+ *	a => async struct of the database
+ *	out => where to store the completions, the caller must free the
+ *	       val of each
+ *	max => room in out
+ *
+ * Returns:
+ *	Number of completions stored in out
+ */
+int hashDB_async_poll(struct hashDB_async *a, struct hashDB_completion *out,
+		      int max)
+{
+	struct hashDB_async_done  *d;
+	int                       n = 0;
+
+	pthread_mutex_lock(&a->lock);
+	while (n < max && (d = a->done) != NULL) {
+		a->done = d->next;
+		out[n++] = d->c;
+		free(d);
+	}
+	if (a->done == NULL) {
+		a->done_tail = NULL;
+		drain_efd(a);
+	}
+	pthread_mutex_unlock(&a->lock);
+	return n;
+}
+
+
+/*
+ * Like hashDB_async_poll, but waits for a completion if there is none
+ *
+ * Returns:
+ *	Number of completions stored in out, at least 1 unless max is 0
+ */
+int hashDB_async_wait(struct hashDB_async *a, struct hashDB_completion *out,
+		      int max)
+{
+	pthread_mutex_lock(&a->lock);
+	while (max > 0 && a->done == NULL)
+		pthread_cond_wait(&a->completed, &a->lock);
+	pthread_mutex_unlock(&a->lock);
+
+	return hashDB_async_poll(a, out, max);
+}
+
+
+/*
+ * Queues a request and wakes the worker. A request without a callback
+ * gets its completion queue entry here, so running out of memory is
+ * reported to the caller instead of losing the completion.
+ */
+static int submit(struct hashDB_async *a, int op, int key, int val_len,
+		  const char *val, hashDB_async_fn fn, void *arg)
+{
+	struct hashDB_async_req *req;
+
+	if (op == HASHDB_ASYNC_PUT && val_len < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((req = calloc(1, sizeof(struct hashDB_async_req))) == NULL)
+		return -1;
+
+	if ((fn == NULL &&
+	     (req->done = malloc(sizeof(struct hashDB_async_done))) == NULL) ||
+	    (op == HASHDB_ASYNC_PUT && (req->val = malloc(val_len + 1)) == NULL)) {
+		free(req->done);
+		free(req);
+		return -1;
+	}
+
+	if (op == HASHDB_ASYNC_PUT) {
+		memcpy(req->val, val, val_len);
+		req->val[val_len] = '\0';
+	}
+
+	req->op = op;
+	req->key = key;
+	req->val_len = val_len;
+	req->fn = fn;
+	req->arg = arg;
+
+	pthread_mutex_lock(&a->lock);
+	if (a->tail)
+		a->tail->next = req;
+	else
+		a->head = req;
+	a->tail = req;
+	pthread_cond_signal(&a->submitted);
+	pthread_mutex_unlock(&a->lock);
+	return 0;
+}
+
+
+/*
+ * Worker of the async struct passed in arg. Takes every queued request at
+ * once and runs them in order, runs of gets through run_gets. Stops once
+ * hashDB_async_free was called and the queue is empty.
+ */
+static void *async_worker(void *arg)
+{
+	struct hashDB_async      *a = arg;
+	struct hashDB_async_req  *req, *next;
+	size_t                   len = HASHDB_ASYNC_ARENA;
+	char                     *arena = malloc(len);
+	int                      res;
+
+	while (1) {
+		pthread_mutex_lock(&a->lock);
+		while (a->head == NULL && !a->stop)
+			pthread_cond_wait(&a->submitted, &a->lock);
+		req = a->head;
+		a->head = a->tail = NULL;
+		pthread_mutex_unlock(&a->lock);
+
+		if (req == NULL)
+			break;
+
+		while (req) {
+			if (req->op == HASHDB_ASYNC_GET) {
+				req = run_gets(a, req, &arena, &len);
+				continue;
+			}
+
+			res = hashDB_put(a->db, req->key, req->val_len, req->val);
+			next = req->next;
+			complete(a, req, res, (res < 0) ? errno : 0, NULL);
+			req = next;
+		}
+	}
+
+	free(arena);
+	return NULL;
+}
+
+
+/*
+ * Runs the gets at the front of the list, up to HASHDB_ASYNC_BATCH of
+ * them and no further than the first put, with one hashDB_multi_get.
+ * The arena is grown if the values do not fit. If there is no memory for
+ * that, or the multi get fails, the gets are run one by one instead.
+ *
+ * Returns:
+ *	The first request not run
+ */
+static struct hashDB_async_req *run_gets(struct hashDB_async *a,
+					 struct hashDB_async_req *req,
+					 char **arena, size_t *len)
+{
+	struct hashDB_async_req  *reqs[HASHDB_ASYNC_BATCH];
+	struct hashDB_result     results[HASHDB_ASYNC_BATCH];
+	struct hashDB_arena      ar;
+	int                      keys[HASHDB_ASYNC_BATCH];
+	int                      n = 0, res = -1, found, i;
+	char                     *val, *tmp;
+
+	for (; req && req->op == HASHDB_ASYNC_GET && n < HASHDB_ASYNC_BATCH;
+	     req = req->next) {
+		reqs[n] = req;
+		keys[n++] = req->key;
+	}
+
+	while (*arena) {
+		ar.buf = *arena;
+		ar.len = *len;
+		ar.used = 0;
+		if ((res = hashDB_multi_get(a->db, keys, n, results, &ar)) >= 0 ||
+		    errno != ENOBUFS)
+			break;
+		if ((tmp = realloc(*arena, *len * 2)) == NULL)
+			break;
+		*arena = tmp;
+		*len *= 2;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (res < 0) {
+			found = hashDB_get(a->db, keys[i], &val);
+			complete(a, reqs[i], found, (found < 0) ? errno : 0,
+				 (found == 1) ? val : NULL);
+		} else if (!results[i].found) {
+			complete(a, reqs[i], 0, 0, NULL);
+		} else if ((val = malloc(results[i].val_len + 1)) == NULL) {
+			complete(a, reqs[i], -1, ENOMEM, NULL);
+		} else {
+			memcpy(val, results[i].val, results[i].val_len + 1);
+			complete(a, reqs[i], 1, 0, val);
+		}
+	}
+	return req;
+}
+
+
+/*
+ * Hands the result of a request to its callback, or queues it in the
+ * completion queue in the entry allocated by submit, and frees the
+ * request
+ */
+static void complete(struct hashDB_async *a, struct hashDB_async_req *req,
+		     int res, int err, char *val)
+{
+	struct hashDB_async_done  *d = req->done;
+	struct hashDB_completion  c;
+
+	c.op = req->op;
+	c.key = req->key;
+	c.res = res;
+	c.err = err;
+	c.val = val;
+	c.arg = req->arg;
+
+	if (req->fn) {
+		req->fn(&c);
+		free(req->val);
+		free(req);
+		return;
+	}
+
+	free(req->val);
+	free(req);
+
+	d->c = c;
+	d->next = NULL;
+	pthread_mutex_lock(&a->lock);
+	if (a->done_tail)
+		a->done_tail->next = d;
+	else
+		a->done = d;
+	a->done_tail = d;
+	signal_efd(a);
+	pthread_cond_broadcast(&a->completed);
+	pthread_mutex_unlock(&a->lock);
+}
+
+
+/*
+ * Adds to the counter of the eventfd so it is readable. The only other
+ * error is EAGAIN, a counter about to overflow, which leaves it readable.
+ */
+static void signal_efd(struct hashDB_async *a)
+{
+	uint64_t one = 1;
+
+	while (write(a->efd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+}
+
+
+/*
+ * Resets the counter of the eventfd so it stops being readable. The lock
+ * must be held and the completion queue empty. The only other error is
+ * EAGAIN, a counter that is already 0.
+ */
+static void drain_efd(struct hashDB_async *a)
+{
+	uint64_t count;
+
+	while (read(a->efd, &count, sizeof(count)) < 0 && errno == EINTR)
+		;
+}
@@ -0,0 +1,114 @@
+#ifndef _HASHDB_ASYNC_H_
+#define _HASHDB_ASYNC_H_
+
+#include <pthread.h>
+
+#include "hashDB.h"
+
+// Max number of queued gets run as one hashDB_multi_get
+#define HASHDB_ASYNC_BATCH 64
+
+// Bytes of the arena the values of a batch of gets are read into to start
+// with, it is doubled whenever a batch does not fit
+#define HASHDB_ASYNC_ARENA (1 << 16)
+
+// Kinds of async requests
+#define HASHDB_ASYNC_GET 0
+#define HASHDB_ASYNC_PUT 1
+
+
+// Result of an async request, handed to its callback or taken from the
+// completion queue with hashDB_async_poll or hashDB_async_wait
+struct hashDB_completion {
+	int op;    // HASHDB_ASYNC_GET or HASHDB_ASYNC_PUT
+	int key;   // key of the request
+	int res;   // what hashDB_get or hashDB_put would have returned
+	int err;   // errno of the request if res is -1, 0 otherwise
+	char *val; // value a get found (caller must free it), NULL otherwise
+	void *arg; // arg given with the request
+};
+
+
+// Called on the worker thread once a request is done, the completion is
+// only valid during the call (its val is still the callee's to free)
+typedef void (*hashDB_async_fn)(struct hashDB_completion *c);
+
+
+// Async request waiting in the submission queue
+struct hashDB_async_req {
+	int op;                         // HASHDB_ASYNC_GET or HASHDB_ASYNC_PUT
+	int key;                        // key to get or put
+	int val_len;                    // length of val
+	char *val;                      // copy of the value to put
+	hashDB_async_fn fn;             // callback, NULL to use the completion
+	                                // queue
+	void *arg;                      // passed back in the completion
+	struct hashDB_async_done *done; // completion queue entry, allocated
+	                                // with the request if fn is NULL so
+	                                // completing it never fails
+	struct hashDB_async_req *next;  // next request in the queue
+};
+
+
+// Completion waiting in the completion queue
+struct hashDB_async_done {
+	struct hashDB_completion c;
+	struct hashDB_async_done *next;
+};
+
+
+// Runs gets and puts of a database on a worker thread, see
+// hashDB_async_init.
+//
+// Requests run one at a time in the order they were submitted, so an
+// async get sees every async put submitted before it and none submitted
+// after it, and requests on the same key complete in the order they were
+// submitted. Requests submitted from different threads are ordered by
+// when their submit call took the queue lock. Callbacks are called, and
+// completions queued, in that same order.
+//
+// The worker takes every request queued when it wakes up. Runs of gets
+// between puts are read with hashDB_multi_get, which hands the reads of
+// up to HASHDB_ASYNC_BATCH gets to the I/O engine together, so any number
+// of requests can be in flight while a single thread drives them.
+struct hashDB_async {
+	struct hashDB *db;               // database the requests run on
+	pthread_t thread;                // worker running the requests
+	pthread_mutex_t lock;            // guards the queues and stop
+	pthread_cond_t submitted;        // signaled when a request is queued
+	pthread_cond_t completed;        // signaled when a completion is
+	                                 // queued
+	struct hashDB_async_req *head;   // submission queue, oldest first
+	struct hashDB_async_req *tail;
+	struct hashDB_async_done *done;  // completion queue, oldest first
+	struct hashDB_async_done *done_tail;
+	int efd;                         // eventfd, readable while the
+	                                 // completion queue is not empty
+	int stop;                        // set by hashDB_async_free
+};
+
+
+/* Struct constructors and destructors */
+struct hashDB_async *hashDB_async_init(struct hashDB *db);
+
+void hashDB_async_free(struct hashDB_async *a);
+
+
+/* Async request functions */
+int hashDB_get_async(struct hashDB_async *a, int key, hashDB_async_fn fn,
+                     void *arg);
+
+int hashDB_put_async(struct hashDB_async *a, int key, int val_len,
+                     const char *val, hashDB_async_fn fn, void *arg);
+
+
+/* Completion queue functions */
+int hashDB_async_fd(struct hashDB_async *a);
+
+int hashDB_async_poll(struct hashDB_async *a, struct hashDB_completion *out,
+                      int max);
+
+int hashDB_async_wait(struct hashDB_async *a, struct hashDB_completion *out,
+                      int max);
+
+#endif
@@ -0,0 +1,411 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "committer.h"
+
+/* 'Private' helper functions */
+static void *commit_worker(void *);
+
+static struct hashDB_commit_req *take_queue(struct hashDB_committer *);
+
+static void commit_reqs(struct hashDB_committer *,
+			struct hashDB_commit_req **, int);
+
+static void run_txn_req(struct hashDB_committer *, struct hashDB_commit_req *);
+
+static void finish_req(struct hashDB_commit_req *);
+
+static int wait_req(struct hashDB_committer *, struct hashDB_commit_req *);
+
+
+/*
+ * Starts a committer for the database. While it runs the database must
+ * not be used any other way, puts go through hashDB_committer_put and
+ * transactions through hashDB_committer_txn_begin.
+ *
+ * Parameter:
+ *	db => database the puts go to
+ *
+ * Returns:
+ *	Pointer to a hashDB_committer struct, caller must stop it by calling
+ *	hashDB_committer_free, or NULL if there is an error (check errno)
+ */
+struct hashDB_committer *hashDB_committer_init(struct hashDB *db)
+{
+	struct hashDB_committer  *c;
+	int                      err;
+
+	if ((c = calloc(1, sizeof(struct hashDB_committer))) == NULL)
+		return NULL;
+
+	c->db = db;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->pending, NULL);
+
+	if ((err = pthread_create(&c->thread, NULL, commit_worker, c)) != 0) {
+		pthread_cond_destroy(&c->pending);
+		pthread_mutex_destroy(&c->lock);
+		free(c);
+		errno = err;
+		return NULL;
+	}
+
+	return c;
+}
+
+
+/*
+ * Commits every put still queued, then stops the committer. No thread may
+ * be in a hashDB_committer_* call, and every transaction begun through it
+ * must have ended. The database is left open.
+ *
+ * Parameter:
+ *	c => struct to free
+ *
+ * Returns:
+ *	void
+ */
+void hashDB_committer_free(struct hashDB_committer *c)
+{
+	pthread_mutex_lock(&c->lock);
+	c->stop = 1;
+	pthread_cond_signal(&c->pending);
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->thread, NULL);
+
+	pthread_cond_destroy(&c->pending);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+
+/*
+ * Inserts the given key value pair into the database through the
+ * committer, waiting until it has been written. Can be called from any
+ * number of threads at once.
+ *
+ * Parameters:
+ *	c => committer of the database
+ *	key => key to insert
+ *	val_len => length of the value (in bytes)
+ *	val => pointer to the value to insert
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno), see hashDB_put
+ */
+int hashDB_committer_put(struct hashDB_committer *c, int key, int val_len,
+			 char *val)
+{
+	struct hashDB_commit_req req;
+
+	req.op = HASHDB_COMMIT_PUT;
+	req.key = key;
+	req.val_len = val_len;
+	req.val = val;
+	return wait_req(c, &req);
+}
+
+
+/*
+ * Gets the counters of the committer
+ *
+ * Parameters:
+ *	c => committer to get the counters of
+ *	s => where to store them
+ *
+ * Returns:
+ *	void
+ */
+void hashDB_committer_stats(struct hashDB_committer *c,
+			    struct hashDB_commit_stats *s)
+{
+	pthread_mutex_lock(&c->lock);
+	*s = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+/*
+ * Begins an optimistic transaction through the committer. Its gets, its
+ * commit and its abort must go through the committer as well, its puts
+ * only touch the transaction and are made with hashDB_txn_put. Can be
+ * called from any number of threads at once, each transaction must only
+ * be used by one thread at a time.
+ *
+ * Parameter:
+ *	c => committer of the database
+ *
+ * Returns:
+ *	see hashDB_txn_begin, the transaction must be ended with
+ *	hashDB_committer_txn_commit or hashDB_committer_txn_abort
+ */
+struct hashDB_txn *hashDB_committer_txn_begin(struct hashDB_committer *c)
+{
+	struct hashDB_commit_req req;
+
+	req.op = HASHDB_COMMIT_TXN_BEGIN;
+	req.txn = NULL;
+	wait_req(c, &req);
+	return req.txn;
+}
+
+
+/*
+ * Gets the value of the key in a transaction begun through the committer
+ *
+ * Parameters:
+ *	c => committer of the database
+ *	txn => transaction to read in
+ *	key => used to look up the value
+ *	val => pointer to where the value will be stored if the key was found
+ *
+ * Returns:
+ *	see hashDB_txn_get
+ */
+int hashDB_committer_txn_get(struct hashDB_committer *c,
+			     struct hashDB_txn *txn, int key, char **val)
+{
+	struct hashDB_commit_req req;
+
+	req.op = HASHDB_COMMIT_TXN_GET;
+	req.txn = txn;
+	req.key = key;
+	req.out = val;
+	return wait_req(c, &req);
+}
+
+
+/*
+ * Commits a transaction begun through the committer and frees it. Commits
+ * of different threads are checked and written one after the other.
+ *
+ * Parameters:
+ *	c => committer of the database
+ *	txn => transaction to commit
+ *
+ * Returns:
+ *	see hashDB_txn_commit
+ */
+int hashDB_committer_txn_commit(struct hashDB_committer *c,
+				struct hashDB_txn *txn)
+{
+	struct hashDB_commit_req req;
+
+	req.op = HASHDB_COMMIT_TXN_COMMIT;
+	req.txn = txn;
+	return wait_req(c, &req);
+}
+
+
+/*
+ * Ends a transaction begun through the committer without writing
+ * anything and frees it
+ *
+ * Parameters:
+ *	c => committer of the database
+ *	txn => transaction to abort
+ *
+ * Returns:
+ *	void
+ */
+void hashDB_committer_txn_abort(struct hashDB_committer *c,
+				struct hashDB_txn *txn)
+{
+	struct hashDB_commit_req req;
+
+	req.op = HASHDB_COMMIT_TXN_ABORT;
+	req.txn = txn;
+	wait_req(c, &req);
+}
+
+
+/*
+ * Committer thread of the struct passed in arg. Sleeps until there are
+ * requests and takes all of them. Puts in a row are committed
+ * SEGF_APPEND_BATCH at a time, transaction requests run one at a time in
+ * between. Stops once hashDB_committer_free was called and the queue is
+ * empty.
+ */
+static void *commit_worker(void *arg)
+{
+	struct hashDB_committer   *c = arg;
+	struct hashDB_commit_req  *batch[SEGF_APPEND_BATCH], *req, *next;
+	int                       n;
+
+	while ((req = take_queue(c)) != NULL) {
+		// a request may be gone once it is done, so the next one is
+		// picked before it is run
+		while (req) {
+			for (n = 0; req && req->op == HASHDB_COMMIT_PUT &&
+			     n < SEGF_APPEND_BATCH; req = req->next)
+				batch[n++] = req;
+
+			if (n > 0) {
+				commit_reqs(c, batch, n);
+			} else {
+				next = req->next;
+				run_txn_req(c, req);
+				req = next;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Waits until the queue is not empty, then empties it
+ *
+ * Returns:
+ *	The requests, oldest first, or NULL if the committer is stopping and
+ *	there are none
+ */
+static struct hashDB_commit_req *take_queue(struct hashDB_committer *c)
+{
+	struct hashDB_commit_req *list, *fifo = NULL, *next;
+
+	pthread_mutex_lock(&c->lock);
+	while (__atomic_load_n(&c->queue, __ATOMIC_RELAXED) == NULL && !c->stop)
+		pthread_cond_wait(&c->pending, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+
+	list = __atomic_exchange_n(&c->queue, NULL, __ATOMIC_ACQUIRE);
+	for (; list; list = next) {
+		next = list->next;
+		list->next = fifo;
+		fifo = list;
+	}
+	return fifo;
+}
+
+
+/*
+ * Writes the puts of the requests with hashDB_put_batch and wakes the
+ * threads that made them. A put that fails fails on its own, the ones
+ * after it are tried again.
+ */
+static void commit_reqs(struct hashDB_committer *c,
+			struct hashDB_commit_req **batch, int n)
+{
+	int   keys[SEGF_APPEND_BATCH], val_lens[SEGF_APPEND_BATCH];
+	char  *vals[SEGF_APPEND_BATCH];
+	int   i, done;
+
+	for (i = 0; i < n; ++i) {
+		keys[i] = batch[i]->key;
+		val_lens[i] = batch[i]->val_len;
+		vals[i] = batch[i]->val;
+		batch[i]->res = 0;
+	}
+
+	for (i = 0; i < n; i = done + 1) {
+		done = i + hashDB_put_batch(c->db, keys + i, val_lens + i,
+					    vals + i, n - i);
+		if (done < n) {
+			batch[done]->res = -1;
+			batch[done]->err = errno;
+		}
+	}
+
+	pthread_mutex_lock(&c->lock);
+	c->stats.puts += n;
+	c->stats.batches += 1;
+	if ((unsigned int)n > c->stats.max_batch)
+		c->stats.max_batch = n;
+	pthread_mutex_unlock(&c->lock);
+
+	for (i = 0; i < n; ++i)
+		finish_req(batch[i]);
+}
+
+
+/*
+ * Runs a transaction request on the database and wakes the thread that
+ * made it
+ */
+static void run_txn_req(struct hashDB_committer *c,
+			struct hashDB_commit_req *req)
+{
+	req->res = 0;
+	switch (req->op) {
+	case HASHDB_COMMIT_TXN_BEGIN:
+		if ((req->txn = hashDB_txn_begin(c->db)) == NULL)
+			req->res = -1;
+		break;
+	case HASHDB_COMMIT_TXN_GET:
+		req->res = hashDB_txn_get(req->txn, req->key, req->out);
+		break;
+	case HASHDB_COMMIT_TXN_COMMIT:
+		req->res = hashDB_txn_commit(req->txn);
+		break;
+	default: // HASHDB_COMMIT_TXN_ABORT
+		hashDB_txn_abort(req->txn);
+	}
+	req->err = errno;
+	finish_req(req);
+}
+
+
+/*
+ * Marks the request done and wakes the thread that made it if it went to
+ * sleep. The request may be gone as soon as it is marked done, a wake up
+ * that lands on its reused memory is spurious and the futex waiters there
+ * check their state again.
+ */
+static void finish_req(struct hashDB_commit_req *req)
+{
+	int *state = &req->state;
+
+	if (__atomic_exchange_n(state, HASHDB_REQ_DONE, __ATOMIC_RELEASE) ==
+	    HASHDB_REQ_SLEEPING)
+		syscall(SYS_futex, state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
+/*
+ * Pushes the request on the queue of the committer and sleeps until it
+ * is done
+ *
+ * Returns:
+ *	res of the request, errno is set to its err if res is -1
+ */
+static int wait_req(struct hashDB_committer *c, struct hashDB_commit_req *req)
+{
+	struct hashDB_commit_req  *head;
+	int                       state = HASHDB_REQ_QUEUED;
+
+	req->state = HASHDB_REQ_QUEUED;
+
+	// once pushed, req->next belongs to the committer
+	head = __atomic_load_n(&c->queue, __ATOMIC_RELAXED);
+	do {
+		req->next = head;
+	} while (!__atomic_compare_exchange_n(&c->queue, &head, req, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	// the committer only sleeps on an empty queue
+	if (head == NULL) {
+		pthread_mutex_lock(&c->lock);
+		pthread_cond_signal(&c->pending);
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	// only the committer wakes this thread, and only if it is asleep
+	if (__atomic_compare_exchange_n(&req->state, &state,
+					HASHDB_REQ_SLEEPING, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&req->state, __ATOMIC_ACQUIRE) !=
+		       HASHDB_REQ_DONE)
+			syscall(SYS_futex, &req->state, FUTEX_WAIT_PRIVATE,
+				HASHDB_REQ_SLEEPING, NULL, NULL, 0);
+	}
+
+	if (req->res < 0)
+		errno = req->err;
+	return req->res;
+}
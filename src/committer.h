@@ -0,0 +1,102 @@
+#ifndef _HASHDB_COMMITTER_H_
+#define _HASHDB_COMMITTER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "hashDB.h"
+
+// Kinds of committer requests
+#define HASHDB_COMMIT_PUT 0
+#define HASHDB_COMMIT_TXN_BEGIN 1
+#define HASHDB_COMMIT_TXN_GET 2
+#define HASHDB_COMMIT_TXN_COMMIT 3
+#define HASHDB_COMMIT_TXN_ABORT 4
+
+// States of a committer request
+#define HASHDB_REQ_QUEUED 0   // waiting for the committer
+#define HASHDB_REQ_SLEEPING 1 // waiting, its thread sleeps on the state
+#define HASHDB_REQ_DONE 2     // res and err are filled in
+
+
+// Request waiting in the queue of a committer. It lives on the stack of
+// the thread that made it, which sleeps on a futex on state until the
+// committer is done with it.
+struct hashDB_commit_req {
+	int op;                          // one of the HASHDB_COMMIT_* kinds
+	int key;                         // key to put or get
+	int val_len;                     // length of val
+	char *val;                       // value to put, the caller's memory
+	struct hashDB_txn *txn;          // transaction the request runs in,
+	                                 // or the one it began
+	char **out;                      // where HASHDB_COMMIT_TXN_GET stores
+	                                 // the value it found
+	int res;                         // what the hashDB call returned
+	int err;                         // errno of the call if res is -1
+	int state;                       // one of the HASHDB_REQ_* states
+	struct hashDB_commit_req *next;  // next request in the queue
+};
+
+
+// Counters of a committer, see hashDB_committer_stats
+struct hashDB_commit_stats {
+	uint64_t puts;          // puts committed
+	uint64_t batches;       // batches of puts committed together
+	unsigned int max_batch; // most puts in one batch
+};
+
+
+// Commits the puts of any number of threads to a database. Putting
+// threads push their request on a lock free queue and sleep. A single
+// committer thread takes everything that piled up since it last looked,
+// writes it with hashDB_put_batch (one writev for the pairs that fit in
+// the head segment file together), and wakes the threads whose puts are
+// done, each through the futex of its own request. The more threads put
+// at once, the more puts share each write.
+//
+// Puts are applied in the order they made it onto the queue, a thread
+// sees its own puts applied in the order it made them.
+//
+// Optimistic transactions (see hashDB_txn_begin) run through the
+// committer too. Their gets and commits are queued like puts and run on
+// the committer thread one at a time, so any number of threads can run
+// transactions at once without a lock around the database. Nothing is
+// locked while a transaction runs, a commit that conflicts returns
+// HASHDB_TXN_RETRY.
+struct hashDB_committer {
+	struct hashDB *db;                // database the puts go to
+	pthread_t thread;                 // committer thread
+	struct hashDB_commit_req *queue;  // pushed requests, newest first
+	pthread_mutex_t lock;             // guards stop and stats
+	pthread_cond_t pending;           // signaled when a request is pushed
+	                                  // on an empty queue
+	int stop;                         // set by hashDB_committer_free
+	struct hashDB_commit_stats stats; // updated under lock
+};
+
+
+/* Struct constructors and destructors */
+struct hashDB_committer *hashDB_committer_init(struct hashDB *db);
+
+void hashDB_committer_free(struct hashDB_committer *c);
+
+
+/* Committer functions */
+int hashDB_committer_put(struct hashDB_committer *c, int key, int val_len,
+                         char *val);
+
+void hashDB_committer_stats(struct hashDB_committer *c,
+                            struct hashDB_commit_stats *s);
+
+struct hashDB_txn *hashDB_committer_txn_begin(struct hashDB_committer *c);
+
+int hashDB_committer_txn_get(struct hashDB_committer *c,
+                             struct hashDB_txn *txn, int key, char **val);
+
+int hashDB_committer_txn_commit(struct hashDB_committer *c,
+                                struct hashDB_txn *txn);
+
+void hashDB_committer_txn_abort(struct hashDB_committer *c,
+                                struct hashDB_txn *txn);
+
+#endif
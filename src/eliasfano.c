@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "eliasfano.h"
+
+/* 'Private' helper functions */
+static unsigned int low_bits(struct ef *, unsigned int);
+
+
+/*
+ * Encodes the given values
+ *
+ * Parameters:
+ *	vals => values to encode, in non-decreasing order
+ *	n => number of values
+ *
+ * Returns:
+ *	Pointer to an ef struct, caller must free it by calling ef_free, or
+ *	NULL if there is an error (check errno, EINVAL if the values are not
+ *	in order)
+ */
+struct ef *ef_build(const unsigned int *vals, unsigned int n)
+{
+	struct ef     *ef;
+	uint64_t      universe = (n) ? (uint64_t)vals[n - 1] + 1 : 1;
+	unsigned int  i;
+
+	for (i = 1; i < n; ++i) {
+		if (vals[i] < vals[i - 1]) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	if ((ef = calloc(1, sizeof(struct ef))) == NULL)
+		return NULL;
+
+	ef->n = n;
+	while (n > 0 && (universe >> (ef->low_len + 1)) >= n)
+		ef->low_len += 1;
+
+	// n set bits and at most universe >> low_len clear ones before them
+	ef->nhigh = (n + (universe >> ef->low_len)) / 64 + 1;
+	ef->high = calloc(ef->nhigh, sizeof(uint64_t));
+	ef->low = calloc(((uint64_t)n * ef->low_len) / 64 + 1, sizeof(uint64_t));
+	ef->samples = malloc((n / EF_SAMPLE + 1) * sizeof(uint32_t));
+	if (ef->high == NULL || ef->low == NULL || ef->samples == NULL) {
+		ef_free(ef);
+		return NULL;
+	}
+
+	for (i = 0; i < n; ++i) {
+		uint64_t pos = i + ((uint64_t)vals[i] >> ef->low_len);
+		ef->high[pos / 64] |= 1ULL << (pos % 64);
+		if (i % EF_SAMPLE == 0)
+			ef->samples[i / EF_SAMPLE] = pos;
+
+		if (ef->low_len) {
+			uint64_t low = vals[i] & ((1ULL << ef->low_len) - 1);
+			uint64_t bit = (uint64_t)i * ef->low_len;
+			ef->low[bit / 64] |= low << (bit % 64);
+			if (bit % 64 + ef->low_len > 64) // spills into the next word
+				ef->low[bit / 64 + 1] |= low >> (64 - bit % 64);
+		}
+	}
+
+	return ef;
+}
+
+
+/*
+ * Deallocates the encoding
+ *
+ * Parameter:
+ *	ef => pointer to the ef struct to free
+ *
+ * Returns:
+ *	void
+ */
+void ef_free(struct ef *ef)
+{
+	free(ef->high);
+	free(ef->low);
+	free(ef->samples);
+	free(ef);
+}
+
+
+/*
+ * Reads the i'th value. The nearest sample gives the word holding the
+ * set bit of the value, at most a few words after it.
+ *
+ * Parameters:
+ *	ef => encoding to read from
+ *	i => index of the value, less than ef->n
+ *
+ * Returns:
+ *	The i'th value
+ */
+unsigned int ef_get(struct ef *ef, unsigned int i)
+{
+	uint32_t      pos = ef->samples[i / EF_SAMPLE];
+	unsigned int  word = pos / 64, skip = i % EF_SAMPLE;
+	uint64_t      bits = ef->high[word] & (~0ULL << (pos % 64));
+	int           ones;
+
+	// find the skip'th set bit after the sampled one
+	while ((ones = __builtin_popcountll(bits)) <= skip) {
+		skip -= ones;
+		bits = ef->high[++word];
+	}
+	while (skip-- > 0)
+		bits &= bits - 1;
+
+	pos = word * 64 + __builtin_ctzll(bits);
+	return ((uint64_t)(pos - i) << ef->low_len) | low_bits(ef, i);
+}
+
+
+/*
+ * Starts a sequential decode of every value in order, cheaper per value
+ * than calling ef_get for each
+ *
+ * Parameters:
+ *	ef => encoding to decode
+ *	it => iterator to set up
+ *
+ * Returns:
+ *	void
+ */
+void ef_iter_init(struct ef *ef, struct ef_iter *it)
+{
+	it->ef = ef;
+	it->i = 0;
+	it->word = 0;
+	it->bits = ef->high[0];
+}
+
+
+/*
+ * Decodes the next value
+ *
+ * Parameters:
+ *	it => iterator set up by ef_iter_init
+ *	val => where to store the value
+ *
+ * Returns:
+ *	1 if there was another value, 0 if every value has been decoded
+ */
+int ef_next(struct ef_iter *it, unsigned int *val)
+{
+	struct ef  *ef = it->ef;
+	uint64_t   pos;
+
+	if (it->i >= ef->n)
+		return 0;
+
+	while (it->bits == 0)
+		it->bits = ef->high[++it->word];
+
+	pos = (uint64_t)it->word * 64 + __builtin_ctzll(it->bits);
+	it->bits &= it->bits - 1;
+
+	*val = ((pos - it->i) << ef->low_len) | low_bits(ef, it->i);
+	it->i += 1;
+	return 1;
+}
+
+
+/*
+ * Returns the low bits of the i'th value
+ */
+static unsigned int low_bits(struct ef *ef, unsigned int i)
+{
+	uint64_t  bit = (uint64_t)i * ef->low_len;
+	uint64_t  v;
+
+	if (ef->low_len == 0)
+		return 0;
+
+	v = ef->low[bit / 64] >> (bit % 64);
+	if (bit % 64 + ef->low_len > 64)
+		v |= ef->low[bit / 64 + 1] << (64 - bit % 64);
+	return v & ((1ULL << ef->low_len) - 1);
+}
@@ -0,0 +1,44 @@
+#ifndef _HASHDB_ELIASFANO_H_
+#define _HASHDB_ELIASFANO_H_
+
+#include <stdint.h>
+
+// Number of set bits of the upper half between select samples
+#define EF_SAMPLE 64
+
+
+// Elias-Fano encoding of a non-decreasing array of integers. The low bits
+// of every value are packed back to back, the high bits are stored in
+// unary as the gaps between set bits of a bit array. Takes about
+// 2 + log2(max value / n) bits per value, any value can be read in
+// constant time.
+struct ef {
+	unsigned int n;       // number of values
+	int low_len;          // bits per value in low
+	uint64_t *low;        // packed low bits of the values
+	uint64_t *high;       // bit i + (value >> low_len) is set for value i
+	unsigned int nhigh;   // number of words in high
+	uint32_t *samples;    // position in high of every EF_SAMPLE'th value
+};
+
+
+// Position of a sequential decode, see ef_next
+struct ef_iter {
+	struct ef *ef;        // encoding to decode
+	unsigned int i;       // index of the next value
+	unsigned int word;    // word in high of the next value
+	uint64_t bits;        // unread set bits of that word
+};
+
+
+struct ef *ef_build(const unsigned int *vals, unsigned int n);
+
+void ef_free(struct ef *ef);
+
+unsigned int ef_get(struct ef *ef, unsigned int i);
+
+void ef_iter_init(struct ef *ef, struct ef_iter *it);
+
+int ef_next(struct ef_iter *it, unsigned int *val);
+
+#endif
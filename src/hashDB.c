@@ -1,47 +1,188 @@
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <time.h>
 
 #include "hashDB.h"
 
+// Record copied by copy_segfs_to
+struct copy_entry {
+	struct segment_file *from; // segment file holding the record
+	uint64_t offset;           // memtable offset of the record
+	int key;                   // key of the record
+	int deleted;               // 1 if the record is a tombstone
+};
+
+// Segment files a merge record is folded over, those of the database or
+// those of a snapshot (see fold_merge)
+struct fold_src {
+	const struct merge_op *op;    // merge operator to fold with
+	struct segment_file **segs;   // segment files, newest first
+	int nsegs;                    // number of segment files
+	struct hashDB_snapshot *snap; // snapshot the segment files belong to,
+	                              // NULL for the database
+	uint64_t now;                 // time expiry times are compared against
+};
+
+
 /* 'Private' helper functions */
 static int keep_entry(const struct dirent *);
 
+static int segf_id_cmp(const struct dirent **, const struct dirent **);
+
 static char *create_file_path(const char *, const char *);
 
-static char *get_next_segf_name(struct hashDB *);
+static char *get_segf_name(struct hashDB *, uint64_t);
 
 static struct segment_file *create_segment_file(char*);
 
-static void replace_segf_in_list(struct hashDB*, 
-                                 struct segment_file*,
-                                 struct segment_file*);
+static struct segment_file *new_segment_file(struct hashDB*);
+
+static void describe_segf(struct segment_file*, struct manifest_seg*);
+
+
+static int keep_rec(struct hashDB*, struct copy_entry*, struct segment_file*);
+
+static int copy_rec_to(struct hashDB*, struct copy_entry*,
+		       struct segment_file*);
+
+static int order_by_slot(struct copy_entry**, int);
+
+static int copy_segfs_to(struct hashDB*,
+                         struct segment_file**,
+                         int,
+                         struct segment_file*,
+                         struct segment_file*,
+                         int);
+
+static int copy_entry_cmp(const void*, const void*);
+
+static int sealed_index(struct hashDB*);
+
+static int finish_index(struct segment_file*, int);
+
+static int copy_range_dels_to(struct segment_file*, struct segment_file*,
+			      uint64_t);
+
+static int append_to_head(struct hashDB*, struct record_hdr*, char*);
+
+static int make_room(struct hashDB*, uint64_t);
+
+static int v2_head(struct hashDB*);
 
-static void add_to_segf_list(struct segment_file**,
-                             struct segment_file*,
-                             int);
+static int put_pair(struct hashDB*, int, int, char*, uint64_t);
 
-static inline int copy_kv_pair_to(struct segment_file*,
-                                  struct segment_file*,
-                                  int);
+static int append_pairs(struct hashDB*, const int*, const int*, char**, int,
+			int);
+
+static int add_new_head(struct hashDB*);
 
 static int merge_possible(struct hashDB*, 
 			  struct segment_file**,
 			  struct segment_file**);
 
-static int get_size_sum(struct segment_file*, struct segment_file*);
+static uint64_t expired_bytes(struct segment_file*, uint64_t);
+
+static int key_in_older(struct hashDB*, struct segment_file*, int);
+
+static uint64_t range_cover(struct hashDB*, struct segment_file*, int);
+
+static int find_key(struct hashDB*, int, char**);
+
+static int locate_key(struct hashDB*, int, int*, uint64_t*, uint64_t*);
+
+static int arena_copy(struct hashDB_arena*, const char*, unsigned int,
+		      struct hashDB_result*);
+
+static int read_value(struct hashDB*, int, int, uint64_t,
+		      struct record_hdr*, char**);
+
+static int hits_cmp(const void*, const void*);
+
+static struct hashDB *open_db(const char*, int);
+
+static struct hashDB *repopulate(const char*, int);
+
+static int open_segfs(struct hashDB*, int);
+
+static int import_segfs(struct hashDB*, int);
+
+static int remove_orphans(struct hashDB*);
+
+static int start_loader(struct hashDB*);
+
+static void *load_worker(void*);
+
+static void stop_loader(struct hashDB*);
+
+static int load_segfs(struct hashDB*, struct segment_file*);
+
+static uint64_t now_ns(void);
+
+static uint64_t wall_clock(void);
+
+static struct memtable *snapshot_table(struct hashDB_snapshot*, int);
+
+static int snapshot_find(struct hashDB_snapshot*, int, int, uint64_t*);
+
+static int key_changed(struct hashDB*, int, uint64_t);
+
+static uint64_t txn_pin(struct hashDB*);
+
+static int fold_merge(struct fold_src*, int, int, struct record_hdr*, char**);
+
+static int fold_find(struct fold_src*, int, int, uint64_t*);
+
+static void *scan_worker(void*);
+
+static int read_range_batch(struct hashDB_range*);
+
+static int range_read_cmp(const void*, const void*);
+
+
+// Arguments and result of one hashDB_scan_parallel worker thread
+struct scan_job {
+	struct hashDB_snapshot *snap;
+	int part;
+	int nparts;
+	hashDB_scan_fn fn;
+	void *arg;
+	int res;
+};
+
+
+// Location of a value read by read_range_batch or hashDB_multi_get
+struct range_read {
+	uint64_t offset; // memtable offset of the value
+	int seg;         // index of the segment file in the snapshot, or in
+	                 // db->segs for hashDB_multi_get
+	int i;           // index of the value in the batch, or of the key
+};
+
+
+// Background loader of a lazily opened database
+struct hashDB_loader {
+	pthread_t thread;           // thread running load_worker
+	struct segment_file **segs; // segment files to load, newest first,
+	                            // each with a reference held
+	int nsegs;                  // number of segment files in segs
+	int stop;                   // set to stop loading early
+};
 
 /*
  * Creates a hashDB struct that represents an active database. If data_dir
- * is the name of a directory with segment files in it, a linked list of
- * segment_file structs is created. The list is ordered in descending order 
- * with respect to the segment file names which represent ID's. If data_dir
- * does not exist then it is created and an empty segment file is added to it.
+ * is the name of a directory with segment files in it, a table of
+ * segment_file structs is created. The table is ordered newest first, as
+ * recorded in the manifest of the database. If data_dir does not exist
+ * then it is created and an empty segment file is added to it.
  *
  * Parameter:
  *	data_dir => name of a directory to read from or create
@@ -52,13 +193,46 @@ static int get_size_sum(struct segment_file*, struct segment_file*);
  *	there is an error NULL is returned.
  */
 struct hashDB *hashDB_init(const char *data_dir)
+{
+	return open_db(data_dir, 0);
+}
+
+
+/*
+ * Creates a hashDB struct like hashDB_init, but returns as soon as the
+ * manifest is read. Only the newest segment files are loaded
+ * right away, until one with any records gives the next sequence number.
+ * Every other one is loaded the first time it is needed, and by a
+ * background thread in newest first order, so queries are answered by the
+ * segment files that are loaded while older ones are still loading. See
+ * hashDB_load_progress.
+ *
+ * Parameter:
+ *	data_dir => name of a directory to read from or create
+ *
+ * Returns:
+ *	Dynamically allocated hashDB struct that is ready to handle read and
+ *	write requests. This struct must be deallocated using hashDB_free. If
+ *	there is an error NULL is returned.
+ */
+struct hashDB *hashDB_init_lazy(const char *data_dir)
+{
+	return open_db(data_dir, 1);
+}
+
+
+/*
+ * Opens or creates the database, the shared part of hashDB_init and
+ * hashDB_init_lazy
+ */
+static struct hashDB *open_db(const char *data_dir, int lazy)
 {
 	struct hashDB *db = NULL;
 
 	DIR *dir = opendir(data_dir);
 	if (dir) {
 		closedir(dir);
-		db = hashDB_repopulate(data_dir);	
+		db = repopulate(data_dir, lazy);
 	} else if (errno == ENOENT) { // does not exist
 		dir = NULL;
 		db = hashDB_mkempty(data_dir);	
@@ -72,10 +246,13 @@ struct hashDB *hashDB_init(const char *data_dir)
 
 
 /*
- * Reads from the given data directory path and builds an in memory list
- * of segment_file structs that represent each of the segment files in the
- * data directory. The segment_file struct memtables are repopulated with
- * the most recent key value pairs found in the segment file.
+ * Reads the manifest of the given data directory and builds an in memory
+ * table of segment_file structs that represent each of the segment files
+ * in it. The segment_file struct memtables are repopulated with the most
+ * recent key value pairs found in the segment file. Every segment file but
+ * the newest is sealed, and the next sequence number continues from the
+ * largest one found in the segment files. A data directory from before
+ * manifests is read by listing its segment files, and given a manifest.
  *
  * Parameter:
  *	data_dir => name of a directory containing segment files
@@ -89,371 +266,2596 @@ struct hashDB *hashDB_init(const char *data_dir)
  *	when it is no longer needed.
  */
 struct hashDB *hashDB_repopulate(const char *data_dir)
+{
+	return repopulate(data_dir, 0);
+}
+
+
+/*
+ * Builds the table of segment files, see hashDB_repopulate. If lazy is set
+ * the segment files are only opened, see hashDB_init_lazy.
+ */
+static struct hashDB *repopulate(const char *data_dir, int lazy)
 {
 	struct hashDB        *db;
-	struct dirent        **entries; // array of struct dirent pointers
-	int                  n, i;
-	char                 *seg_name;
 	struct segment_file  *curr = NULL;
+	uint64_t             start = now_ns();
+	int                  res;
 
 	if ((db = malloc(sizeof(struct hashDB))) == NULL)
 		return NULL;
 
-	if ((n = scandir(data_dir, &entries, keep_entry, alphasort)) < 0) {
+	db->head = NULL;
+	db->next_id = 1;
+	db->next_seq = 1;
+	db->data_dir = data_dir;
+	db->index = NULL;
+	db->sort_sealed = HASHDB_DEFAULT_SORT;
+	db->hash_sealed = HASHDB_DEFAULT_HASH;
+	db->index_budget = HASHDB_INDEX_BUDGET;
+	db->lookups = 0;
+	db->open_start = start;
+	memset(&db->progress, 0, sizeof(db->progress));
+	db->loader = NULL;
+	db->manifest = NULL;
+	db->cache = NULL;
+	db->merge_op = NULL;
+	db->clock = wall_clock;
+	db->txns = NULL;
+	if (segf_table_init(&db->segs) < 0) {
 		free(db);
 		return NULL;
 	}
-	
-	db->head = NULL;
-	for (i = 0; i < n; ++i) {
-		seg_name = create_file_path(data_dir, entries[i]->d_name);
-		if (seg_name == NULL)
-			break;
-
-		if ((curr = segf_init(seg_name)) == NULL)
-			break;
 
-		if (segf_open_file(curr) < 0)
-			break;
+	if (hashDB_enable_cache(db, HASHDB_CACHE_BUDGET) < 0) {
+		hashDB_free(db);
+		return NULL;
+	}
 
-		if (segf_repop_memtable(curr) < 0)
-			break;
+	if ((db->manifest = manifest_open(data_dir)) != NULL)
+		res = open_segfs(db, lazy);
+	else if (errno == ENOENT) // written before manifests
+		res = import_segfs(db, lazy);
+	else
+		res = -1;
 
-		segf_link_before(curr, db->head);
-		db->head = curr;
+	if (res < 0) {
+		printf("ERROR: hashDB.c: hashDB_repopulate: %s\n", 
+				strerror(errno));
+		hashDB_free(db);
+		return NULL;
+	}
 
-		if (i == n-1)
-			db->next_id = get_id_from_fname(entries[i]->d_name)+1;
+	// sequence numbers only grow from older to newer segment files, the
+	// newest one with any records holds the largest
+	for (int i = 0; lazy && i < db->segs.n; ++i) {
+		curr = db->segs.segs[i];
+		if (segf_load(curr) < 0) {
+			hashDB_free(db);
+			return NULL;
+		}
+		if (curr->max_seq >= db->next_seq)
+			db->next_seq = curr->max_seq + 1;
+		if (curr->max_seq > 0)
+			break;
+	}
 
-		free(entries[i]);
+	// v1 segment files can't hold sequence numbers and sorted or hashed
+	// ones are sealed, start a new head
+	if (db && (db->head == NULL || db->head->version == SEGF_V1 ||
+		   db->head->sealed)) {
+		if (add_new_head(db) < 0) {
+			hashDB_free(db);
+			db = NULL;
+		}
 	}
-	
-	if (i < n) { // clean up after error
-		printf("ERROR: hashDB.c: hashDB_repopulate: %s\n", 
-				strerror(errno));
+
+	if (db && lazy && start_loader(db) < 0) {
 		hashDB_free(db);
 		db = NULL;
-		if (curr != NULL)
-			segf_free(curr);
-		while (i < n) {
-			free(entries[i]);
-			i++;
-		}
 	}
 
-	free(entries);
+	// the budget is best effort, indexes left in RAM still work
+	if (db && db->index_budget)
+		hashDB_balance_indexes(db);
+
+	if (db) {
+		db->progress.open_ns = now_ns() - start;
+		if (!lazy)
+			db->progress.loaded_ns = db->progress.open_ns;
+	}
 	return db;
 }
 
 
 /*
- * Predicate function used by scandir to determine if a directory entry
- * should be included in the array of sorted directory entries. It returns
- * true if the file in data directory is an appropiately named segment file
- * and false otherwise.
+ * Builds the table of segment files from the manifest of the database.
+ * Lazily opened segment files are set up from what the
+ * manifest records about them, without opening them. Segment files the
+ * manifest does not know, left behind by a crash before their edit was
+ * committed, are removed.
  *
- * Parameter:
- *	entry => pointer a dirent struct that is having its name checked
+ * Parameters:
+ *	db => database with its manifest opened and no segment files
+ *	lazy => 1 to open the segment files like hashDB_init_lazy
  *
  * Returns:
- *	1 if dirent->d_name is a valid segment file name and 0 otherwise
+ *	0 if successful, -1 otherwise (check errno)
  */
-static int keep_entry(const struct dirent *entry)
+static int open_segfs(struct hashDB *db, int lazy)
 {
-	if ((strcmp(entry->d_name, ".") == 0) ||
-	    (strcmp(entry->d_name, "..") == 0)) {
-		return 0;
+	struct manifest      *m = db->manifest;
+	struct manifest_seg  *ms;
+	struct segment_file  *curr;
+	char                 *seg_name;
+
+	for (int i = 0; i < m->nsegs; ++i) {
+		ms = &m->segs[i];
+		if ((seg_name = get_segf_name(db, ms->id)) == NULL)
+			return -1;
+
+		if ((curr = segf_init(seg_name)) == NULL) {
+			free(seg_name);
+			return -1;
+		}
+		curr->id = ms->id;
+
+		// only the newest segment file takes appends, loading never
+		// truncates the others
+		curr->sealed = (i > 0);
+		if (lazy) {
+			segf_open_known(curr, ms->version, ms->flags, ms->size);
+		} else if (segf_open_file(curr) < 0 ||
+			   segf_repop_memtable(curr) < 0) {
+			segf_free(curr);
+			return -1;
+		}
+
+		if (segf_table_insert(&db->segs, db->segs.n, curr) < 0) {
+			segf_free(curr);
+			return -1;
+		}
+
+		if (curr->max_seq >= db->next_seq)
+			db->next_seq = curr->max_seq + 1;
 	}
-	return 1;
+
+	db->head = (db->segs.n) ? db->segs.segs[0] : NULL;
+	db->next_id = m->next_id;
+	return remove_orphans(db);
 }
 
 
 /*
- * Gets the segment file ID from the segment files path
+ * Builds the table of segment files of a data directory without a manifest
+ * from the segment files in it, ordered by their IDs, and writes the
+ * manifest for them.
  *
- * Parameter:
- *	path => path to the segment file
+ * Parameters:
+ *	db => database with no manifest and no segment files
+ *	lazy => 1 to open the segment files like hashDB_init_lazy
  *
  * Returns:
- *	segment files ID if the name was in the correct format
- *	-1 otherwise
+ *	0 if successful, -1 otherwise (check errno)
  */
-int get_id_from_fname(const char *path)
+static int import_segfs(struct hashDB *db, int lazy)
 {
-	int i = strlen(path);
-	int j = 0;
+	struct dirent        **entries; // array of struct dirent pointers
+	struct manifest_seg  *segs = NULL;
+	struct segment_file  *curr = NULL;
+	char                 *seg_name;
+	int                  n, i;
 
-	while (i >= 0) {
-		if (path[i] == '.') // start of the file extention
-			j = i;
-		if (path[i] == '/') // last '/' in file path
+	if ((n = scandir(db->data_dir, &entries, keep_entry, segf_id_cmp)) < 0)
+		return -1;
+
+	// newest first, the entries are sorted oldest first
+	for (i = n - 1; i >= 0; --i) {
+		seg_name = create_file_path(db->data_dir, entries[i]->d_name);
+		if (seg_name == NULL)
 			break;
-		--i;
+
+		if ((curr = segf_init(seg_name)) == NULL) {
+			free(seg_name);
+			break;
+		}
+		curr->id = get_id_from_fname(entries[i]->d_name);
+
+		// only the newest segment file takes appends, loading never
+		// truncates the others
+		curr->sealed = (i < n - 1);
+		if (lazy) {
+			if (segf_open_lazy(curr) < 0)
+				break;
+		} else if (segf_open_file(curr) < 0 ||
+			   segf_repop_memtable(curr) < 0) {
+			break;
+		}
+
+		if (segf_table_insert(&db->segs, db->segs.n, curr) < 0)
+			break;
+		curr = NULL;
 	}
 
-	if (j <= i) {
-		printf("%s is not in the correct format\n", path);
+	if (curr != NULL) // clean up after error
+		segf_free(curr);
+	for (int j = 0; j < n; ++j)
+		free(entries[j]);
+	free(entries);
+
+	if (i >= 0 || (segs = malloc((n + 1) * sizeof(*segs))) == NULL)
 		return -1;
-	}
 
-	// File ID will be between i and j
-	char id[5];
-	int k = 0;
-	i += 1; // skip '/'
-	while (i < j) {
-		id[k] = path[i];
-		++i;
-		++k;
+	db->head = (n) ? db->segs.segs[0] : NULL;
+	for (i = 0; i < n; ++i) {
+		curr = db->segs.segs[i];
+		describe_segf(curr, &segs[i]);
+		if (curr->max_seq >= db->next_seq)
+			db->next_seq = curr->max_seq + 1;
 	}
 
-	return atoi(id);
+	db->manifest = manifest_create(db->data_dir, segs, n);
+	free(segs);
+	if (db->manifest == NULL)
+		return -1;
+
+	db->next_id = db->manifest->next_id;
+	return 0;
 }
 
 
 /*
- * Creates a directory named after the given string. The first empty
- * segment file is also created in the directory.
+ * Removes the files of the data directory that are named like segment
+ * files but are not in the manifest, and any manifest left half written.
+ * Segment files are left alone if opening the manifest dropped an edit
+ * cut short, they are only removed once the manifest opens whole.
  *
  * Parameter:
- *	data_dir => name of the data directory to create
+ *	db => database with its manifest opened
  *
  * Returns:
- *	Pointer a dynamically allocated hashDB struct that represents the
- *	new key value database.
- *
- *	Note, the returned hashDB struct must be deallocated with hashDB_free
- *	when it is no longer needed.
+ *	0 if successful, -1 otherwise (check errno)
  */
-struct hashDB *hashDB_mkempty(const char *data_dir)
+static int remove_orphans(struct hashDB *db)
 {
-	char                 *file_path = NULL;
-	struct segment_file  *first = NULL;
-	struct hashDB        *db;
-
-	if (mkdir(data_dir, 0755) < 0)
-		return NULL;
-
-	if ((file_path = create_file_path(data_dir, "1.dat")) == NULL)
-		goto err;
-
-	if ((first = create_segment_file(file_path)) == NULL)
-		goto err;
+	struct dirent  **entries;
+	char           *path;
+	int            n, i, res = 0;
 
-	if ((db = malloc(sizeof(struct hashDB))) == NULL)
-		goto err;
-	
-	db->next_id = 2;
-	db->head = first;
-	return db;
+	unlink(db->manifest->tmp_path);
+	if (db->manifest->truncated)
+		return 0;
 
-err:
-	if (first && first->seg_fd != -1)
-		segf_delete_file(first);
+	if ((n = scandir(db->data_dir, &entries, keep_entry, NULL)) < 0)
+		return -1;
 
-	if (first) {
-		segf_free(first);
-		file_path = NULL;
+	for (i = 0; i < n; ++i) {
+		int64_t id = get_id_from_fname(entries[i]->d_name);
+		if (res == 0 && manifest_find(db->manifest, id) == NULL) {
+			path = create_file_path(db->data_dir, entries[i]->d_name);
+			if (path == NULL || unlink(path) < 0)
+				res = -1;
+			free(path);
+		}
+		free(entries[i]);
 	}
-
-	if (file_path != NULL)
-		free(file_path);
-
-	rmdir(data_dir);
-	return NULL;
+	free(entries);
+	return res;
 }
 
 
 /*
- * Deallocates all of the in memory data structures used by the hashDB struct.
- * This includes all segment_file structs and their respective data structures.
+ * Starts the background loader of a lazily opened database. It holds a
+ * reference to every segment file so compaction and merging can go on
+ * while it loads.
  *
  * Parameter:
- *	db => pointer to the hashDB struct to free
+ *	db => lazily opened database
  *
  * Returns:
- *	void
+ *	0 if successful, -1 otherwise (check errno)
  */
-void hashDB_free(struct hashDB *db)
+static int start_loader(struct hashDB *db)
 {
-	struct segment_file *curr, *prev;	
+	struct hashDB_loader  *ld;
+	int                   err;
+
+	if ((ld = calloc(1, sizeof(struct hashDB_loader))) == NULL)
+		return -1;
 
-	curr = prev = db->head;
-	while (curr) {
-		curr = curr->next;
-		segf_free(prev);
-		prev = curr;
+	ld->nsegs = db->segs.n;
+	if ((ld->segs = malloc(ld->nsegs * sizeof(struct segment_file *))) == NULL) {
+		free(ld);
+		return -1;
 	}
 
-	free(db);
-	db = NULL;
+	memcpy(ld->segs, db->segs.segs, ld->nsegs * sizeof(*ld->segs));
+	for (int i = 0; i < ld->nsegs; ++i)
+		segf_ref(ld->segs[i]);
+
+	db->loader = ld;
+	if ((err = pthread_create(&ld->thread, NULL, load_worker, db)) != 0) {
+		db->loader = NULL;
+		for (int i = 0; i < ld->nsegs; ++i)
+			segf_unref(ld->segs[i]);
+		free(ld->segs);
+		free(ld);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
 }
 
 
 /*
- * Inserts the given key value pair into the database
- *
- * Parameters:
- *	db => pointer to the database resource handler
- *	key => key to insert
- *	val_len => length of the value (in bytes)
- *	val => pointer to the value to insert
- *
- * Returns:
- *	0 if successful, -1 otherwise (check errno). If there is an error
- *	the database is left unchanged, however a compact and merge may
- *	have taken place but the result of these are invisible to the user.
+ * Loads the segment files held by the loader of the database passed in
+ * arg, newest first. A segment file that fails to load is left for the
+ * first query that needs it to try again.
  */
-int hashDB_put(struct hashDB *db, int key, int val_len, char *val)
+static void *load_worker(void *arg)
 {
-	unsigned int kv_sz = get_kv_size(key, val_len);
-
-	if ((kv_sz + db->head->size < MAX_SEG_FILE_SIZE)) // normal append
-		return segf_append(db->head, key, val, TOMBSTONE_INS);
-
-	if (hashDB_compact(db, db->head) < 0)
-		return -1;
+	struct hashDB         *db = arg;
+	struct hashDB_loader  *ld = db->loader;
+	int                   failed = 0;
+
+	for (int i = 0; i < ld->nsegs; ++i) {
+		if (__atomic_load_n(&ld->stop, __ATOMIC_RELAXED))
+			return NULL;
+		if (segf_load(ld->segs[i]) < 0)
+			failed = 1;
+	}
 
-	char *name;
-	if ((name = get_next_segf_name(db)) == NULL)
-		return -1;
+	if (!failed)
+		__atomic_store_n(&db->progress.loaded_ns,
+				 now_ns() - db->open_start, __ATOMIC_RELAXED);
+	return NULL;
+}
 
-	struct segment_file *seg = NULL;
-	if ((seg = create_segment_file(name)) == NULL)
-		return -1;
 
-	segf_link_before(seg, db->head);
-	db->head = seg;
+/*
+ * Stops the background loader, waiting for the segment file it is
+ * loading, and drops its references
+ */
+static void stop_loader(struct hashDB *db)
+{
+	struct hashDB_loader *ld = db->loader;
 
-	// append to the new segment file
-	if (segf_append(db->head, key, val, TOMBSTONE_INS) < 0) {
-		segf_delete_file(db->head);	
-		db->head = db->head->next;
-		segf_free(seg);
-		return -1;
-	}
+	__atomic_store_n(&ld->stop, 1, __ATOMIC_RELAXED);
+	pthread_join(ld->thread, NULL);
 
-	db->next_id += 1;
-	return 0;
+	for (int i = 0; i < ld->nsegs; ++i)
+		segf_unref(ld->segs[i]);
+	free(ld->segs);
+	free(ld);
+	db->loader = NULL;
 }
 
 
 /*
- * Calculates and returns the total size in bytes that the key value
- * pair would take up in a segment file.
+ * Reports how far loading the database has come
  *
  * Parameters:
- *	key => key in the key value pair
- *	val_len => length of the value
+ *	db => pointer to the database handler
+ *	p => where to store the progress
  *
  * Returns:
- *	The size of the key length, key, val_len, and value
+ *	void
  */
-unsigned int get_kv_size(int key, int val_len)
+void hashDB_load_progress(struct hashDB *db, struct hashDB_progress *p)
 {
-	unsigned int sz = sizeof(char)
-			+ (sizeof(key)*2)
-			+ sizeof(val_len)
-			+ val_len;
-	return sz;
+	// the loader sets loaded_ns, the rest is only written by this thread
+	p->open_ns = db->progress.open_ns;
+	p->first_query_ns = db->progress.first_query_ns;
+	p->loaded_ns = __atomic_load_n(&db->progress.loaded_ns, __ATOMIC_RELAXED);
+	p->nsegs = db->segs.n;
+	p->nloaded = 0;
+	for (int i = 0; i < db->segs.n; ++i)
+		p->nloaded += segf_loaded(db->segs.segs[i]);
 }
 
 
 /*
- * Uses the next_id and data_dir field in the given hashDB struct to
- * build a string representing the file path to a new segment file.
- *
- * File paths be in the following format:
- *	data_dir/[next_id].dat
+ * Loads the segment files from the head up to and including the given
+ * one, or all of them if last is NULL, see segf_load
  *
- * Parameter:
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+static int load_segfs(struct hashDB *db, struct segment_file *last)
+{
+	struct segment_file *curr;
+
+	for (int i = 0; i < db->segs.n; ++i) {
+		curr = db->segs.segs[i];
+		if (segf_load(curr) < 0)
+			return -1;
+		if (curr == last)
+			break;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Returns the current time of CLOCK_MONOTONIC in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Returns the current time of CLOCK_REALTIME in seconds, the default
+ * clock of a database
+ */
+static uint64_t wall_clock(void)
+{
+	return time(NULL);
+}
+
+
+/*
+ * Predicate function used by scandir to determine if a directory entry
+ * should be included in the array of sorted directory entries. It returns
+ * true if the file in data directory is an appropiately named segment file
+ * and false otherwise.
+ *
+ * Parameter:
+ *	entry => pointer a dirent struct that is having its name checked
+ *
+ * Returns:
+ *	1 if dirent->d_name is a valid segment file name and 0 otherwise
+ */
+static int keep_entry(const struct dirent *entry)
+{
+	const char *name = entry->d_name;
+
+	// [ID].dat, see get_segf_name
+	if (!isdigit((unsigned char)*name))
+		return 0;
+	while (isdigit((unsigned char)*name))
+		++name;
+	return strcmp(name, ".dat") == 0;
+}
+
+
+/*
+ * Comparison function used by scandir to sort segment files by their ID,
+ * oldest first. Sorting the names alphabetically would put 10.dat before
+ * 2.dat.
+ *
+ * Parameters:
+ *	a => first directory entry
+ *	b => second directory entry
+ *
+ * Returns:
+ *	negative, zero, or positive if a's ID is less than, equal to, or
+ *	greater than b's ID
+ */
+static int segf_id_cmp(const struct dirent **a, const struct dirent **b)
+{
+	int64_t a_id = get_id_from_fname((*a)->d_name);
+	int64_t b_id = get_id_from_fname((*b)->d_name);
+
+	return (a_id > b_id) - (a_id < b_id);
+}
+
+
+/*
+ * Gets the segment file ID from the segment files path
+ *
+ * Parameter:
+ *	path => path to the segment file
+ *
+ * Returns:
+ *	segment files ID if the name was in the correct format
+ *	-1 otherwise
+ */
+int64_t get_id_from_fname(const char *path)
+{
+	int i = strlen(path);
+	int j = 0;
+
+	while (i >= 0) {
+		if (path[i] == '.') // start of the file extention
+			j = i;
+		if (path[i] == '/') // last '/' in file path
+			break;
+		--i;
+	}
+
+	if (j <= i) {
+		printf("%s is not in the correct format\n", path);
+		return -1;
+	}
+
+	// File ID will be between i and j, strtoll stops at the '.'
+	return strtoll(path + i + 1, NULL, 10);
+}
+
+
+/*
+ * Creates a directory named after the given string. The manifest and the
+ * first empty segment file are also created in the directory.
+ *
+ * Parameter:
+ *	data_dir => name of the data directory to create
+ *
+ * Returns:
+ *	Pointer a dynamically allocated hashDB struct that represents the
+ *	new key value database.
+ *
+ *	Note, the returned hashDB struct must be deallocated with hashDB_free
+ *	when it is no longer needed.
+ */
+struct hashDB *hashDB_mkempty(const char *data_dir)
+{
+	struct hashDB  *db;
+	uint64_t       start = now_ns();
+
+	if (mkdir(data_dir, 0755) < 0)
+		return NULL;
+
+	if ((db = malloc(sizeof(struct hashDB))) == NULL)
+		goto err;
+	
+	db->next_id = 1;
+	db->next_seq = 1;
+	db->head = NULL;
+	db->data_dir = data_dir;
+	db->index = NULL;
+	db->sort_sealed = HASHDB_DEFAULT_SORT;
+	db->hash_sealed = HASHDB_DEFAULT_HASH;
+	db->index_budget = HASHDB_INDEX_BUDGET;
+	db->lookups = 0;
+	db->open_start = start;
+	memset(&db->progress, 0, sizeof(db->progress));
+	db->loader = NULL;
+	db->manifest = NULL;
+	db->cache = NULL;
+	db->merge_op = NULL;
+	db->clock = wall_clock;
+	db->txns = NULL;
+	if (segf_table_init(&db->segs) < 0) {
+		free(db);
+		db = NULL;
+		goto err;
+	}
+
+	if (hashDB_enable_cache(db, HASHDB_CACHE_BUDGET) < 0)
+		goto err;
+
+	if ((db->manifest = manifest_create(data_dir, NULL, 0)) == NULL ||
+	    add_new_head(db) < 0)
+		goto err;
+
+	db->progress.open_ns = now_ns() - start;
+	db->progress.loaded_ns = db->progress.open_ns;
+	return db;
+
+err:
+	if (db) {
+		if (db->manifest)
+			unlink(db->manifest->path);
+		hashDB_free(db);
+	}
+
+	rmdir(data_dir);
+	return NULL;
+}
+
+
+/*
+ * Turns the value cache of hashDB_get on with the given byte budget, or
+ * off. Any values already cached are dropped.
+ *
+ * Parameters:
+ *	db => pointer to the database handler
+ *	budget => bytes the cached values may take, 0 to turn the cache off
+ *
+ * Returns:
+ *	0 if successful, -1 if there is no memory available (the cache is
+ *	left as it was)
+ */
+int hashDB_enable_cache(struct hashDB *db, size_t budget)
+{
+	struct vcache *cache = NULL;
+
+	if (budget && (cache = vcache_init(budget, HASHDB_CACHE_POLICY)) == NULL)
+		return -1;
+
+	if (db->cache)
+		vcache_free(db->cache);
+	db->cache = cache;
+	return 0;
+}
+
+
+/*
+ * Reports the hits, misses, and evictions of the value cache, and the
+ * bytes and entries in it. Every counter is 0 while the cache is off.
+ *
+ * Parameters:
+ *	db => pointer to the database handler
+ *	s => where to store the counters
+ *
+ * Returns:
+ *	void
+ */
+void hashDB_cache_stats(struct hashDB *db, struct vcache_stats *s)
+{
+	if (db->cache)
+		vcache_stats(db->cache, s);
+	else
+		memset(s, 0, sizeof(*s));
+}
+
+
+/*
+ * Deallocates all of the in memory data structures used by the hashDB struct.
+ * This includes all segment_file structs and their respective data structures.
+ * Segment files still held by a snapshot are freed when it is released.
+ *
+ * Parameter:
+ *	db => pointer to the hashDB struct to free
+ *
+ * Returns:
+ *	void
+ */
+void hashDB_free(struct hashDB *db)
+{
+	if (db->loader)
+		stop_loader(db);
+
+	for (int i = 0; i < db->segs.n; ++i)
+		segf_unref(db->segs.segs[i]);
+	segf_table_free(&db->segs);
+
+	if (db->index)
+		keyidx_free(db->index);
+
+	if (db->manifest)
+		manifest_free(db->manifest);
+
+	if (db->cache)
+		vcache_free(db->cache);
+
+	free(db);
+	db = NULL;
+}
+
+
+/*
+ * Inserts the given key value pair into the database
+ *
+ * Parameters:
+ *	db => pointer to the database resource handler
+ *	key => key to insert
+ *	val_len => length of the value (in bytes)
+ *	val => pointer to the value to insert
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno). If there is an error
+ *	the database is left unchanged, however a compact and merge may
+ *	have taken place but the result of these are invisible to the user.
+ */
+int hashDB_put(struct hashDB *db, int key, int val_len, char *val)
+{
+	return put_pair(db, key, val_len, val, 0);
+}
+
+
+/*
+ * Inserts the given key value pair into the database like hashDB_put, the
+ * pair expires ttl seconds from now (see db->clock). Once it has, reads
+ * treat the key as missing and compaction drops its record, nothing has
+ * to delete it.
+ *
+ * Parameters:
+ *	db => pointer to the database resource handler
+ *	key => key to insert
+ *	val_len => length of the value (in bytes)
+ *	val => pointer to the value to insert
+ *	ttl => seconds until the pair expires, more than 0
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno, EINVAL if ttl is 0)
+ */
+int hashDB_put_ttl(struct hashDB *db, int key, int val_len, char *val,
+		   unsigned int ttl)
+{
+	if (ttl == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// v1 files have no room for expiry times
+	if (v2_head(db) < 0)
+		return -1;
+
+	return put_pair(db, key, val_len, val, db->clock() + ttl);
+}
+
+
+/*
+ * Appends a key value pair to the head segment file and adds its key to
+ * the ordered key index, see hashDB_put
+ *
+ * Parameters:
+ *	db => pointer to the database resource handler
+ *	key, val_len, val => the pair
+ *	expires => expiry time of the pair, 0 if it never expires
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+static int put_pair(struct hashDB *db, int key, int val_len, char *val,
+		    uint64_t expires)
+{
+	struct record_hdr  hdr;
+	int                added = 0;
+
+	if (db->index && (added = keyidx_insert(db->index, key)) < 0)
+		return -1;
+
+	hdr.flags = 0;
+	hdr.key = key;
+	hdr.val_len = val_len;
+	hdr.seq = db->next_seq;
+	hdr.expires = expires;
+	if (append_to_head(db, &hdr, val) < 0) {
+		if (added)
+			keyidx_remove(db->index, key);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Inserts key value pairs into the database in order, as if hashDB_put was
+ * called with each of them. The pairs that fit in the head segment file
+ * together are written to it with one segf_append_batch.
+ *
+ * Parameters:
+ *	db => pointer to the database resource handler
+ *	keys => keys to insert
+ *	val_lens => lengths of the values (in bytes)
+ *	vals => values to insert
+ *	n => number of pairs
+ *
+ * Returns:
+ *	n if successful, otherwise the number of pairs inserted before the
+ *	error (check errno). Pairs from there on were not inserted.
+ */
+int hashDB_put_batch(struct hashDB *db, const int *keys, const int *val_lens,
+		     char **vals, int n)
+{
+	uint64_t  size, kv_sz;
+	int       done, k;
+
+	for (done = 0; done < n; done += k) {
+		size = segf_kv_size(db->head, keys[done], val_lens[done],
+				    db->next_seq);
+		if (make_room(db, size) < 0)
+			return done;
+
+		// the pairs after the first that fit in the head with it
+		size += db->head->size;
+		for (k = 1; k < SEGF_APPEND_BATCH && done + k < n; ++k) {
+			kv_sz = segf_kv_size(db->head, keys[done + k],
+					     val_lens[done + k], db->next_seq + k);
+			if (size + kv_sz >= MAX_SEG_FILE_SIZE)
+				break;
+			size += kv_sz;
+		}
+
+		if (append_pairs(db, keys + done, val_lens + done, vals + done,
+				 k, 0) < 0)
+			return done;
+	}
+
+	return n;
+}
+
+
+/*
+ * Appends key value pairs to the head segment file with one
+ * segf_append_batch, giving them the next sequence numbers, and adds
+ * their keys to the ordered key index. The caller makes room for them.
+ *
+ * Parameters:
+ *	db => pointer to the database resource handler
+ *	keys, val_lens, vals => the pairs, see hashDB_put_batch
+ *	n => number of pairs, at most SEGF_APPEND_BATCH
+ *	atomic => 1 to write the pairs as one atomic batch
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno). If there is an error
+ *	no pair is left in the head segment file, its memtable, or the key
+ *	index, and the sequence numbers are not used up.
+ */
+static int append_pairs(struct hashDB *db, const int *keys,
+			const int *val_lens, char **vals, int n, int atomic)
+{
+	struct record_hdr  hdrs[SEGF_APPEND_BATCH];
+	char               added[SEGF_APPEND_BATCH];
+	int                i, res;
+
+	for (i = 0; i < n; ++i) {
+		hdrs[i].flags = (atomic && i < n - 1) ? REC_BATCH : 0;
+		hdrs[i].key = keys[i];
+		hdrs[i].val_len = val_lens[i];
+		hdrs[i].seq = db->next_seq + i;
+		hdrs[i].expires = 0;
+		added[i] = 0;
+		if (db->index && (res = keyidx_insert(db->index, keys[i])) < 0)
+			goto err;
+		added[i] = (db->index) ? res : 0;
+	}
+
+	if (segf_append_batch(db->head, hdrs, vals, n) < 0)
+		goto err;
+
+	db->next_seq += n;
+	return 0;
+
+err:
+	res = errno;
+	while (i-- > 0) {
+		if (added[i])
+			keyidx_remove(db->index, keys[i]);
+	}
+	errno = res;
+	return -1;
+}
+
+
+/*
+ * Appends a record to the head segment file with the next sequence number.
+ * If the head segment file is full it is sealed and compacted, and a new
+ * head segment file is started.
+ *
+ * Parameters:
+ *	db => pointer to the database resource handler
+ *	hdr => record to append, seq must be db->next_seq
+ *	val => value of the record, ignored for tombstones
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+static int append_to_head(struct hashDB *db, struct record_hdr *hdr, char *val)
+{
+	uint64_t size;
+
+	size = segf_kv_size(db->head, hdr->key, hdr->val_len, hdr->seq);
+	if (hdr->expires)
+		size += varint_len(hdr->expires);
+	if (make_room(db, size) < 0)
+		return -1;
+
+	if (segf_append_rec(db->head, hdr, val) < 0)
+		return -1;
+
+	db->next_seq += 1;
+	return 0;
+}
+
+
+/*
+ * Makes sure the head segment file can take a record of kv_sz bytes. If
+ * it is full it is sealed and compacted, and a new head segment file is
+ * started.
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+static int make_room(struct hashDB *db, uint64_t kv_sz)
+{
+	struct segment_file *full = db->head;
+
+	if (!full->sealed && kv_sz + full->size >= MAX_SEG_FILE_SIZE) {
+		// sealed first so the compacted copy may be sorted
+		full->sealed = 1;
+		if (hashDB_compact(db, full) < 0) {
+			if (db->head == full) // not replaced, keep using it
+				full->sealed = 0;
+			return -1;
+		}
+
+		// space the old head was waiting on may have expired, a
+		// failed sweep leaves the segment files as they were
+		hashDB_sweep(db);
+
+		// compaction and merging load new indexes into RAM
+		if (db->index_budget)
+			hashDB_balance_indexes(db);
+	}
+
+	// a head left sealed by an earlier failure is replaced here
+	if (db->head->sealed && add_new_head(db) < 0)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ * Makes sure the head segment file is a v2 segment file, records of a v1
+ * head have no room for sequence numbers, merge operands, or expiry
+ * times. A v1 head is sealed and compacted, and a new head is started.
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+static int v2_head(struct hashDB *db)
+{
+	if (db->head->version == SEGF_V1 && !db->head->sealed)
+		return make_room(db, MAX_SEG_FILE_SIZE);
+	return 0;
+}
+
+
+/*
+ * Creates a new empty segment file and puts it at the front of the table
+ * of segment files. The old head is sealed, the manifest records its
+ * final size in the same edit that adds the new head.
+ *
+ * Parameter:
+ *	db => pointer to the database resource handler
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+static int add_new_head(struct hashDB *db)
+{
+	struct segment_file   *seg;
+	struct manifest_edit  edit;
+	struct manifest_seg   ms;
+
+	if ((seg = new_segment_file(db)) == NULL)
+		return -1;
+
+	edit.nops = 0;
+	if (db->head) {
+		describe_segf(db->head, &ms);
+		manifest_edit_set(&edit, &ms);
+	}
+	describe_segf(seg, &ms);
+	manifest_edit_add(&edit, &ms, (db->head) ? db->head->id : 0);
+
+	// room in the table is made first, the edit can't be taken back
+	if (segf_table_insert(&db->segs, 0, seg) < 0 ||
+	    manifest_commit(db->manifest, &edit) < 0) {
+		if (db->segs.n && db->segs.segs[0] == seg)
+			segf_table_remove(&db->segs, 0);
+		segf_delete_file(seg);
+		segf_free(seg);
+		return -1;
+	}
+
+	if (db->head)
+		db->head->sealed = 1;
+	db->head = seg;
+	return 0;
+}
+
+
+/*
+ * Calculates and returns the total size in bytes that the key value
+ * pair would take up in a newly created segment file.
+ *
+ * Parameters:
+ *	key => key in the key value pair
+ *	val_len => length of the value
+ *
+ * Returns:
+ *	The size of the record header, value, and checksum if enabled
+ */
+uint64_t get_kv_size(int key, int val_len)
+{
+	struct record_hdr hdr;
+
+	hdr.flags = (SEGF_DEFAULT_FLAGS & SEGF_HDR_CHECKSUM) ? REC_CHECKSUM : 0;
+	hdr.key = key;
+	hdr.val_len = val_len;
+	hdr.expires = 0;
+	return rec_size(&hdr);
+}
+
+
+/*
+ * Uses the data_dir field in the given hashDB struct to build a string
+ * representing the file path of the segment file with the given ID.
+ *
+ * File paths be in the following format:
+ *	data_dir/[id].dat
+ *
+ * Parameters:
  *	db => pointer a database handler
+ *	id => ID of the segment file
+ *
+ * Returns:
+ *	A pointer a dynamically allocated string reprsenting a segment 
+ * 	file path, or null if there is no memory available.
+ */
+static char *get_segf_name(struct hashDB *db, uint64_t id)
+{
+	int   path_len;
+	char  *path;
+
+	path_len = snprintf(NULL, 0, "%s/%" PRIu64 ".dat", db->data_dir, id);
+	if ((path = malloc(path_len + 1)) == NULL) // +1 for '\0'
+		return NULL;
+
+	sprintf(path, "%s/%" PRIu64 ".dat", db->data_dir, id);
+	return path;
+}
+
+
+/*
+ * Gets the value associated with the given key
+ *
+ * Parameters:
+ *	db => hashDB to read from
+ *	key => used to look up the value
+ *	val => pointer to where the value will be stored if the key was found
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 if the key was not found,
+ *	of 1 if the key was found
+ */
+int hashDB_get(struct hashDB *db, int key, char **val)
+{
+	int res = find_key(db, key, val);
+
+	if (db->progress.first_query_ns == 0)
+		db->progress.first_query_ns = now_ns() - db->open_start;
+	return res;
+}
+
+
+/*
+ * Finds the newest record of the key. The key is live if that record
+ * holds a value and no newer range tombstone covers it. The value is read
+ * through the value cache if it is turned on.
+ *
+ * Parameters:
+ *	db => hashDB to read from
+ *	key => key to look up
+ *	val => where to store the value if the key is live, may be NULL to
+ *	       only check if it is
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 if the key is not live,
+ *	or 1 if it is
+ */
+static int find_key(struct hashDB *db, int key, char **val)
+{
+	struct record_hdr  hdr;
+	uint64_t           offset, cover;
+	int                pos, res;
+
+	if ((res = locate_key(db, key, &pos, &offset, &cover)) <= 0)
+		return res;
+
+	// the header says if the record has expired
+	if ((res = read_value(db, pos, key, offset, &hdr, val)) < 0)
+		return -1;
+
+	if (res == 0) { // expired, compaction reclaims the record
+		if (db->index)
+			keyidx_remove(db->index, key);
+		return 0;
+	}
+
+	if (hdr.seq < cover) { // deleted by a range tombstone
+		if (val)
+			free(*val);
+		return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * Finds where the newest record of the key is without reading it. Every
+ * segment file the lookup reaches counts it for hashDB_balance_indexes.
+ *
+ * Parameters:
+ *	db => hashDB to search
+ *	key => key to look up
+ *	pos => where to store the position in db->segs of the segment file
+ *	       holding the record
+ *	offset => where to store the memtable offset of the record
+ *	cover => where to store the sequence number of the newest range
+ *	         tombstone covering the key, 0 if there is none. The record
+ *	         is deleted if its sequence number is smaller.
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 if the key has no record
+ *	or its newest record is a tombstone, or 1 if the record was found
+ */
+static int locate_key(struct hashDB *db, int key, int *pos, uint64_t *offset,
+		      uint64_t *cover)
+{
+	struct segment_file  *curr;
+	uint64_t             rd;
+	int                  res;
+
+	if (db->index_budget && ++db->lookups % HASHDB_BALANCE_INTERVAL == 0)
+		hashDB_balance_indexes(db);
+
+	*cover = 0;
+	for (int i = 0; i < db->segs.n; ++i) {
+		curr = db->segs.segs[i];
+
+		// range tombstones are read by loading the segment file
+		if (segf_load(curr) < 0)
+			return -1;
+
+		curr->hits += 1;
+		if (curr->nrange_dels &&
+		    (rd = segf_range_cover(curr, key, UINT64_MAX)) > *cover)
+			*cover = rd;
+
+		if ((res = segf_read_memtable(curr, key, offset)) == MEMTE_MISSING)
+			continue;
+
+		if (res < 0)
+			return -1;
+
+		if (res == MEMTE_DELETED) // tombstone shadows older segment files
+			return 0;
+
+		*pos = i;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Gets the values of a batch of keys. Every key is looked up in the
+ * segment files first, then the records are read grouped by segment file
+ * and sorted by offset, so records close to each other in a file are
+ * read together and the reads of every file go to the I/O engine as one
+ * batch (see segf_read_batch). Values come from the value cache
+ * when it is turned on and has them.
+ *
+ * Parameters:
+ *	db => hashDB to read from
+ *	keys => keys to look up, in any order
+ *	n => number of keys
+ *	results => where to store the result of every key, results[i] for
+ *	           keys[i]
+ *	arena => memory the values are stored in, one after another
+ *
+ * Returns:
+ *	The number of live keys, or -1 if there is an error (check errno,
+ *	ENOBUFS if the values do not fit in the arena)
+ */
+int hashDB_multi_get(struct hashDB *db, const int *keys, int n,
+		     struct hashDB_result *results, struct hashDB_arena *arena)
+{
+	struct range_read  *reads = NULL;
+	struct segf_read   *recs = NULL;
+	struct record_hdr  hdr;
+	uint64_t           *covers = NULL, seq, now;
+	char               *val;
+	int                nreads = 0, nfound = 0, pos, res, i;
+
+	if (n <= 0)
+		return 0;
+
+	now = db->clock();
+
+	if ((reads = malloc(n * sizeof(struct range_read))) == NULL ||
+	    (recs = malloc(n * sizeof(struct segf_read))) == NULL ||
+	    (covers = malloc(n * sizeof(uint64_t))) == NULL)
+		goto err;
+
+	for (i = 0; i < n; ++i) {
+		struct range_read *r = &reads[nreads];
+
+		results[i].found = 0;
+		results[i].val = NULL;
+		results[i].val_len = 0;
+
+		if ((res = locate_key(db, keys[i], &pos, &r->offset, &covers[i])) < 0)
+			goto err;
+		if (res == 0)
+			continue;
+
+		// the cache answers without any reads
+		if (db->cache && db->segs.segs[pos]->id &&
+		    vcache_get(db->cache, keys[i], db->segs.segs[pos]->id,
+			       r->offset, &seq, &val)) {
+			res = 0;
+			if (seq >= covers[i])
+				res = arena_copy(arena, val, strlen(val), &results[i]);
+			free(val);
+			if (res < 0)
+				goto err;
+			nfound += results[i].found;
+			continue;
+		}
+
+		r->seg = pos;
+		r->i = i;
+		nreads += 1;
+	}
+
+	qsort(reads, nreads, sizeof(struct range_read), range_read_cmp);
+	for (i = 0; i < nreads; ++i) {
+		recs[i].seg = db->segs.segs[reads[i].seg];
+		recs[i].offset = reads[i].offset;
+	}
+
+	if (segf_read_batch(recs, nreads, arena->buf, arena->len, &arena->used) < 0)
+		goto err;
+
+	for (i = 0; i < nreads; ++i) {
+		struct hashDB_result  *out = &results[reads[i].i];
+		struct segment_file   *seg = recs[i].seg;
+
+		if (recs[i].hdr.seq < covers[reads[i].i])
+			continue; // deleted by a range tombstone
+
+		// operands are folded on their own, the record read stays
+		// unused in the arena
+		if (recs[i].hdr.flags & REC_MERGE) {
+			if ((res = read_value(db, reads[i].seg, keys[reads[i].i],
+					      recs[i].offset, &hdr, &val)) < 0)
+				goto err;
+			if (res == 0)
+				continue; // expired along with its value
+			res = arena_copy(arena, val, hdr.val_len, out);
+			free(val);
+			if (res < 0)
+				goto err;
+			nfound += 1;
+			continue;
+		}
+
+		if (recs[i].hdr.expires && recs[i].hdr.expires <= now)
+			continue;
+
+		out->found = 1;
+		out->val = recs[i].val;
+		out->val_len = recs[i].hdr.val_len;
+		nfound += 1;
+
+		// the value has been read either way, a full cache is not an
+		// error. Values that expire are never cached.
+		if (db->cache && seg->id && recs[i].hdr.expires == 0)
+			vcache_put(db->cache, keys[reads[i].i], seg->id,
+				   recs[i].offset, recs[i].hdr.seq, out->val,
+				   out->val_len);
+	}
+
+	if (db->progress.first_query_ns == 0)
+		db->progress.first_query_ns = now_ns() - db->open_start;
+
+	free(reads);
+	free(recs);
+	free(covers);
+	return nfound;
+
+err:
+	free(reads);
+	free(recs);
+	free(covers);
+	return -1;
+}
+
+
+/*
+ * Copies a value into the arena and makes it the result of its key
+ *
+ * Returns:
+ *	-1 if it does not fit (errno is set to ENOBUFS), 0 otherwise
+ */
+static int arena_copy(struct hashDB_arena *arena, const char *val,
+		      unsigned int val_len, struct hashDB_result *res)
+{
+	if (arena->len - arena->used < (size_t)val_len + 1) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	res->found = 1;
+	res->val = arena->buf + arena->used;
+	res->val_len = val_len;
+	memcpy(res->val, val, val_len + 1);
+	arena->used += val_len + 1;
+	return 0;
+}
+
+
+/*
+ * Reads the record at the memtable offset of the segment file like
+ * segf_read_rec, the value from the value cache if it is there. A value
+ * read from the file is added to the cache. A merge record is folded into
+ * the value of its key first (see fold_merge), the folded value is what
+ * gets cached. Records of segment files with no ID and values that expire
+ * are never cached, an expired value reads as missing. Only
+ * lookups come through here, compaction, merging, scans, and ranges read
+ * the segment files directly so they neither fill the cache nor count
+ * towards its admission policy.
+ *
+ * Parameters:
+ *	db => hashDB the segment file belongs to
+ *	pos => position of the segment file to read in db->segs
+ *	key => key of the record
+ *	offset => memtable offset of the record
+ *	hdr => where to store the header of the record, only its seq and
+ *	       expires are set when the value comes from the cache
+ *	val => where to store the value (caller must free it), may be NULL
+ *	       to only read the header
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 if the value has expired,
+ *	1 otherwise
+ */
+static int read_value(struct hashDB *db, int pos, int key, uint64_t offset,
+		      struct record_hdr *hdr, char **val)
+{
+	struct segment_file  *seg = db->segs.segs[pos];
+	struct fold_src      src = {db->merge_op, db->segs.segs, db->segs.n, NULL,
+				    db->clock()};
+	char                 *tmp = NULL;
+	int                  cached, res;
+
+	cached = (db->cache && seg->id && val);
+	if (cached && (res = vcache_get(db->cache, key, seg->id, offset,
+					&hdr->seq, val))) {
+		hdr->expires = 0;
+		return res;
+	}
+
+	if (segf_read_rec(seg, offset, hdr, val) < 0)
+		return -1;
+
+	if (hdr->flags & REC_MERGE) {
+		// whether the folded value expired takes its operands
+		if (val == NULL &&
+		    segf_read_rec(seg, offset, hdr, (val = &tmp)) < 0)
+			return -1;
+		res = fold_merge(&src, pos, key, hdr, val);
+		free(tmp);
+		if (res <= 0)
+			return res;
+	} else if (hdr->expires && hdr->expires <= src.now) {
+		if (val)
+			free(*val);
+		return 0;
+	}
+
+	// the value has been read either way, a full cache is not an error
+	if (cached && hdr->expires == 0)
+		vcache_put(db->cache, key, seg->id, offset, hdr->seq, *val,
+			   hdr->val_len);
+	return 1;
+}
+
+
+/*
+ * Removes a key value pair from the database. The tombstone is always
+ * appended to the head segment file, even if the value lives in an older
+ * one, so sealed segment files are never written to.
+ *
+ * Parameters:
+ *	db => pointer to a database handler
+ *	key => key to look up and remove
+ *
+ * Returns:
+ *	1 if the key was found and the key value pair was deleted, 0 if the
+ *	key was not found, or -1 if there was an error (check errno)
+ */
+int hashDB_delete(struct hashDB *db, int key)
+{
+	struct record_hdr  hdr;
+	int                res;
+
+	if ((res = find_key(db, key, NULL)) <= 0)
+		return res; // not found or already deleted
+
+	hdr.flags = REC_DEL;
+	hdr.key = key;
+	hdr.val_len = 0;
+	hdr.seq = db->next_seq;
+	hdr.expires = 0;
+	if (append_to_head(db, &hdr, NULL) < 0)
+		return -1;
+
+	if (db->index)
+		keyidx_remove(db->index, key);
+	return 1;
+}
+
+
+/*
+ * Removes every key from lo to hi (inclusive) from the database by
+ * appending a single range tombstone to the head segment file. No values
+ * are read, the cost does not depend on how many keys are in the range.
+ * Keys put after the range tombstone are not affected by it.
+ *
+ * Parameters:
+ *	db => pointer to a database handler
+ *	lo => first key to remove
+ *	hi => last key to remove
+ *
+ * Returns:
+ *	0 if successful, -1 if there was an error (check errno, EINVAL if lo
+ *	is greater than hi)
+ */
+int hashDB_delete_range(struct hashDB *db, int lo, int hi)
+{
+	struct record_hdr   hdr;
+	struct keyidx_iter  it;
+	char                val[REC_MAX_VARINT_SZ];
+	int                 key;
+
+	if (lo > hi) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hdr.flags = REC_RANGE_DEL;
+	hdr.key = lo;
+	hdr.val_len = rec_encode_range_end(val, hi);
+	hdr.seq = db->next_seq;
+	hdr.expires = 0;
+	if (append_to_head(db, &hdr, val) < 0)
+		return -1;
+
+	// the index holds live keys only, it has to visit every one in range
+	if (db->index) {
+		keyidx_seek(db->index, lo, &it);
+		while (keyidx_next(&it, &key) && key <= hi) {
+			keyidx_remove(db->index, key);
+			keyidx_seek(db->index, key, &it);
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Sets the merge operator that folds the operands of hashDB_merge_value
+ * into values. Operands are folded when they are read, or when compaction
+ * writes them back as a value, so the same operator must be set every
+ * time the database is opened, before any of them are read.
+ *
+ * Parameters:
+ *	db => pointer to a database handler
+ *	op => merge operator, mergeop_add, mergeop_append, or one of the
+ *	      callers own that outlives the database
+ *
+ * Returns:
+ *	void
+ */
+void hashDB_set_merge_op(struct hashDB *db, const struct merge_op *op)
+{
+	db->merge_op = op;
+}
+
+
+/*
+ * Applies a merge operand to the value of the key without reading the
+ * value. A merge record holding just the operand is appended to the head
+ * segment file, so the cost of an update does not depend on the size of
+ * the value. Reads fold the operands of a key into its value with the
+ * merge operator of the database, compaction writes the folded value
+ * back in their place.
+ *
+ * Parameters:
+ *	db => pointer to a database handler
+ *	key => key whose value the operand applies to
+ *	len => length of the operand (in bytes)
+ *	operand => operand to apply
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno, EINVAL if no merge
+ *	operator has been set)
+ */
+int hashDB_merge_value(struct hashDB *db, int key, int len, char *operand)
+{
+	struct record_hdr  hdr;
+	uint64_t           prev;
+	char               *val;
+	int                added = 0, res;
+
+	if (db->merge_op == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// v1 files can't hold merge records
+	if (v2_head(db) < 0)
+		return -1;
+
+	hdr.flags = REC_MERGE;
+	hdr.key = key;
+	hdr.val_len = (REC_MAX_VARINT64_SZ * 2) + len;
+	hdr.seq = db->next_seq;
+	hdr.expires = 0;
+	if (make_room(db, segf_kv_size(db->head, key, hdr.val_len,
+				       hdr.seq)) < 0)
+		return -1;
+
+	// the previous record is looked for in the head the record goes to
+	if ((res = segf_read_memtable(db->head, key, &prev)) < 0)
+		return -1;
+	if (res == MEMTE_MISSING)
+		prev = 0;
+
+	// the time it was written decides if the operand outlives an
+	// expired value (see fold_merge)
+	if ((val = malloc((REC_MAX_VARINT64_SZ * 2) + len)) == NULL)
+		return -1;
+	hdr.val_len = varint_encode(val, prev);
+	hdr.val_len += varint_encode(val + hdr.val_len, db->clock());
+	memcpy(val + hdr.val_len, operand, len);
+	hdr.val_len += len;
+
+	if (db->index && (added = keyidx_insert(db->index, key)) < 0) {
+		free(val);
+		return -1;
+	}
+
+	res = segf_append_rec(db->head, &hdr, val);
+	free(val);
+	if (res < 0) {
+		if (added)
+			keyidx_remove(db->index, key);
+		return -1;
+	}
+
+	db->next_seq += 1;
+	return 0;
+}
+
+
+/*
+ * Takes a snapshot of the database. Reads through the snapshot see every
+ * put and delete made before it was taken and none made after, no matter
+ * how many segment files are compacted or merged in the meantime. Every
+ * segment file is loaded first, so reads through the snapshot never have
+ * to.
+ *
+ * Parameter:
+ *	db => pointer to the database handler
+ *
+ * Returns:
+ *	Dynamically allocated snapshot, or NULL if there is an error (check
+ *	errno). The snapshot must be released with
+ *	hashDB_release_snapshot, it may outlive the hashDB struct.
+ */
+struct hashDB_snapshot *hashDB_snapshot(struct hashDB *db)
+{
+	struct hashDB_snapshot  *snap;
+	int                     i;
+
+	if (load_segfs(db, NULL) < 0)
+		return NULL;
+
+	if ((snap = malloc(sizeof(struct hashDB_snapshot))) == NULL)
+		return NULL;
+
+	snap->seq = db->next_seq - 1;
+	snap->merge_op = db->merge_op;
+	snap->now = db->clock();
+	snap->nsegs = db->segs.n;
+	snap->segs = malloc(snap->nsegs * sizeof(struct segment_file *));
+	if (snap->segs == NULL) {
+		free(snap);
+		return NULL;
+	}
+
+	if ((snap->head_table = memtable_copy(db->head->table)) == NULL) {
+		free(snap->segs);
+		free(snap);
+		return NULL;
+	}
+
+	memcpy(snap->segs, db->segs.segs, snap->nsegs * sizeof(*snap->segs));
+	for (i = 0; i < snap->nsegs; ++i)
+		segf_ref(snap->segs[i]);
+
+	return snap;
+}
+
+
+/*
+ * Gets the value the key had when the snapshot was taken
+ *
+ * Parameters:
+ *	snap => snapshot to read from
+ *	key => used to look up the value
+ *	val => pointer to where the value will be stored if the key was found
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 if the key was not found,
+ *	or 1 if the key was found
+ */
+int hashDB_snapshot_get(struct hashDB_snapshot *snap, int key, char **val)
+{
+	struct fold_src    src = {snap->merge_op, snap->segs, snap->nsegs, snap,
+				  snap->now};
+	struct record_hdr  hdr;
+	uint64_t           offset;
+	uint64_t           cover = 0, rd;
+	int                res;
+
+	for (int i = 0; i < snap->nsegs; ++i) {
+		// range tombstones appended to the head after the snapshot
+		// was taken are skipped by their sequence number
+		rd = segf_range_cover(snap->segs[i], key, snap->seq);
+		if (rd > cover)
+			cover = rd;
+
+		res = snapshot_find(snap, i, key, &offset);
+		if (res == MEMTE_MISSING)
+			continue;
+		if (res < 0)
+			return -1;
+		if (res == MEMTE_DELETED)
+			return 0;
+
+		if (segf_read_rec(snap->segs[i], offset, &hdr, val) < 0)
+			return -1;
+
+		if (hdr.seq < cover) {
+			free(*val);
+			return 0;
+		}
+
+		if (hdr.flags & REC_MERGE)
+			return fold_merge(&src, i, key, &hdr, val);
+
+		if (hdr.expires && hdr.expires <= snap->now) {
+			free(*val);
+			return 0;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Releases the snapshot and the segment files it was holding on to
+ *
+ * Parameter:
+ *	snap => snapshot to release
+ *
+ * Returns:
+ *	void
+ */
+void hashDB_release_snapshot(struct hashDB_snapshot *snap)
+{
+	for (int i = 0; i < snap->nsegs; ++i)
+		segf_unref(snap->segs[i]);
+
+	memtable_free(snap->head_table);
+	free(snap->segs);
+	free(snap);
+}
+
+
+/*
+ * Begins an optimistic transaction. Its gets read the database as it is
+ * when they run, its puts are held back until hashDB_txn_commit, which
+ * only writes them if no key the transaction read has been put or
+ * deleted since it began. Transactions never lock anything, the database
+ * can be used in the meantime, including by other transactions. As with
+ * every other call, calls on the database and its transactions must not
+ * run at the same time, hashDB_committer_txn_begin runs transactions of
+ * many threads at once. Every transaction must end before the database
+ * is freed.
+ *
+ * Parameter:
+ *	db => database the transaction runs on
+ *
+ * Returns:
+ *	Pointer to a hashDB_txn struct, caller must end it with
+ *	hashDB_txn_commit or hashDB_txn_abort, or NULL if there is an error
+ *	(check errno)
+ */
+struct hashDB_txn *hashDB_txn_begin(struct hashDB *db)
+{
+	struct hashDB_txn *txn;
+
+	// records of a v1 head have no sequence numbers to check against
+	if (v2_head(db) < 0)
+		return NULL;
+
+	if ((txn = calloc(1, sizeof(struct hashDB_txn))) == NULL)
+		return NULL;
+
+	txn->db = db;
+	txn->start_seq = db->next_seq - 1;
+	txn->next = db->txns;
+	if (db->txns)
+		db->txns->prev = txn;
+	db->txns = txn;
+	return txn;
+}
+
+
+/*
+ * Gets the value of the key in the transaction. A value the transaction
+ * put is returned as is, otherwise the key is read from the database and
+ * hashDB_txn_commit checks it has not changed since the transaction began.
+ *
+ * Parameters:
+ *	txn => transaction to read in
+ *	key => used to look up the value
+ *	val => pointer to where the value will be stored if the key was found
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 if the key was not found,
+ *	or 1 if the key was found
+ */
+int hashDB_txn_get(struct hashDB_txn *txn, int key, char **val)
+{
+	int  *tmp, cap;
+
+	for (int i = 0; i < txn->nwrites; ++i) {
+		if (txn->keys[i] != key)
+			continue;
+		if ((*val = strdup(txn->vals[i])) == NULL)
+			return -1;
+		return 1;
+	}
+
+	if (txn->nreads == txn->reads_cap) {
+		cap = (txn->reads_cap) ? txn->reads_cap * 2 : 16;
+		if ((tmp = realloc(txn->reads, cap * sizeof(int))) == NULL)
+			return -1;
+		txn->reads = tmp;
+		txn->reads_cap = cap;
+	}
+	txn->reads[txn->nreads++] = key;
+
+	return hashDB_get(txn->db, key, val);
+}
+
+
+/*
+ * Puts the key value pair in the transaction, it is written to the
+ * database by hashDB_txn_commit. The value is copied. Putting a key the
+ * transaction already put replaces the value.
+ *
+ * Parameters:
+ *	txn => transaction to put in
+ *	key => key to insert
+ *	val_len => length of the value (in bytes)
+ *	val => pointer to the value to insert
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno, E2BIG if the transaction
+ *	already puts HASHDB_TXN_MAX_WRITES other keys)
+ */
+int hashDB_txn_put(struct hashDB_txn *txn, int key, int val_len, char *val)
+{
+	char  *copy;
+	int   i;
+
+	for (i = 0; i < txn->nwrites && txn->keys[i] != key; ++i)
+		;
+
+	if (i == HASHDB_TXN_MAX_WRITES) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	if ((copy = malloc(val_len + 1)) == NULL)
+		return -1;
+	memcpy(copy, val, val_len);
+	copy[val_len] = '\0';
+
+	if (i == txn->nwrites) {
+		txn->keys[i] = key;
+		txn->nwrites += 1;
+	} else {
+		free(txn->vals[i]);
+	}
+	txn->val_lens[i] = val_len;
+	txn->vals[i] = copy;
+	return 0;
+}
+
+
+/*
+ * Commits the transaction and frees it. Every key the transaction read
+ * from the database is checked against the puts and deletes made since
+ * the transaction began, if none of them changed the puts of the
+ * transaction are appended to the head segment file as one atomic batch.
+ * Either all of them are seen afterwards, also after a crash, or none.
+ *
+ * Parameter:
+ *	txn => transaction to commit
+ *
+ * Returns:
+ *	0 if the transaction was committed, HASHDB_TXN_RETRY if a key it
+ *	read has changed (nothing is written, run the transaction again),
+ *	or -1 if there is an error (check errno)
+ */
+int hashDB_txn_commit(struct hashDB_txn *txn)
+{
+	struct hashDB  *db = txn->db;
+	uint64_t       size = 0;
+	int            res = 0, i, err;
+
+	for (i = 0; i < txn->nreads && res == 0; ++i) {
+		if ((res = key_changed(db, txn->reads[i], txn->start_seq)) > 0)
+			res = HASHDB_TXN_RETRY;
+	}
+
+	if (res == 0 && txn->nwrites) {
+		for (i = 0; i < txn->nwrites; ++i) {
+			size += segf_kv_size(db->head, txn->keys[i],
+					     txn->val_lens[i], db->next_seq + i);
+		}
+
+		// the whole batch goes into one head segment file
+		if (make_room(db, size) < 0 ||
+		    append_pairs(db, txn->keys, txn->val_lens, txn->vals,
+				 txn->nwrites, 1) < 0)
+			res = -1;
+	}
+
+	err = errno;
+	hashDB_txn_abort(txn);
+	errno = err;
+	return res;
+}
+
+
+/*
+ * Ends the transaction without writing anything and frees it
+ *
+ * Parameter:
+ *	txn => transaction to abort
  *
  * Returns:
- *	A pointer a dynamically allocated string reprsenting a segment 
- * 	file path, or null if there is no memory available.
+ *	void
+ */
+void hashDB_txn_abort(struct hashDB_txn *txn)
+{
+	if (txn->prev)
+		txn->prev->next = txn->next;
+	else
+		txn->db->txns = txn->next;
+	if (txn->next)
+		txn->next->prev = txn->prev;
+
+	for (int i = 0; i < txn->nwrites; ++i)
+		free(txn->vals[i]);
+	free(txn->reads);
+	free(txn);
+}
+
+
+/*
+ * Checks if a put or delete newer than the sequence number reached the
+ * key. Segment files holding nothing newer are skipped, in the first
+ * other one that has a record of the key, the sequence number of that
+ * record decides.
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 1 if one did, 0 otherwise
+ */
+static int key_changed(struct hashDB *db, int key, uint64_t seq)
+{
+	struct segment_file  *curr;
+	struct record_hdr    hdr;
+	uint64_t             offset;
+	int                  res;
+
+	for (int i = 0; i < db->segs.n; ++i) {
+		curr = db->segs.segs[i];
+		if (segf_load(curr) < 0)
+			return -1;
+
+		if (curr->max_seq <= seq)
+			continue;
+
+		if (curr->nrange_dels &&
+		    segf_range_cover(curr, key, UINT64_MAX) > seq)
+			return 1;
+
+		if ((res = segf_read_memtable(curr, key, &offset)) == 0)
+			continue;
+		if (res < 0 || segf_read_rec(curr, offset, &hdr, NULL) < 0)
+			return -1;
+		return hdr.seq > seq;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Returns the sequence number the oldest open transaction began at, or
+ * UINT64_MAX if there is none. Tombstones newer than it are kept by
+ * compaction and merging, key_changed would miss the delete otherwise.
+ */
+static uint64_t txn_pin(struct hashDB *db)
+{
+	struct hashDB_txn  *txn;
+	uint64_t           pin = UINT64_MAX;
+
+	for (txn = db->txns; txn; txn = txn->next) {
+		if (txn->start_seq < pin)
+			pin = txn->start_seq;
+	}
+	return pin;
+}
+
+/*
+ * Returns the memtable a snapshot uses for its i'th segment file, the
+ * copy for the head and the segment files own for sealed ones
+ */
+static struct memtable *snapshot_table(struct hashDB_snapshot *snap, int i)
+{
+	return (i == 0) ? snap->head_table : snap->segs[i]->table;
+}
+
+
+/*
+ * Looks the key up in the i'th segment file of a snapshot, through
+ * snapshot_table unless the segment file is sorted or hashed and keeps
+ * its keys out of the memtable.
+ *
+ * Returns:
+ *	see segf_read_memtable
+ */
+static int snapshot_find(struct hashDB_snapshot *snap, int i, int key,
+			 uint64_t *offset)
+{
+	if (snap->segs[i]->flags & SEGF_HDR_INDEXED)
+		return segf_read_memtable(snap->segs[i], key, offset);
+	return memtable_read(snapshot_table(snap, i), key, offset);
+}
+
+
+/*
+ * Folds a merge record into the value its key had at the sequence number
+ * of the record. The chain of merge records is followed back through the
+ * offset each keeps of the previous record of the key in its segment
+ * file, and on into older segment files, until it reaches a value, a
+ * tombstone, a record covered by a range tombstone, or the end of the
+ * table. The operands are then applied to the value, or to no value,
+ * oldest first.
+ *
+ * A value that has expired by src->now is dropped along with the
+ * operands written before it expired, the rest apply to no value. The
+ * folded value of a value that has not expired yet expires with it.
+ *
+ * Parameters:
+ *	src => segment files the record is folded over
+ *	pos => position of the segment file holding the record in src->segs
+ *	key => key of the record
+ *	hdr => header of the record, val_len and expires are set to those
+ *	       of the folded value
+ *	val => value of the record, replaced by the folded value (caller
+ *	       must free it). It is freed if there is an error or the key
+ *	       has no value.
+ *
+ * Returns:
+ *	1 if the key has a value, 0 if every operand was dropped along with
+ *	an expired value, -1 otherwise (check errno, EINVAL if there is no
+ *	merge operator or it failed to apply an operand)
+ */
+static int fold_merge(struct fold_src *src, int pos, int key,
+		      struct record_hdr *hdr, char **val)
+{
+	struct record_hdr  rec = *hdr;
+	uint64_t           prev, offset, cover = 0, rd, *times = NULL, *ttmp;
+	char               **ops = NULL, **tmp, *cur = *val, *base = NULL, *out;
+	int                nops = 0, cap = 0, covered = 0, res, n, m, i;
+
+	*val = NULL;
+	hdr->expires = 0;
+	if (src->op == NULL) {
+		errno = EINVAL;
+		goto err;
+	}
+
+	while (1) {
+		// range tombstones of the segment files up to the record's
+		for (; covered <= pos; ++covered) {
+			if (segf_load(src->segs[covered]) < 0)
+				goto err;
+			rd = segf_range_cover(src->segs[covered], key, hdr->seq);
+			if (rd > cover)
+				cover = rd;
+		}
+
+		if (rec.seq < cover || (rec.flags & REC_DEL))
+			break; // the operands apply to no value
+
+		if (!(rec.flags & REC_MERGE)) {
+			base = cur;
+			cur = NULL;
+			hdr->expires = rec.expires;
+			break;
+		}
+
+		// keep the operand and the time it was written, they follow
+		// the offset of the previous record
+		if ((n = varint_decode(cur, rec.val_len, &prev)) < 0 ||
+		    (m = varint_decode(cur + n, rec.val_len - n, &rd)) < 0) {
+			errno = EIO;
+			goto err;
+		}
+		memmove(cur, cur + n + m, rec.val_len - n - m + 1);
+		if (nops == cap) {
+			cap = (cap) ? cap * 2 : 8;
+			if ((tmp = realloc(ops, cap * sizeof(char *))) == NULL)
+				goto err;
+			ops = tmp;
+			if ((ttmp = realloc(times, cap * sizeof(uint64_t))) == NULL)
+				goto err;
+			times = ttmp;
+		}
+		times[nops] = rd;
+		ops[nops++] = cur;
+		cur = NULL;
+
+		if (prev == 0) { // newest record of the key in an older file
+			res = MEMTE_MISSING;
+			while (res == MEMTE_MISSING && ++pos < src->nsegs)
+				res = fold_find(src, pos, key, &offset);
+			if (res < 0)
+				goto err;
+			if (res != MEMTE_LIVE)
+				break;
+			prev = offset;
+		}
+
+		if (segf_read_rec(src->segs[pos], prev, &rec, &cur) < 0)
+			goto err;
+	}
+
+	// operands written before the value expired went with it
+	i = nops - 1;
+	if (hdr->expires && hdr->expires <= src->now) {
+		while (i >= 0 && times[i] < hdr->expires)
+			--i;
+		free(base);
+		base = NULL;
+		hdr->expires = 0;
+	}
+
+	for (; i >= 0; --i) {
+		if (src->op->merge(base, ops[i], &out) < 0)
+			goto err;
+		free(base);
+		base = out;
+	}
+
+	for (i = 0; i < nops; ++i)
+		free(ops[i]);
+	free(ops);
+	free(times);
+	free(cur);
+
+	if (base == NULL)
+		return 0;
+	*val = base;
+	hdr->val_len = strlen(base);
+	return 1;
+
+err:
+	for (i = 0; i < nops; ++i)
+		free(ops[i]);
+	free(ops);
+	free(times);
+	free(cur);
+	free(base);
+	return -1;
+}
+
+
+/*
+ * Looks the key up in the i'th segment file of a fold_src, see
+ * segf_read_memtable
+ */
+static int fold_find(struct fold_src *src, int i, int key, uint64_t *offset)
+{
+	if (src->snap)
+		return snapshot_find(src->snap, i, key, offset);
+	if (segf_load(src->segs[i]) < 0)
+		return -1;
+	return segf_read_memtable(src->segs[i], key, offset);
+}
+
+
+/*
+ * Calls fn with the newest value of every live key in the snapshot whose
+ * hash falls in the given partition of the keyspace. Each segment file
+ * is read front to back, newest segment file first. Scanning different
+ * partitions of the same snapshot from different threads is safe.
+ *
+ * Parameters:
+ *	snap => snapshot to scan
+ *	part => partition to scan, 0 to nparts - 1
+ *	nparts => number of partitions the keyspace is split into
+ *	fn => called with every key value pair in the partition
+ *	arg => passed along to fn
+ *
+ * Returns:
+ *	0 if every key was visited, 1 if fn stopped the scan, or -1 if there
+ *	was an error (check errno)
+ */
+int hashDB_snapshot_scan(struct hashDB_snapshot *snap, int part, int nparts,
+                         hashDB_scan_fn fn, void *arg)
+{
+	struct fold_src     src = {snap->merge_op, snap->segs, snap->nsegs, snap,
+				   snap->now};
+	struct segf_cursor  *cur;
+	struct record_hdr   hdr;
+	uint64_t            offset;
+	char                *val;
+	int                 key, res = 0;
+
+	for (int i = 0; i < snap->nsegs && res == 0; ++i) {
+		cur = segf_cursor_init(snap->segs[i], snapshot_table(snap, i));
+		if (cur == NULL)
+			return -1;
+
+		while (res == 0 && segf_cursor_next(cur, &key)) {
+			if ((unsigned int)default_hash(key) % (unsigned int)nparts !=
+			    (unsigned int)part)
+				continue;
+
+			// the newest version is in the first segment file
+			// that knows the key
+			uint64_t cover = 0, rd;
+			int j, found = MEMTE_MISSING;
+			for (j = 0; j <= i; ++j) {
+				rd = segf_range_cover(snap->segs[j], key, snap->seq);
+				if (rd > cover)
+					cover = rd;
+				if (j < i && (found = snapshot_find(snap, j, key,
+								    &offset)))
+					break;
+			}
+			if (found < 0) {
+				res = -1;
+				break;
+			}
+			if (j <= i)
+				continue;
+
+			if ((res = segf_cursor_read(cur, &hdr, &val)) < 0)
+				break;
+
+			if (res == SEGF_DELETED) {
+				res = 0;
+				continue;
+			}
+
+			if (hdr.seq < cover) { // deleted by a range tombstone
+				free(val);
+				res = 0;
+				continue;
+			}
+
+			if (hdr.flags & REC_MERGE) {
+				if ((res = fold_merge(&src, i, key, &hdr,
+						      &val)) < 0)
+					break;
+				if (res == 0)
+					continue; // expired along with its value
+			} else if (hdr.expires && hdr.expires <= snap->now) {
+				free(val);
+				res = 0;
+				continue;
+			}
+
+			res = (fn(key, val, arg) != 0);
+			free(val);
+		}
+
+		segf_cursor_free(cur);
+	}
+
+	return res;
+}
+
+
+/*
+ * Calls fn with the newest value of every live key in the database. The
+ * scan runs on a snapshot taken when it starts, fn may write to the
+ * database without changing what the scan sees.
+ *
+ * Parameters:
+ *	db => pointer to the database handler
+ *	fn => called with every key value pair
+ *	arg => passed along to fn
+ *
+ * Returns:
+ *	0 if every key was visited, 1 if fn stopped the scan, or -1 if there
+ *	was an error (check errno)
+ */
+int hashDB_scan(struct hashDB *db, hashDB_scan_fn fn, void *arg)
+{
+	struct hashDB_snapshot  *snap;
+	int                     res;
+
+	if ((snap = hashDB_snapshot(db)) == NULL)
+		return -1;
+
+	res = hashDB_snapshot_scan(snap, 0, 1, fn, arg);
+	hashDB_release_snapshot(snap);
+	return res;
+}
+
+
+/*
+ * Splits the keyspace into nparts partitions by key hash and scans each
+ * one in its own thread, see hashDB_scan. fn is called from the worker
+ * threads, calls for the same partition never overlap. The database
+ * handler is not thread safe, fn must not use it.
+ *
+ * Parameters:
+ *	db => pointer to the database handler
+ *	nparts => number of partitions and worker threads
+ *	fn => called with every key value pair
+ *	args => args[i] is passed to fn for keys in partition i, may be NULL
+ *
+ * Returns:
+ *	0 if every key was visited, 1 if fn stopped the scan of at least
+ *	one partition, or -1 if there was an error (check errno)
+ */
+int hashDB_scan_parallel(struct hashDB *db, int nparts, hashDB_scan_fn fn,
+                         void **args)
+{
+	struct hashDB_snapshot  *snap;
+	struct scan_job         *jobs;
+	pthread_t               *threads;
+	int                     i, err = 0, res = 0;
+
+	if (nparts < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	jobs = malloc(nparts * sizeof(struct scan_job));
+	threads = malloc(nparts * sizeof(pthread_t));
+	if (jobs == NULL || threads == NULL || (snap = hashDB_snapshot(db)) == NULL) {
+		free(jobs);
+		free(threads);
+		return -1;
+	}
+
+	for (i = 0; i < nparts; ++i) {
+		jobs[i].snap = snap;
+		jobs[i].part = i;
+		jobs[i].nparts = nparts;
+		jobs[i].fn = fn;
+		jobs[i].arg = (args) ? args[i] : NULL;
+		if ((err = pthread_create(&threads[i], NULL, scan_worker, &jobs[i])))
+			break;
+	}
+
+	// wait for every thread that was started
+	for (int j = 0; j < i; ++j) {
+		pthread_join(threads[j], NULL);
+		if (jobs[j].res < 0)
+			res = -1;
+		else if (jobs[j].res > 0 && res == 0)
+			res = 1;
+	}
+
+	if (err) {
+		errno = err;
+		res = -1;
+	}
+
+	hashDB_release_snapshot(snap);
+	free(jobs);
+	free(threads);
+	return res;
+}
+
+
+/*
+ * Thread start routine of hashDB_scan_parallel, scans one partition
  */
-static char *get_next_segf_name(struct hashDB *db)
+static void *scan_worker(void *arg)
 {
-	int  path_len, name_len;
-	char *path, *name;
+	struct scan_job *job = arg;
+
+	job->res = hashDB_snapshot_scan(job->snap, job->part, job->nparts,
+					job->fn, job->arg);
+	return NULL;
+}
+
+
+/*
+ * Turns on the ordered index of live keys that hashDB_range needs. The
+ * index is built from the memtables and segment file indexes, only
+ * sorted segment files are read,
+ * and is kept up to date by every put and delete from then on. Compaction and
+ * merging never change which keys are live so they leave it alone.
+ *
+ * Parameter:
+ *	db => pointer to the database handler
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+int hashDB_enable_index(struct hashDB *db)
+{
+	struct key_index     *idx;
+	struct segment_file  *seg, *newer;
+	struct segf_cursor   *cur;
+	uint64_t             offset;
+	int                  key, res = 0, i, j;
+
+	if (db->index)
+		return 0;
+
+	if ((idx = keyidx_init()) == NULL)
+		return -1;
+
+	for (i = 0; i < db->segs.n && res == 0; ++i) {
+		seg = db->segs.segs[i];
+		if ((cur = segf_cursor_init(seg, seg->table)) == NULL) {
+			res = -1;
+			break;
+		}
+
+		while (res == 0 && segf_cursor_next(cur, &key)) {
+			// only the newest segment file that knows the key counts
+			for (j = 0; j < i; ++j) {
+				newer = db->segs.segs[j];
+				if ((res = segf_read_memtable(newer, key, &offset)))
+					break;
+			}
+
+			if (j == i && (res = find_key(db, key, NULL)) == 1)
+				res = keyidx_insert(idx, key);
+
+			res = (res < 0) ? -1 : 0;
+		}
+
+		segf_cursor_free(cur);
+	}
+
+	if (res < 0) {
+		keyidx_free(idx);
+		return -1;
+	}
+
+	db->index = idx;
+	return 0;
+}
+
 
-	path_len = strlen(db->data_dir) + 1; // +1 for '/'
-	name_len = (db->next_id >= 10) ? 7 : 6; // XX.dat or X.dat and '\0'
+/*
+ * Creates an iterator over the live keys from lo to hi (inclusive) in
+ * ascending order, along with their values. The iterator sees the
+ * database as it was when it was created, see hashDB_snapshot.
+ *
+ * Parameters:
+ *	db => pointer to the database handler, its index must be turned on
+ *	      with hashDB_enable_index
+ *	lo => smallest key in the range
+ *	hi => largest key in the range
+ *
+ * Returns:
+ *	Dynamically allocated iterator that must be freed with
+ *	hashDB_range_free, or NULL if there is an error (check errno,
+ *	EINVAL if the index is not turned on)
+ */
+struct hashDB_range *hashDB_range(struct hashDB *db, int lo, int hi)
+{
+	struct hashDB_range  *range;
+	struct keyidx_iter   it;
+	int                  key, cap = HASHDB_RANGE_BATCH;
 
-	path_len += name_len;
-	if ((path = calloc(path_len, sizeof(char))) == NULL)
+	if (db->index == NULL) {
+		errno = EINVAL;
 		return NULL;
-	
-	if ((name = calloc(name_len, sizeof(char))) == NULL) {
-		free(path);
+	}
+
+	if ((range = calloc(1, sizeof(struct hashDB_range))) == NULL)
 		return NULL;
+
+	if ((range->keys = malloc(cap * sizeof(int))) == NULL)
+		goto err;
+
+	keyidx_seek(db->index, lo, &it);
+	while (keyidx_next(&it, &key) && key <= hi) {
+		if (range->nkeys == cap) {
+			int *keys = realloc(range->keys, cap * 2 * sizeof(int));
+			if (keys == NULL)
+				goto err;
+			range->keys = keys;
+			cap *= 2;
+		}
+		range->keys[range->nkeys++] = key;
 	}
 
-	sprintf(name, "%d.dat", db->next_id);
-	strncat(path, "/", 1);
-	strncat(path, name, name_len);
+	if ((range->snap = hashDB_snapshot(db)) == NULL)
+		goto err;
 
-	free(name);
-	return path;
+	return range;
+
+err:
+	free(range->keys);
+	free(range);
+	return NULL;
 }
 
 
 /*
- * Gets the value associated with the given key
+ * Moves the range iterator to the next key and gets its value
  *
  * Parameters:
- *	db => hashDB to read from
- *	key => used to look up the value
- *	val => pointer to where the value will be stored if the key was found
+ *	range => iterator created by hashDB_range
+ *	key => where to store the next key
+ *	val => where to store the value of the key, the caller must free it
  *
  * Returns:
- *	-1 if there is an error (check errno), 0 if the key was not found,
- *	of 1 if the key was found
+ *	1 if there was another key, 0 if the end of the range was reached,
+ *	or -1 if there was an error (check errno)
  */
-int hashDB_get(struct hashDB *db, int key, char **val)
+int hashDB_range_next(struct hashDB_range *range, int *key, char **val)
+{
+	while (1) {
+		if (range->batch_pos == range->batch_len) {
+			if (range->next == range->nkeys)
+				return 0;
+			if (read_range_batch(range) < 0)
+				return -1;
+		}
+
+		int i = range->batch_pos++;
+		if (range->vals[i] == NULL)
+			continue;
+
+		*key = range->keys[range->next - range->batch_len + i];
+		*val = range->vals[i];
+		range->vals[i] = NULL;
+		return 1;
+	}
+}
+
+
+/*
+ * Reads the values of the next HASHDB_RANGE_BATCH keys of the range. The
+ * reads are sorted by segment file and offset.
+ *
+ * Parameter:
+ *	range => iterator whose current batch has been used up
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+static int read_range_batch(struct hashDB_range *range)
 {
-	struct segment_file  *curr = db->head;	
-	int                   res;
+	struct hashDB_snapshot  *snap = range->snap;
+	struct fold_src         src = {snap->merge_op, snap->segs, snap->nsegs,
+				       snap, snap->now};
+	struct range_read       reads[HASHDB_RANGE_BATCH];
+	struct record_hdr       hdr;
+	int                     nreads = 0, len, i, j, res;
+
+	len = range->nkeys - range->next;
+	if (len > HASHDB_RANGE_BATCH)
+		len = HASHDB_RANGE_BATCH;
+
+	// find where the newest value of each key lives
+	for (i = 0; i < len; ++i) {
+		int key = range->keys[range->next + i];
+
+		range->vals[i] = NULL;
+		for (j = 0; j < snap->nsegs; ++j) {
+			res = snapshot_find(snap, j, key, &reads[nreads].offset);
+			if (res < 0)
+				return -1;
+			if (res == MEMTE_LIVE) {
+				reads[nreads].seg = j;
+				reads[nreads].i = i;
+				nreads += 1;
+			}
+			if (res != MEMTE_MISSING)
+				break;
+		}
+	}
+
+	qsort(reads, nreads, sizeof(struct range_read), range_read_cmp);
+
+	for (i = 0; i < nreads; ++i) {
+		struct range_read *r = &reads[i];
+		if (segf_read_rec(snap->segs[r->seg], r->offset, &hdr,
+				  &range->vals[r->i]) < 0 ||
+		    ((hdr.flags & REC_MERGE) &&
+		     fold_merge(&src, r->seg, range->keys[range->next + r->i],
+				&hdr, &range->vals[r->i]) < 0)) {
+			// drop the values read so far, the batch can be retried
+			for (j = 0; j < len; ++j) {
+				free(range->vals[j]);
+				range->vals[j] = NULL;
+			}
+			return -1;
+		}
 
-	while (curr) {
-		if ((res = segf_read_file(curr, key, val)) != 0)
-			return res;
-		curr = curr->next;
+		// a key whose value expired, or was dropped by a fold along
+		// with one, is left out
+		if (!(hdr.flags & REC_MERGE) && hdr.expires &&
+		    hdr.expires <= snap->now) {
+			free(range->vals[r->i]);
+			range->vals[r->i] = NULL;
+		}
 	}
 
+	range->batch_len = len;
+	range->batch_pos = 0;
+	range->next += len;
 	return 0;
 }
 
 
 /*
- * Removes a key value pair from the database
+ * Comparison function used by qsort to order range reads by segment file
+ * and then by offset
+ */
+static int range_read_cmp(const void *a, const void *b)
+{
+	const struct range_read *ra = a;
+	const struct range_read *rb = b;
+
+	if (ra->seg != rb->seg)
+		return (ra->seg > rb->seg) - (ra->seg < rb->seg);
+	return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+
+/*
+ * Frees the range iterator along with any values it has not returned
  *
- * Parameters:
- *	db => pointer to a database handler
- *	key => key to look up and remove
+ * Parameter:
+ *	range => iterator to free
  *
  * Returns:
- *	1 if the key was found and the key value pair was deleted, 0 if the
- *	key was not found, or -1 if there was an error (check errno)
+ *	void
  */
-int hashDB_delete(struct hashDB *db, int key)
+void hashDB_range_free(struct hashDB_range *range)
 {
-	struct segment_file *curr = db->head;
-	int                 res = 0;
-
-	while (curr) {
-		// attempt to remove key from current segment file
-		if ((res = segf_remove_pair(curr, key)))
-			break;
-		curr = curr->next;
-	}
+	for (int i = range->batch_pos; i < range->batch_len; ++i)
+		free(range->vals[i]);
 
-	return (curr) ? res : 0;
+	hashDB_release_snapshot(range->snap);
+	free(range->keys);
+	free(range);
 }
 
 
 /*
- * Compacts the given segment file.
+ * Compacts the given segment file. If the segment file is sealed, the
+ * compacted copy is sorted or hashed as set in db, see sealed_index. The
+ * copy is a new segment file, a single manifest edit swaps it in for the
+ * given one.
  *
  * Parameters:
  *	db => pointer to the database handler
@@ -464,40 +2866,49 @@ int hashDB_delete(struct hashDB *db, int key)
  */
 int hashDB_compact(struct hashDB *db, struct segment_file *seg)
 {
-	struct segment_file *tmp = NULL;
-	char                *tmp_name = NULL;
-	char                *seg_tmp_name = NULL;
-	char                *old_seg_name = NULL;
-	int                  name_changed = 0;
+	struct segment_file   *tmp = NULL;
+	struct manifest_edit  edit;
+	struct manifest_seg   ms;
+	uint64_t              after;
+	int                   index, pos;
+
+	if ((pos = segf_table_pos(&db->segs, seg)) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	if ((tmp_name = create_file_path(db->data_dir, "tmp.dat")) == NULL)
+	if ((tmp = new_segment_file(db)) == NULL)
 		goto err;
 
-	if ((tmp = create_segment_file(tmp_name)) == NULL)
+	index = (seg->sealed) ? sealed_index(db) : 0;
+	if (copy_segfs_to(db, &seg, 1, tmp, seg, index) < 0)
 		goto err;
 
-	int key;
-	while ((key = segf_next_key(seg)) != -1) {
-		if (copy_kv_pair_to(seg, tmp, key) < 0)
-			goto err;
-	}
-	
-	old_seg_name = seg->name;
-	if ((seg_tmp_name = create_file_path(db->data_dir, "old.dat")) == NULL)
+	// nothing is older than the last segment file, its range tombstones
+	// have been applied above and can be dropped, unless an open
+	// transaction may still have to see them
+	after = (pos < db->segs.n - 1) ? 0 : txn_pin(db);
+	if (copy_range_dels_to(seg, tmp, after) < 0)
 		goto err;
 
-	if (segf_rename_file(seg, seg_tmp_name) < 0)
+	if (finish_index(tmp, index) < 0)
 		goto err;
+	tmp->sealed = seg->sealed;
 
-	name_changed = 1;
-
-	if (segf_rename_file(tmp, old_seg_name) < 0)
+	edit.nops = 0;
+	describe_segf(tmp, &ms);
+	manifest_edit_add(&edit, &ms, seg->id);
+	manifest_edit_del(&edit, seg->id);
+	if (manifest_commit(db->manifest, &edit) < 0)
 		goto err;
 
-	replace_segf_in_list(db, seg, tmp);
+	segf_table_replace(&db->segs, pos, tmp);
+	if (pos == 0)
+		db->head = tmp;
 
-	segf_delete_file(seg);
-	segf_free(seg);
+	// snapshots may still be reading seg
+	segf_retire_file(seg);
+	segf_unref(seg);
 
 	struct segment_file *a, *b;
 	if (merge_possible(db, &a, &b)) {
@@ -510,26 +2921,61 @@ int hashDB_compact(struct hashDB *db, struct segment_file *seg)
 
 err:
 	// clean up after error
-	if (tmp && tmp->seg_fd != -1)
-		segf_delete_file(tmp);
-
 	if (tmp) {
+		segf_delete_file(tmp);
 		segf_free(tmp);
-		tmp_name = NULL;
 	}
 
-	if (name_changed)
-		segf_rename_file(seg, old_seg_name);
+	return -1;
+}
 
-	segf_reset_next_key(seg);
 
-	if (tmp_name != NULL)
-		free(tmp_name);
+/*
+ * Reclaims the space of records that have expired. Sealed segment files
+ * are compacted one at a time, the one with the most expired bytes
+ * first, as long as about HASHDB_SWEEP_PCT percent of the records of the
+ * one picked have expired (see expired_bytes), the index of a sorted or
+ * hashed one not counted. Compaction drops the expired records. At
+ * most HASHDB_SWEEP_MAX segment files are compacted per call. It runs
+ * every time the head segment file fills up.
+ *
+ * Parameters:
+ *	db => pointer to the database handler
+ *
+ * Returns:
+ *	The number of segment files compacted, or -1 if there was an error
+ *	(check errno)
+ */
+int hashDB_sweep(struct hashDB *db)
+{
+	struct segment_file  *seg, *best;
+	uint64_t             now = db->clock(), exp, most, recs;
+	int                  n;
+
+	for (n = 0; n < HASHDB_SWEEP_MAX; ++n) {
+		best = NULL;
+		most = 0;
+		for (int i = 1; i < db->segs.n; ++i) {
+			seg = db->segs.segs[i];
+			// only loaded segment files have expired bytes
+			if ((exp = expired_bytes(seg, now)) == 0)
+				continue;
+			recs = (seg->flags & SEGF_HDR_INDEXED) ? seg->data_end
+							       : seg->size;
+			if (exp * 100 >= recs * HASHDB_SWEEP_PCT &&
+			    exp > most) {
+				best = seg;
+				most = exp;
+			}
+		}
 
-	if (seg_tmp_name != NULL)
-		free(seg_tmp_name);
+		if (best == NULL)
+			break;
+		if (hashDB_compact(db, best) < 0)
+			return -1;
+	}
 
-	return -1;
+	return n;
 }
 
 
@@ -537,7 +2983,8 @@ err:
  * Creates a new segment file struct and backing segment file
  *
  * Parameters:
- *	name => string representing the name of the new segment file
+ *	name => string representing the name of the new segment file, it
+ *	        is freed if there is an error
  *
  * Returns:
  *	a pointer to the new segment_file struct on the heap, NULL if there
@@ -547,8 +2994,10 @@ static struct segment_file *create_segment_file(char *name)
 {
 	struct segment_file *tmp = NULL;
 	
-	if ((tmp = segf_init(name)) == NULL)
+	if ((tmp = segf_init(name)) == NULL) {
+		free(name);
 		return NULL;
+	}
 
 	if (segf_create_file(tmp) < 0) {
 		segf_free(tmp);
@@ -560,34 +3009,57 @@ static struct segment_file *create_segment_file(char *name)
 
 
 /*
- * Replaces seg in db's linked list of segment files with tmp
+ * Creates a segment file with the next ID of the database. It is not in
+ * the manifest until an edit adds it.
+ *
+ * Parameter:
+ *	db => pointer to the database handler
+ *
+ * Returns:
+ *	a pointer to the new segment_file struct on the heap, NULL if there
+ *	is an error (check errno)
+ */
+static struct segment_file *new_segment_file(struct hashDB *db)
+{
+	struct segment_file  *seg;
+	char                 *name;
+
+	if ((name = get_segf_name(db, db->next_id)) == NULL)
+		return NULL;
+
+	if ((seg = create_segment_file(name)) == NULL)
+		return NULL;
+
+	seg->id = db->next_id++;
+	return seg;
+}
+
+
+/*
+ * Fills in what the manifest records about the segment file. Compaction
+ * and merging write no shadowed records, a head that is sealed without
+ * being compacted counts all of its records as live.
  *
  * Parameters:
- *	db => pointer to database resource handler
- *	seg => segment file to replace
- *	tmp => segment file to replace with
+ *	seg => segment file to describe
+ *	ms => where to store the description
  *
  * Returns:
  *	void
  */
-static void replace_segf_in_list(struct hashDB *db,
-                                 struct segment_file *seg,
-                                 struct segment_file *tmp)
+static void describe_segf(struct segment_file *seg, struct manifest_seg *ms)
 {
-	if (db->head == seg) {
-		tmp->next = db->head->next;		
-		db->head = tmp;
-		return;
-	}
-
-	struct segment_file *curr, *prev;
-	curr = prev = db->head;
-	while (curr && curr != seg) {
-		prev = curr;
-		curr = curr->next;
-	}
-	prev->next = tmp;
-	tmp->next = curr->next;
+	unsigned int hdr_sz = (seg->version == SEGF_V1) ? 0 : SEGF_HDR_SZ;
+
+	ms->id = seg->id;
+	ms->version = seg->version;
+	ms->flags = seg->flags;
+	ms->size = segf_size(seg);
+	if ((seg->flags & SEGF_HDR_INDEXED) && segf_loaded(seg))
+		ms->live = seg->data_end - hdr_sz;
+	else
+		ms->live = ms->size - hdr_sz;
+	ms->dead = 0;
 }
 
 
@@ -614,7 +3086,7 @@ static char *create_file_path(const char *dir_name, const char *file_name)
 		return NULL;
 	
 	strncat(path, dir_name, dir_len);
-	strncat(path, "/", 1);
+	strcat(path, "/");
 	strncat(path, file_name, file_len);
 
 	return path;
@@ -622,9 +3094,12 @@ static char *create_file_path(const char *dir_name, const char *file_name)
 
 
 /*
- * Checks if there are any two pairs of segment files that can be
+ * Checks if there are any two neighboring segment files that can be
  * merge into one. For this to be true the sum of the two file sizes must 
- * still be less than the max segment file size.
+ * still be less than the max segment file size, not counting the bytes
+ * of records that have expired since merging drops them. Only neighbors
+ * are considered so that merging never moves a key value pair past a
+ * newer segment file that shadows it.
  *
  * Parameters:
  *	db => pointer to the database handler
@@ -639,71 +3114,58 @@ static int merge_possible(struct hashDB *db,
 			  struct segment_file **a,
 			  struct segment_file **b)
 {
-	struct segment_file *one = db->head;
-	struct segment_file *two;
+	struct segment_file  **segs = db->segs.segs;
+	uint64_t             now = db->clock();
 	*a = *b = NULL;
 
-	while (one) {
-		two = db->head;
-		while (two) {
-			if (two == one) {
-				two = two->next;
-				continue;
-			}
-
-			int sum = get_size_sum(one, two);
-			if (sum == -1) {
-				printf("ERROR: merge_possible\n");
-				goto exit;
-			} else if (sum < MAX_SEG_FILE_SIZE) {
-				*a = one;
-				*b = two;
-				goto exit;
-			}
-			two = two->next;
+	// sizes of unloaded segment files come from the manifest, the
+	// loader may be changing them (see segf_size)
+	for (int i = 0; i + 1 < db->segs.n; ++i) {
+		if (segf_size(segs[i]) - expired_bytes(segs[i], now) +
+		    segf_size(segs[i + 1]) - expired_bytes(segs[i + 1], now) <
+		    MAX_SEG_FILE_SIZE) {
+			*a = segs[i];
+			*b = segs[i + 1];
+			break;
 		}
-		one = one->next;
 	}
 
-exit:
-	return (a && b) ? 1 : 0;
+	return (*a && *b) ? 1 : 0;
 }
 
 
 /*
- * Returns the sum of given segment file sizes
+ * Estimates how many bytes of the segment file are records that have
+ * expired by now. Expiry times are taken to be spread evenly between the
+ * earliest and the latest one in the file.
  *
  * Parameters:
- *	a => first segment file
- *	b => second segment file
+ *	seg => segment file to look at, unloaded ones have no expiry times
+ *	       counted yet
+ *	now => time to compare the expiry times against
  *
  * Returns:
- *	
+ *	The estimate, at most the size of every record with an expiry time
  */
-static int get_size_sum(struct segment_file *a, struct segment_file *b)
+static uint64_t expired_bytes(struct segment_file *seg, uint64_t now)
 {
-	struct stat file_info;
-
-	// Log errors and return
-	if (stat(a->name, &file_info) < 0) {
-		printf("ERROR: get_size_sum: %s\n", strerror(errno));
-		return -1;
-	}
-	int a_size = file_info.st_size;
-
-	if (stat(b->name, &file_info) < 0) {
-		printf("ERROR: get_size_sum: %s\n", strerror(errno));
-		return -1;
-	}
-
-	return a_size + file_info.st_size;
+	// the loader fills in the counts of the segment files it loads
+	if (!segf_loaded(seg) || seg->nttl == 0 || now < seg->ttl_min)
+		return 0;
+	if (now >= seg->ttl_max)
+		return seg->ttl_bytes;
+	return (uint64_t)((double)seg->ttl_bytes * (now - seg->ttl_min) /
+			  (seg->ttl_max - seg->ttl_min));
 }
 
 
 /*
  * Merges the two given segment files into one. The resulting segment file
- * is given the same name as the newer of the two segment file (the one with
- * larger name ID)
+ * is a new segment file that takes the place of the newer of the two (the
+ * one closer to the head) in the table, a single manifest edit swaps it in
+ * for both. The two segment files must be neighbors in the table, neither
+ * of them is changed by the merge. Like hashDB_compact, the result is
+ * sorted or hashed if the newer one is sealed.
  *
  * Parameters:
  *	db => pointer the database handler
@@ -717,137 +3179,515 @@ int hashDB_merge(struct hashDB *db,
                  struct segment_file *s1, 
                  struct segment_file *s2)
 {
-	char                *mtemp_name = NULL;
-	struct segment_file *mtemp = NULL;
-	struct segment_file *newer, *older;
+	struct segment_file   *merged = NULL;
+	struct segment_file   *newer, *older;
+	struct manifest_edit  edit;
+	struct manifest_seg   ms;
+	uint64_t              after;
+	int                   pos1, pos2, pos;
+
+	pos1 = segf_table_pos(&db->segs, s1);
+	pos2 = segf_table_pos(&db->segs, s2);
+	if (pos1 < 0 || pos2 < 0 || abs(pos1 - pos2) != 1) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	if ((mtemp_name = create_file_path(db->data_dir, "mtemp.dat")) == NULL)
+	pos = (pos1 < pos2) ? pos1 : pos2;
+	newer = db->segs.segs[pos];
+	older = db->segs.segs[pos + 1];
+
+	if ((merged = new_segment_file(db)) == NULL)
 		goto err;
 
-	if ((mtemp = create_segment_file(mtemp_name)) == NULL)
+	// pairs in older that are shadowed by a newer pair or tombstone are
+	// skipped
+	struct segment_file *segs[] = {newer, older};
+	int index = (newer->sealed) ? sealed_index(db) : 0;
+	if (copy_segfs_to(db, segs, 2, merged, older, index) < 0)
 		goto err;
 
-	int s1_id = get_id_from_fname(s1->name);
-	int s2_id = get_id_from_fname(s2->name);
-	if (s1_id > s2_id) {
-		newer = s1;
-		older = s2;
-	} else {
-		newer = s2;
-		older = s1;
+	after = (pos + 2 < db->segs.n) ? 0 : txn_pin(db);
+	if (copy_range_dels_to(newer, merged, after) < 0 ||
+	    copy_range_dels_to(older, merged, after) < 0)
+		goto err;
+
+	if (finish_index(merged, index) < 0)
+		goto err;
+	merged->sealed = newer->sealed;
+
+	edit.nops = 0;
+	describe_segf(merged, &ms);
+	manifest_edit_add(&edit, &ms, newer->id);
+	manifest_edit_del(&edit, newer->id);
+	manifest_edit_del(&edit, older->id);
+	if (manifest_commit(db->manifest, &edit) < 0)
+		goto err;
+
+	segf_table_replace(&db->segs, pos, merged);
+	segf_table_remove(&db->segs, pos + 1);
+	if (pos == 0)
+		db->head = merged;
+
+	// snapshots may still be reading them
+	segf_retire_file(s1);
+	segf_retire_file(s2);
+
+	segf_unref(s1);
+	segf_unref(s2);
+
+	return 1;
+err:
+	if (merged != NULL) { 
+		segf_delete_file(merged);	
+		segf_free(merged);
 	}
 
-	int key;
-	while ((key = segf_next_key(newer)) != -1) {
-		if (copy_kv_pair_to(newer, mtemp, key) < 0)
-			goto err;
+	return -1;
+}
+
 
-		// Remove key value pair from older memtable if present
-		memtable_remove(older->table, key);
+/*
+ * Decides which hashed segment files keep their index in RAM. The segment
+ * files with the most lookups since the last call are promoted while
+ * their indexes fit in db->index_budget, the rest are demoted to their
+ * mapped slot tables. The lookup counts are halved so older lookups count
+ * for less every time.
+ *
+ * Parameter:
+ *	db => pointer to the database handler
+ *
+ * Returns:
+ *	-1 if an index could not be moved (check errno, every other one
+ *	still is), 0 otherwise
+ */
+int hashDB_balance_indexes(struct hashDB *db)
+{
+	struct segment_file  **segs, *curr;
+	size_t               used = 0, mem;
+	int                  n = 0, npromote = 0, res = 0, i;
+
+	// segment files still loading are left for the next call
+	for (i = 0; i < db->segs.n; ++i) {
+		curr = db->segs.segs[i];
+		n += (segf_loaded(curr) && curr->hidx != NULL);
 	}
 
-	while ((key = segf_next_key(older)) != -1) {
-		if (copy_kv_pair_to(older, mtemp, key) < 0)
-			goto err;
+	if ((segs = malloc((n + 1) * sizeof(struct segment_file *))) == NULL)
+		return -1;
+
+	for (i = n = 0; i < db->segs.n; ++i) {
+		curr = db->segs.segs[i];
+		if (segf_loaded(curr) && curr->hidx)
+			segs[n++] = curr;
 	}
-	
-	segf_unlink(&(db->head), s1);
-	segf_unlink(&(db->head), s2);
+	qsort(segs, n, sizeof(struct segment_file *), hits_cmp);
 
-	segf_delete_file(s1);
-	segf_delete_file(s2);
+	// demote first so promoting never takes more than the budget
+	for (i = 0; i < n; ++i) {
+		curr = segs[i];
+		mem = segf_index_mem(curr);
+		if (db->index_budget == 0 || used + mem <= db->index_budget) {
+			used += mem;
+			segs[npromote++] = curr;
+		} else if (segf_demote_index(curr) < 0) {
+			res = -1;
+		}
+		curr->hits /= 2;
+	}
 
-	segf_rename_file(mtemp, newer->name);
+	for (i = 0; i < npromote; ++i) {
+		if (segf_promote_index(segs[i]) < 0)
+			res = -1;
+	}
 
-	if (newer == s1)
-		add_to_segf_list(&(db->head), mtemp, s1_id);
-	else
-		add_to_segf_list(&(db->head), mtemp, s2_id);
+	free(segs);
+	return res;
+}
 
-	segf_free(s1);
-	segf_free(s2);
 
-	return 1;
-err:
-	if (mtemp == NULL)
-		free(mtemp_name);
+/*
+ * Copies the newest record of every key in the given segment files to
+ * another, unless keep_rec drops it. Keys are copied in the order they
+ * appear in the segment files, newest segment file first, or in the
+ * order the index the output is going to get needs.
+ *
+ * Parameters:
+ *	db => pointer to the database handler
+ *	segs => neighboring source segment files of the copy, newest first
+ *	n => number of source segment files
+ *	to => destination segment file of copy
+ *	oldest => oldest segment file whose pairs are being copied into 'to'
+ *	index => SEGF_HDR_SORTED to copy the keys in ascending order,
+ *	         SEGF_HDR_HASHED to copy them in the order of their slots
+ *	         (see segf_finish_hashed), or 0
+ *
+ * Returns:
+ *	0 if the copy was successful, -1 otherwise
+ */
+static int copy_segfs_to(struct hashDB *db,
+                         struct segment_file **segs,
+                         int n,
+                         struct segment_file *to,
+                         struct segment_file *oldest,
+                         int index)
+{
+	struct segf_cursor     *cur;
+	struct memtable_entry  *e;
+	struct copy_entry      *entries = NULL, *tmp;
+	uint64_t               offset;
+	int                    len = 0, cap = 0, key, res = 0, i, j;
+
+	// keep_rec checks the range tombstones of every newer segment file
+	if (load_segfs(db, oldest) < 0)
+		return -1;
+
+	for (i = 0; i < n && res == 0; ++i) {
+		if ((cur = segf_cursor_init(segs[i], segs[i]->table)) == NULL) {
+			res = -1;
+			break;
+		}
+
+		while (res == 0 && segf_cursor_next(cur, &key)) {
+			// keys in a newer segment file shadow this one
+			for (j = 0; j < i; ++j) {
+				if ((res = segf_read_memtable(segs[j], key, &offset)))
+					break;
+			}
+			if (j < i) {
+				res = (res < 0) ? -1 : 0;
+				continue;
+			}
+
+			if (len == cap) {
+				cap = (cap) ? cap * 2 : 64;
+				tmp = realloc(entries, cap * sizeof(struct copy_entry));
+				if (tmp == NULL) {
+					res = -1;
+					break;
+				}
+				entries = tmp;
+			}
+
+			e = segf_cursor_entry(cur);
+			entries[len].from = segs[i];
+			entries[len].key = key;
+			entries[len].offset = e->offset;
+			entries[len].deleted = e->deleted;
+			len += 1;
+		}
+
+		segf_cursor_free(cur);
+	}
 
-	if (mtemp != NULL) { 
-		segf_delete_file(mtemp);	
-		segf_free(mtemp);
+	// the key set has to be final before it can be ordered by slot
+	for (i = j = 0; i < len && res == 0; ++i) {
+		if ((res = keep_rec(db, &entries[i], oldest)) > 0)
+			entries[j++] = entries[i];
+		res = (res < 0) ? -1 : 0;
 	}
+	len = j;
 
-	segf_reset_next_key(s1);
-	segf_reset_next_key(s2);
+	if (res == 0 && index == SEGF_HDR_SORTED)
+		qsort(entries, len, sizeof(struct copy_entry), copy_entry_cmp);
+	if (res == 0 && index == SEGF_HDR_HASHED)
+		res = order_by_slot(&entries, len);
 
-	return -1;
+	for (i = 0; i < len && res == 0; ++i)
+		res = copy_rec_to(db, &entries[i], to);
+
+	free(entries);
+	return res;
+}
+
+
+/*
+ * Comparison function used by qsort to order segment files by their
+ * number of lookups, most first
+ */
+static int hits_cmp(const void *a, const void *b)
+{
+	unsigned int ha = (*(struct segment_file * const *)a)->hits;
+	unsigned int hb = (*(struct segment_file * const *)b)->hits;
+
+	return (ha < hb) - (ha > hb);
+}
+
+
+/*
+ * Comparison function used by qsort to order copy entries by key
+ */
+static int copy_entry_cmp(const void *a, const void *b)
+{
+	const struct copy_entry *ea = a;
+	const struct copy_entry *eb = b;
+
+	return (ea->key > eb->key) - (ea->key < eb->key);
 }
 
 
 /*
- * Copies the key value pair identified by 'key' from the segment file
- * to the other.
+ * Puts the copy entries in the order of the slots a minimal perfect hash
+ * function over their keys gives them. segf_finish_hashed builds the same
+ * function from the same keys.
  *
  * Parameters:
- *	from => source segment file of copy	
- *	to => destination segment file of copy
- *	key => key to copy
+ *	entries => copy entries to order, each key once, replaced by a new
+ *	           array on success
+ *	n => number of entries
  *
  * Returns:
- *	0 of copy was successful, -1 otherwise
+ *	0 if successful, -1 otherwise (check errno)
  */
-static inline int copy_kv_pair_to(struct segment_file *from,
-                                  struct segment_file *to,
-				  int key)
+static int order_by_slot(struct copy_entry **entries, int n)
 {
-	char *val;
+	struct copy_entry  *ordered = NULL;
+	struct mph         *mph = NULL;
+	int                *keys;
 
-	if (segf_read_file(from, key, &val) < 0)
+	if ((keys = malloc((n + 1) * sizeof(int))) == NULL)
 		return -1;
 
-	if (segf_append(to, key, val, TOMBSTONE_INS) < 0) {
-		free(val);
+	for (int i = 0; i < n; ++i)
+		keys[i] = (*entries)[i].key;
+
+	if ((mph = mph_build(keys, n)) == NULL ||
+	    (ordered = malloc((n + 1) * sizeof(struct copy_entry))) == NULL) {
+		if (mph)
+			mph_free(mph);
+		free(keys);
+		return -1;
+	}
+
+	for (int i = 0; i < n; ++i)
+		ordered[mph_lookup(mph, keys[i])] = (*entries)[i];
+
+	mph_free(mph);
+	free(keys);
+	free(*entries);
+	*entries = ordered;
+	return 0;
+}
+
+
+/*
+ * Decides if a record is copied. A tombstone is only copied if some
+ * segment file older than 'oldest' holds a value that it needs to shadow,
+ * or an open transaction began before it (see txn_pin).
+ * Pairs and tombstones covered by a newer range tombstone in 'oldest' or
+ * a newer segment file are dropped. An expired pair is dropped too, or
+ * turned into a tombstone if an older segment file holds a value of its
+ * key that it shadowed.
+ *
+ * Parameters:
+ *	db => pointer to the database handler
+ *	entry => record that may be copied
+ *	oldest => oldest segment file whose pairs are being copied
+ *
+ * Returns:
+ *	1 if the record is copied, 0 if it is dropped, or -1 if there was an
+ *	error (check errno)
+ */
+static int keep_rec(struct hashDB *db,
+                    struct copy_entry *entry,
+                    struct segment_file *oldest)
+{
+	struct record_hdr hdr;
+
+	if (segf_read_rec(entry->from, entry->offset, &hdr, NULL) < 0)
+		return -1;
+
+	if (hdr.seq < range_cover(db, oldest, entry->key))
+		return 0; // deleted by a range tombstone
+
+	if (hdr.expires && hdr.expires <= db->clock())
+		entry->deleted = 1;
+
+	// an open transaction may still have to see the delete
+	if (entry->deleted && hdr.seq <= txn_pin(db) &&
+	    !key_in_older(db, oldest, entry->key))
+		return 0; // nothing left for the tombstone to shadow
+
+	return 1;
+}
+
+
+/*
+ * Copies a record to the segment file, keeping its sequence number. A
+ * merge record is folded and copied as the value of its key, so the
+ * operands before it are never read again, or as a tombstone if the fold
+ * leaves the key without a value. A record keep_rec turned into a
+ * tombstone is copied as one.
+ *
+ * Parameters:
+ *	db => pointer to the database handler
+ *	entry => record to copy
+ *	to => destination segment file of copy
+ *
+ * Returns:
+ *	0 of copy was successful, -1 otherwise
+ */
+static int copy_rec_to(struct hashDB *db, struct copy_entry *entry,
+		       struct segment_file *to)
+{
+	struct fold_src    src = {db->merge_op, db->segs.segs, db->segs.n, NULL,
+				  db->clock()};
+	struct record_hdr  hdr;
+	char               *val = NULL;
+	int                res;
+
+	if (segf_read_rec(entry->from, entry->offset, &hdr,
+			  (entry->deleted) ? NULL : &val) < 0)
 		return -1;
+
+	if (!entry->deleted && (hdr.flags & REC_MERGE)) {
+		if ((res = fold_merge(&src, segf_table_pos(&db->segs,
+							   entry->from),
+				      entry->key, &hdr, &val)) < 0)
+			return -1;
+		hdr.flags &= ~REC_MERGE;
+		if (res == 0)
+			entry->deleted = 1;
+	}
+
+	if (entry->deleted) {
+		hdr.flags &= ~REC_TTL;
+		hdr.flags |= REC_DEL;
+		hdr.val_len = 0;
+		hdr.expires = 0;
 	}
 
+	res = segf_append_rec(to, &hdr, val);
 	free(val);
+	return res;
+}
+
+
+/*
+ * Returns the index sealed segment files written by compaction and
+ * merging get, SEGF_HDR_SORTED, SEGF_HDR_HASHED, or 0 for none. Sorted
+ * takes precedence over hashed.
+ */
+static int sealed_index(struct hashDB *db)
+{
+	if (db->sort_sealed)
+		return SEGF_HDR_SORTED;
+	if (db->hash_sealed)
+		return SEGF_HDR_HASHED;
+	return 0;
+}
+
+
+/*
+ * Gives a segment file written by compaction or merging its index, see
+ * sealed_index. The segment file is sealed if it gets one. A segment file
+ * too large for an index (see SEGF_MAX_INDEXED_SZ) keeps its memtable
+ * instead, its records are in order either way.
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+static int finish_index(struct segment_file *seg, int index)
+{
+	int res = 0;
+
+	if (index == SEGF_HDR_SORTED)
+		res = segf_finish_sorted(seg);
+	if (index == SEGF_HDR_HASHED)
+		res = segf_finish_hashed(seg);
+	return (res < 0 && errno == EFBIG) ? 0 : res;
+}
+
+
+/*
+ * Copies the range tombstones of one segment file newer than the given
+ * sequence number to another, keeping their sequence numbers.
+ *
+ * Parameters:
+ *	from => source segment file of copy
+ *	to => destination segment file of copy
+ *	after => range tombstones up to this sequence number are dropped
+ *
+ * Returns:
+ *	0 if the copy was successful, -1 otherwise
+ */
+static int copy_range_dels_to(struct segment_file *from,
+                              struct segment_file *to, uint64_t after)
+{
+	struct record_hdr  hdr;
+	char               val[REC_MAX_VARINT_SZ];
+
+	for (int i = 0; i < from->nrange_dels; ++i) {
+		if (from->range_dels[i].seq <= after)
+			continue;
+		hdr.flags = REC_RANGE_DEL;
+		hdr.key = from->range_dels[i].lo;
+		hdr.val_len = rec_encode_range_end(val, from->range_dels[i].hi);
+		hdr.seq = from->range_dels[i].seq;
+		hdr.expires = 0;
+		if (segf_append_rec(to, &hdr, val) < 0)
+			return -1;
+	}
+
 	return 0;
 }
 
 
 /*
- * Adds the given segment file to its sorted place by name
- * in the linked list
+ * Checks if a segment file older than the given one still holds a value
+ * for the key, that is the newest older segment file that knows the key
+ * has a value and not a tombstone for it.
  *
  * Parameters:
- *	head => double pointer to the start of the linked list
- *	seg => segment file struct to add to the linked list
- *	seg_id => ID of the segment file, this determines where in the
- *	          linked list to place the segment file struct
+ *	db => pointer to the database handler
+ *	seg => segment file to start after
+ *	key => key to look for
  *
  * Returns:
- *	void
+ *	1 if an older segment file holds a value for the key or reading a
+ *	sorted segment file failed, 0 otherwise
  */
-static void add_to_segf_list(struct segment_file **head,
-                             struct segment_file *seg, 
-                             int seg_id)
+static int key_in_older(struct hashDB *db, struct segment_file *seg, int key)
 {
-	struct segment_file *curr = *head;
-	struct segment_file *prev = NULL;
+	uint64_t      offset;
+	int           res;
 
-	while (curr) {
-		int id = get_id_from_fname(curr->name);
-		if (seg_id > id)
-			break;
-		prev = curr;
-		curr = curr->next;
+	for (int i = segf_table_pos(&db->segs, seg) + 1; i < db->segs.n; ++i) {
+		res = segf_read_memtable(db->segs.segs[i], key, &offset);
+		if (res != MEMTE_MISSING)
+			return (res != MEMTE_DELETED);
 	}
 
-	if (curr == *head) {
-		*head = seg;
-		(*head)->next = (curr) ? (curr->next) : (NULL);
-	} else {
-		seg->next = curr;
-		prev->next = seg;	
+	return 0;
+}
+
+
+/*
+ * Finds the newest range tombstone that covers the key in the segment
+ * files from the head up to and including the given one.
+ *
+ * Parameters:
+ *	db => pointer to the database handler
+ *	last => oldest segment file to look in
+ *	key => key to look for
+ *
+ * Returns:
+ *	The sequence number of the newest range tombstone covering the key,
+ *	or 0 if there is none
+ */
+static uint64_t range_cover(struct hashDB *db, struct segment_file *last,
+			    int key)
+{
+	struct segment_file  *curr;
+	uint64_t             cover = 0, rd;
+
+	for (int i = 0; i < db->segs.n; ++i) {
+		curr = db->segs.segs[i];
+		if ((rd = segf_range_cover(curr, key, UINT64_MAX)) > cover)
+			cover = rd;
+		if (curr == last)
+			break;
 	}
+
+	return cover;
 }
@@ -1,25 +1,280 @@
 #ifndef _HASHDB_HASHDB_H_
 #define _HASHDB_HASHDB_H_
 
+#include <stdint.h>
+
+#include "keyindex.h"
+#include "manifest.h"
+#include "mergeop.h"
 #include "segment.h"
+#include "valcache.h"
+
+// Whether compaction and merging write sealed segment files sorted by key
+// (see segf_finish_sorted). Build with -DHASHDB_SORT_SEALED to turn it on.
+#ifdef HASHDB_SORT_SEALED
+#define HASHDB_DEFAULT_SORT 1
+#else
+#define HASHDB_DEFAULT_SORT 0
+#endif
+
+// Whether compaction and merging give sealed segment files a minimal
+// perfect hash index (see segf_finish_hashed) when they are not sorted.
+// Build with -DHASHDB_HASH_SEALED to turn it on.
+#ifdef HASHDB_HASH_SEALED
+#define HASHDB_DEFAULT_HASH 1
+#else
+#define HASHDB_DEFAULT_HASH 0
+#endif
+
+// Bytes the in RAM slots of hashed segment files may take in all, the
+// rest are demoted and probed through a mapping of their slot tables (see
+// segf_demote_index). 0 keeps every one in RAM. Build with
+// -DHASHDB_INDEX_BUDGET=<bytes> to set it.
+#ifndef HASHDB_INDEX_BUDGET
+#define HASHDB_INDEX_BUDGET 0
+#endif
+
+// Number of lookups between rebalancing the index budget
+#define HASHDB_BALANCE_INTERVAL 1024
+
+// Bytes the value cache of hashDB_get may take, 0 leaves it off (see
+// hashDB_enable_cache). Build with -DHASHDB_CACHE_BUDGET=<bytes> to set it.
+#ifndef HASHDB_CACHE_BUDGET
+#define HASHDB_CACHE_BUDGET 0
+#endif
+
+// Admission and eviction policy of the value cache, VCACHE_TINYLFU or
+// VCACHE_CLOCK. Build with -DHASHDB_CACHE_POLICY=VCACHE_CLOCK to change it.
+#ifndef HASHDB_CACHE_POLICY
+#define HASHDB_CACHE_POLICY VCACHE_TINYLFU
+#endif
+
+// hashDB_sweep compacts sealed segment files once about this percent of
+// their bytes are records that have expired, at most HASHDB_SWEEP_MAX of
+// them per call
+#define HASHDB_SWEEP_PCT 50
+#define HASHDB_SWEEP_MAX 4
+
+// Load progress of a database, see hashDB_load_progress. Times are in
+// nanoseconds from when opening the database started, 0 if it has not
+// happened yet.
+struct hashDB_progress {
+	int nsegs;               // segment files in the database
+	int nloaded;             // segment files whose index has been loaded
+	uint64_t open_ns;        // when the database was ready for queries
+	uint64_t first_query_ns; // when the first hashDB_get returned
+	uint64_t loaded_ns;      // when every index had been loaded
+};
+
+
+// Background loader of a lazily opened database, see hashDB_init_lazy
+struct hashDB_loader;
+
 
 // Represents a database handler. Through this users can interact with
 // the data stored in the semgent files
 struct hashDB {
-	// start of the linked list of active segment files
+	// segment files of the database, newest first
+	struct segf_table segs;
+
+	// newest segment file, the one puts and deletes are appended to
+	// (segs.segs[0])
 	struct segment_file *head;
 
 	// ID to be given to the next newly created segment file
-	int next_id;
+	uint64_t next_id;
+
+	// sequence number given to the next put or delete
+	uint64_t next_seq;
 
 	// File path to the directory containing the segment files
 	const char *data_dir;
+
+	// log of the segment files in the database, every change to the
+	// table of segment files is committed to it first
+	struct manifest *manifest;
+
+	// ordered index of the live keys, NULL unless turned on with
+	// hashDB_enable_index
+	struct key_index *index;
+
+	// 1 if sealed segment files written by compaction and merging are
+	// sorted by key, starts as HASHDB_DEFAULT_SORT
+	int sort_sealed;
+
+	// 1 if sealed segment files written by compaction and merging that
+	// are not sorted get a hash index, starts as HASHDB_DEFAULT_HASH
+	int hash_sealed;
+
+	// bytes the in RAM indexes of hashed segment files may take, 0 for
+	// no limit, starts as HASHDB_INDEX_BUDGET
+	size_t index_budget;
+
+	// number of lookups, the index budget is rebalanced every
+	// HASHDB_BALANCE_INTERVAL of them
+	unsigned int lookups;
+
+	// values recently read by hashDB_get, NULL unless turned on with
+	// hashDB_enable_cache or HASHDB_CACHE_BUDGET
+	struct vcache *cache;
+
+	// when opening the database started, in nanoseconds of
+	// CLOCK_MONOTONIC
+	uint64_t open_start;
+
+	// load progress, nsegs and nloaded are only filled in by
+	// hashDB_load_progress
+	struct hashDB_progress progress;
+
+	// loads the segment files of a lazily opened database in the
+	// background, NULL if the database was not opened lazily
+	struct hashDB_loader *loader;
+
+	// folds the operands of hashDB_merge_value into values, NULL until
+	// set with hashDB_set_merge_op
+	const struct merge_op *merge_op;
+
+	// returns the time expiry times are compared against, in seconds
+	// since the epoch, starts as the wall clock
+	uint64_t (*clock)(void);
+
+	// open transactions, newest first. Compaction and merging keep the
+	// tombstones the oldest of them may still have to check its reads
+	// against, see txn_pin
+	struct hashDB_txn *txns;
+};
+
+
+// A read only, point in time view of the database. It holds a reference
+// to every segment file that was in the database when it was taken, so
+// compaction and merging never take away a value the snapshot can see.
+// Sealed segment files never change, the memtable of the head segment
+// file is copied so later writes to it stay invisible.
+struct hashDB_snapshot {
+	// sequence number of the newest put or delete the snapshot sees
+	uint64_t seq;
+
+	// number of segment files in segs
+	int nsegs;
+
+	// segment files of the database, newest first
+	struct segment_file **segs;
+
+	// copy of the head segment files (segs[0]) memtable
+	struct memtable *head_table;
+
+	// merge operator of the database when the snapshot was taken
+	const struct merge_op *merge_op;
+
+	// time the snapshot was taken, records that expired by then are
+	// missing from it
+	uint64_t now;
+};
+
+
+// Max number of keys a transaction can put, they are appended with one
+// segf_append_batch
+#define HASHDB_TXN_MAX_WRITES SEGF_APPEND_BATCH
+
+// Returned by hashDB_txn_commit when a key the transaction read has been
+// put or deleted since it began
+#define HASHDB_TXN_RETRY 1
+
+
+// An optimistic transaction, see hashDB_txn_begin. Puts are held back
+// until commit, the keys read are checked then against every put and
+// delete made since the transaction began.
+struct hashDB_txn {
+	// database the transaction runs on
+	struct hashDB *db;
+
+	// sequence number of the newest put or delete when it began
+	uint64_t start_seq;
+
+	// keys read from the database
+	int *reads;
+
+	// number of keys read, and how many reads can hold
+	int nreads;
+	int reads_cap;
+
+	// keys put, in the order of their first put
+	int keys[HASHDB_TXN_MAX_WRITES];
+
+	// lengths of the values put
+	int val_lens[HASHDB_TXN_MAX_WRITES];
+
+	// copies of the values put
+	char *vals[HASHDB_TXN_MAX_WRITES];
+
+	// number of keys put
+	int nwrites;
+
+	// neighbors in the list of open transactions of db
+	struct hashDB_txn *prev;
+	struct hashDB_txn *next;
+};
+
+// Memory hashDB_multi_get stores values in. Values are stored from used
+// on and used is moved past them, set it back to 0 to reuse the arena.
+struct hashDB_arena {
+	char *buf;   // start of the memory
+	size_t len;  // size of the memory in bytes
+	size_t used; // bytes in use
+};
+
+
+// Result of one key of hashDB_multi_get
+struct hashDB_result {
+	int found;            // 1 if the key is live, 0 if not
+	char *val;            // value in the arena (null terminated), NULL if
+	                      // the key is not live
+	unsigned int val_len; // length of the value
+};
+
+
+// Number of values hashDB_range reads at a time
+#define HASHDB_RANGE_BATCH 64
+
+
+// Iterator over the live keys in a range of keys and their values, see
+// hashDB_range. Values are read in batches, sorted by segment file and
+// offset so each segment file is read front to back.
+struct hashDB_range {
+	// values are read through this snapshot
+	struct hashDB_snapshot *snap;
+
+	// live keys in the range in ascending order
+	int *keys;
+
+	// number of keys
+	int nkeys;
+
+	// index in keys of the first key of the next batch
+	int next;
+
+	// values of the current batch, NULL for keys that were not found
+	char *vals[HASHDB_RANGE_BATCH];
+
+	// number of keys in the current batch
+	int batch_len;
+
+	// index in vals of the next value to return
+	int batch_pos;
 };
 
 
+// Called by the scan functions with every live key value pair. val is
+// freed once the call returns. Return 0 to keep scanning, anything else
+// stops the scan.
+typedef int (*hashDB_scan_fn)(int key, char *val, void *arg);
+
+
 /* Struct constructors and destructors */
 struct hashDB *hashDB_init(const char *data_dir);
 
+struct hashDB *hashDB_init_lazy(const char *data_dir);
+
 struct hashDB *hashDB_repopulate(const char *data_dir);
 
 struct hashDB *hashDB_mkempty(const char *data_dir);
@@ -30,10 +285,66 @@ void hashDB_free(struct hashDB *db);
 /* Database interface functions */
 int hashDB_get(struct hashDB *db, int key, char **val);
 
+int hashDB_multi_get(struct hashDB *db, const int *keys, int n,
+                     struct hashDB_result *results, struct hashDB_arena *arena);
+
 int hashDB_put(struct hashDB *db, int key, int val_len, char *val);
 
+int hashDB_put_batch(struct hashDB *db, const int *keys, const int *val_lens,
+                     char **vals, int n);
+
+int hashDB_put_ttl(struct hashDB *db, int key, int val_len, char *val,
+                   unsigned int ttl);
+
 int hashDB_delete(struct hashDB *db, int key);
 
+int hashDB_delete_range(struct hashDB *db, int lo, int hi);
+
+
+/* Merge functions */
+void hashDB_set_merge_op(struct hashDB *db, const struct merge_op *op);
+
+int hashDB_merge_value(struct hashDB *db, int key, int len, char *operand);
+
+
+/* Snapshot functions */
+struct hashDB_snapshot *hashDB_snapshot(struct hashDB *db);
+
+int hashDB_snapshot_get(struct hashDB_snapshot *snap, int key, char **val);
+
+void hashDB_release_snapshot(struct hashDB_snapshot *snap);
+
+
+/* Transaction functions */
+struct hashDB_txn *hashDB_txn_begin(struct hashDB *db);
+
+int hashDB_txn_get(struct hashDB_txn *txn, int key, char **val);
+
+int hashDB_txn_put(struct hashDB_txn *txn, int key, int val_len, char *val);
+
+int hashDB_txn_commit(struct hashDB_txn *txn);
+
+void hashDB_txn_abort(struct hashDB_txn *txn);
+
+/* Scan functions */
+int hashDB_scan(struct hashDB *db, hashDB_scan_fn fn, void *arg);
+
+int hashDB_scan_parallel(struct hashDB *db, int nparts, hashDB_scan_fn fn,
+                         void **args);
+
+int hashDB_snapshot_scan(struct hashDB_snapshot *snap, int part, int nparts,
+                         hashDB_scan_fn fn, void *arg);
+
+
+/* Range functions */
+int hashDB_enable_index(struct hashDB *db);
+
+struct hashDB_range *hashDB_range(struct hashDB *db, int lo, int hi);
+
+int hashDB_range_next(struct hashDB_range *range, int *key, char **val);
+
+void hashDB_range_free(struct hashDB_range *range);
+
 
 /* Background/helper functions */
 int hashDB_compact(struct hashDB *db, struct segment_file *seg);
@@ -42,8 +353,18 @@ int hashDB_merge(struct hashDB *db,
                  struct segment_file *s1,
                  struct segment_file *s2);
 
-int get_id_from_fname(const char *);
+int hashDB_balance_indexes(struct hashDB *db);
+
+int hashDB_sweep(struct hashDB *db);
+
+void hashDB_load_progress(struct hashDB *db, struct hashDB_progress *p);
+
+int hashDB_enable_cache(struct hashDB *db, size_t budget);
+
+void hashDB_cache_stats(struct hashDB *db, struct vcache_stats *s);
+
+int64_t get_id_from_fname(const char *);
 
-unsigned int get_kv_size(int key, int val_len);
+uint64_t get_kv_size(int key, int val_len);
 
 #endif
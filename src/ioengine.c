@@ -0,0 +1,584 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "ioengine.h"
+
+#ifdef IOE_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// Engine segment files and the manifest do their I/O through, see
+// ioe_set_default. The POSIX engine lives here for good and stands in
+// whenever no other engine is set.
+static struct ioe_engine posix_engine;
+
+static struct {
+	struct ioe_engine *engine; // NULL until first used
+	pthread_mutex_t lock;
+} default_engine = {NULL, PTHREAD_MUTEX_INITIALIZER};
+
+
+#ifdef IOE_HAVE_URING
+// Submission and completion queues of an io_uring, mapped from the kernel
+struct ioe_ring {
+	int fd;                     // io_uring file descriptor
+	unsigned int entries;       // number of submission queue entries
+	unsigned int *sq_head;      // submission queue ring, the kernel
+	unsigned int *sq_tail;      // moves head and we move tail
+	unsigned int *sq_mask;
+	unsigned int *sq_array;     // index in sqes of every ring entry
+	struct io_uring_sqe *sqes;  // submission queue entries
+	unsigned int *cq_head;      // completion queue ring, we move head
+	unsigned int *cq_tail;      // and the kernel moves tail
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;  // completion queue entries
+	void *sq_map;               // mappings of the rings and the sqes
+	size_t sq_map_len;
+	void *cq_map;               // same as sq_map if the kernel maps both
+	size_t cq_map_len;          // rings together
+	size_t sqes_len;
+	int dead;                   // set if ops may still be in flight
+	                            // after a failed batch, see uring_fail
+};
+#endif
+
+
+/* 'Private' helper functions */
+static void engine_setup(struct ioe_engine *, const char *, unsigned int);
+
+static int posix_submit(struct ioe_engine *, struct ioe_op *, int);
+
+static ssize_t posix_op(struct ioe_op *);
+
+static int op_complete(struct ioe_op *, ssize_t);
+
+#ifdef IOE_HAVE_URING
+static int uring_submit(struct ioe_engine *, struct ioe_op *, int);
+
+static int uring_batch(struct ioe_ring *, struct ioe_op *, int);
+
+static int uring_reap(struct ioe_ring *, struct ioe_op *, int);
+
+static int uring_fail(struct ioe_ring *, struct ioe_op *, int, int);
+
+static void uring_free(struct ioe_engine *);
+
+static void ring_unmap(struct ioe_ring *);
+#endif
+
+
+/*
+ * Allocates a POSIX engine. It runs the ops of a batch one after another
+ * with pread, preadv, pwrite, and fdatasync.
+ *
+ * Returns:
+ *	Pointer to an engine, caller must free it by calling ioe_free, or
+ *	NULL if there is no memory available
+ */
+struct ioe_engine *ioe_posix_init(void)
+{
+	struct ioe_engine *e;
+
+	if ((e = calloc(1, sizeof(struct ioe_engine))) == NULL)
+		return NULL;
+
+	engine_setup(e, "posix", 1);
+	return e;
+}
+
+
+/*
+ * Allocates an io_uring engine. The ops of a batch are handed to the
+ * kernel together, up to depth of them at a time.
+ *
+ * Parameters:
+ *	depth => max ops in flight at once
+ *
+ * Returns:
+ *	Pointer to an engine, caller must free it by calling ioe_free, or
+ *	NULL if there is an error (check errno, ENOSYS if io_uring was not
+ *	built in or the kernel does not allow it)
+ */
+struct ioe_engine *ioe_uring_init(unsigned int depth)
+{
+#ifdef IOE_HAVE_URING
+	struct io_uring_params  p;
+	struct ioe_engine       *e;
+	struct ioe_ring         *r;
+	char                    *sq, *cq;
+	int                     err;
+
+	if ((e = calloc(1, sizeof(struct ioe_engine))) == NULL)
+		return NULL;
+	if ((r = calloc(1, sizeof(struct ioe_ring))) == NULL) {
+		free(e);
+		return NULL;
+	}
+
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = syscall(__NR_io_uring_setup, depth, &p)) < 0)
+		goto err;
+
+	// both rings come out of one mapping on newer kernels
+	r->entries = p.sq_entries;
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_map_len > r->sq_map_len)
+		r->sq_map_len = r->cq_map_len;
+
+	r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) {
+		r->sq_map = NULL;
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED) {
+			r->cq_map = NULL;
+			goto err;
+		}
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto err;
+	}
+
+	sq = r->sq_map;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+	cq = r->cq_map;
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	engine_setup(e, "io_uring", r->entries);
+	e->submit = uring_submit;
+	e->free = uring_free;
+	e->ring = r;
+	return e;
+
+err:
+	err = (errno == EPERM) ? ENOSYS : errno; // e.g. blocked by seccomp
+	ring_unmap(r);
+	free(r);
+	free(e);
+	errno = err;
+	return NULL;
+#else
+	(void)depth;
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+
+/*
+ * Deallocates the engine. It must not be the default engine.
+ *
+ * Parameter:
+ *	e => engine to free
+ *
+ * Returns:
+ *	void
+ */
+void ioe_free(struct ioe_engine *e)
+{
+	if (e == NULL || e == &posix_engine)
+		return;
+
+	if (e->free)
+		e->free(e);
+	pthread_mutex_destroy(&e->lock);
+	free(e);
+}
+
+
+/*
+ * Sets up the fields every engine has, it starts as a POSIX engine
+ */
+static void engine_setup(struct ioe_engine *e, const char *name,
+			 unsigned int depth)
+{
+	e->name = name;
+	e->depth = depth;
+	e->submit = posix_submit;
+	e->free = NULL;
+	e->ring = NULL;
+	memset(&e->stats, 0, sizeof(e->stats));
+	pthread_mutex_init(&e->lock, NULL);
+}
+
+
+/*
+ * Runs a batch of I/O ops and waits for all of them to finish. Ops not
+ * linked to each other may run in any order. The result of every op is
+ * left in its res field, a failed op does not fail the batch.
+ *
+ * Parameters:
+ *	e => engine to run the ops with
+ *	ops => ops to run
+ *	n => number of ops
+ *
+ * Returns:
+ *	-1 if the engine failed and the results are unknown (check errno,
+ *	EINVAL if an op is of no known kind or a chain of linked ops is
+ *	longer than the engine depth, EIO if an earlier failure left ops
+ *	of the engine in flight and it takes no more), 0 otherwise
+ */
+int ioe_submit(struct ioe_engine *e, struct ioe_op *ops, int n)
+{
+	int res;
+
+	for (int i = 0; i < n; ++i) {
+		if (ops[i].op < IOE_READ || ops[i].op > IOE_DSYNC) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if (n <= 0)
+		return 0;
+
+	pthread_mutex_lock(&e->lock);
+	res = e->submit(e, ops, n);
+	e->stats.submits += 1;
+	e->stats.ops += n;
+	pthread_mutex_unlock(&e->lock);
+	return res;
+}
+
+
+/*
+ * Copies the counters of the engine into s
+ *
+ * Returns:
+ *	void
+ */
+void ioe_stats(struct ioe_engine *e, struct ioe_stats *s)
+{
+	pthread_mutex_lock(&e->lock);
+	*s = e->stats;
+	pthread_mutex_unlock(&e->lock);
+}
+
+
+/*
+ * Gets the engine segment files and the manifest do their I/O through.
+ * Unless one was set with ioe_set_default it is the POSIX engine, or an
+ * io_uring engine of IOE_DEFAULT_DEPTH when built with -DIOE_URING and
+ * the kernel allows it.
+ *
+ * Returns:
+ *	The default engine
+ */
+struct ioe_engine *ioe_default(void)
+{
+	struct ioe_engine *e;
+
+	pthread_mutex_lock(&default_engine.lock);
+	if (default_engine.engine == NULL) {
+		if (posix_engine.name == NULL)
+			engine_setup(&posix_engine, "posix", 1);
+		default_engine.engine = &posix_engine;
+#ifdef IOE_URING
+		if ((e = ioe_uring_init(IOE_DEFAULT_DEPTH)) != NULL)
+			default_engine.engine = e;
+#endif
+	}
+	e = default_engine.engine;
+	pthread_mutex_unlock(&default_engine.lock);
+	return e;
+}
+
+
+/*
+ * Makes e the engine segment files and the manifest do their I/O
+ * through. Batches already running finish on the old engine.
+ *
+ * Parameter:
+ *	e => engine to use, NULL for the POSIX engine
+ *
+ * Returns:
+ *	The engine that was the default before, the caller may free it
+ *	once no batch is running on it (unless it is the POSIX engine,
+ *	freeing it does nothing)
+ */
+struct ioe_engine *ioe_set_default(struct ioe_engine *e)
+{
+	struct ioe_engine *old = ioe_default();
+
+	pthread_mutex_lock(&default_engine.lock);
+	default_engine.engine = (e) ? e : &posix_engine;
+	pthread_mutex_unlock(&default_engine.lock);
+	return old;
+}
+
+
+/*
+ * Runs the ops one after another with the blocking system calls. An op
+ * linked to one that did not transfer all of its bytes is cancelled.
+ */
+static int posix_submit(struct ioe_engine *e, struct ioe_op *ops, int n)
+{
+	int cancel = 0;
+
+	if (e->stats.max_batch < 1)
+		e->stats.max_batch = 1;
+
+	for (int i = 0; i < n; ++i) {
+		ops[i].res = (cancel) ? -ECANCELED : posix_op(&ops[i]);
+		cancel = (ops[i].flags & IOE_LINK) && !op_complete(&ops[i], ops[i].res);
+	}
+	return 0;
+}
+
+
+/*
+ * Runs one op with its system call, returns what the call returned or
+ * -errno if it failed
+ */
+static ssize_t posix_op(struct ioe_op *op)
+{
+	ssize_t n;
+
+	switch (op->op) {
+	case IOE_READ:
+		n = pread(op->fd, op->buf, op->len, op->offset);
+		break;
+	case IOE_READV:
+		n = preadv(op->fd, op->buf, op->len, op->offset);
+		break;
+	case IOE_WRITE:
+		n = pwrite(op->fd, op->buf, op->len, op->offset);
+		break;
+	default: // IOE_DSYNC
+		n = fdatasync(op->fd);
+	}
+	return (n < 0) ? -errno : n;
+}
+
+
+/*
+ * Returns 1 if res is the op transferring all of its bytes, 0 otherwise
+ */
+static int op_complete(struct ioe_op *op, ssize_t res)
+{
+	size_t want = op->len;
+
+	if (res < 0)
+		return 0;
+
+	if (op->op == IOE_DSYNC)
+		return 1;
+
+	if (op->op == IOE_READV) {
+		struct iovec *iov = op->buf;
+		want = 0;
+		for (size_t i = 0; i < op->len; ++i)
+			want += iov[i].iov_len;
+	}
+	return (size_t)res == want;
+}
+
+
+#ifdef IOE_HAVE_URING
+/*
+ * Hands the ops to the kernel, as many at a time as fit in the ring. A
+ * chain of linked ops is never split between two of them.
+ */
+static int uring_submit(struct ioe_engine *e, struct ioe_op *ops, int n)
+{
+	struct ioe_ring *r = e->ring;
+	int i = 0, batch;
+
+	if (r->dead) {
+		errno = EIO;
+		return -1;
+	}
+
+	while (i < n) {
+		batch = n - i;
+		if (batch > (int)r->entries) {
+			batch = r->entries;
+			while (batch > 0 && (ops[i + batch - 1].flags & IOE_LINK))
+				batch -= 1;
+			if (batch == 0) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+
+		if (uring_batch(r, ops + i, batch) < 0)
+			return -1;
+		if ((unsigned int)batch > e->stats.max_batch)
+			e->stats.max_batch = batch;
+		i += batch;
+	}
+	return 0;
+}
+
+
+/*
+ * Puts the ops in the submission queue, submits them, and waits for all
+ * of their completions. There must be no more ops than ring entries.
+ */
+static int uring_batch(struct ioe_ring *r, struct ioe_op *ops, int n)
+{
+	struct io_uring_sqe  *sqe;
+	unsigned int         tail, idx;
+	int                  submitted = 0, done = 0, res;
+
+	tail = *r->sq_tail;
+	for (int i = 0; i < n; ++i) {
+		idx = tail & *r->sq_mask;
+		sqe = &r->sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+
+		sqe->fd = ops[i].fd;
+		sqe->addr = (uint64_t)(uintptr_t)ops[i].buf;
+		sqe->len = ops[i].len;
+		sqe->off = ops[i].offset;
+		sqe->user_data = i;
+		if (ops[i].flags & IOE_LINK)
+			sqe->flags |= IOSQE_IO_LINK;
+
+		switch (ops[i].op) {
+		case IOE_READ:
+			sqe->opcode = IORING_OP_READ;
+			break;
+		case IOE_READV:
+			sqe->opcode = IORING_OP_READV;
+			break;
+		case IOE_WRITE:
+			sqe->opcode = IORING_OP_WRITE;
+			break;
+		case IOE_DSYNC:
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			sqe->addr = sqe->len = sqe->off = 0;
+			break;
+		}
+
+		r->sq_array[idx] = idx;
+		tail += 1;
+	}
+	// the kernel must see the entries before the new tail
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (done < n) {
+		res = syscall(__NR_io_uring_enter, r->fd, n - submitted, n - done,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (res < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return uring_fail(r, ops, submitted, done);
+		}
+		submitted += res;
+		done += uring_reap(r, ops, n);
+	}
+	return 0;
+}
+
+
+/*
+ * Moves the results of the completions in the completion queue into the
+ * ops they belong to
+ *
+ * Returns:
+ *	The number of completions
+ */
+static int uring_reap(struct ioe_ring *r, struct ioe_op *ops, int n)
+{
+	struct io_uring_cqe  *cqe;
+	unsigned int         head = *r->cq_head;
+	int                  done = 0;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &r->cqes[head & *r->cq_mask];
+		if (cqe->user_data < (uint64_t)n)
+			ops[cqe->user_data].res = cqe->res;
+		head += 1;
+		done += 1;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return done;
+}
+
+
+/*
+ * Cleans up after io_uring_enter failed part way through a batch. The
+ * entries the kernel has not taken are taken back off the submission
+ * queue, and the ops it did take are waited for, the caller frees their
+ * buffers once the batch returns. If they can't be waited for the ring
+ * is marked dead and takes no more ops.
+ *
+ * Returns:
+ *	-1, errno is that of the failed io_uring_enter
+ */
+static int uring_fail(struct ioe_ring *r, struct ioe_op *ops, int submitted,
+		      int done)
+{
+	int err = errno, res;
+
+	__atomic_store_n(r->sq_tail, __atomic_load_n(r->sq_head,
+			 __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+
+	while (done < submitted) {
+		res = syscall(__NR_io_uring_enter, r->fd, 0, submitted - done,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (res < 0 && errno != EINTR && errno != EAGAIN) {
+			r->dead = 1;
+			break;
+		}
+		done += uring_reap(r, ops, submitted);
+	}
+
+	errno = err;
+	return -1;
+}
+
+
+/*
+ * Tears down the ring of an io_uring engine
+ */
+static void uring_free(struct ioe_engine *e)
+{
+	ring_unmap(e->ring);
+	free(e->ring);
+	e->ring = NULL;
+}
+
+
+/*
+ * Unmaps whatever of the ring was mapped and closes its descriptor
+ */
+static void ring_unmap(struct ioe_ring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_map && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_len);
+	if (r->sq_map)
+		munmap(r->sq_map, r->sq_map_len);
+	if (r->fd >= 0)
+		close(r->fd);
+}
+#endif
@@ -0,0 +1,85 @@
+#ifndef _HASHDB_IOENGINE_H_
+#define _HASHDB_IOENGINE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// io_uring needs Linux 5.6 or newer (IORING_OP_READ and IORING_OP_WRITE),
+// the engine is talked to through its system calls so liburing is not
+// needed. Build with -DIOE_NO_URING to leave it out.
+#if defined(__linux__) && !defined(IOE_NO_URING)
+#define IOE_HAVE_URING 1
+#endif
+
+// Number of ops an io_uring engine can have in flight, and the depth the
+// default engine is set up with when built with -DIOE_URING
+#define IOE_DEFAULT_DEPTH 64
+
+// Kinds of I/O ops
+#define IOE_READ  0 // read len bytes at offset into buf
+#define IOE_READV 1 // read at offset into the len struct iovecs at buf
+#define IOE_WRITE 2 // write len bytes of buf at offset
+#define IOE_DSYNC 3 // fdatasync the file
+
+// Op flags
+#define IOE_LINK 0x01 // the next op only runs if this one transfers all
+                      // of its bytes, otherwise it fails with ECANCELED
+
+
+// An I/O op for ioe_submit
+struct ioe_op {
+	int op;          // IOE_READ, IOE_READV, IOE_WRITE, or IOE_DSYNC
+	int fd;          // file to do it on
+	int flags;       // IOE_* flags
+	void *buf;       // buffer, or array of struct iovec for IOE_READV
+	size_t len;      // bytes in buf, or number of iovecs for IOE_READV
+	uint64_t offset; // offset in the file
+	ssize_t res;     // set by ioe_submit, bytes transferred (0 for
+	                 // IOE_DSYNC) or -errno if the op failed
+};
+
+
+// Counters of an engine, see ioe_stats
+struct ioe_stats {
+	uint64_t submits;      // calls to ioe_submit
+	uint64_t ops;          // ops done
+	unsigned int max_batch; // most ops one call had in flight at once
+};
+
+
+// Something that runs batches of I/O ops. The POSIX engine runs the ops
+// of a batch one after another with the blocking system calls, the
+// io_uring engine hands the whole batch to the kernel at once so the
+// device sees all of them together. An engine can be used from any
+// number of threads, the batches run one at a time.
+struct ioe_engine {
+	const char *name;   // "posix" or "io_uring"
+	unsigned int depth; // max ops in flight at once, 1 for POSIX
+	int (*submit)(struct ioe_engine *e, struct ioe_op *ops, int n);
+	void (*free)(struct ioe_engine *e);
+	void *ring;         // io_uring ring, NULL for POSIX
+	struct ioe_stats stats;
+	pthread_mutex_t lock; // held while a batch runs
+};
+
+
+/* Struct constructors and destructors */
+struct ioe_engine *ioe_posix_init(void);
+
+struct ioe_engine *ioe_uring_init(unsigned int depth);
+
+void ioe_free(struct ioe_engine *e);
+
+
+/* Engine functions */
+int ioe_submit(struct ioe_engine *e, struct ioe_op *ops, int n);
+
+void ioe_stats(struct ioe_engine *e, struct ioe_stats *s);
+
+struct ioe_engine *ioe_default(void);
+
+struct ioe_engine *ioe_set_default(struct ioe_engine *e);
+
+#endif
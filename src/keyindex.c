@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyindex.h"
+
+/* 'Private' helper functions */
+static struct keyidx_node *node_init(int);
+
+static void node_free(struct keyidx_node *);
+
+static int split_child(struct keyidx_node *, int);
+
+static struct keyidx_node *find_leaf(struct keyidx_node *, int);
+
+static int lower_bound(struct keyidx_node *, int);
+
+static int upper_bound(struct keyidx_node *, int);
+
+
+/*
+ * Allocates an empty key index
+ *
+ * Parameters:
+ *	None
+ *
+ * Returns:
+ *	Pointer to a key_index struct, caller must free it by calling
+ *	keyidx_free, or NULL if there is no memory available
+ */
+struct key_index *keyidx_init()
+{
+	struct key_index *idx;
+
+	if ((idx = malloc(sizeof(struct key_index))) == NULL)
+		return NULL;
+
+	if ((idx->root = node_init(1)) == NULL) {
+		free(idx);
+		return NULL;
+	}
+
+	idx->entries = 0;
+	return idx;
+}
+
+
+/*
+ * Deallocates the key index and all of its nodes
+ *
+ * Parameter:
+ *	idx => pointer to the key index to free
+ *
+ * Returns:
+ *	void
+ */
+void keyidx_free(struct key_index *idx)
+{
+	node_free(idx->root);
+	free(idx);
+}
+
+
+/*
+ * Allocates an empty node
+ */
+static struct keyidx_node *node_init(int leaf)
+{
+	struct keyidx_node *node;
+
+	if ((node = calloc(1, sizeof(struct keyidx_node))) == NULL)
+		return NULL;
+
+	node->leaf = leaf;
+	return node;
+}
+
+
+/*
+ * Frees the node and every node below it
+ */
+static void node_free(struct keyidx_node *node)
+{
+	if (!node->leaf) {
+		for (int i = 0; i <= node->n; ++i)
+			node_free(node->child[i]);
+	}
+	free(node);
+}
+
+
+/*
+ * Adds the key to the index. Full nodes are split on the way down so a
+ * failed allocation never leaves the tree half changed.
+ *
+ * Parameters:
+ *	idx => pointer to the key index to add to
+ *	key => key to add
+ *
+ * Returns:
+ *	1 if the key was added, 0 if it was already in the index, or -1 if
+ *	there is no memory available (the index is left unchanged)
+ */
+int keyidx_insert(struct key_index *idx, int key)
+{
+	struct keyidx_node  *node;
+	int                 i;
+
+	if (idx->root->n == KEYIDX_ORDER) { // grow the tree by one level
+		if ((node = node_init(0)) == NULL)
+			return -1;
+
+		node->child[0] = idx->root;
+		if (split_child(node, 0) < 0) {
+			free(node);
+			return -1;
+		}
+		idx->root = node;
+	}
+
+	node = idx->root;
+	while (!node->leaf) {
+		i = upper_bound(node, key);
+		if (node->child[i]->n == KEYIDX_ORDER) {
+			if (split_child(node, i) < 0)
+				return -1;
+			if (key >= node->keys[i])
+				i += 1;
+		}
+		node = node->child[i];
+	}
+
+	i = lower_bound(node, key);
+	if (i < node->n && node->keys[i] == key)
+		return 0;
+
+	memmove(node->keys + i + 1, node->keys + i, (node->n - i) * sizeof(int));
+	node->keys[i] = key;
+	node->n += 1;
+	idx->entries += 1;
+	return 1;
+}
+
+
+/*
+ * Splits the full i'th child of the given node in two, the new right half
+ * is placed after it in the node. The node must not be full.
+ *
+ * Returns:
+ *	0 if successful, -1 if there is no memory available (nothing is
+ *	changed)
+ */
+static int split_child(struct keyidx_node *node, int i)
+{
+	struct keyidx_node  *left = node->child[i];
+	struct keyidx_node  *right;
+	int                 mid = KEYIDX_ORDER / 2;
+	int                 sep;
+
+	if ((right = node_init(left->leaf)) == NULL)
+		return -1;
+
+	if (left->leaf) {
+		// the separator is copied up, leaves keep every key
+		right->n = KEYIDX_ORDER - mid;
+		memcpy(right->keys, left->keys + mid, right->n * sizeof(int));
+		left->n = mid;
+		sep = right->keys[0];
+
+		right->next = left->next;
+		left->next = right;
+	} else {
+		// the separator is moved up
+		right->n = KEYIDX_ORDER - mid - 1;
+		memcpy(right->keys, left->keys + mid + 1, right->n * sizeof(int));
+		memcpy(right->child, left->child + mid + 1,
+		       (right->n + 1) * sizeof(struct keyidx_node *));
+		left->n = mid;
+		sep = left->keys[mid];
+	}
+
+	memmove(node->keys + i + 1, node->keys + i, (node->n - i) * sizeof(int));
+	memmove(node->child + i + 2, node->child + i + 1,
+		(node->n - i) * sizeof(struct keyidx_node *));
+	node->keys[i] = sep;
+	node->child[i + 1] = right;
+	node->n += 1;
+	return 0;
+}
+
+
+/*
+ * Removes the key from the index. Nodes are not merged, separators in
+ * internal nodes stay valid bounds after their key is removed.
+ *
+ * Parameters:
+ *	idx => pointer to the key index to remove from
+ *	key => key to remove
+ *
+ * Returns:
+ *	1 if the key was found and removed, 0 otherwise
+ */
+int keyidx_remove(struct key_index *idx, int key)
+{
+	struct keyidx_node  *leaf = find_leaf(idx->root, key);
+	int                 i = lower_bound(leaf, key);
+
+	if (i == leaf->n || leaf->keys[i] != key)
+		return 0;
+
+	memmove(leaf->keys + i, leaf->keys + i + 1, (leaf->n - i - 1) * sizeof(int));
+	leaf->n -= 1;
+	idx->entries -= 1;
+	return 1;
+}
+
+
+/*
+ * Checks if the key is in the index
+ *
+ * Parameters:
+ *	idx => pointer to the key index to search
+ *	key => key to look for
+ *
+ * Returns:
+ *	1 if the key is in the index, 0 otherwise
+ */
+int keyidx_contains(struct key_index *idx, int key)
+{
+	struct keyidx_node  *leaf = find_leaf(idx->root, key);
+	int                 i = lower_bound(leaf, key);
+
+	return (i < leaf->n && leaf->keys[i] == key);
+}
+
+
+/*
+ * Positions the iterator at the smallest key in the index that is greater
+ * than or equal to the given key. Adding or removing keys invalidates the
+ * iterator.
+ *
+ * Parameters:
+ *	idx => pointer to the key index to iterate over
+ *	key => where to start
+ *	it => iterator to position
+ *
+ * Returns:
+ *	void
+ */
+void keyidx_seek(struct key_index *idx, int key, struct keyidx_iter *it)
+{
+	it->leaf = find_leaf(idx->root, key);
+	it->pos = lower_bound(it->leaf, key);
+}
+
+
+/*
+ * Moves the iterator to the next key in ascending order.
+ *
+ * Parameters:
+ *	it => iterator positioned by keyidx_seek
+ *	key => where to store the next key
+ *
+ * Returns:
+ *	1 if there was another key, 0 if the end of the index was reached
+ */
+int keyidx_next(struct keyidx_iter *it, int *key)
+{
+	while (it->leaf && it->pos >= it->leaf->n) {
+		it->leaf = it->leaf->next;
+		it->pos = 0;
+	}
+
+	if (it->leaf == NULL)
+		return 0;
+
+	*key = it->leaf->keys[it->pos++];
+	return 1;
+}
+
+
+/*
+ * Returns the leaf the key belongs in
+ */
+static struct keyidx_node *find_leaf(struct keyidx_node *node, int key)
+{
+	while (!node->leaf)
+		node = node->child[upper_bound(node, key)];
+	return node;
+}
+
+
+/*
+ * Returns the index of the first key in the node that is greater than or
+ * equal to the given key, node->n if there is none
+ */
+static int lower_bound(struct keyidx_node *node, int key)
+{
+	int lo = 0, hi = node->n;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (node->keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+/*
+ * Returns the index of the first key in the node that is greater than the
+ * given key, node->n if there is none
+ */
+static int upper_bound(struct keyidx_node *node, int key)
+{
+	int lo = 0, hi = node->n;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (node->keys[mid] <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
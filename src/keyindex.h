@@ -0,0 +1,51 @@
+#ifndef _HASHDB_KEYINDEX_H_
+#define _HASHDB_KEYINDEX_H_
+
+// Max number of keys in a key index node
+#define KEYIDX_ORDER 32
+
+
+// Represents a node in the key index B+ tree. Leaves hold the keys and
+// are chained in key order, internal nodes hold separator keys: every key
+// under child[i] is less than keys[i] and every key under child[i+1] is
+// greater than or equal to it.
+struct keyidx_node {
+	int leaf;                                    // 1 if the node is a leaf
+	int n;                                       // number of keys in the node
+	int keys[KEYIDX_ORDER];                      // sorted keys
+	struct keyidx_node *child[KEYIDX_ORDER + 1]; // children of internal nodes
+	struct keyidx_node *next;                    // next leaf in key order
+};
+
+
+// Represents an ordered set of keys, a B+ tree of keyidx_nodes. Removing
+// keys never merges nodes, a leaf may be left empty and is skipped over
+// by iterators.
+struct key_index {
+	unsigned int entries;     // number of keys in the index
+	struct keyidx_node *root; // root of the tree, a leaf when it is small
+};
+
+
+// Position of an iterator over the keys of a key index
+struct keyidx_iter {
+	struct keyidx_node *leaf; // leaf of the next key, NULL at the end
+	int pos;                  // index of the next key in the leaf
+};
+
+
+struct key_index *keyidx_init();
+
+void keyidx_free(struct key_index *idx);
+
+int keyidx_insert(struct key_index *idx, int key);
+
+int keyidx_remove(struct key_index *idx, int key);
+
+int keyidx_contains(struct key_index *idx, int key);
+
+void keyidx_seek(struct key_index *idx, int key, struct keyidx_iter *it);
+
+int keyidx_next(struct keyidx_iter *it, int *key);
+
+#endif
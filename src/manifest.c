@@ -0,0 +1,651 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ioengine.h"
+#include "manifest.h"
+#include "record.h"
+
+/* 'Private' helper functions */
+static struct manifest *manifest_new(const char *);
+
+static char *path_in(const char *, const char *);
+
+static int write_snapshot(struct manifest *, struct manifest_seg *, int);
+
+static int write_edit(int, struct manifest_op *, int);
+
+static int encode_op(char *, struct manifest_op *);
+
+static int decode_op(const char *, int, struct manifest_op *);
+
+static int replay(struct manifest *, const char *, size_t, size_t *);
+
+static int apply_op(struct manifest *, struct manifest_op *);
+
+static int find_index(struct manifest *, uint64_t);
+
+
+/*
+ * Opens the manifest of the given data directory and replays its edits.
+ * An edit cut short at the end of the manifest is removed from it, and
+ * truncated is set.
+ *
+ * Parameter:
+ *	dir => data directory holding the manifest
+ *
+ * Returns:
+ *	Pointer to a manifest struct, caller must free it by calling
+ *	manifest_free, or NULL if there is an error (check errno, ENOENT if
+ *	the directory has no manifest, EIO if the manifest is corrupt)
+ */
+struct manifest *manifest_open(const char *dir)
+{
+	struct manifest  *m;
+	struct stat      st;
+	char             *buf = NULL;
+	size_t           end;
+	ssize_t          n;
+
+	if ((m = manifest_new(dir)) == NULL)
+		return NULL;
+
+	if ((m->fd = open(m->path, O_RDWR | O_APPEND)) < 0 ||
+	    fstat(m->fd, &st) < 0)
+		goto err;
+
+	if ((buf = malloc(st.st_size + 1)) == NULL)
+		goto err;
+	if ((n = pread(m->fd, buf, st.st_size, 0)) < 0)
+		goto err;
+
+	if (n < MANIFEST_HDR_SZ ||
+	    memcmp(buf, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN) != 0 ||
+	    buf[MANIFEST_MAGIC_LEN] != MANIFEST_VERSION) {
+		errno = EIO;
+		goto err;
+	}
+
+	if (replay(m, buf, n, &end) < 0)
+		goto err;
+
+	// drop the edit a crash cut short, the next one goes in its place
+	if (end < (size_t)n) {
+		if (ftruncate(m->fd, end) < 0)
+			goto err;
+		m->truncated = 1;
+	}
+
+	free(buf);
+	return m;
+
+err:
+	free(buf);
+	manifest_free(m);
+	return NULL;
+}
+
+
+/*
+ * Creates the manifest of the given data directory, replacing any manifest
+ * it has. The manifest starts with one edit adding the given segment files.
+ * It is written to MANIFEST_TMP_NAME first and renamed, so a crash leaves
+ * either the old or the new manifest.
+ *
+ * Parameters:
+ *	dir => data directory to create the manifest in
+ *	segs => segment files of the database, newest first
+ *	nsegs => number of segment files
+ *
+ * Returns:
+ *	Pointer to a manifest struct, caller must free it by calling
+ *	manifest_free, or NULL if there is an error (check errno)
+ */
+struct manifest *manifest_create(const char *dir, struct manifest_seg *segs,
+				 int nsegs)
+{
+	struct manifest *m;
+
+	if ((m = manifest_new(dir)) == NULL)
+		return NULL;
+
+	if (write_snapshot(m, segs, nsegs) < 0) {
+		manifest_free(m);
+		return NULL;
+	}
+
+	for (int i = 0; i < nsegs; ++i) {
+		struct manifest_op op = {MANIFEST_ADD, 0, segs[i]};
+		if (apply_op(m, &op) < 0) {
+			manifest_free(m);
+			return NULL;
+		}
+	}
+
+	return m;
+}
+
+
+/*
+ * Deallocates the manifest struct, the manifest stays on disk
+ *
+ * Parameter:
+ *	m => pointer to the manifest struct to free
+ *
+ * Returns:
+ *	void
+ */
+void manifest_free(struct manifest *m)
+{
+	if (m->fd >= 0)
+		close(m->fd);
+	free(m->path);
+	free(m->tmp_path);
+	free(m->segs);
+	free(m);
+}
+
+
+/*
+ * Adds a MANIFEST_ADD op to the edit
+ *
+ * Parameters:
+ *	e => edit to add to, holding less than MANIFEST_MAX_OPS ops
+ *	seg => segment file to add
+ *	before => ID of the segment file it goes in front of, 0 to go after
+ *	          every other one
+ *
+ * Returns:
+ *	void
+ */
+void manifest_edit_add(struct manifest_edit *e, struct manifest_seg *seg,
+		       uint64_t before)
+{
+	struct manifest_op *op = &e->ops[e->nops++];
+
+	op->type = MANIFEST_ADD;
+	op->before = before;
+	op->seg = *seg;
+}
+
+
+/*
+ * Adds a MANIFEST_DEL op to the edit
+ *
+ * Parameters:
+ *	e => edit to add to, holding less than MANIFEST_MAX_OPS ops
+ *	id => ID of the segment file to remove
+ *
+ * Returns:
+ *	void
+ */
+void manifest_edit_del(struct manifest_edit *e, uint64_t id)
+{
+	struct manifest_op *op = &e->ops[e->nops++];
+
+	memset(op, 0, sizeof(struct manifest_op));
+	op->type = MANIFEST_DEL;
+	op->seg.id = id;
+}
+
+
+/*
+ * Adds a MANIFEST_SET op to the edit, it records the size, live, and dead
+ * bytes of seg for the segment file with seg's ID
+ *
+ * Parameters:
+ *	e => edit to add to, holding less than MANIFEST_MAX_OPS ops
+ *	seg => segment file to update
+ *
+ * Returns:
+ *	void
+ */
+void manifest_edit_set(struct manifest_edit *e, struct manifest_seg *seg)
+{
+	struct manifest_op *op = &e->ops[e->nops++];
+
+	op->type = MANIFEST_SET;
+	op->before = 0;
+	op->seg = *seg;
+}
+
+
+/*
+ * Appends the edit to the manifest and applies it to the segment files in
+ * m. The edit is synced to disk before the function returns, once it is
+ * the edit survives a crash. If the manifest has grown to
+ * MANIFEST_MAX_EDITS edits it is rewritten, failing to do so leaves the
+ * longer manifest in place.
+ *
+ * Parameters:
+ *	m => manifest to append to
+ *	e => edit to commit
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno, EINVAL if an op names a
+ *	segment file that is missing or already there). If there is an
+ *	error the manifest is left unchanged.
+ */
+int manifest_commit(struct manifest *m, struct manifest_edit *e)
+{
+	struct manifest      check = *m;
+	struct manifest_seg  *segs = m->segs;
+	int                  i;
+
+	// apply to a copy first, so a bad edit is never written
+	check.cap = m->cap + e->nops + 1;
+	if ((check.segs = malloc(check.cap * sizeof(*segs))) == NULL)
+		return -1;
+	if (m->nsegs)
+		memcpy(check.segs, m->segs, m->nsegs * sizeof(*segs));
+	for (i = 0; i < e->nops; ++i) {
+		if (apply_op(&check, &e->ops[i]) < 0) {
+			free(check.segs);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (write_edit(m->fd, e->ops, e->nops) < 0) {
+		free(check.segs);
+		return -1;
+	}
+
+	check.nedits += 1;
+	*m = check;
+	free(segs);
+
+	if (m->nedits >= MANIFEST_MAX_EDITS)
+		manifest_rewrite(m);
+	return 0;
+}
+
+
+/*
+ * Rewrites the manifest as a single edit adding the segment files it holds
+ * now, see manifest_create
+ *
+ * Parameter:
+ *	m => manifest to rewrite
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno, the old manifest is
+ *	still in use)
+ */
+int manifest_rewrite(struct manifest *m)
+{
+	return write_snapshot(m, m->segs, m->nsegs);
+}
+
+
+/*
+ * Finds the segment file with the given ID
+ *
+ * Parameters:
+ *	m => manifest to search
+ *	id => ID of the segment file
+ *
+ * Returns:
+ *	Pointer to the segment file in m->segs, or NULL if it is not there
+ */
+struct manifest_seg *manifest_find(struct manifest *m, uint64_t id)
+{
+	int i = find_index(m, id);
+
+	return (i < 0) ? NULL : &m->segs[i];
+}
+
+
+/*
+ * Allocates a manifest struct for the given data directory that has no
+ * segment files and no open manifest
+ */
+static struct manifest *manifest_new(const char *dir)
+{
+	struct manifest *m;
+
+	if ((m = calloc(1, sizeof(struct manifest))) == NULL)
+		return NULL;
+
+	m->fd = -1;
+	m->next_id = 1;
+	m->path = path_in(dir, MANIFEST_NAME);
+	m->tmp_path = path_in(dir, MANIFEST_TMP_NAME);
+	if (m->path == NULL || m->tmp_path == NULL) {
+		manifest_free(m);
+		return NULL;
+	}
+	return m;
+}
+
+
+/*
+ * Returns dir/name allocated on the heap, or NULL if out of memory
+ */
+static char *path_in(const char *dir, const char *name)
+{
+	int   len = snprintf(NULL, 0, "%s/%s", dir, name) + 1;
+	char  *path;
+
+	if ((path = malloc(len)) == NULL)
+		return NULL;
+	snprintf(path, len, "%s/%s", dir, name);
+	return path;
+}
+
+
+/*
+ * Writes a manifest holding only an edit adding the given segment files to
+ * m->tmp_path, syncs it, and renames it to m->path. m->fd is switched over
+ * to the new manifest.
+ */
+static int write_snapshot(struct manifest *m, struct manifest_seg *segs,
+			  int nsegs)
+{
+	char  hdr[MANIFEST_HDR_SZ];
+	int   fd, dir_fd, i;
+	char  *slash;
+
+	if ((fd = open(m->tmp_path, O_CREAT | O_TRUNC | O_RDWR | O_APPEND,
+		       0664)) < 0)
+		return -1;
+
+	memset(hdr, 0, MANIFEST_HDR_SZ);
+	memcpy(hdr, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN);
+	hdr[MANIFEST_MAGIC_LEN] = MANIFEST_VERSION;
+	if (write(fd, hdr, MANIFEST_HDR_SZ) != MANIFEST_HDR_SZ)
+		goto err;
+
+	// one MANIFEST_ADD op per segment file, oldest last
+	struct manifest_op *ops = malloc((nsegs + 1) * sizeof(*ops));
+	if (ops == NULL)
+		goto err;
+	for (i = 0; i < nsegs; ++i) {
+		ops[i].type = MANIFEST_ADD;
+		ops[i].before = 0;
+		ops[i].seg = segs[i];
+	}
+	i = write_edit(fd, ops, nsegs);
+	free(ops);
+	if (i < 0 || rename(m->tmp_path, m->path) < 0)
+		goto err;
+
+	// the rename is only durable once the directory is synced
+	slash = strrchr(m->path, '/');
+	*slash = '\0';
+	dir_fd = open(m->path, O_RDONLY);
+	*slash = '/';
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	if (m->fd >= 0)
+		close(m->fd);
+	m->fd = fd;
+	m->nedits = 1;
+	return 0;
+
+err:
+	close(fd);
+	unlink(m->tmp_path);
+	return -1;
+}
+
+
+/*
+ * Appends an edit holding the given ops to the file and syncs it. The
+ * write and the fdatasync go to the I/O engine linked, as one batch. If
+ * the edit is only partly written, the file is truncated back to where it
+ * started.
+ */
+static int write_edit(int fd, struct manifest_op *ops, int nops)
+{
+	struct ioe_op  io[2];
+	char           *buf;
+	uint32_t       len = 0, crc;
+	off_t          start;
+	ssize_t        n;
+
+	buf = malloc(MANIFEST_EDIT_HDR_SZ + nops * MANIFEST_MAX_OP_SZ);
+	if (buf == NULL)
+		return -1;
+
+	for (int i = 0; i < nops; ++i)
+		len += encode_op(buf + MANIFEST_EDIT_HDR_SZ + len, &ops[i]);
+
+	crc = rec_crc32(0, buf + MANIFEST_EDIT_HDR_SZ, len);
+	memcpy(buf, &len, sizeof(len));
+	memcpy(buf + sizeof(len), &crc, sizeof(crc));
+
+	if ((start = lseek(fd, 0, SEEK_END)) < 0) {
+		free(buf);
+		return -1;
+	}
+
+	io[0].op = IOE_WRITE;
+	io[0].fd = fd;
+	io[0].flags = IOE_LINK;
+	io[0].buf = buf;
+	io[0].len = MANIFEST_EDIT_HDR_SZ + len;
+	io[0].offset = start;
+	io[1].op = IOE_DSYNC;
+	io[1].fd = fd;
+	io[1].flags = 0;
+	io[1].buf = NULL;
+	io[1].len = 0;
+	io[1].offset = 0;
+
+	n = ioe_submit(ioe_default(), io, 2);
+	free(buf);
+	if (n < 0)
+		return -1;
+
+	if (io[0].res != MANIFEST_EDIT_HDR_SZ + len) {
+		if (io[0].res >= 0) {
+			ftruncate(fd, start);
+			errno = EIO;
+		} else {
+			errno = -io[0].res;
+		}
+		return -1;
+	}
+	if (io[1].res < 0) {
+		errno = -io[1].res;
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Encodes the op into buf, which must have room for MANIFEST_MAX_OP_SZ
+ * bytes, and returns the number of bytes written
+ */
+static int encode_op(char *buf, struct manifest_op *op)
+{
+	int n = 0;
+
+	buf[n++] = op->type;
+	n += varint_encode(buf + n, op->seg.id);
+	if (op->type == MANIFEST_ADD) {
+		n += varint_encode(buf + n, op->before);
+		n += varint_encode(buf + n, op->seg.version);
+		n += varint_encode(buf + n, op->seg.flags);
+	}
+	if (op->type != MANIFEST_DEL) {
+		n += varint_encode(buf + n, op->seg.size);
+		n += varint_encode(buf + n, op->seg.live);
+		n += varint_encode(buf + n, op->seg.dead);
+	}
+	return n;
+}
+
+
+/*
+ * Decodes an op written by encode_op
+ *
+ * Returns:
+ *	number of bytes read, or -1 if buf does not start with a valid op
+ */
+static int decode_op(const char *buf, int len, struct manifest_op *op)
+{
+	uint64_t  vals[7];
+	int       nvals, n = 1, i, res;
+
+	if (len < 1)
+		return -1;
+
+	memset(op, 0, sizeof(struct manifest_op));
+	op->type = buf[0];
+	switch (op->type) {
+	case MANIFEST_ADD: nvals = 7; break;
+	case MANIFEST_DEL: nvals = 1; break;
+	case MANIFEST_SET: nvals = 4; break;
+	default: return -1;
+	}
+
+	for (i = 0; i < nvals; ++i) {
+		if ((res = varint_decode(buf + n, len - n, &vals[i])) < 0)
+			return -1;
+		n += res;
+	}
+
+	op->seg.id = vals[0];
+	if (op->type == MANIFEST_ADD) {
+		op->before = vals[1];
+		op->seg.version = vals[2];
+		op->seg.flags = vals[3];
+		op->seg.size = vals[4];
+		op->seg.live = vals[5];
+		op->seg.dead = vals[6];
+	} else if (op->type == MANIFEST_SET) {
+		op->seg.size = vals[1];
+		op->seg.live = vals[2];
+		op->seg.dead = vals[3];
+	}
+	return n;
+}
+
+
+/*
+ * Applies every edit after the header of the manifest in buf. Sets end to
+ * the end of the last whole edit. Only the last edit may be cut short, by
+ * a crash while it was appended. Appended edits are never longer than
+ * MANIFEST_MAX_OPS ops, so a cut short edit never leaves more bytes than
+ * that.
+ *
+ * Returns:
+ *	0 if successful, -1 if an edit other than the last one fails its
+ *	length or crc32 check, or a whole edit could not be applied (errno
+ *	is EIO)
+ */
+static int replay(struct manifest *m, const char *buf, size_t len,
+		  size_t *end)
+{
+	struct manifest_op  op;
+	uint32_t            edit_len, crc;
+	size_t              pos = MANIFEST_HDR_SZ, left;
+	int                 n;
+
+	while ((left = len - pos) >= MANIFEST_EDIT_HDR_SZ) {
+		memcpy(&edit_len, buf + pos, sizeof(edit_len));
+		memcpy(&crc, buf + pos + sizeof(edit_len), sizeof(crc));
+		left -= MANIFEST_EDIT_HDR_SZ;
+
+		const char *ops = buf + pos + MANIFEST_EDIT_HDR_SZ;
+		if (edit_len > left || rec_crc32(0, ops, edit_len) != crc) {
+			// bytes after it, or more than an appended edit holds
+			if (edit_len < left ||
+			    left > MANIFEST_MAX_OPS * MANIFEST_MAX_OP_SZ) {
+				errno = EIO;
+				return -1;
+			}
+			break; // the last edit, cut short
+		}
+
+		for (uint32_t i = 0; i < edit_len; i += n) {
+			if ((n = decode_op(ops + i, edit_len - i, &op)) < 0 ||
+			    apply_op(m, &op) < 0) {
+				errno = EIO;
+				return -1;
+			}
+		}
+
+		m->nedits += 1;
+		pos += MANIFEST_EDIT_HDR_SZ + edit_len;
+	}
+
+	*end = pos;
+	return 0;
+}
+
+
+/*
+ * Applies the op to the segment files in m
+ *
+ * Returns:
+ *	0 if successful, -1 if the op names a segment file that is missing
+ *	or already there, or there is no memory
+ */
+static int apply_op(struct manifest *m, struct manifest_op *op)
+{
+	int i, pos;
+
+	i = find_index(m, op->seg.id);
+	if (op->seg.id == 0 || (op->type == MANIFEST_ADD) != (i < 0))
+		return -1;
+
+	if (op->type == MANIFEST_DEL) {
+		memmove(&m->segs[i], &m->segs[i + 1],
+			(m->nsegs - i - 1) * sizeof(struct manifest_seg));
+		m->nsegs -= 1;
+		return 0;
+	}
+
+	if (op->type == MANIFEST_SET) {
+		m->segs[i].size = op->seg.size;
+		m->segs[i].live = op->seg.live;
+		m->segs[i].dead = op->seg.dead;
+		return 0;
+	}
+
+	pos = (op->before) ? find_index(m, op->before) : m->nsegs;
+	if (pos < 0)
+		return -1;
+
+	if (m->nsegs == m->cap) {
+		int cap = (m->cap) ? m->cap * 2 : 8;
+		struct manifest_seg *segs;
+		if ((segs = realloc(m->segs, cap * sizeof(*segs))) == NULL)
+			return -1;
+		m->segs = segs;
+		m->cap = cap;
+	}
+
+	memmove(&m->segs[pos + 1], &m->segs[pos],
+		(m->nsegs - pos) * sizeof(struct manifest_seg));
+	m->segs[pos] = op->seg;
+	m->nsegs += 1;
+	if (op->seg.id >= m->next_id)
+		m->next_id = op->seg.id + 1;
+	return 0;
+}
+
+
+/*
+ * Returns the index in m->segs of the segment file with the given ID, -1
+ * if it is not there
+ */
+static int find_index(struct manifest *m, uint64_t id)
+{
+	for (int i = 0; i < m->nsegs; ++i) {
+		if (m->segs[i].id == id)
+			return i;
+	}
+	return -1;
+}
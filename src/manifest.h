@@ -0,0 +1,118 @@
+#ifndef _HASHDB_MANIFEST_H_
+#define _HASHDB_MANIFEST_H_
+
+#include <stdint.h>
+
+// Name of the manifest in the data directory, and of the new one while
+// manifest_create writes it
+#define MANIFEST_NAME     "MANIFEST"
+#define MANIFEST_TMP_NAME "MANIFEST.tmp"
+
+// Manifest header, written at the start of the manifest:
+//	magic (4 bytes) | version (1 byte) | reserved (3 bytes)
+#define MANIFEST_MAGIC     "HMAN"
+#define MANIFEST_MAGIC_LEN 4
+#define MANIFEST_HDR_SZ    8
+#define MANIFEST_VERSION   1
+
+// The header is followed by edits, each appended as a whole and framed as:
+//	length of the ops (4 bytes) | crc32 of the ops (4 bytes) | ops
+// An edit cut short by a crash fails its length or crc32 check. It is
+// dropped when the manifest is opened if it is the last one, any other
+// edit that fails them makes the manifest corrupt.
+#define MANIFEST_EDIT_HDR_SZ 8
+
+// Every op is its type (1 byte) followed by varints:
+//	MANIFEST_ADD: id | id of the segment file it goes in front of, 0 to
+//	              go after every other one | version | flags | size |
+//	              live bytes | dead bytes
+//	MANIFEST_DEL: id
+//	MANIFEST_SET: id | size | live bytes | dead bytes
+#define MANIFEST_ADD 1 // adds a segment file
+#define MANIFEST_DEL 2 // removes a segment file
+#define MANIFEST_SET 3 // updates the sizes of a sealed segment file
+
+#define MANIFEST_MAX_OP_SZ (1 + 7 * 10)
+
+// Max number of ops in one manifest_edit
+#define MANIFEST_MAX_OPS 4
+
+// Number of edits the manifest grows to before manifest_commit rewrites
+// it as a single edit holding the current segment files
+#ifdef TESTING
+#define MANIFEST_MAX_EDITS 8
+#else
+#define MANIFEST_MAX_EDITS 1024
+#endif
+
+
+// Segment file as recorded in the manifest. The sizes are as of the edit
+// that last added or updated it, the head segment file keeps growing
+// after it is added.
+struct manifest_seg {
+	uint64_t id;          // ID of the segment file, its name is <id>.dat
+	int version;          // on disk format (SEGF_V1 or SEGF_V2)
+	unsigned char flags;  // SEGF_HDR_* flags
+	uint64_t size;        // size in bytes
+	uint64_t live;        // bytes of records no newer record shadows
+	uint64_t dead;        // bytes of records a newer record shadows
+};
+
+
+// Op of an edit, see MANIFEST_ADD, MANIFEST_DEL, and MANIFEST_SET
+struct manifest_op {
+	int type;                 // MANIFEST_* op type
+	uint64_t before;          // MANIFEST_ADD: ID of the segment file the
+	                          // new one goes in front of, 0 for the end
+	struct manifest_seg seg;  // segment file the op is about, only the
+	                          // id is used by MANIFEST_DEL
+};
+
+
+// Ops that are committed together, either all of them or none
+struct manifest_edit {
+	struct manifest_op ops[MANIFEST_MAX_OPS];
+	int nops;
+};
+
+
+// Append only log of the segment files of a database. Replaying the
+// edits gives the segment files in the database, newest first.
+struct manifest {
+	char *path;                // path of the manifest
+	char *tmp_path;            // path manifest_create writes to first
+	int fd;                    // opened for appending
+	struct manifest_seg *segs; // segment files, newest first
+	int nsegs;                 // number of segment files
+	int cap;                   // number of segment files segs can hold
+	uint64_t next_id;          // larger than every ID in the manifest
+	int nedits;                // number of edits in the manifest
+	int truncated;             // 1 if manifest_open dropped an edit cut
+	                           // short at the end
+};
+
+
+/* Struct constructors and destructors */
+struct manifest *manifest_open(const char *dir);
+
+struct manifest *manifest_create(const char *dir, struct manifest_seg *segs,
+				 int nsegs);
+
+void manifest_free(struct manifest *m);
+
+
+/* Manifest edit functions */
+void manifest_edit_add(struct manifest_edit *e, struct manifest_seg *seg,
+		       uint64_t before);
+
+void manifest_edit_del(struct manifest_edit *e, uint64_t id);
+
+void manifest_edit_set(struct manifest_edit *e, struct manifest_seg *seg);
+
+int manifest_commit(struct manifest *m, struct manifest_edit *e);
+
+int manifest_rewrite(struct manifest *m);
+
+struct manifest_seg *manifest_find(struct manifest *m, uint64_t id);
+
+#endif
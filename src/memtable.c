@@ -1,8 +1,12 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "memtable.h"
 
+/* 'Private' helper functions */
+static int write_entry(struct memtable *, int, uint64_t, char);
+
 
 /*
  * Creates a memtable_entry. Caller is responsible for freeing this struct
@@ -16,7 +20,7 @@
  *	Pointer to a struct memtable_entry on the heap if allocation was
  *	successful, NULL otherwise
  */
-struct memtable_entry *memte_init(int key, unsigned int offset)
+struct memtable_entry *memte_init(int key, uint64_t offset)
 {
 	struct memtable_entry *e;
 
@@ -25,6 +29,7 @@ struct memtable_entry *memte_init(int key, unsigned int offset)
 
 	e->key = key;
 	e->offset = offset;
+	e->deleted = 0;
 	e->next = NULL;
 	return e;
 }
@@ -129,6 +134,42 @@ void memtable_free(struct memtable *tbl)
 }
 
 
+/*
+ * Makes a copy of the memtable that is not changed by later writes to the
+ * original. Bucket chains keep their order.
+ *
+ * Parameter:
+ *	tbl => pointer to the memtable to copy
+ *
+ * Returns:
+ *	Pointer to the new memtable, caller must free it by calling
+ *	memtable_free, or NULL if there is no memory available
+ */
+struct memtable *memtable_copy(struct memtable *tbl)
+{
+	struct memtable        *cpy;
+	struct memtable_entry  *e, **tail;
+
+	if ((cpy = memtable_init()) == NULL)
+		return NULL;
+
+	for (int i = 0; i < MAX_TBL_SZ; ++i) {
+		tail = &cpy->table[i];
+		for (e = tbl->table[i]; e; e = e->next) {
+			if ((*tail = memte_init(e->key, e->offset)) == NULL) {
+				memtable_free(cpy);
+				return NULL;
+			}
+			(*tail)->deleted = e->deleted;
+			tail = &(*tail)->next;
+		}
+	}
+
+	cpy->entries = tbl->entries;
+	return cpy;
+}
+
+
 /*
  * Prints the entire memtable to stdout
  *
@@ -146,7 +187,8 @@ void memtable_dump(struct memtable *tbl)
 		printf("Bucket: %d\n\t", i);
 		e = tbl->table[i];
 		while (e) {
-			printf("%d %d -> ", e->key, e->offset);
+			printf("%d %" PRIu64 "%s -> ", e->key, e->offset,
+					(e->deleted) ? " (deleted)" : "");
 			e = e->next;
 		}
 		printf("NULL\n");
@@ -166,7 +208,35 @@ void memtable_dump(struct memtable *tbl)
  * Returns:
  *	-1 if there is an error allocating memte_entry struct, 0 otherwise
  */
-int memtable_write(struct memtable *tbl, int key, unsigned int offset)
+int memtable_write(struct memtable *tbl, int key, uint64_t offset)
+{
+	return write_entry(tbl, key, offset, 0);
+}
+
+
+/*
+ * Marks the key as deleted in the memtable. The key stays in the memtable
+ * so that it shadows any older value of the key in older segment files.
+ *
+ * Parameters:
+ *	tbl => pointer to the memtable to add to
+ *	key => integer representing the key
+ *	offset => offset of the keys tombstone in the segment file
+ *
+ * Returns:
+ *	-1 if there is an error allocating memte_entry struct, 0 otherwise
+ */
+int memtable_write_tombstone(struct memtable *tbl, int key, uint64_t offset)
+{
+	return write_entry(tbl, key, offset, 1);
+}
+
+
+/*
+ * Adds or updates the entry for the given key, see memtable_write
+ */
+static int write_entry(struct memtable *tbl, int key, uint64_t offset,
+		       char deleted)
 {
 	int hash = default_hash(key);
 	hash = hash % MAX_TBL_SZ;
@@ -178,12 +248,14 @@ int memtable_write(struct memtable *tbl, int key, unsigned int offset)
 
 	if (curr) { // key already exist in the memtable
 		curr->offset = offset;	
+		curr->deleted = deleted;
 		return 0;
 	}
 
 	struct memtable_entry *entry;
 	if ((entry = memte_init(key, offset)) == NULL)
 		return -1;
+	entry->deleted = deleted;
 	
 	// place new entry at the front of the bucket chain
 	memte_place_before(entry, tbl->table[hash]);
@@ -202,9 +274,11 @@ int memtable_write(struct memtable *tbl, int key, unsigned int offset)
  *	offset => address of where to store the offset it found
  *
  * Returns:
- *	1 if offset was found, 0 otherwise (does not change offset)
+ *	MEMTE_LIVE if the offset of a value was found, MEMTE_DELETED if the
+ *	key was deleted (offset is set to the tombstone), or MEMTE_MISSING (0)
+ *	if the key is not in the memtable (does not change offset)
  */
-int memtable_read(struct memtable *tbl, int key, unsigned int *offset)
+int memtable_read(struct memtable *tbl, int key, uint64_t *offset)
 {
 	int hash = default_hash(key);
 	hash = hash % MAX_TBL_SZ;
@@ -213,7 +287,7 @@ int memtable_read(struct memtable *tbl, int key, unsigned int *offset)
 	while (curr) {
 		if (curr->key == key) {
 			*offset = curr->offset;
-			return 1;
+			return (curr->deleted) ? MEMTE_DELETED : MEMTE_LIVE;
 		}
 		curr = curr->next;
 	}
@@ -1,20 +1,30 @@
 #ifndef _HASHDB_MEMTABLE_H_
 #define _HASHDB_MEMTABLE_H_
 
-// Represents an entry in the memtables bucket chain
+#include <stdint.h>
+
+// Represents an entry in the memtables bucket chain. deleted sits next to
+// key so the 64 bit offset adds no padding.
 struct memtable_entry {
 	int key;                     // used to look up data in the memtable
-	unsigned int offset;         // byte offset of the kv pair in segment file
+	char deleted;                // 1 if offset is the keys tombstone
+	uint64_t offset;             // byte offset of the kv pair in segment file
 	struct memtable_entry *next; // pointer to the next entry in chain
 };
 
-struct memtable_entry *memte_init(int key, unsigned int offset);
+struct memtable_entry *memte_init(int key, uint64_t offset);
 
 void memte_free(struct memtable_entry *entry);
 
 void memte_place_before(struct memtable_entry *e1, struct memtable_entry *e2);
 
 
+// Results of memtable_read
+#define MEMTE_MISSING 0 // key is not in the memtable
+#define MEMTE_LIVE    1 // key maps to a value
+#define MEMTE_DELETED 2 // key maps to a tombstone
+
+
 // Max number of entries in a memtable
 #define MAX_TBL_SZ 97
 
@@ -30,11 +40,15 @@ struct memtable *memtable_init();
 
 void memtable_free(struct memtable *tbl);
 
+struct memtable *memtable_copy(struct memtable *tbl);
+
 void memtable_dump(struct memtable *tbl);
 
-int memtable_read(struct memtable *tbl, int key, unsigned int *offset);
+int memtable_read(struct memtable *tbl, int key, uint64_t *offset);
+
+int memtable_write(struct memtable *tbl, int key, uint64_t offset);
 
-int memtable_write(struct memtable *tbl, int key, unsigned int offset);
+int memtable_write_tombstone(struct memtable *tbl, int key, uint64_t offset);
 
 int memtable_remove(struct memtable *tbl, int key);
 
@@ -0,0 +1,91 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mergeop.h"
+
+/* 'Private' helper functions */
+static int add_int64(const char *, const char *, char **);
+
+static int append_bytes(const char *, const char *, char **);
+
+static int parse_int64(const char *, int64_t *);
+
+
+const struct merge_op mergeop_add = {"add", add_int64};
+
+const struct merge_op mergeop_append = {"append", append_bytes};
+
+
+/*
+ * Merge function of mergeop_add
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno, EINVAL if base or
+ *	operand is not a decimal int64, ERANGE if the sum overflows)
+ */
+static int add_int64(const char *base, const char *operand, char **out)
+{
+	int64_t  a = 0, b, sum;
+	char     *buf;
+
+	if ((base && parse_int64(base, &a) < 0) || parse_int64(operand, &b) < 0)
+		return -1;
+
+	if (__builtin_add_overflow(a, b, &sum)) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	if ((buf = malloc(MERGEOP_INT64_LEN + 1)) == NULL)
+		return -1;
+
+	snprintf(buf, MERGEOP_INT64_LEN + 1, "%" PRId64, sum);
+	*out = buf;
+	return 0;
+}
+
+
+/*
+ * Merge function of mergeop_append
+ *
+ * Returns:
+ *	0 if successful, -1 if there is no memory available
+ */
+static int append_bytes(const char *base, const char *operand, char **out)
+{
+	size_t  base_len = (base) ? strlen(base) : 0;
+	size_t  op_len = strlen(operand);
+	char    *buf;
+
+	if ((buf = malloc(base_len + op_len + 1)) == NULL)
+		return -1;
+
+	if (base)
+		memcpy(buf, base, base_len);
+	memcpy(buf + base_len, operand, op_len + 1);
+	*out = buf;
+	return 0;
+}
+
+
+/*
+ * Parses a decimal int64 that takes up the whole string
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (errno is set to EINVAL)
+ */
+static int parse_int64(const char *s, int64_t *v)
+{
+	char *end;
+
+	errno = 0;
+	*v = strtoll(s, &end, 10);
+	if (end == s || *end != '\0' || errno == ERANGE) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
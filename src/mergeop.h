@@ -0,0 +1,31 @@
+#ifndef _HASHDB_MERGEOP_H_
+#define _HASHDB_MERGEOP_H_
+
+// Largest int64 mergeop_add keeps as text, sign included
+#define MERGEOP_INT64_LEN 20
+
+
+// Combines the value of a key with operands written by hashDB_merge_value,
+// see hashDB_set_merge_op. Reads fold the operands of a key into its value
+// oldest first, compaction writes the result back as a plain value.
+struct merge_op {
+	// name of the operator, for error messages and debugging
+	const char *name;
+
+	// Stores the result of applying operand to base in *out (null
+	// terminated, caller must free it). base is NULL if the key has no
+	// value. Returns 0, or -1 with errno set if operand does not apply.
+	int (*merge)(const char *base, const char *operand, char **out);
+};
+
+
+/* Built in merge operators */
+
+// Adds decimal int64 operands to a decimal int64 value, a key with no
+// value counts as 0
+extern const struct merge_op mergeop_add;
+
+// Appends operands to the value, a key with no value counts as empty
+extern const struct merge_op mergeop_append;
+
+#endif
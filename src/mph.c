@@ -0,0 +1,340 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mph.h"
+
+/* 'Private' helper functions */
+static uint64_t mph_hash(int, int);
+
+static int build_ranks(struct mph *);
+
+static unsigned int rank(struct mph *, unsigned int, unsigned int);
+
+static int int_cmp(const void *, const void *);
+
+
+/*
+ * Builds a minimal perfect hash function over the given keys
+ *
+ * Parameters:
+ *	keys => keys to map, every key must be distinct
+ *	n => number of keys
+ *
+ * Returns:
+ *	Pointer to a mph struct, caller must free it by calling mph_free,
+ *	or NULL if there is an error (check errno, EINVAL if a key is in
+ *	keys more than once)
+ */
+struct mph *mph_build(const int *keys, unsigned int n)
+{
+	struct mph    *mph;
+	uint64_t      *seen = NULL, *collide = NULL, *bits;
+	int           *rem;
+	unsigned int  nrem = n, words, next, i;
+
+	if ((mph = calloc(1, sizeof(struct mph))) == NULL)
+		return NULL;
+
+	mph->nkeys = n;
+	if ((rem = malloc((n + 1) * sizeof(int))) == NULL)
+		goto err;
+	memcpy(rem, keys, n * sizeof(int));
+
+	while (nrem > 0 && mph->nlevels < MPH_MAX_LEVELS) {
+		words = (nrem * MPH_GAMMA + 63) / 64;
+		uint64_t nbits = (uint64_t)words * 64;
+
+		seen = calloc(words, sizeof(uint64_t));
+		collide = calloc(words, sizeof(uint64_t));
+		bits = realloc(mph->bits, (mph->nwords + words) * sizeof(uint64_t));
+		if (seen == NULL || collide == NULL || bits == NULL) {
+			if (bits)
+				mph->bits = bits;
+			goto err;
+		}
+		mph->bits = bits;
+
+		for (i = 0; i < nrem; ++i) {
+			uint64_t pos = mph_hash(rem[i], mph->nlevels) % nbits;
+			uint64_t bit = 1ULL << (pos % 64);
+			if (seen[pos / 64] & bit)
+				collide[pos / 64] |= bit;
+			seen[pos / 64] |= bit;
+		}
+
+		// keys that collided are left for the next level
+		for (i = next = 0; i < nrem; ++i) {
+			uint64_t pos = mph_hash(rem[i], mph->nlevels) % nbits;
+			if (collide[pos / 64] & (1ULL << (pos % 64)))
+				rem[next++] = rem[i];
+		}
+
+		for (i = 0; i < words; ++i)
+			mph->bits[mph->nwords + i] = seen[i] & ~collide[i];
+
+		mph->level_words[mph->nlevels++] = words;
+		mph->nwords += words;
+		nrem = next;
+		free(seen);
+		free(collide);
+		seen = collide = NULL;
+	}
+
+	qsort(rem, nrem, sizeof(int), int_cmp);
+	for (i = 1; i < nrem; ++i) {
+		if (rem[i] == rem[i - 1]) { // duplicates never stop colliding
+			errno = EINVAL;
+			goto err;
+		}
+	}
+	mph->fallback = rem;
+	mph->nfallback = nrem;
+	rem = NULL;
+
+	if (build_ranks(mph) < 0)
+		goto err;
+
+	return mph;
+
+err:
+	free(seen);
+	free(collide);
+	free(rem);
+	mph_free(mph);
+	return NULL;
+}
+
+
+/*
+ * Deallocates the minimal perfect hash function
+ *
+ * Parameter:
+ *	mph => pointer to the mph struct to free
+ *
+ * Returns:
+ *	void
+ */
+void mph_free(struct mph *mph)
+{
+	free(mph->bits);
+	free(mph->ranks);
+	free(mph->fallback);
+	free(mph);
+}
+
+
+/*
+ * Finds the slot of the key. Keys outside of the set the function was
+ * built from map to -1 or to the slot of some key in the set, callers
+ * must check the key stored for the slot.
+ *
+ * Parameters:
+ *	mph => minimal perfect hash function to evaluate
+ *	key => key to look up
+ *
+ * Returns:
+ *	Slot of the key, 0 to mph->nkeys - 1, or -1 if the key is known not
+ *	to be in the set
+ */
+int mph_lookup(struct mph *mph, int key)
+{
+	unsigned int  start = 0, lo, hi;
+
+	for (int l = 0; l < mph->nlevels; ++l) {
+		uint64_t pos = mph_hash(key, l) % ((uint64_t)mph->level_words[l] * 64);
+		unsigned int w = start + pos / 64;
+		if (mph->bits[w] & (1ULL << (pos % 64)))
+			return rank(mph, w, pos % 64);
+		start += mph->level_words[l];
+	}
+
+	// keys of no level come after every placed key
+	lo = 0;
+	hi = mph->nfallback;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (mph->fallback[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < mph->nfallback && mph->fallback[lo] == key)
+		return mph->nkeys - mph->nfallback + lo;
+
+	return -1;
+}
+
+
+/*
+ * Returns the number of bytes mph_encode writes
+ */
+unsigned int mph_encoded_len(struct mph *mph)
+{
+	return sizeof(uint32_t) * (3 + mph->nlevels)
+		+ mph->nwords * sizeof(uint64_t)
+		+ mph->nfallback * sizeof(int);
+}
+
+
+/*
+ * Writes the minimal perfect hash function to the buffer:
+ *	number of keys | number of levels | number of fallback keys | words
+ *	of each level | bit arrays | fallback keys
+ * The rank table is not written, mph_decode builds it again.
+ *
+ * Parameters:
+ *	mph => minimal perfect hash function to encode
+ *	buf => where to write it, needs mph_encoded_len bytes
+ *
+ * Returns:
+ *	void
+ */
+void mph_encode(struct mph *mph, char *buf)
+{
+	uint32_t hdr[3] = {mph->nkeys, mph->nlevels, mph->nfallback};
+
+	memcpy(buf, hdr, sizeof(hdr));
+	buf += sizeof(hdr);
+	memcpy(buf, mph->level_words, mph->nlevels * sizeof(uint32_t));
+	buf += mph->nlevels * sizeof(uint32_t);
+	if (mph->nwords) // a function over no keys has no bits
+		memcpy(buf, mph->bits, mph->nwords * sizeof(uint64_t));
+	buf += mph->nwords * sizeof(uint64_t);
+	memcpy(buf, mph->fallback, mph->nfallback * sizeof(int));
+}
+
+
+/*
+ * Reads a minimal perfect hash function written by mph_encode
+ *
+ * Parameters:
+ *	buf => encoded minimal perfect hash function
+ *	len => length of buf
+ *
+ * Returns:
+ *	Pointer to a mph struct, caller must free it by calling mph_free,
+ *	or NULL if there is an error (check errno, EIO if buf does not hold
+ *	a valid minimal perfect hash function)
+ */
+struct mph *mph_decode(const char *buf, unsigned int len)
+{
+	struct mph  *mph;
+	uint32_t    hdr[3];
+	uint64_t    ones = 0;
+
+	if (len < sizeof(hdr))
+		goto corrupt;
+	memcpy(hdr, buf, sizeof(hdr));
+	if (hdr[1] > MPH_MAX_LEVELS || hdr[2] > hdr[0])
+		goto corrupt;
+
+	if ((mph = calloc(1, sizeof(struct mph))) == NULL)
+		return NULL;
+
+	mph->nkeys = hdr[0];
+	mph->nlevels = hdr[1];
+	mph->nfallback = hdr[2];
+	buf += sizeof(hdr);
+	len -= sizeof(hdr);
+
+	if (len < mph->nlevels * sizeof(uint32_t))
+		goto corrupt_free;
+	memcpy(mph->level_words, buf, mph->nlevels * sizeof(uint32_t));
+	buf += mph->nlevels * sizeof(uint32_t);
+	len -= mph->nlevels * sizeof(uint32_t);
+
+	for (int l = 0; l < mph->nlevels; ++l)
+		mph->nwords += mph->level_words[l];
+
+	if (len != (uint64_t)mph->nwords * sizeof(uint64_t)
+		  + mph->nfallback * sizeof(int))
+		goto corrupt_free;
+
+	mph->bits = malloc(mph->nwords * sizeof(uint64_t) + 1);
+	mph->fallback = malloc(mph->nfallback * sizeof(int) + 1);
+	if (mph->bits == NULL || mph->fallback == NULL)
+		goto err;
+	memcpy(mph->bits, buf, mph->nwords * sizeof(uint64_t));
+	memcpy(mph->fallback, buf + mph->nwords * sizeof(uint64_t),
+	       mph->nfallback * sizeof(int));
+
+	// every key has exactly one slot
+	for (unsigned int i = 0; i < mph->nwords; ++i)
+		ones += __builtin_popcountll(mph->bits[i]);
+	if (ones + mph->nfallback != mph->nkeys)
+		goto corrupt_free;
+
+	if (build_ranks(mph) < 0)
+		goto err;
+
+	return mph;
+
+corrupt_free:
+	errno = EIO;
+err:
+	mph_free(mph);
+	return NULL;
+
+corrupt:
+	errno = EIO;
+	return NULL;
+}
+
+
+/*
+ * Hashes the key for the given level
+ */
+static uint64_t mph_hash(int key, int level)
+{
+	uint64_t x = (uint32_t)key + 0x9e3779b97f4a7c15ULL * (level + 1);
+
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+
+/*
+ * Fills in the rank table of the mph struct
+ */
+static int build_ranks(struct mph *mph)
+{
+	uint32_t sum = 0;
+
+	mph->ranks = malloc((mph->nwords / MPH_RANK_WORDS + 1) * sizeof(uint32_t));
+	if (mph->ranks == NULL)
+		return -1;
+
+	for (unsigned int i = 0; i < mph->nwords; ++i) {
+		if (i % MPH_RANK_WORDS == 0)
+			mph->ranks[i / MPH_RANK_WORDS] = sum;
+		sum += __builtin_popcountll(mph->bits[i]);
+	}
+	return 0;
+}
+
+
+/*
+ * Returns the number of set bits before the given bit of the given word
+ */
+static unsigned int rank(struct mph *mph, unsigned int word, unsigned int bit)
+{
+	unsigned int r = mph->ranks[word / MPH_RANK_WORDS];
+
+	for (unsigned int i = word - word % MPH_RANK_WORDS; i < word; ++i)
+		r += __builtin_popcountll(mph->bits[i]);
+	return r + __builtin_popcountll(mph->bits[word] & ((1ULL << bit) - 1));
+}
+
+
+/*
+ * Comparison function used by qsort to order keys
+ */
+static int int_cmp(const void *a, const void *b)
+{
+	int ka = *(const int *)a;
+	int kb = *(const int *)b;
+
+	return (ka > kb) - (ka < kb);
+}
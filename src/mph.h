@@ -0,0 +1,48 @@
+#ifndef _HASHDB_MPH_H_
+#define _HASHDB_MPH_H_
+
+#include <stdint.h>
+
+// Bits per key of each level's bit array, more bits means fewer keys
+// collide and fall through to the next level
+#define MPH_GAMMA 2
+
+// Max number of levels, keys still colliding after the last one are kept
+// in a sorted fallback array
+#define MPH_MAX_LEVELS 24
+
+// Number of bit array words covered by each entry of the rank table
+#define MPH_RANK_WORDS 8
+
+
+// Minimal perfect hash function over a fixed set of keys (BBHash style).
+// Every level hashes the keys left over from the level before into a bit
+// array, keys that land on a bit of their own are placed there and the
+// rest move on. The slot of a key is the rank of its bit among all set
+// bits, so the n keys map onto 0 to n - 1 without any collisions.
+struct mph {
+	unsigned int nkeys;                     // number of keys in the set
+	int nlevels;                            // number of levels
+	unsigned int level_words[MPH_MAX_LEVELS]; // 64 bit words per level
+	unsigned int nwords;                    // words in all the levels
+	uint64_t *bits;                         // bit arrays of every level
+	uint32_t *ranks;                        // set bits before every
+	                                        // MPH_RANK_WORDS words
+	int *fallback;                          // sorted keys of no level
+	unsigned int nfallback;                 // number of fallback keys
+};
+
+
+struct mph *mph_build(const int *keys, unsigned int n);
+
+void mph_free(struct mph *mph);
+
+int mph_lookup(struct mph *mph, int key);
+
+unsigned int mph_encoded_len(struct mph *mph);
+
+void mph_encode(struct mph *mph, char *buf);
+
+struct mph *mph_decode(const char *buf, unsigned int len);
+
+#endif
@@ -0,0 +1,276 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "record.h"
+
+
+/*
+ * Encodes the header of a v2 record into the given buffer. The buffer
+ * must have room for at least REC_MAX_HDR_SZ bytes. hdr->hdr_len is set
+ * to the number of bytes written.
+ *
+ * Parameters:
+ *	buf => where to write the encoded header
+ *	hdr => header to encode
+ *
+ * Returns:
+ *	The number of bytes written to buf
+ */
+int rec_encode_hdr(char *buf, struct record_hdr *hdr)
+{
+	int n = 0;
+
+	buf[n++] = hdr->flags;
+	n += varint_encode(buf + n, zigzag_encode(hdr->key));
+	n += varint_encode(buf + n, hdr->val_len);
+	if (hdr->flags & REC_SEQ)
+		n += varint_encode(buf + n, hdr->seq);
+	if (hdr->flags & REC_TTL)
+		n += varint_encode(buf + n, hdr->expires);
+
+	hdr->hdr_len = n;
+	return n;
+}
+
+
+/*
+ * Decodes the header of a v2 record from the given buffer.
+ *
+ * Parameters:
+ *	buf => start of the encoded record
+ *	len => number of valid bytes in buf
+ *	hdr => where to store the decoded header
+ *
+ * Returns:
+ *	The number of bytes the header takes up, or -1 if buf does not
+ *	contain a complete header
+ */
+int rec_decode_hdr(const char *buf, int len, struct record_hdr *hdr)
+{
+	uint64_t  v;
+	int       n = 0, i;
+
+	if (len < 1)
+		return -1;
+	hdr->flags = buf[n++];
+
+	i = varint_decode(buf + n, len - n, &v);
+	if (i < 0 || v > UINT32_MAX)
+		return -1;
+	hdr->key = zigzag_decode(v);
+	n += i;
+
+	i = varint_decode(buf + n, len - n, &v);
+	if (i < 0 || v > UINT32_MAX)
+		return -1;
+	hdr->val_len = v;
+	n += i;
+
+	hdr->seq = 0;
+	if (hdr->flags & REC_SEQ) {
+		if ((i = varint_decode(buf + n, len - n, &hdr->seq)) < 0)
+			return -1;
+		n += i;
+	}
+
+	hdr->expires = 0;
+	if (hdr->flags & REC_TTL) {
+		if ((i = varint_decode(buf + n, len - n, &hdr->expires)) < 0)
+			return -1;
+		n += i;
+	}
+
+	hdr->hdr_len = n;
+	return n;
+}
+
+
+/*
+ * Calculates the number of bytes the record takes up in a segment file,
+ * this includes the header, value, and checksum if there is one.
+ *
+ * Parameter:
+ *	hdr => header of the record, hdr_len does not need to be set
+ *
+ * Returns:
+ *	The size of the encoded record in bytes
+ */
+unsigned int rec_size(struct record_hdr *hdr)
+{
+	unsigned int sz = 1
+			+ varint_len(zigzag_encode(hdr->key))
+			+ varint_len(hdr->val_len)
+			+ hdr->val_len;
+
+	if (hdr->flags & REC_SEQ)
+		sz += varint_len(hdr->seq);
+	if (hdr->flags & REC_TTL)
+		sz += varint_len(hdr->expires);
+	if (hdr->flags & REC_CHECKSUM)
+		sz += REC_CRC_SZ;
+	return sz;
+}
+
+
+/*
+ * Encodes the end of a range tombstones range, the value of the record.
+ *
+ * Parameters:
+ *	buf => where to write the value, needs REC_MAX_VARINT_SZ bytes
+ *	hi => last key in the range
+ *
+ * Returns:
+ *	The number of bytes written to buf, the val_len of the record
+ */
+int rec_encode_range_end(char *buf, int hi)
+{
+	return varint_encode(buf, zigzag_encode(hi));
+}
+
+
+/*
+ * Decodes the value of a range tombstone written by rec_encode_range_end.
+ *
+ * Parameters:
+ *	buf => value of the record
+ *	len => length of the value
+ *	hi => where to store the last key in the range
+ *
+ * Returns:
+ *	The number of bytes read from buf, or -1 if the value is not a
+ *	valid range end
+ */
+int rec_decode_range_end(const char *buf, int len, int *hi)
+{
+	uint64_t  v;
+	int       n;
+
+	if ((n = varint_decode(buf, len, &v)) < 0 || v > UINT32_MAX)
+		return -1;
+
+	*hi = zigzag_decode(v);
+	return n;
+}
+
+
+/*
+ * Encodes v as a little endian base 128 varint, 7 bits per byte with the
+ * high bit set on every byte except the last.
+ *
+ * Parameters:
+ *	buf => where to write the varint, needs REC_MAX_VARINT64_SZ bytes
+ *	       (REC_MAX_VARINT_SZ for 32 bit values)
+ *	v => value to encode
+ *
+ * Returns:
+ *	The number of bytes written to buf
+ */
+int varint_encode(char *buf, uint64_t v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = (char)((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (char)v;
+	return n;
+}
+
+
+/*
+ * Decodes a varint written by varint_encode.
+ *
+ * Parameters:
+ *	buf => start of the varint
+ *	len => number of valid bytes in buf
+ *	v => where to store the decoded value
+ *
+ * Returns:
+ *	The number of bytes read from buf, or -1 if the varint is truncated
+ *	or longer than REC_MAX_VARINT64_SZ bytes
+ */
+int varint_decode(const char *buf, int len, uint64_t *v)
+{
+	uint64_t  res = 0;
+	int       i;
+
+	for (i = 0; i < len && i < REC_MAX_VARINT64_SZ; ++i) {
+		unsigned char b = buf[i];
+		res |= (uint64_t)(b & 0x7f) << (7 * i);
+		if ((b & 0x80) == 0) {
+			*v = res;
+			return i + 1;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Returns the number of bytes varint_encode would use for v
+ */
+int varint_len(uint64_t v)
+{
+	int n = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		++n;
+	}
+	return n;
+}
+
+
+/*
+ * Maps signed integers onto unsigned ones so that values close to zero,
+ * positive or negative, encode to short varints (0, -1, 1, -2 => 0, 1, 2, 3)
+ */
+uint32_t zigzag_encode(int v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+
+/*
+ * Inverse of zigzag_encode
+ */
+int zigzag_decode(uint32_t v)
+{
+	return (int)((v >> 1) ^ (~(v & 1) + 1));
+}
+
+
+/*
+ * Updates a CRC-32 (IEEE 802.3) checksum with the given bytes. Start
+ * with a crc of 0.
+ *
+ * Parameters:
+ *	crc => checksum of the bytes seen so far
+ *	buf => bytes to add to the checksum
+ *	len => number of bytes in buf
+ *
+ * Returns:
+ *	The updated checksum
+ */
+uint32_t rec_crc32(uint32_t crc, const char *buf, unsigned int len)
+{
+	static uint32_t  table[256];
+	static int       table_built = 0;
+
+	if (!table_built) {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+			table[i] = c;
+		}
+		table_built = 1;
+	}
+
+	crc = ~crc;
+	for (unsigned int i = 0; i < len; ++i)
+		crc = table[(crc ^ (unsigned char)buf[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
@@ -0,0 +1,128 @@
+#ifndef _HASHDB_RECORD_H_
+#define _HASHDB_RECORD_H_
+
+#include <stdint.h>
+
+// Segment file header, written at the start of every v2 segment file:
+//	magic (4 bytes) | version (1 byte) | flags (1 byte) | reserved (2 bytes)
+//
+// v1 segment files have no header, their first byte is the tombstone of
+// the first key value pair (or the file is empty).
+#define SEGF_MAGIC     "HSEG"
+#define SEGF_MAGIC_LEN 4
+#define SEGF_HDR_SZ    8
+
+#define SEGF_V1 1 // headerless, fixed size record framing
+#define SEGF_V2 2 // varint record framing
+
+#define SEGF_HDR_CHECKSUM 0x01 // every record in the file ends with a crc32
+#define SEGF_HDR_SORTED   0x02 // records sorted by key, ends with a fence index
+#define SEGF_HDR_HASHED   0x04 // ends with a minimal perfect hash of the keys
+
+// Keys of these segment files are found through the index at their end
+#define SEGF_HDR_INDEXED (SEGF_HDR_SORTED | SEGF_HDR_HASHED)
+
+// Layout of a sorted or hashed segment file after the header:
+//	key value pairs and tombstones, each key once | range tombstones |
+//	index | footer
+//
+// The key value pairs of a sorted segment file are in ascending key order
+// and split into blocks, its index is a fence index that holds the first
+// key and the offset of every block, each as a varint (the key zigzag
+// encoded). The index of a hashed segment file is its slot table, one
+// SEGF_SLOT_SZ slot per key in slot order, followed by a minimal perfect
+// hash function over its keys (see mph_encode). A slot holds the key
+// (4 bytes) and the offset of its record (4 bytes), the top bit of the
+// offset is set if the record is a tombstone. The footer has a fixed size:
+//	end of the key value pairs (4 bytes) | end of the range tombstones
+//	(4 bytes) | number of fences or keys (4 bytes) | crc32 of the index
+//	(4 bytes) | largest sequence number (8 bytes) | SEGF_FOOTER_MAGIC
+#define SEGF_FOOTER_MAGIC "HSST"
+#define SEGF_FOOTER_SZ    28
+
+#define SEGF_SLOT_SZ  8
+#define SEGF_SLOT_DEL 0x80000000U
+
+// Offsets in the index and footer of a sorted or hashed segment file are
+// 32 bits, 31 in a slot, so its records have to end below this. Other
+// segment files have no such limit.
+#define SEGF_MAX_INDEXED_SZ SEGF_SLOT_DEL
+
+
+// v2 record layout:
+//	flags (1 byte) | key (zigzag varint) | val_len (varint) | [seq (varint)]
+//	| [expiry time (varint)] | value | [crc32]
+//
+// The value is stored without its null terminator, readers add it back.
+// The crc32 covers the header and the value. The sequence number orders
+// every put and delete in the database, records written before sequence
+// numbers existed have none and are treated as sequence number 0. A
+// record with an expiry time (seconds since the epoch) is treated as
+// missing once the clock reaches it, see hashDB_put_ttl.
+//
+// A range tombstone deletes every key from its key up to and including
+// the end of the range, its value is the end of the range as a zigzag
+// varint. It covers records of those keys with a smaller sequence number.
+//
+// The records of an atomic batch (see hashDB_txn_commit) are written
+// back to back, every one but the last with REC_BATCH set. A batch whose
+// last record is missing after a crash is dropped as a whole.
+//
+// A merge record (see hashDB_merge_value) holds an operand to apply to
+// the value of its key instead of a value. Its value is the memtable
+// offset of the key's previous record in the same segment file as a
+// varint (0 if the key had none there), the time it was written in
+// seconds since the epoch as a varint, and the operand.
+#define REC_DEL       0x01 // record deletes the key
+#define REC_CHECKSUM  0x02 // record ends with a crc32
+#define REC_SEQ       0x04 // record has a sequence number
+#define REC_RANGE_DEL 0x08 // record deletes a range of keys
+#define REC_BATCH     0x10 // more records of the same atomic batch follow
+#define REC_MERGE     0x20 // record holds a merge operand
+#define REC_TTL       0x40 // record has an expiry time
+
+#define REC_MAX_VARINT_SZ   5  // max bytes of a varint encoded 32 bit integer
+#define REC_MAX_VARINT64_SZ 10 // max bytes of a varint encoded 64 bit integer
+#define REC_MAX_HDR_SZ      (1 + (REC_MAX_VARINT_SZ * 2) + \
+			     (REC_MAX_VARINT64_SZ * 2))
+#define REC_CRC_SZ          4
+
+
+// Decoded header of a v2 record
+struct record_hdr {
+	unsigned char flags;  // REC_* bits
+	int key;              // key of the record
+	unsigned int val_len; // length of the value in bytes
+	uint64_t seq;         // sequence number, 0 if the record has none
+	uint64_t expires;     // expiry time in seconds since the epoch, 0 if
+	                      // the record never expires
+	unsigned int hdr_len; // encoded length of the header in bytes
+};
+
+
+/* Record encoding functions */
+int rec_encode_hdr(char *buf, struct record_hdr *hdr);
+
+int rec_decode_hdr(const char *buf, int len, struct record_hdr *hdr);
+
+unsigned int rec_size(struct record_hdr *hdr);
+
+int rec_encode_range_end(char *buf, int hi);
+
+int rec_decode_range_end(const char *buf, int len, int *hi);
+
+
+/* Varint and checksum helpers */
+int varint_encode(char *buf, uint64_t v);
+
+int varint_decode(const char *buf, int len, uint64_t *v);
+
+int varint_len(uint64_t v);
+
+uint32_t zigzag_encode(int v);
+
+int zigzag_decode(uint32_t v);
+
+uint32_t rec_crc32(uint32_t crc, const char *buf, unsigned int len);
+
+#endif
@@ -4,9 +4,140 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
+#include "ioengine.h"
 #include "segment.h"
 
+// Open descriptors of every segment file, shared by all databases. Files
+// are opened on first use and the least recently used descriptor that is
+// not in use is closed once more than limit are open.
+static struct {
+	pthread_mutex_t lock;
+	int limit;                       // max descriptors kept open
+	int nopen;                       // descriptors open now
+	struct segment_file *lru_head;   // most recently used, not in use
+	struct segment_file *lru_tail;   // least recently used, not in use
+	uint64_t hits;                   // see struct segf_fd_stats
+	uint64_t misses;
+	uint64_t evictions;
+} fd_cache = {PTHREAD_MUTEX_INITIALIZER, SEGF_FD_CACHE_SZ, 0, NULL, NULL,
+	      0, 0, 0};
+
+
+// Rest of a record segf_read_batch reads in its second round
+struct batch_tail {
+	const char *rec;          // the record as the first round read it
+	struct iovec iov[2];      // rest of the value and of the checksum
+	char crc[REC_CRC_SZ];     // checksum of the record
+};
+
+
+// Records of one segment file segf_read_batch reads with one op
+struct batch_run {
+	struct segf_read *reads;  // records of the run
+	struct batch_tail *tails; // tail of every record
+	int n;                    // number of records
+	char *buf;                // what the first round read
+	size_t len;               // bytes the first round reads
+};
+
+/* 'Private' helper functions */
+static int fd_acquire(struct segment_file *);
+
+static void fd_release(struct segment_file *);
+
+static void fd_evict(void);
+
+static void lru_remove(struct segment_file *);
+
+static int segf_write_header(struct segment_file *);
+
+static int segf_read_header(struct segment_file *);
+
+static int repop_memtable_v1(struct segment_file *);
+
+static int repop_memtable_v2(struct segment_file *);
+
+static int index_recs(struct segment_file *, off_t, off_t);
+
+static int index_read(struct segment_file *, struct record_hdr *, off_t);
+
+static int append_v1(struct segment_file *, struct record_hdr *, char *);
+
+static int append_v2(struct segment_file *, struct record_hdr *, char *);
+
+static int index_pair(struct segment_file *, int, uint64_t, char);
+
+static void unindex_pairs(struct segment_file *, struct record_hdr *, int *,
+			  uint64_t *, int);
+
+static void count_expiry(struct segment_file *, struct record_hdr *);
+
+static int read_rec_v1(struct segment_file *, uint64_t,
+		       struct record_hdr *, char **);
+
+static int read_rec_v2(struct segment_file *, uint64_t,
+		       struct record_hdr *, char **);
+
+static int read_batch_v1(struct segf_read *, int, char *, size_t, size_t *);
+
+static int decode_run(struct batch_run *, ssize_t, char *, size_t, size_t *,
+		      struct ioe_op *, int *);
+
+static int finish_record(struct segf_read *, struct batch_tail *);
+
+static int offset_cmp(const void *, const void *);
+
+static int add_range_del(struct segment_file *, int, int, uint64_t);
+
+static int index_rec(struct segment_file *, struct record_hdr *, uint64_t,
+		     const char *);
+
+static int finish_indexed(struct segment_file *, struct segf_cursor *, char *,
+			  unsigned int, int, int);
+
+static int repop_indexed(struct segment_file *);
+
+static int load_fences(struct segment_file *, const char *, unsigned int,
+		       unsigned int);
+
+static int load_hash_index(struct segment_file *, const char *, unsigned int,
+			   unsigned int, unsigned int);
+
+static struct segf_hash_index *hidx_init(unsigned int);
+
+static int hidx_fill(struct segment_file *, struct segf_hash_index *,
+		     const char *);
+
+static void hidx_drop_slots(struct segf_hash_index *);
+
+static void read_slot(const char *, unsigned int, int *, uint32_t *);
+
+static int table_grow(struct segf_table *);
+
+static unsigned int table_slot(struct segf_table *, uint64_t);
+
+static void table_hash(struct segf_table *, int);
+
+static void table_unhash(struct segf_table *, int);
+
+static void table_rehash(struct segf_table *);
+
+static void hidx_free(struct segf_hash_index *);
+
+static int hashed_find(struct segment_file *, int, uint64_t *);
+
+static int load_hashed_entries(struct segf_cursor *);
+
+static int sorted_find(struct segment_file *, int, uint64_t *);
+
+static char *read_block(struct segment_file *, int, unsigned int *,
+			unsigned int *);
+
+static int load_sorted_entries(struct segf_cursor *);
+
 
 /*
  * Allocates and returns a pointer to a segment_file struct. Note, this
@@ -14,7 +145,12 @@
  * for that. For that reason some fields are set to default values:
  *	- size to 0
  *	- seg_fd to -1
- *	- next to null
+ *	- version to SEGF_V2 (the format used for newly created files)
+ *	- sealed to 0
+ *	- max_seq to 0
+ *	- id to 0
+ *	- refs to 1 (held by the caller)
+ *	- no range tombstones, fences or hash index
  *
  * Parameter:
  *	name => name of the segment file to use when its created, this is
@@ -35,13 +171,32 @@ struct segment_file *segf_init(char *name)
 	seg->size = 0;
 	seg->name = name;
 	seg->seg_fd = -1;
-	seg->next_bucket = 0;
+	seg->fd_users = 0;
+	seg->lru_prev = NULL;
+	seg->lru_next = NULL;
+	seg->version = SEGF_V2;
+	seg->flags = SEGF_DEFAULT_FLAGS;
+	seg->sealed = 0;
+	seg->max_seq = 0;
+	seg->id = 0;
+	seg->refs = 1;
+	seg->loaded = 1;
 	if ((seg->table = memtable_init()) == NULL) {
 		free(seg);
 		return NULL;
 	}
-	seg->next_entry = seg->table->table[0];
-	seg->next = NULL;
+	pthread_mutex_init(&seg->load_lock, NULL);
+	seg->range_dels = NULL;
+	seg->nrange_dels = 0;
+	seg->fences = NULL;
+	seg->nfences = 0;
+	seg->hidx = NULL;
+	seg->hits = 0;
+	seg->data_end = 0;
+	seg->nttl = 0;
+	seg->ttl_bytes = 0;
+	seg->ttl_min = 0;
+	seg->ttl_max = 0;
 
 	return seg;
 }
@@ -60,15 +215,53 @@ struct segment_file *segf_init(char *name)
 void segf_free(struct segment_file *seg)
 {
 	memtable_free(seg->table);
+	free(seg->range_dels);
+	free(seg->fences);
+	if (seg->hidx)
+		hidx_free(seg->hidx);
 	free(seg->name);
 	seg->name = NULL;
 	if (seg->seg_fd != -1)
 		segf_close_file(seg);
+	pthread_mutex_destroy(&seg->load_lock);
 	free(seg);
 	seg = NULL;
 }
 
 
+/*
+ * Takes another reference to the segment file struct, it is not freed
+ * until every reference is dropped with segf_unref.
+ *
+ * Parameter:
+ *	seg => segment_file struct to hold on to
+ *
+ * Returns:
+ *	void
+ */
+void segf_ref(struct segment_file *seg)
+{
+	seg->refs += 1;
+}
+
+
+/*
+ * Drops a reference to the segment file struct and frees it once the
+ * last reference is gone.
+ *
+ * Parameter:
+ *	seg => segment_file struct to let go of
+ *
+ * Returns:
+ *	void
+ */
+void segf_unref(struct segment_file *seg)
+{
+	if (--seg->refs == 0)
+		segf_free(seg);
+}
+
+
 /*
  * Adds the key offset pair to the given segment files memtable.
  *
@@ -82,7 +275,7 @@ void segf_free(struct segment_file *seg)
  */
 int segf_update_memtable(struct segment_file *seg, 
 			 int key, 
-			 unsigned int offset)
+			 uint64_t offset)
 {
 	if (memtable_write(seg->table, key, offset) < 0)
 		return -1;
@@ -91,7 +284,11 @@ int segf_update_memtable(struct segment_file *seg,
 
 
 /*
- * Reads the offset from the segment file memtable at the given key.
+ * Reads the offset from the segment file memtable at the given key. Keys
+ * of sorted segment files are not in the memtable, the block that may
+ * hold the key is found through the fence index and read instead. Keys of
+ * hashed segment files are found through their hash index. A segment
+ * file opened with segf_open_lazy is loaded first.
  *
  * Parameters:
  *	seg => container for the segment files memtable
@@ -99,97 +296,398 @@ int segf_update_memtable(struct segment_file *seg,
  *	offset => address of where to store the data's offset if found
  *
  * Returns:
- *	1 if the key and offset were found, 0 otherwise (offset not changed)
+ *	MEMTE_LIVE if the key and offset were found, MEMTE_DELETED if the key
+ *	was deleted (offset is the tombstone), 0 otherwise (offset not changed),
+ *	or -1 if loading the segment file or reading a block of a sorted
+ *	segment file failed (check errno)
  */
 int segf_read_memtable(struct segment_file *seg, 
 		       int key, 
-		       unsigned int *offset)
+		       uint64_t *offset)
 {
+	if (segf_load(seg) < 0)
+		return -1;
+
+	if (seg->flags & SEGF_HDR_SORTED)
+		return sorted_find(seg, key, offset);
+	if (seg->flags & SEGF_HDR_HASHED)
+		return hashed_find(seg, key, offset);
 	return memtable_read(seg->table, key, offset);
 }
 
 
 /*
- * Returns the next key from the segment files memtable.
+ * Moves the index of a hashed segment file out of RAM. The slot table at
+ * the end of the file is mapped and lookups probe it in place, so only
+ * the minimal perfect hash function stays in RAM. Does nothing for other
+ * segment files or if the index is already demoted.
  *
  * Parameter:
- *	seg => pointer to the segment file struct containing the memtable to
- *             read from 
+ *	seg => segment file whose index to demote
  *
  * Returns:
- *	The next key if there is one, or -1 if there are no more keys
+ *	-1 if the slot table can't be mapped (check errno, the index stays
+ *	in RAM), 0 otherwise
  */
-int segf_next_key(struct segment_file *seg)
+int segf_demote_index(struct segment_file *seg)
 {
-	int bucket_idx = seg->next_bucket;
+	struct segf_hash_index  *hidx = seg->hidx;
+	long                    page = sysconf(_SC_PAGESIZE);
+	off_t                   start;
+	size_t                  len;
+	void                    *map;
+
+	if (hidx == NULL || hidx->slots || hidx->n == 0)
+		return 0;
+
+	// mappings start on a page boundary and outlive the descriptor
+	start = hidx->slots_off - hidx->slots_off % page;
+	len = hidx->slots_off - start + (size_t)hidx->n * SEGF_SLOT_SZ;
+	if (fd_acquire(seg) < 0)
+		return -1;
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, seg->seg_fd, start);
+	fd_release(seg);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, len, MADV_RANDOM);
 
-	if (seg->next_entry == NULL) {
-		bucket_idx += 1;
-		while (bucket_idx < MAX_TBL_SZ && !seg->table->table[bucket_idx])
-			bucket_idx += 1;
+	hidx_drop_slots(hidx);
+	hidx->map = map;
+	hidx->map_len = len;
+	hidx->slots = (char *)map + (hidx->slots_off - start);
+	return 0;
+}
 
-		if (bucket_idx == MAX_TBL_SZ) {
-			seg->next_bucket = 0; // reset for future calls
-			seg->next_entry = seg->table->table[0];
-			return -1;
-		}
 
-		// new bucket
-		seg->next_bucket = bucket_idx;
-		seg->next_entry = seg->table->table[bucket_idx];
-	}
+/*
+ * Reads the slot table of a demoted hashed segment file back into RAM and
+ * unmaps it. Does nothing if the index is not demoted.
+ *
+ * Parameter:
+ *	seg => segment file whose index to promote
+ *
+ * Returns:
+ *	-1 if there is an error (check errno, the index stays mapped), 0
+ *	otherwise
+ */
+int segf_promote_index(struct segment_file *seg)
+{
+	struct segf_hash_index *hidx = seg->hidx;
+
+	if (hidx == NULL || hidx->slots == NULL)
+		return 0;
+
+	if (hidx_fill(seg, hidx, hidx->slots) < 0)
+		return -1;
 
-	int key = seg->next_entry->key;
-	seg->next_entry = seg->next_entry->next;	
-	return key;
+	munmap(hidx->map, hidx->map_len);
+	hidx->map = NULL;
+	hidx->map_len = 0;
+	hidx->slots = NULL;
+	return 0;
 }
 
 
 /*
- * Resets the next key members to their inital values. The next call to
- * segf_next_key will then return the first key from the segment files 
- * memtable.
+ * Returns the number of bytes the slots of a hashed segment file take
+ * when its index is in RAM, 0 for other segment files
+ */
+size_t segf_index_mem(struct segment_file *seg)
+{
+	return (seg->hidx) ? seg->hidx->mem : 0;
+}
+
+
+/*
+ * Sets the max number of segment file descriptors kept open. Descriptors
+ * in use are never closed, so more may be open for a while.
  *
- * This only needs to be called in error handling situations.
+ * Parameter:
+ *	limit => max number of open descriptors, at least 1
+ *
+ * Returns:
+ *	void
+ */
+void segf_fd_cache_limit(int limit)
+{
+	pthread_mutex_lock(&fd_cache.lock);
+	fd_cache.limit = (limit > 0) ? limit : 1;
+	fd_evict();
+	pthread_mutex_unlock(&fd_cache.lock);
+}
+
+
+/*
+ * Reads the counters of the descriptor cache. The hit rate is
+ * hits / (hits + misses), every file opened counts as a miss.
  *
  * Parameter:
- *	seg => pointer to segment file struct to reset
+ *	stats => where to store the counters
  *
  * Returns:
  *	void
  */
-void segf_reset_next_key(struct segment_file *seg)
+void segf_fd_cache_stats(struct segf_fd_stats *stats)
+{
+	pthread_mutex_lock(&fd_cache.lock);
+	stats->hits = fd_cache.hits;
+	stats->misses = fd_cache.misses;
+	stats->evictions = fd_cache.evictions;
+	stats->open = fd_cache.nopen;
+	stats->limit = fd_cache.limit;
+	pthread_mutex_unlock(&fd_cache.lock);
+}
+
+
+/*
+ * Makes sure seg->seg_fd is open, reopening the file if the cache closed
+ * it, and keeps it open until fd_release. Every call must be paired with
+ * a call to fd_release.
+ *
+ * Returns:
+ *	-1 if the file can't be opened (check errno), 0 otherwise
+ */
+static int fd_acquire(struct segment_file *seg)
+{
+	int fd;
+
+	pthread_mutex_lock(&fd_cache.lock);
+	if (seg->seg_fd == -1) {
+		if ((fd = open(seg->name, O_RDWR)) < 0) {
+			pthread_mutex_unlock(&fd_cache.lock);
+			return -1;
+		}
+		seg->seg_fd = fd;
+		fd_cache.nopen += 1;
+		fd_cache.misses += 1;
+	} else {
+		if (seg->fd_users == 0)
+			lru_remove(seg);
+		fd_cache.hits += 1;
+	}
+
+	seg->fd_users += 1;
+	fd_evict();
+	pthread_mutex_unlock(&fd_cache.lock);
+	return 0;
+}
+
+
+/*
+ * Gives back the descriptor taken by fd_acquire. Once no one uses it, it
+ * goes to the front of the LRU list.
+ */
+static void fd_release(struct segment_file *seg)
+{
+	pthread_mutex_lock(&fd_cache.lock);
+	if (--seg->fd_users == 0 && seg->seg_fd != -1) {
+		seg->lru_prev = NULL;
+		seg->lru_next = fd_cache.lru_head;
+		if (fd_cache.lru_head)
+			fd_cache.lru_head->lru_prev = seg;
+		else
+			fd_cache.lru_tail = seg;
+		fd_cache.lru_head = seg;
+		fd_evict();
+	}
+	pthread_mutex_unlock(&fd_cache.lock);
+}
+
+
+/*
+ * Closes the least recently used descriptors until no more than the
+ * limit are open or none are left unused. fd_cache.lock must be held.
+ */
+static void fd_evict(void)
+{
+	struct segment_file *seg;
+
+	while (fd_cache.nopen > fd_cache.limit && fd_cache.lru_tail) {
+		seg = fd_cache.lru_tail;
+		lru_remove(seg);
+		close(seg->seg_fd);
+		seg->seg_fd = -1;
+		fd_cache.nopen -= 1;
+		fd_cache.evictions += 1;
+	}
+}
+
+
+/*
+ * Takes the segment file out of the LRU list. fd_cache.lock must be held.
+ */
+static void lru_remove(struct segment_file *seg)
 {
-	seg->next_bucket = 0;	
-	seg->next_entry = seg->table->table[0];
+	if (seg->lru_prev)
+		seg->lru_prev->lru_next = seg->lru_next;
+	else
+		fd_cache.lru_head = seg->lru_next;
+
+	if (seg->lru_next)
+		seg->lru_next->lru_prev = seg->lru_prev;
+	else
+		fd_cache.lru_tail = seg->lru_prev;
+
+	seg->lru_prev = seg->lru_next = NULL;
 }
 
 
 /*
  * Opens the segment file identified by seg->name. Sets the given segment
- * file structs seg_fd field to the return file descriptor.
+ * file structs seg_fd field to the return file descriptor. The file
+ * header is read to detect the format version of the file, empty files
+ * are given a v2 header.
  *
  * Parameter:
  *	seg => segment file to open and assign the file descriptor
  *
  * Returns:
- *	-1 if the file can't be opened, 0 if successful
+ *	-1 if the file can't be opened or has an unknown format, 0 if
+ *	successful
  */
 int segf_open_file(struct segment_file *seg)
 {
-	int fd;
+	int res;
+
+	if (fd_acquire(seg) < 0)
+		return -1;
+
+	res = segf_read_header(seg);
+	fd_release(seg);
+	if (res < 0)
+		segf_close_file(seg);
+	return res;
+}
+
+
+/*
+ * Opens the segment file like segf_open_file, but only its header is
+ * read. The memtable or index is loaded by segf_load, which
+ * segf_read_memtable and segf_cursor_init call on their own. Until then
+ * only the name, size, version, and flags of the segment file are known.
+ *
+ * Parameter:
+ *	seg => segment file to open
+ *
+ * Returns:
+ *	-1 if the file can't be opened or has an unknown format, 0 if
+ *	successful
+ */
+int segf_open_lazy(struct segment_file *seg)
+{
+	off_t end;
+
+	if (fd_acquire(seg) < 0)
+		return -1;
+
+	if (segf_read_header(seg) < 0 ||
+	    (end = lseek(seg->seg_fd, 0, SEEK_END)) < 0) {
+		fd_release(seg);
+		segf_close_file(seg);
+		return -1;
+	}
+	fd_release(seg);
+
+	seg->size = end;
+	seg->loaded = 0;
+	return 0;
+}
+
+
+/*
+ * Sets up the segment file like segf_open_lazy, but from what is already
+ * known about it instead of reading the file. Nothing is opened until the
+ * segment file is loaded.
+ *
+ * Parameters:
+ *	seg => segment file to set up
+ *	version => on disk format of the segment file
+ *	flags => SEGF_HDR_* flags from its header
+ *	size => size in bytes of the segment file
+ *
+ * Returns:
+ *	void
+ */
+void segf_open_known(struct segment_file *seg, int version,
+		     unsigned char flags, uint64_t size)
+{
+	seg->version = version;
+	seg->flags = flags;
+	seg->size = size;
+	seg->loaded = 0;
+}
+
+
+/*
+ * Reads the header of the open segment file and sets the version and
+ * flags fields of the segment file struct. Files that do not start with
+ * SEGF_MAGIC are v1 files. Empty files have a v2 header written to them.
+ *
+ * Parameter:
+ *	seg => open segment file
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 otherwise
+ */
+static int segf_read_header(struct segment_file *seg)
+{
+	char  hdr[SEGF_HDR_SZ];
+	int   n;
 
-	if ((fd = open(seg->name, O_RDWR)) < 0)
+	if ((n = pread(seg->seg_fd, hdr, SEGF_HDR_SZ, 0)) < 0)
 		return -1;
 
-	seg->seg_fd = fd;
+	if (n == 0) // empty file, nothing to stay compatible with
+		return segf_write_header(seg);
+
+	if (n < SEGF_HDR_SZ || memcmp(hdr, SEGF_MAGIC, SEGF_MAGIC_LEN) != 0) {
+		seg->version = SEGF_V1;
+		seg->flags = 0;
+		return 0;
+	}
+
+	if (hdr[SEGF_MAGIC_LEN] != SEGF_V2) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	seg->version = hdr[SEGF_MAGIC_LEN];
+	seg->flags = hdr[SEGF_MAGIC_LEN + 1];
+	return 0;
+}
+
+
+/*
+ * Writes a v2 header with the flags in seg->flags to the start of the
+ * segment file. The file must be empty.
+ *
+ * Parameter:
+ *	seg => open segment file
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 otherwise
+ */
+static int segf_write_header(struct segment_file *seg)
+{
+	char hdr[SEGF_HDR_SZ];
+
+	memset(hdr, 0, SEGF_HDR_SZ);
+	memcpy(hdr, SEGF_MAGIC, SEGF_MAGIC_LEN);
+	hdr[SEGF_MAGIC_LEN] = SEGF_V2;
+	hdr[SEGF_MAGIC_LEN + 1] = seg->flags;
+
+	if (pwrite(seg->seg_fd, hdr, SEGF_HDR_SZ, 0) != SEGF_HDR_SZ)
+		return -1;
+
+	seg->version = SEGF_V2;
+	seg->size = SEGF_HDR_SZ;
 	return 0;
 }
 
 
 /*
  * Closes the given segment file. Does not free the segment file struct, but
- * sets seg_fd = -1.
+ * sets seg_fd = -1. No one may be using the descriptor.
  *
  * Parameter:
  *	seg => pointer to the segment file struct to close
@@ -199,14 +697,24 @@ int segf_open_file(struct segment_file *seg)
  */
 void segf_close_file(struct segment_file *seg)
 {
-	close(seg->seg_fd);
+	pthread_mutex_lock(&fd_cache.lock);
+	if (seg->seg_fd != -1) {
+		if (seg->fd_users == 0)
+			lru_remove(seg);
+		close(seg->seg_fd);
+		fd_cache.nopen -= 1;
+	}
 	seg->seg_fd = -1;
+	seg->fd_users = 0;
+	pthread_mutex_unlock(&fd_cache.lock);
 }
 
 
 /*
  * Creates a new segment file with the name seg->name. The file is opened
  * for read and write operations. The file descriptor is set in seg->seg_fd.
+ * New segment files are always v2 files, their header is written with the
+ * flags in seg->flags.
  *
  * Parameter:
  *	seg => pointer to a segment_file struct that contains the name of the
@@ -217,13 +725,20 @@ void segf_close_file(struct segment_file *seg)
  */
 int segf_create_file(struct segment_file *seg)
 {
-	int fd;
+	int fd, res;
 
 	if ((fd = open(seg->name, O_CREAT|O_TRUNC|O_RDWR, 0664)) < 0)
 		return -1;
+	close(fd);
 
-	seg->seg_fd = fd;
-	return 0;	
+	if (fd_acquire(seg) < 0)
+		return -1;
+
+	res = segf_write_header(seg);
+	fd_release(seg);
+	if (res < 0)
+		segf_close_file(seg);
+	return res;
 }
 
 
@@ -240,8 +755,7 @@ int segf_create_file(struct segment_file *seg)
  */
 int segf_delete_file(struct segment_file *seg)
 {
-	close(seg->seg_fd);
-	seg->seg_fd = -1;
+	segf_close_file(seg);
 
 	if (remove(seg->name) < 0)
 		return -1;
@@ -251,6 +765,35 @@ int segf_delete_file(struct segment_file *seg)
 }
 
 
+/*
+ * Removes the segment file backing the given struct from the file system
+ * but leaves it open, so anyone still holding a reference to the struct
+ * (a snapshot) can keep reading it. The space is given back once the last
+ * reference is dropped and the file is closed.
+ *
+ * Parameter:
+ *	seg => segment file that is no longer part of the database
+ *
+ * Returns:
+ *	0 if successful, -1 if there was an error (check errno)
+ */
+int segf_retire_file(struct segment_file *seg)
+{
+	// the file can't be opened again once it is removed, it stays open
+	// until segf_free closes it
+	if (fd_acquire(seg) < 0)
+		return -1;
+
+	if (remove(seg->name) < 0) {
+		fd_release(seg);
+		return -1;
+	}
+
+	seg->sealed = 1;
+	return 0;
+}
+
+
 /*
  * Changes the given segment files name to the given string. This function
  * changes seg->name string and the name of the backing segment file.
@@ -269,9 +812,11 @@ int segf_rename_file(struct segment_file *seg, char *name)
 	int   name_len = strlen(name);
 
 	// Update in memory segment file name
-	if ((new_name = calloc(name_len, sizeof(char))) == NULL)
+	if ((new_name = calloc(name_len + 1, sizeof(char))) == NULL)
 		return -1;
 
+	// the descriptor cache reopens files by name
+	pthread_mutex_lock(&fd_cache.lock);
 	old_name = seg->name;
 	strncpy(new_name, name, name_len);
 	seg->name = new_name;
@@ -279,9 +824,11 @@ int segf_rename_file(struct segment_file *seg, char *name)
 	// Change segment file name in file system
 	if (rename(old_name, new_name) < 0) {
 		seg->name = old_name;		
+		pthread_mutex_unlock(&fd_cache.lock);
 		free(new_name);
 		return -1;
 	}
+	pthread_mutex_unlock(&fd_cache.lock);
 	
 	//free(old_name);
 	return 0;	
@@ -290,7 +837,9 @@ int segf_rename_file(struct segment_file *seg, char *name)
 
 /*
  * Reads the segment file associated with the given segment file struct
- * and repopulate its memtable with all keys and their value offsets.
+ * and repopulate its memtable with all keys and their value offsets. For
+ * sorted and hashed segment files only their index and range tombstones
+ * are loaded, and the segment file is sealed.
  *
  * Parameter:
  *	seg => segment file struct to repopulate
@@ -300,33 +849,110 @@ int segf_rename_file(struct segment_file *seg, char *name)
  */
 int segf_repop_memtable(struct segment_file *seg)
 {
-	unsigned int  offset;
-	int           key, key_len, val_len, n, pair_deleted;
-	char          tombstone;
+	int res;
 
-	// seek to the front of the file
-	if (lseek(seg->seg_fd, 0, SEEK_SET) < 0)
+	if (fd_acquire(seg) < 0)
 		return -1;
 
-	tombstone = 0;
-	pair_deleted = 0;
-	while (1) {
-		if ((offset = lseek(seg->seg_fd, 0, SEEK_CUR)) < 0)
-			return -1;
-
-		if ((n = read(seg->seg_fd, &tombstone, sizeof(tombstone))) < 0)
-			return -1;
-
-		if (tombstone == TOMBSTONE_DEL)
-			pair_deleted = 1;
+	if (seg->flags & SEGF_HDR_INDEXED)
+		res = repop_indexed(seg);
+	else if (seg->version == SEGF_V1)
+		res = repop_memtable_v1(seg);
+	else
+		res = repop_memtable_v2(seg);
+	fd_release(seg);
 
-		if (n == 0) // EOF
-			break;
+	if (res == 0) // pairs with the check in segf_loaded
+		__atomic_store_n(&seg->loaded, 1, __ATOMIC_RELEASE);
+	return res;
+}
 
-		if ((n = read(seg->seg_fd, &val_len, sizeof(val_len))) < 0)
-			return -1;
 
-		if (lseek(seg->seg_fd, val_len, SEEK_CUR) < 0)
+/*
+ * Repopulates the memtable of a segment file opened with segf_open_lazy,
+ * unless that has been done already. Safe to call from several threads,
+ * the first call loads and the others wait for it.
+ *
+ * Parameter:
+ *	seg => segment file to load
+ *
+ * Returns:
+ *	-1 if there is an error (check errno, the segment file stays
+ *	unloaded), 0 otherwise
+ */
+int segf_load(struct segment_file *seg)
+{
+	int res = 0;
+
+	if (segf_loaded(seg))
+		return 0;
+
+	pthread_mutex_lock(&seg->load_lock);
+	if (!seg->loaded)
+		res = segf_repop_memtable(seg);
+	pthread_mutex_unlock(&seg->load_lock);
+	return res;
+}
+
+
+/*
+ * Returns 1 if the memtable or index of the segment file has been loaded,
+ * after which it can be read without segf_load, 0 otherwise
+ */
+int segf_loaded(struct segment_file *seg)
+{
+	return __atomic_load_n(&seg->loaded, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Returns the size of the segment file. Loading may change the size of
+ * an unloaded segment file (see repop_memtable_v2), so it is read under
+ * the load lock, which waits for a load in progress on another thread.
+ */
+uint64_t segf_size(struct segment_file *seg)
+{
+	uint64_t size;
+
+	if (segf_loaded(seg))
+		return seg->size;
+
+	pthread_mutex_lock(&seg->load_lock);
+	size = seg->size;
+	pthread_mutex_unlock(&seg->load_lock);
+	return size;
+}
+
+
+/*
+ * Repopulates the memtable from a v1 segment file. Memtable offsets point
+ * at the value length of each key value pair.
+ */
+static int repop_memtable_v1(struct segment_file *seg)
+{
+	off_t         offset;
+	int           key, key_len, val_len, n;
+	char          tombstone;
+
+	// seek to the front of the file
+	if (lseek(seg->seg_fd, 0, SEEK_SET) < 0)
+		return -1;
+
+	tombstone = 0;
+	while (1) {
+		if ((offset = lseek(seg->seg_fd, 0, SEEK_CUR)) < 0)
+			return -1;
+
+		if ((n = read(seg->seg_fd, &tombstone, sizeof(tombstone))) < 0)
+			return -1;
+
+		if (n == 0) // EOF
+			break;
+
+		if ((n = read(seg->seg_fd, &val_len, sizeof(val_len))) < 0)
+			return -1;
+
+		if (lseek(seg->seg_fd, val_len, SEEK_CUR) < 0)
 			return -1;
 
 		if (read(seg->seg_fd, &key_len, sizeof(key_len)) < 0)
@@ -335,61 +961,169 @@ int segf_repop_memtable(struct segment_file *seg)
 		if (read(seg->seg_fd, &key, key_len) < 0)
 			return -1;
 
-		if (pair_deleted) {
-			// remove the pair from the memtable if it was
-			// previously added
-			memtable_remove(seg->table, key);
-			continue; // skip this pair, its been deleted
+		offset += sizeof(tombstone);
+		if (index_pair(seg, key, offset, tombstone) < 0)
+			return -1;
+	}
+
+	seg->size = offset;
+	return 0;
+}
+
+
+/*
+ * Repopulates the memtable from a v2 segment file. Memtable offsets point
+ * at the start of each record. A record cut short by a crash while it was
+ * being appended is truncated off the end of the file, along with the
+ * rest of its atomic batch. Only the last record can have been cut short,
+ * its header runs into the end of the file or its value runs past it. A
+ * header that does not decode with more bytes after it, or a record cut
+ * short in a sealed segment file, which is never appended to, makes the
+ * segment file corrupt (errno is EIO) and nothing is truncated.
+ */
+static int repop_memtable_v2(struct segment_file *seg)
+{
+	struct record_hdr  hdr;
+	off_t              offset = SEGF_HDR_SZ, batch = -1;
+	char               buf[REC_MAX_HDR_SZ];
+	int                n;
+	off_t              end;
+
+	if ((end = lseek(seg->seg_fd, 0, SEEK_END)) < 0)
+		return -1;
+
+	while (offset < end) {
+		if ((n = pread(seg->seg_fd, buf, REC_MAX_HDR_SZ, offset)) < 0)
+			return -1;
+
+		if (rec_decode_hdr(buf, n, &hdr) < 0) {
+			if (n == REC_MAX_HDR_SZ)
+				goto corrupt;
+			break;
 		}
+		if (offset + rec_size(&hdr) > end)
+			break;
 
-		offset += sizeof(tombstone);
-		if (segf_update_memtable(seg, key, offset) < 0)
+		// records of an atomic batch are indexed once its last one
+		// turns up
+		if (hdr.flags & REC_BATCH) {
+			if (batch < 0)
+				batch = offset;
+		} else if (batch >= 0) {
+			if (index_recs(seg, batch, offset + rec_size(&hdr)) < 0)
+				return -1;
+			batch = -1;
+		} else if (index_read(seg, &hdr, offset) < 0) {
 			return -1;
+		}
+
+		offset += rec_size(&hdr);
+	}
 
-		pair_deleted = 0;
+	if (batch >= 0)
+		offset = batch;
+	if (offset < end) {
+		if (seg->sealed)
+			goto corrupt;
+		if (ftruncate(seg->seg_fd, offset) < 0)
+			return -1;
 	}
 
 	seg->size = offset;
 	return 0;
+
+corrupt:
+	errno = EIO;
+	return -1;
+}
+
+
+/*
+ * Indexes the records of a v2 segment file from offset from up to offset
+ * to, see index_read
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 otherwise
+ */
+static int index_recs(struct segment_file *seg, off_t from, off_t to)
+{
+	struct record_hdr  hdr;
+	char               buf[REC_MAX_HDR_SZ];
+	int                n;
+
+	while (from < to) {
+		if ((n = pread(seg->seg_fd, buf, REC_MAX_HDR_SZ, from)) < 0)
+			return -1;
+		if (rec_decode_hdr(buf, n, &hdr) < 0) {
+			errno = EIO;
+			return -1;
+		}
+		if (index_read(seg, &hdr, from) < 0)
+			return -1;
+		from += rec_size(&hdr);
+	}
+	return 0;
+}
+
+
+/*
+ * Indexes a v2 record read back in from the segment file, reading the
+ * value of a range tombstone first
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 otherwise
+ */
+static int index_read(struct segment_file *seg, struct record_hdr *hdr,
+		      off_t offset)
+{
+	char  buf[REC_MAX_VARINT_SZ];
+	int   n;
+
+	if (hdr->flags & REC_RANGE_DEL) { // value is needed, it is short
+		if (hdr->val_len > REC_MAX_VARINT_SZ) {
+			errno = EIO;
+			return -1;
+		}
+		n = pread(seg->seg_fd, buf, hdr->val_len, offset + hdr->hdr_len);
+		if (n < 0)
+			return -1;
+	}
+
+	if (index_rec(seg, hdr, offset, buf) < 0)
+		return -1;
+
+	if (hdr->seq > seg->max_seq)
+		seg->max_seq = hdr->seq;
+	return 0;
 }
 
 
 /*
- * Removes a key value pair from the memtable and segment file.
+ * Removes a key value pair from the segment file by appending a tombstone
+ * for the key. The tombstone only holds the key, the value is not read or
+ * written again. The key stays in the memtable marked as deleted so that
+ * it shadows older segment files.
  *
  * Parameters:
  *	seg => represents the segment file to remove from
  *	key => identifies the kv pair to remove
  *
  * Returns:
- *	-1 if there is an error (check errno), 0 if the key was not found,
- *	or 1 if the kv pair was removed
+ *	-1 if there is an error (check errno), 0 if the key was not found
+ *	or was already deleted, or 1 if the kv pair was removed
  *
  *	Note, if there is an error the memtable is left unchanged
  */
 int segf_remove_pair(struct segment_file *seg, int key)
 {
-	unsigned int  offset;
-	char          *val;
-	int           err;
-
-	// look up the offset
-	if (segf_read_memtable(seg, key, &offset) == 0)
-		return 0; // key not found
+	uint64_t      offset;
+	int           res;
 
-	// look up value
-	if ((err = segf_read_file(seg, key, &val)) != 1)
-		return err;
+	if ((res = segf_read_memtable(seg, key, &offset)) != MEMTE_LIVE)
+		return (res < 0) ? -1 : 0; // key not found
 
-	// remove from memtable, don't need to check if the key was found
-	// because segf_read_memtable already did
-	err = memtable_remove(seg->table, key);
-
-	if (segf_append(seg, key, val, TOMBSTONE_DEL) < 0) {
-		// put the kv pair back in the memtable!!
-		segf_update_memtable(seg, key, offset);
+	if (segf_append(seg, key, NULL, TOMBSTONE_DEL) < 0)
 		return -1;
-	}
 
 	return 1;
 }
@@ -397,28 +1131,105 @@ int segf_remove_pair(struct segment_file *seg, int key)
 
 /*
  * Appends the given key value pair to the segment file. This will also
- * add the key and the values offset in the file to the memtable.
+ * add the key and the values offset in the file to the memtable. The pair
+ * is written without a sequence number, see segf_append_rec.
  *
  * Parameters:
  *	seg => pointer to a segment_file that contains the name of the
  *             segment file and the memtable to add to
  *	key => key to add to the file and memtable
- *	val => value to add to the file and memtable
+ *	val => value to add to the file and memtable, ignored (and may be
+ *	       NULL) when appending a tombstone
  *	tombstone => byte of metadata associated with key value pair, as of
  *	             now all it does is indicate if the kv pair is being
- *	             deleted. 1 if it is 0 if not.
+ *	             deleted. 1 if it is 0 if not. Deletes are written as
+ *	             tombstone only records without a value.
  *
  * Returns:
- *	-1 if there is an error (check errno), 0 otherwise
+ *	-1 if there is an error (check errno), 0 otherwise. If there is an
+ *	error the memtable is left unchanged.
  */
 int segf_append(struct segment_file *seg, int key, char *val, char tombstone)
 {
-	unsigned int  offset;
+	struct record_hdr hdr;
+
+	hdr.flags = (tombstone == TOMBSTONE_DEL) ? REC_DEL : 0;
+	hdr.key = key;
+	hdr.seq = 0;
+	hdr.expires = 0;
+	return segf_append_rec(seg, &hdr, val);
+}
+
+
+/*
+ * Appends a record to the segment file and points the keys memtable entry
+ * at it. Sealed segment files are never appended to.
+ *
+ * Parameters:
+ *	seg => segment file to append to
+ *	hdr => describes the record, only the REC_DEL, REC_RANGE_DEL, and
+ *	       REC_MERGE flags, the key, the sequence number (0 for none), and
+ *	       the expiry time (0 for none) are used. val_len is set from val
+ *	       unless the record is a range tombstone or a merge record.
+ *	val => value of the record, ignored (and may be NULL) if the record
+ *	       is a tombstone. The value of a range tombstone is written by
+ *	       rec_encode_range_end, the value of a merge record is laid out
+ *	       as described in record.h, hdr->val_len must be their length.
+ *
+ * Returns:
+ *	-1 if there is an error (check errno, EPERM if seg is sealed, EINVAL
+ *	for a range tombstone, merge record, or expiry time in a v1 file), 0
+ *	otherwise. If there is an error the memtable is left unchanged.
+ */
+int segf_append_rec(struct segment_file *seg, struct record_hdr *hdr,
+		    char *val)
+{
+	int res;
+
+	if (seg->sealed) {
+		errno = EPERM;
+		return -1;
+	}
+
+	hdr->flags &= (REC_DEL | REC_RANGE_DEL | REC_MERGE);
+	if (hdr->flags & REC_DEL)
+		hdr->val_len = 0;
+	else if (!(hdr->flags & (REC_RANGE_DEL | REC_MERGE)))
+		hdr->val_len = strlen(val);
+
+	if (seg->version == SEGF_V1 &&
+	    ((hdr->flags & (REC_RANGE_DEL | REC_MERGE)) || hdr->expires)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fd_acquire(seg) < 0)
+		return -1;
+
+	res = (seg->version == SEGF_V1) ? append_v1(seg, hdr, val)
+					: append_v2(seg, hdr, val);
+	fd_release(seg);
+	return res;
+}
+
+
+/*
+ * Appends a key value pair to a v1 segment file, see segf_append_rec. v1
+ * files have no room for sequence numbers.
+ */
+static int append_v1(struct segment_file *seg, struct record_hdr *hdr,
+		     char *val)
+{
+	off_t         offset;
 	unsigned int  kv_pair_sz = 0;
-	int           val_len, key_len, buf_offset;
-	char          *buf;
+	int           key, val_len, key_len, buf_offset;
+	char          *buf, tombstone;
+
+	tombstone = (hdr->flags & REC_DEL) ? TOMBSTONE_DEL : TOMBSTONE_INS;
+	key = hdr->key;
 
-	val_len = strlen(val) + 1; // include null char
+	// tombstones are written with an empty value
+	val_len = (tombstone == TOMBSTONE_DEL) ? 0 : hdr->val_len + 1;
 	key_len = sizeof(key);
 	kv_pair_sz = sizeof(tombstone) + sizeof(val_len) 
 			+ val_len + (key_len * 2);
@@ -458,115 +1269,2000 @@ int segf_append(struct segment_file *seg, int key, char *val, char tombstone)
 
 	offset += sizeof(tombstone); // skip to offset of value length
 
-	// add key and offset to the memtable if not deleting
-	if (tombstone == TOMBSTONE_INS) {
-		if (segf_update_memtable(seg, key, offset) < 0) {
-			free(buf);
-			return -1;
-		}
-	}
-
 	// handle event where write return n < kv_pair_sz
 	if (write(seg->seg_fd, buf, kv_pair_sz) < 0) {
-		if (tombstone == TOMBSTONE_INS)
-			memtable_remove(seg->table, key);
 		free(buf);
 		return -1;
 	}
+	free(buf);
 
 	// update the size field
 	seg->size += kv_pair_sz;
 
+	return index_pair(seg, key, offset, tombstone);
+}
+
+
+/*
+ * Appends a record to a v2 segment file, see segf_append_rec. The
+ * memtable offset of the key is the start of the record.
+ */
+static int append_v2(struct segment_file *seg, struct record_hdr *hdr,
+		     char *val)
+{
+	unsigned int  kv_pair_sz;
+	char          *buf;
+	int           n;
+	off_t         end;
+
+	if (hdr->seq)
+		hdr->flags |= REC_SEQ;
+	if (hdr->expires)
+		hdr->flags |= REC_TTL;
+	if (seg->flags & SEGF_HDR_CHECKSUM)
+		hdr->flags |= REC_CHECKSUM;
+	kv_pair_sz = rec_size(hdr);
+
+	if ((buf = malloc(kv_pair_sz * sizeof(char))) == NULL)
+		return -1;
+
+	n = rec_encode_hdr(buf, hdr);
+	if (hdr->val_len)
+		memcpy(buf + n, val, hdr->val_len);
+	n += hdr->val_len;
+
+	if (hdr->flags & REC_CHECKSUM) {
+		uint32_t crc = rec_crc32(0, buf, n);
+		memcpy(buf + n, &crc, sizeof(crc));
+	}
+
+	if ((end = lseek(seg->seg_fd, 0, SEEK_END)) < 0) {
+		free(buf);
+		return -1;
+	}
+
+	if (write(seg->seg_fd, buf, kv_pair_sz) < 0) {
+		free(buf);
+		return -1;
+	}
 	free(buf);
-	return 0;
+
+	seg->size += kv_pair_sz;
+	if (hdr->seq > seg->max_seq)
+		seg->max_seq = hdr->seq;
+
+	return index_rec(seg, hdr, end, val);
 }
 
 
 /*
- * Reads the value using the key from the segment file
+ * Appends key value pairs to the segment file with one writev and points
+ * the memtable entries of their keys at them. The records are laid out as
+ * segf_append_rec would have written them one by one. v1 segment files
+ * are appended to one record at a time, an error there takes the records
+ * before it back off the file.
  *
  * Parameters:
- *	seg => pointer a segment_file struct that contains the name of
- *             segment file to read
- *	key => used to look up the value in segment files memtable
- *	val => stores the value read from the segment file
+ *	seg => segment file to append to
+ *	hdrs => describe the records, as for segf_append_rec, tombstones can
+ *	        not be batched. REC_BATCH is kept, set it on every record but
+ *	        the last to make them one atomic batch (v2 files only).
+ *	vals => values of the records
+ *	n => number of records, at most SEGF_APPEND_BATCH
  *
  * Returns:
- *	-1 if there is an error (check errno), 0 if the key was not found,
- *	or 1 if the key was found
+ *	-1 if there is an error (check errno, EINVAL for a tombstone, too
+ *	many records, or an atomic batch in a v1 file), 0 otherwise. If there
+ *	is an error no record is added to the file or the memtable.
  */
-int segf_read_file(struct segment_file *seg, int key, char **val)
+int segf_append_batch(struct segment_file *seg, struct record_hdr *hdrs,
+		      char **vals, int n)
 {
-	unsigned int offset;	
+	struct iovec  iov[SEGF_APPEND_BATCH * 3];
+	char          hdr_bufs[SEGF_APPEND_BATCH][REC_MAX_HDR_SZ];
+	uint32_t      crcs[SEGF_APPEND_BATCH];
+	uint64_t      prev_offs[SEGF_APPEND_BATCH];
+	int           prev[SEGF_APPEND_BATCH];
+	uint64_t      total = 0, offset, start;
+	off_t         end;
+	ssize_t       res;
+	int           i, h, err, niov = 0;
+
+	if (n > SEGF_APPEND_BATCH) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < n; ++i) {
+		if ((hdrs[i].flags & (REC_DEL | REC_RANGE_DEL)) ||
+		    (seg->version == SEGF_V1 && (hdrs[i].flags & REC_BATCH))) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
 
-	if (memtable_read(seg->table, key, &offset) == 0)
-		return 0; // key not found
-	
-	if (lseek(seg->seg_fd, offset, SEEK_SET) < 0)
+	if (seg->sealed) {
+		errno = EPERM;
+		return -1;
+	}
+
+	// what the memtable held for the keys, put back if the append fails
+	for (i = 0; i < n; ++i)
+		prev[i] = memtable_read(seg->table, hdrs[i].key, &prev_offs[i]);
+
+	if (seg->version == SEGF_V1) {
+		start = seg->size;
+		for (i = 0; i < n; ++i) {
+			if (segf_append_rec(seg, &hdrs[i], vals[i]) == 0)
+				continue;
+
+			err = errno;
+			if (fd_acquire(seg) < 0)
+				return -1;
+			if (ftruncate(seg->seg_fd, start) < 0) {
+				fd_release(seg);
+				return -1;
+			}
+			fd_release(seg);
+			seg->size = start;
+			unindex_pairs(seg, hdrs, prev, prev_offs, n);
+			errno = err;
+			return -1;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < n; ++i) {
+		hdrs[i].flags &= REC_BATCH;
+		if (hdrs[i].seq)
+			hdrs[i].flags |= REC_SEQ;
+		if (hdrs[i].expires)
+			hdrs[i].flags |= REC_TTL;
+		if (seg->flags & SEGF_HDR_CHECKSUM)
+			hdrs[i].flags |= REC_CHECKSUM;
+		hdrs[i].val_len = strlen(vals[i]);
+
+		h = rec_encode_hdr(hdr_bufs[i], &hdrs[i]);
+		iov[niov++] = (struct iovec){hdr_bufs[i], h};
+		if (hdrs[i].val_len)
+			iov[niov++] = (struct iovec){vals[i], hdrs[i].val_len};
+		if (hdrs[i].flags & REC_CHECKSUM) {
+			crcs[i] = rec_crc32(rec_crc32(0, hdr_bufs[i], h), vals[i],
+					    hdrs[i].val_len);
+			iov[niov++] = (struct iovec){&crcs[i], sizeof(crcs[i])};
+		}
+		total += rec_size(&hdrs[i]);
+	}
+
+	if (fd_acquire(seg) < 0)
 		return -1;
 
-	int val_len = 0;
-	if (read(seg->seg_fd, &val_len, sizeof(val_len)) < 0)
+	if ((end = lseek(seg->seg_fd, 0, SEEK_END)) < 0) {
+		fd_release(seg);
 		return -1;
+	}
+
+	// index first so nothing is left to fail once the records are written
+	for (i = 0, offset = end; i < n; offset += rec_size(&hdrs[i++])) {
+		if (index_pair(seg, hdrs[i].key, offset, TOMBSTONE_INS) < 0) {
+			fd_release(seg);
+			unindex_pairs(seg, hdrs, prev, prev_offs, i);
+			return -1;
+		}
+	}
 
-	char *v;
-	if ((v = calloc(val_len, sizeof(char))) == NULL)
+	if ((res = writev(seg->seg_fd, iov, niov)) < 0) {
+		err = errno;
+		fd_release(seg);
+		unindex_pairs(seg, hdrs, prev, prev_offs, n);
+		errno = err;
 		return -1;
+	}
 
-	if (read(seg->seg_fd, v, val_len) < 0) {
-		free(v);
+	// a short write leaves part of the batch, take it back off
+	if ((uint64_t)res != total) {
+		err = (ftruncate(seg->seg_fd, end) == 0) ? EIO : errno;
+		fd_release(seg);
+		unindex_pairs(seg, hdrs, prev, prev_offs, n);
+		errno = err;
 		return -1;
 	}
-	
-	*val = v;
-	return 1;
+	fd_release(seg);
+
+	seg->size += total;
+	for (i = 0; i < n; ++i) {
+		if (hdrs[i].seq > seg->max_seq)
+			seg->max_seq = hdrs[i].seq;
+		count_expiry(seg, &hdrs[i]);
+	}
+	return 0;
+}
+
+
+/*
+ * Puts back the memtable entries a failed segf_append_batch overwrote.
+ * Entries are only put back for keys that were in the memtable before,
+ * which never needs memory.
+ *
+ * Parameters:
+ *	seg => segment file the batch was appended to
+ *	hdrs => headers of the records in the batch
+ *	prev => memtable_read result for each key before the batch
+ *	prev_offs => memtable offset of each key before the batch
+ *	n => number of records that were indexed
+ */
+static void unindex_pairs(struct segment_file *seg, struct record_hdr *hdrs,
+			  int *prev, uint64_t *prev_offs, int n)
+{
+	int i;
+
+	for (i = n - 1; i >= 0; --i) {
+		if (prev[i] == MEMTE_LIVE)
+			memtable_write(seg->table, hdrs[i].key, prev_offs[i]);
+		else if (prev[i] == MEMTE_DELETED)
+			memtable_write_tombstone(seg->table, hdrs[i].key,
+						 prev_offs[i]);
+		else
+			memtable_remove(seg->table, hdrs[i].key);
+	}
 }
 
 
 /*
- * Puts s1 before s2 in the linked list
+ * Indexes a v2 record that was appended or read back in, key value pairs
+ * and tombstones go in the memtable and range tombstones in the list of
+ * range tombstones. Records with an expiry time are counted towards the
+ * expiry accounting of the segment file.
  *
  * Parameters:
- *	s1 => new predecessor of s2
- *	s2 => new successor of s1
+ *	seg => segment file the record is in
+ *	hdr => header of the record
+ *	offset => offset of the start of the record
+ *	val => value of the record, only read for range tombstones
  *
  * Returns:
- *	void
+ *	-1 if there is an error (check errno), 0 otherwise
  */
-void segf_link_before(struct segment_file *s1, struct segment_file *s2)
+static int index_rec(struct segment_file *seg, struct record_hdr *hdr,
+		     uint64_t offset, const char *val)
 {
-	if (s1 == NULL) {
-		fprintf(stderr, "segf_link_before: s1 was NULL\n");
-		exit(1);
+	int hi;
+
+	if (hdr->flags & REC_RANGE_DEL) {
+		if (rec_decode_range_end(val, hdr->val_len, &hi) < 0) {
+			errno = EIO;
+			return -1;
+		}
+		return add_range_del(seg, hdr->key, hi, hdr->seq);
 	}
-	s1->next = s2;
+
+	count_expiry(seg, hdr);
+
+	if (hdr->flags & REC_DEL)
+		return index_pair(seg, hdr->key, offset, TOMBSTONE_DEL);
+	return index_pair(seg, hdr->key, offset, TOMBSTONE_INS);
+}
+
+
+/*
+ * Counts a record with an expiry time towards the expiry accounting of
+ * the segment file, records without one are ignored.
+ */
+static void count_expiry(struct segment_file *seg, struct record_hdr *hdr)
+{
+	if (!hdr->expires)
+		return;
+
+	if (seg->nttl == 0 || hdr->expires < seg->ttl_min)
+		seg->ttl_min = hdr->expires;
+	if (hdr->expires > seg->ttl_max)
+		seg->ttl_max = hdr->expires;
+	seg->nttl += 1;
+	seg->ttl_bytes += rec_size(hdr);
+}
+
+
+/*
+ * Adds a range tombstone to the segment files list, keeping it sorted by
+ * the start of the range.
+ *
+ * Returns:
+ *	-1 if there is no memory available, 0 otherwise
+ */
+static int add_range_del(struct segment_file *seg, int lo, int hi,
+			 uint64_t seq)
+{
+	struct segf_range_del  *rds;
+	int                    i;
+
+	rds = realloc(seg->range_dels,
+		      (seg->nrange_dels + 1) * sizeof(struct segf_range_del));
+	if (rds == NULL)
+		return -1;
+
+	for (i = seg->nrange_dels; i > 0 && rds[i - 1].lo > lo; --i)
+		rds[i] = rds[i - 1];
+
+	rds[i].lo = lo;
+	rds[i].hi = hi;
+	rds[i].seq = seq;
+	seg->range_dels = rds;
+	seg->nrange_dels += 1;
+	return 0;
 }
 
 
 /*
- * Removes seg from the given list. Does not free seg.
+ * Finds the newest range tombstone in the segment file that covers the
+ * key. Records of the key with a smaller sequence number are deleted.
  *
  * Parameters:
- *	head => start of the linked list
- *	seg => segment_file to remove from the linked list
+ *	seg => segment file to search
+ *	key => key to look for
+ *	max_seq => range tombstones newer than this are ignored
  *
  * Returns:
- *	void
+ *	The sequence number of the newest range tombstone covering the key,
+ *	or 0 if no range tombstone covers it
  */
-void segf_unlink(struct segment_file **head, struct segment_file *seg)
+uint64_t segf_range_cover(struct segment_file *seg, int key, uint64_t max_seq)
 {
-	struct segment_file *prev = NULL;
-	struct segment_file *walk = *head;
+	struct segf_range_del  *rd;
+	uint64_t               cover = 0;
+	int                    lo = 0, hi = seg->nrange_dels;
+
+	// only ranges that start at or before the key can cover it
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (seg->range_dels[mid].lo <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	while (walk != seg) {
-		prev = walk;	
-		walk = walk->next;
+	for (rd = seg->range_dels; rd < seg->range_dels + lo; ++rd) {
+		if (rd->hi >= key && rd->seq <= max_seq && rd->seq > cover)
+			cover = rd->seq;
 	}
 
-	if (!prev)
-		*head = seg->next;
-	else
-		prev->next = seg->next;
+	return cover;
+}
+
+
+/*
+ * Points the memtable entry of the key at a newly appended key value pair
+ * or tombstone.
+ *
+ * Parameters:
+ *	seg => segment file the pair was appended to
+ *	key => key of the appended pair
+ *	offset => memtable offset of the appended pair
+ *	tombstone => TOMBSTONE_DEL if the pair was a tombstone
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 otherwise
+ */
+static int index_pair(struct segment_file *seg, int key, uint64_t offset,
+		      char tombstone)
+{
+	if (tombstone == TOMBSTONE_DEL)
+		return memtable_write_tombstone(seg->table, key, offset);
+	return segf_update_memtable(seg, key, offset);
+}
+
+
+/*
+ * Calculates the number of bytes a key value pair would take up when
+ * appended to the given segment file.
+ *
+ * Parameters:
+ *	seg => segment file the pair would be appended to
+ *	key => key in the key value pair
+ *	val_len => length of the value, not including the null char
+ *	seq => sequence number the pair would be written with, 0 for none
+ *
+ * Returns:
+ *	The size of the encoded key value pair in bytes
+ */
+uint64_t segf_kv_size(struct segment_file *seg, int key, int val_len,
+		      uint64_t seq)
+{
+	struct record_hdr hdr;
+
+	if (seg->version == SEGF_V1) {
+		return sizeof(char)
+			+ (sizeof(key)*2)
+			+ sizeof(val_len)
+			+ val_len + 1;
+	}
+
+	hdr.flags = (seg->flags & SEGF_HDR_CHECKSUM) ? REC_CHECKSUM : 0;
+	if (seq)
+		hdr.flags |= REC_SEQ;
+	hdr.key = key;
+	hdr.val_len = val_len;
+	hdr.seq = seq;
+	hdr.expires = 0;
+	return rec_size(&hdr);
+}
+
+
+/*
+ * Reads the value using the key from the segment file
+ *
+ * Parameters:
+ *	seg => pointer a segment_file struct that contains the name of
+ *             segment file to read
+ *	key => used to look up the value in segment files memtable
+ *	val => stores the value read from the segment file
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 if the key was not found,
+ *	1 if the key was found, or SEGF_DELETED if the key was deleted in
+ *	this segment file (older segment files must not be checked)
+ */
+int segf_read_file(struct segment_file *seg, int key, char **val)
+{
+	struct record_hdr  hdr;
+	uint64_t           offset;
+
+	switch (segf_read_memtable(seg, key, &offset)) {
+	case -1:
+		return -1;
+	case MEMTE_MISSING:
+		return 0; // key not found
+	case MEMTE_DELETED:
+		return SEGF_DELETED;
+	}
+
+	return segf_read_rec(seg, offset, &hdr, val);
+}
+
+
+/*
+ * Looks up the key in the segment file and reads the header of its newest
+ * record, and the value if the key was not deleted.
+ *
+ * Parameters:
+ *	seg => segment file to read
+ *	key => key to look up
+ *	hdr => where to store the header of the record
+ *	val => where to store the value, may be NULL to only read the header
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 if the key was not found,
+ *	1 if the key was found, or SEGF_DELETED if the key was deleted in
+ *	this segment file (hdr is the tombstone, val is not set)
+ */
+int segf_lookup(struct segment_file *seg, int key, struct record_hdr *hdr,
+		char **val)
+{
+	uint64_t  offset;
+	int       res;
+
+	if ((res = segf_read_memtable(seg, key, &offset)) <= 0)
+		return res;
+
+	if (res == MEMTE_DELETED)
+		val = NULL;
+
+	if (segf_read_rec(seg, offset, hdr, val) < 0)
+		return -1;
+
+	return (res == MEMTE_DELETED) ? SEGF_DELETED : 1;
+}
+
+
+/*
+ * Reads the record at the given memtable offset of the segment file.
+ *
+ * Parameters:
+ *	seg => segment file to read
+ *	offset => memtable offset of the record
+ *	hdr => where to store the header of the record, for v1 files the
+ *	       sequence number is always 0
+ *	val => where to store the value (null terminated, caller must free
+ *	       it), may be NULL to only read the header
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 1 otherwise
+ */
+int segf_read_rec(struct segment_file *seg, uint64_t offset,
+		  struct record_hdr *hdr, char **val)
+{
+	int res;
+
+	if (fd_acquire(seg) < 0)
+		return -1;
+
+	res = (seg->version == SEGF_V1) ? read_rec_v1(seg, offset, hdr, val)
+					: read_rec_v2(seg, offset, hdr, val);
+	fd_release(seg);
+	return res;
+}
+
+
+/*
+ * Reads the key value pair at the given offset of a v1 segment file, the
+ * offset points at the length of the value
+ */
+static int read_rec_v1(struct segment_file *seg, uint64_t offset,
+		       struct record_hdr *hdr, char **val)
+{
+	char  buf[sizeof(char) + sizeof(int)];
+	char  *v;
+	int   n, val_len, trailer;
+
+	// tombstone is the byte before the value length
+	if ((n = pread(seg->seg_fd, buf, sizeof(buf), offset - 1)) != sizeof(buf)) {
+		if (n >= 0)
+			errno = EIO;
+		return -1;
+	}
+	memcpy(&val_len, buf + 1, sizeof(val_len));
+	offset += sizeof(val_len);
+
+	// read the value along with the key length and key that follow it
+	trailer = sizeof(int) * 2;
+	if ((v = calloc(val_len + trailer + 1, sizeof(char))) == NULL)
+		return -1;
+
+	n = pread(seg->seg_fd, v, val_len + trailer, offset);
+	if (n != val_len + trailer) {
+		if (n >= 0)
+			errno = EIO;
+		free(v);
+		return -1;
+	}
+
+	hdr->flags = (buf[0] == TOMBSTONE_DEL) ? REC_DEL : 0;
+	memcpy(&hdr->key, v + val_len + sizeof(int), sizeof(int));
+	hdr->val_len = (val_len > 0) ? val_len - 1 : 0; // drop null char
+	hdr->seq = 0;
+	hdr->expires = 0;
+	hdr->hdr_len = 0;
+
+	if (val) {
+		v[val_len] = '\0';
+		*val = v;
+	} else {
+		free(v);
+	}
+	return 1;
+}
+
+
+/*
+ * Reads the record at the given offset of a v2 segment file. If the
+ * value is read and the record has a checksum it is verified, a mismatch
+ * sets errno to EIO.
+ */
+static int read_rec_v2(struct segment_file *seg, uint64_t offset,
+		       struct record_hdr *hdr, char **val)
+{
+	char  buf[REC_MAX_HDR_SZ];
+	char  *v;
+	int   n, data_len;
+
+	if ((n = pread(seg->seg_fd, buf, REC_MAX_HDR_SZ, offset)) < 0)
+		return -1;
+
+	if (rec_decode_hdr(buf, n, hdr) < 0) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (val == NULL)
+		return 1;
+
+	// read the value and checksum in one go, the null char is added
+	// after the checksum is verified
+	data_len = hdr->val_len;
+	if (hdr->flags & REC_CHECKSUM)
+		data_len += REC_CRC_SZ;
+
+	if ((v = calloc(data_len + 1, sizeof(char))) == NULL)
+		return -1;
+
+	if ((n = pread(seg->seg_fd, v, data_len, offset + hdr->hdr_len)) != data_len) {
+		if (n >= 0) // short read, record runs past the end of file
+			errno = EIO;
+		free(v);
+		return -1;
+	}
+
+	if (hdr->flags & REC_CHECKSUM) {
+		uint32_t crc, stored;
+		memcpy(&stored, v + hdr->val_len, sizeof(stored));
+		crc = rec_crc32(0, buf, hdr->hdr_len);
+		crc = rec_crc32(crc, v, hdr->val_len);
+		if (crc != stored) {
+			free(v);
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	v[hdr->val_len] = '\0';
+	*val = v;
+	return 1;
+}
+
+
+/*
+ * Reads a batch of records, their values go one after another into the
+ * arena. Records of a segment file close to each other are read together
+ * (see SEGF_BATCH_GAP), and the reads of every segment file are handed to
+ * the default I/O engine as one batch (see ioe_default). A batch of n
+ * records takes two rounds of I/O, the second only for values that ran
+ * past what the first one read.
+ *
+ * Parameters:
+ *	reads => records to read, grouped by segment file and in ascending
+ *	         order of offset within each
+ *	n => number of records
+ *	arena => memory the values are stored in
+ *	len => size of the arena
+ *	used => bytes of the arena already used, moved past every value
+ *
+ * Returns:
+ *	-1 if there is an error (check errno, ENOBUFS if the values do not
+ *	fit in the arena), 1 otherwise
+ */
+int segf_read_batch(struct segf_read *reads, int n, char *arena, size_t len,
+		    size_t *used)
+{
+	struct ioe_engine  *io = ioe_default();
+	struct batch_run   *runs = NULL;
+	struct batch_tail  *tails = NULL;
+	struct ioe_op      *ops = NULL;
+	int                nruns = 0, nops = 0, nacquired = 0, res = -1;
+	int                i, j;
+
+	if (n <= 0)
+		return 1;
+
+	if ((runs = calloc(n, sizeof(struct batch_run))) == NULL ||
+	    (tails = calloc(n, sizeof(struct batch_tail))) == NULL ||
+	    (ops = calloc(n, sizeof(struct ioe_op))) == NULL)
+		goto out;
+
+	for (i = 0; i < n; i = j) {
+		struct segment_file *seg = reads[i].seg;
+
+		for (j = i + 1; j < n && reads[j].seg == seg; ++j)
+			;
+		if (fd_acquire(seg) < 0)
+			goto out;
+		nacquired = j;
+
+		if (seg->version == SEGF_V1) {
+			if (read_batch_v1(reads + i, j - i, arena, len, used) < 0)
+				goto out;
+			continue;
+		}
+
+		// split the records of the segment file into runs
+		for (int k = i; k < j; ) {
+			struct batch_run *run = &runs[nruns];
+			uint64_t first = reads[k].offset;
+
+			run->reads = &reads[k];
+			run->tails = &tails[k];
+			for (run->n = 1, ++k; k < j; ++run->n, ++k) {
+				if (reads[k].offset - reads[k - 1].offset > SEGF_BATCH_GAP ||
+				    reads[k].offset - first > SEGF_BATCH_SPAN)
+					break;
+			}
+
+			run->len = reads[k - 1].offset - first + REC_MAX_HDR_SZ +
+				   SEGF_BATCH_READAHEAD;
+			if ((run->buf = malloc(run->len)) == NULL)
+				goto out;
+			nruns += 1;
+
+			ops[nops].op = IOE_READ;
+			ops[nops].fd = seg->seg_fd;
+			ops[nops].flags = 0;
+			ops[nops].buf = run->buf;
+			ops[nops].len = run->len;
+			ops[nops].offset = first;
+			nops += 1;
+		}
+	}
+
+	if (ioe_submit(io, ops, nops) < 0)
+		goto out;
+
+	// the runs and ops line up, every op read one run
+	for (i = 0, nops = 0; i < nruns; ++i) {
+		if (ops[i].res < 0) {
+			errno = -ops[i].res;
+			goto out;
+		}
+		if (decode_run(&runs[i], ops[i].res, arena, len, used, ops, &nops) < 0)
+			goto out;
+	}
+
+	if (ioe_submit(io, ops, nops) < 0)
+		goto out;
+
+	for (i = 0; i < nops; ++i) {
+		struct iovec *iov = ops[i].buf;
+		ssize_t want = 0;
+
+		for (j = 0; j < (int)ops[i].len; ++j)
+			want += iov[j].iov_len;
+		if (ops[i].res != want) {
+			// short read, record runs past the end of file
+			errno = (ops[i].res < 0) ? -ops[i].res : EIO;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nruns; ++i) {
+		for (j = 0; j < runs[i].n; ++j) {
+			if (finish_record(&runs[i].reads[j], &runs[i].tails[j]) < 0)
+				goto out;
+		}
+	}
+	res = 1;
+
+out:
+	for (i = 0; i < nacquired; i = j) {
+		for (j = i + 1; j < nacquired && reads[j].seg == reads[i].seg; ++j)
+			;
+		fd_release(reads[i].seg);
+	}
+	for (i = 0; i < nruns; ++i)
+		free(runs[i].buf);
+	free(runs);
+	free(tails);
+	free(ops);
+	return res;
+}
+
+
+/*
+ * Reads records of a v1 segment file one at a time, they are framed
+ * around their value. The descriptor of the segment file must be held.
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 1 otherwise
+ */
+static int read_batch_v1(struct segf_read *reads, int n, char *arena,
+			 size_t len, size_t *used)
+{
+	struct segf_read  *r;
+	char              *v;
+
+	for (int i = 0; i < n; ++i) {
+		r = &reads[i];
+		if (read_rec_v1(r->seg, r->offset, &r->hdr, &v) < 0)
+			return -1;
+
+		if (len - *used < r->hdr.val_len + 1) {
+			free(v);
+			errno = ENOBUFS;
+			return -1;
+		}
+		r->val = arena + *used;
+		memcpy(r->val, v, r->hdr.val_len + 1);
+		*used += r->hdr.val_len + 1;
+		free(v);
+	}
+	return 1;
+}
+
+
+/*
+ * Decodes the headers of a run the first round read and gives every
+ * record its place in the arena. The part of a value (and checksum) the
+ * round got is copied, for the rest an IOE_READV op is added that reads
+ * the value straight into the arena and the checksum into the tail of
+ * the record.
+ *
+ * Parameters:
+ *	run => run to decode
+ *	nread => bytes the first round read of it
+ *	arena, len, used => see segf_read_batch
+ *	ops => where to add the ops of the second round
+ *	nops => number of ops in ops, moved past the added ones
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 1 otherwise
+ */
+static int decode_run(struct batch_run *run, ssize_t nread, char *arena,
+		      size_t len, size_t *used, struct ioe_op *ops, int *nops)
+{
+	struct segf_read   *r;
+	struct batch_tail  *t;
+	const char         *data;
+	int                pos, have, val_len, crc_sz;
+
+	for (int i = 0; i < run->n; ++i) {
+		r = &run->reads[i];
+		t = &run->tails[i];
+		pos = r->offset - run->reads[0].offset;
+		if (pos >= nread || rec_decode_hdr(run->buf + pos, nread - pos, &r->hdr) < 0) {
+			errno = EIO;
+			return -1;
+		}
+
+		val_len = r->hdr.val_len;
+		crc_sz = (r->hdr.flags & REC_CHECKSUM) ? REC_CRC_SZ : 0;
+		if (len - *used < (size_t)val_len + 1) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		r->val = arena + *used;
+		*used += val_len + 1;
+		t->rec = run->buf + pos;
+
+		// copy what the first round got
+		data = t->rec + r->hdr.hdr_len;
+		have = nread - pos - r->hdr.hdr_len;
+		if (have > val_len + crc_sz)
+			have = val_len + crc_sz;
+		memcpy(r->val, data, (have < val_len) ? have : val_len);
+		if (have > val_len)
+			memcpy(t->crc, data + val_len, have - val_len);
+
+		if (have == val_len + crc_sz)
+			continue;
+
+		// the rest goes straight to where it belongs
+		int niov = 0, got_crc = (have > val_len) ? have - val_len : 0;
+		if (have < val_len) {
+			t->iov[niov].iov_base = r->val + have;
+			t->iov[niov++].iov_len = val_len - have;
+		}
+		if (crc_sz) {
+			t->iov[niov].iov_base = t->crc + got_crc;
+			t->iov[niov++].iov_len = crc_sz - got_crc;
+		}
+
+		struct ioe_op *op = &ops[(*nops)++];
+		op->op = IOE_READV;
+		op->fd = r->seg->seg_fd;
+		op->flags = 0;
+		op->buf = t->iov;
+		op->len = niov;
+		op->offset = r->offset + r->hdr.hdr_len + have;
+	}
+	return 1;
+}
+
+
+/*
+ * Verifies the checksum of a record read by segf_read_batch, once all of
+ * it has been read, and null terminates its value. A mismatch sets errno
+ * to EIO.
+ *
+ * Returns:
+ *	-1 if the checksum does not match, 1 otherwise
+ */
+static int finish_record(struct segf_read *r, struct batch_tail *t)
+{
+	uint32_t crc, stored;
+
+	if (r->hdr.flags & REC_CHECKSUM) {
+		memcpy(&stored, t->crc, sizeof(stored));
+		crc = rec_crc32(0, t->rec, r->hdr.hdr_len);
+		crc = rec_crc32(crc, r->val, r->hdr.val_len);
+		if (crc != stored) {
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	r->val[r->hdr.val_len] = '\0';
+	return 1;
+}
+
+
+/*
+ * Sets up an empty segment file table
+ *
+ * Parameter:
+ *	t => table to set up
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+int segf_table_init(struct segf_table *t)
+{
+	t->n = 0;
+	t->cap = 0;
+	t->segs = NULL;
+	t->pos = NULL;
+	t->npos = 0;
+	return table_grow(t);
+}
+
+
+/*
+ * Deallocates the arrays of the table, the segment files in it are left
+ * alone
+ *
+ * Parameter:
+ *	t => table to free
+ *
+ * Returns:
+ *	void
+ */
+void segf_table_free(struct segf_table *t)
+{
+	free(t->segs);
+	free(t->pos);
+	t->segs = NULL;
+	t->pos = NULL;
+	t->n = t->cap = 0;
+}
+
+
+/*
+ * Puts the segment file at the given position, the segment files from
+ * there on move one position older
+ *
+ * Parameters:
+ *	t => table to insert into
+ *	i => position of the segment file, 0 for the newest and t->n for the
+ *	     oldest
+ *	seg => segment file to insert
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno, the table is unchanged)
+ */
+int segf_table_insert(struct segf_table *t, int i, struct segment_file *seg)
+{
+	if (t->n == t->cap && table_grow(t) < 0)
+		return -1;
+
+	memmove(&t->segs[i + 1], &t->segs[i], (t->n - i) * sizeof(*t->segs));
+	t->segs[i] = seg;
+	t->n += 1;
+
+	if (i == t->n - 1) // nothing moved
+		table_hash(t, i);
+	else
+		table_rehash(t);
+	return 0;
+}
+
+
+/*
+ * Puts the segment file in place of the one at the given position, no
+ * other segment file moves
+ *
+ * Parameters:
+ *	t => table to change
+ *	i => position of the segment file to replace
+ *	seg => segment file to put in its place
+ *
+ * Returns:
+ *	void
+ */
+void segf_table_replace(struct segf_table *t, int i, struct segment_file *seg)
+{
+	table_unhash(t, i);
+	t->segs[i] = seg;
+	table_hash(t, i);
+}
+
+
+/*
+ * Takes the segment file at the given position out of the table, the
+ * older ones move one position newer. The segment file is not freed.
+ *
+ * Parameters:
+ *	t => table to change
+ *	i => position of the segment file to remove
+ *
+ * Returns:
+ *	void
+ */
+void segf_table_remove(struct segf_table *t, int i)
+{
+	t->n -= 1;
+	memmove(&t->segs[i], &t->segs[i + 1], (t->n - i) * sizeof(*t->segs));
+	table_rehash(t);
+}
+
+
+/*
+ * Finds the segment file with the given ID
+ *
+ * Parameters:
+ *	t => table to search
+ *	id => ID of the segment file
+ *
+ * Returns:
+ *	Position of the segment file, or -1 if it is not in the table
+ */
+int segf_table_find(struct segf_table *t, uint64_t id)
+{
+	unsigned int  mask = t->npos - 1;
+	unsigned int  h = table_slot(t, id);
+
+	for (; t->pos[h] != -1; h = (h + 1) & mask) {
+		if (t->segs[t->pos[h]]->id == id)
+			return t->pos[h];
+	}
+	return -1;
+}
+
+
+/*
+ * Finds the position of the given segment file
+ *
+ * Parameters:
+ *	t => table to search
+ *	seg => segment file to look for
+ *
+ * Returns:
+ *	Position of the segment file, or -1 if it is not in the table
+ */
+int segf_table_pos(struct segf_table *t, struct segment_file *seg)
+{
+	int i = segf_table_find(t, seg->id);
+
+	if (i >= 0 && t->segs[i] == seg)
+		return i;
+
+	// segment files in no manifest may share an ID
+	for (i = 0; i < t->n; ++i) {
+		if (t->segs[i] == seg)
+			return i;
+	}
+	return -1;
+}
+
+
+/*
+ * Doubles the room in the table, the hash table is kept at least twice
+ * as large as the array
+ */
+static int table_grow(struct segf_table *t)
+{
+	int                  cap = (t->cap) ? t->cap * 2 : 16;
+	struct segment_file  **segs;
+	int                  *pos;
+
+	if ((segs = realloc(t->segs, cap * sizeof(*segs))) == NULL)
+		return -1;
+	t->segs = segs;
+
+	if ((pos = malloc(cap * 2 * sizeof(int))) == NULL)
+		return -1;
+
+	free(t->pos);
+	t->pos = pos;
+	t->npos = cap * 2;
+	t->cap = cap;
+	table_rehash(t);
+	return 0;
+}
+
+
+/*
+ * Returns the hash table slot an ID starts probing from
+ */
+static unsigned int table_slot(struct segf_table *t, uint64_t id)
+{
+	return (id * 0x9e3779b97f4a7c15ULL) >> 32 & (t->npos - 1);
+}
+
+
+/*
+ * Adds the segment file at position i to the hash table
+ */
+static void table_hash(struct segf_table *t, int i)
+{
+	unsigned int h = table_slot(t, t->segs[i]->id);
+
+	while (t->pos[h] != -1)
+		h = (h + 1) & (t->npos - 1);
+	t->pos[h] = i;
+}
+
+
+/*
+ * Takes the segment file at position i out of the hash table. The entries
+ * after it in its probe run are moved back so no lookup stops early.
+ */
+static void table_unhash(struct segf_table *t, int i)
+{
+	unsigned int  mask = t->npos - 1;
+	unsigned int  h = table_slot(t, t->segs[i]->id);
+	unsigned int  next, want;
+
+	while (t->pos[h] != i)
+		h = (h + 1) & mask;
+
+	next = (h + 1) & mask;
+	while (t->pos[next] != -1) {
+		// an entry can fill the hole if the hole is on its probe path
+		want = table_slot(t, t->segs[t->pos[next]]->id);
+		if (((next - want) & mask) >= ((next - h) & mask)) {
+			t->pos[h] = t->pos[next];
+			h = next;
+		}
+		next = (next + 1) & mask;
+	}
+	t->pos[h] = -1;
+}
+
+
+/*
+ * Builds the hash table again after segment files moved
+ */
+static void table_rehash(struct segf_table *t)
+{
+	memset(t->pos, -1, t->npos * sizeof(int));
+	for (int i = 0; i < t->n; ++i)
+		table_hash(t, i);
+}
+
+
+/*
+ * Creates a cursor over the keys in the given memtable of the segment
+ * file. The keys are returned in the order of their offsets so the
+ * records are read front to back.
+ *
+ * Parameters:
+ *	seg => segment file to read records from
+ *	tbl => memtable to take the keys from, this is seg->table unless
+ *	       the caller holds a copy of it (see hashDB_snapshot). Not
+ *	       used for sorted segment files, their keys are read from the
+ *	       file.
+ *
+ * Returns:
+ *	Dynamically allocated cursor that must be freed with
+ *	segf_cursor_free, or NULL if there is an error (check errno)
+ */
+struct segf_cursor *segf_cursor_init(struct segment_file *seg,
+				     struct memtable *tbl)
+{
+	struct segf_cursor     *cur;
+	struct memtable_entry  *e;
+	int                    i = 0;
+
+	if (segf_load(seg) < 0)
+		return NULL;
+
+	if ((cur = malloc(sizeof(struct segf_cursor))) == NULL)
+		return NULL;
+
+	cur->seg = seg;
+	cur->n = tbl->entries;
+	cur->pos = 0;
+
+	if (seg->flags & SEGF_HDR_INDEXED) {
+		if (((seg->flags & SEGF_HDR_SORTED) ? load_sorted_entries(cur)
+						    : load_hashed_entries(cur)) < 0) {
+			free(cur);
+			return NULL;
+		}
+		return cur;
+	}
+
+	cur->entries = malloc((cur->n + 1) * sizeof(struct memtable_entry));
+	if (cur->entries == NULL) {
+		free(cur);
+		return NULL;
+	}
+
+	for (int b = 0; b < MAX_TBL_SZ; ++b) {
+		for (e = tbl->table[b]; e; e = e->next)
+			cur->entries[i++] = *e;
+	}
+
+	qsort(cur->entries, cur->n, sizeof(struct memtable_entry), offset_cmp);
+	return cur;
+}
+
+
+/*
+ * Comparison function used by qsort to order memtable entries by offset
+ */
+static int offset_cmp(const void *a, const void *b)
+{
+	uint64_t a_off = ((const struct memtable_entry *)a)->offset;
+	uint64_t b_off = ((const struct memtable_entry *)b)->offset;
+
+	return (a_off > b_off) - (a_off < b_off);
+}
+
+
+/*
+ * Moves the cursor to the next key.
+ *
+ * Parameters:
+ *	cur => cursor to move
+ *	key => where to store the next key
+ *
+ * Returns:
+ *	1 if there was another key, 0 if every key has been returned
+ */
+int segf_cursor_next(struct segf_cursor *cur, int *key)
+{
+	if (cur->pos == cur->n)
+		return 0;
+
+	*key = cur->entries[cur->pos++].key;
+	return 1;
+}
+
+
+/*
+ * Returns the memtable entry of the key the cursor is on, the key last
+ * returned by segf_cursor_next. The entry belongs to the cursor.
+ */
+struct memtable_entry *segf_cursor_entry(struct segf_cursor *cur)
+{
+	return &cur->entries[cur->pos - 1];
+}
+
+
+/*
+ * Reads the record of the key the cursor is on, the key last returned by
+ * segf_cursor_next.
+ *
+ * Parameters:
+ *	cur => cursor to read from
+ *	hdr => where to store the header of the record
+ *	val => where to store the value, may be NULL to only read the header
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 1 if the record holds a
+ *	value, or SEGF_DELETED if the record is a tombstone (val is not set)
+ */
+int segf_cursor_read(struct segf_cursor *cur, struct record_hdr *hdr,
+		     char **val)
+{
+	struct memtable_entry *e = &cur->entries[cur->pos - 1];
+
+	if (segf_read_rec(cur->seg, e->offset, hdr, e->deleted ? NULL : val) < 0)
+		return -1;
+
+	return (e->deleted) ? SEGF_DELETED : 1;
+}
+
+
+/*
+ * Frees the cursor
+ *
+ * Parameter:
+ *	cur => cursor to free
+ *
+ * Returns:
+ *	void
+ */
+void segf_cursor_free(struct segf_cursor *cur)
+{
+	free(cur->entries);
+	free(cur);
+}
+
+
+/*
+ * Turns a segment file into a sorted segment file. The fence index and
+ * footer are appended, the header is flagged SEGF_HDR_SORTED, the memtable
+ * is emptied, and the segment file is sealed. Every key must have been
+ * appended once in ascending order, followed by any range tombstones.
+ *
+ * Parameter:
+ *	seg => v2 segment file to finish
+ *
+ * Returns:
+ *	-1 if there is an error (check errno, EINVAL if the keys were not
+ *	appended in order, EFBIG if the segment file is larger than
+ *	SEGF_MAX_INDEXED_SZ), 0 otherwise. If there is an error the segment
+ *	file can't be used as a sorted segment file.
+ */
+int segf_finish_sorted(struct segment_file *seg)
+{
+	struct segf_cursor     *cur = NULL;
+	struct segf_fence      *fences = NULL;
+	struct memtable_entry  *e;
+	char                   *buf = NULL;
+	unsigned int           len = 0;
+	int                    nfences = 0;
+
+	if (seg->version != SEGF_V2 || seg->sealed) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (seg->size > SEGF_MAX_INDEXED_SZ) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if ((cur = segf_cursor_init(seg, seg->table)) == NULL)
+		return -1;
+
+	fences = malloc((cur->n + 1) * sizeof(struct segf_fence));
+	buf = malloc(cur->n * REC_MAX_VARINT_SZ * 2 + SEGF_FOOTER_SZ);
+	if (fences == NULL || buf == NULL)
+		goto err;
+
+	for (int i = 0; i < cur->n; ++i) {
+		e = &cur->entries[i];
+		if (i > 0 && e->key <= cur->entries[i - 1].key) {
+			errno = EINVAL;
+			goto err;
+		}
+
+		if (nfences == 0 ||
+		    e->offset - fences[nfences - 1].offset >= SEGF_BLOCK_SZ) {
+			fences[nfences].key = e->key;
+			fences[nfences].offset = e->offset;
+			len += varint_encode(buf + len, zigzag_encode(e->key));
+			len += varint_encode(buf + len, e->offset);
+			nfences += 1;
+		}
+	}
+
+	if (finish_indexed(seg, cur, buf, len, nfences, SEGF_HDR_SORTED) < 0)
+		goto err;
+
+	seg->fences = fences;
+	seg->nfences = nfences;
+	segf_cursor_free(cur);
+	free(buf);
+	return 0;
+
+err:
+	segf_cursor_free(cur);
+	free(fences);
+	free(buf);
+	return -1;
+}
+
+
+/*
+ * Turns a segment file into a hashed segment file. A minimal perfect hash
+ * function over its keys is built and appended after the slot table,
+ * followed by the footer. The header is flagged SEGF_HDR_HASHED, the
+ * memtable is emptied, and the segment file is sealed. The slots are kept
+ * in RAM until segf_demote_index. Every key must have been appended once
+ * in the order of the slots mph_build gives them, followed by any range
+ * tombstones.
+ *
+ * Parameter:
+ *	seg => v2 segment file to finish
+ *
+ * Returns:
+ *	-1 if there is an error (check errno, EINVAL if the keys were not
+ *	appended in slot order, EFBIG if the segment file is larger than
+ *	SEGF_MAX_INDEXED_SZ), 0 otherwise. If there is an error the
+ *	segment file can't be used as a hashed segment file.
+ */
+int segf_finish_hashed(struct segment_file *seg)
+{
+	struct segf_cursor      *cur = NULL;
+	struct segf_hash_index  *hidx = NULL;
+	struct memtable_entry   *e;
+	char                    *buf = NULL;
+	int                     *keys = NULL;
+	unsigned int            slots_off = seg->size, len;
+	uint32_t                v;
+
+	if (seg->version != SEGF_V2 || seg->sealed) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (seg->size > SEGF_MAX_INDEXED_SZ) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if ((cur = segf_cursor_init(seg, seg->table)) == NULL)
+		return -1;
+
+	if ((keys = malloc((cur->n + 1) * sizeof(int))) == NULL ||
+	    (hidx = hidx_init(cur->n)) == NULL)
+		goto err;
+
+	for (int i = 0; i < cur->n; ++i)
+		keys[i] = cur->entries[i].key;
+
+	if ((hidx->mph = mph_build(keys, cur->n)) == NULL)
+		goto err;
+
+	len = cur->n * SEGF_SLOT_SZ + mph_encoded_len(hidx->mph);
+	if ((buf = malloc(len + SEGF_FOOTER_SZ)) == NULL)
+		goto err;
+
+	// the i'th record in the file has to be the key of slot i
+	for (int i = 0; i < cur->n; ++i) {
+		e = &cur->entries[i];
+		if (mph_lookup(hidx->mph, e->key) != i) {
+			errno = EINVAL;
+			goto err;
+		}
+		v = e->offset | ((e->deleted) ? SEGF_SLOT_DEL : 0);
+		memcpy(buf + i * SEGF_SLOT_SZ, &e->key, sizeof(int));
+		memcpy(buf + i * SEGF_SLOT_SZ + sizeof(int), &v, sizeof(v));
+	}
+	mph_encode(hidx->mph, buf + cur->n * SEGF_SLOT_SZ);
+
+	if (finish_indexed(seg, cur, buf, len, cur->n, SEGF_HDR_HASHED) < 0)
+		goto err;
+
+	// the slot table is still in buf
+	hidx->slots_off = slots_off;
+	if (hidx_fill(seg, hidx, buf) < 0)
+		goto err;
+
+	seg->hidx = hidx;
+	segf_cursor_free(cur);
+	free(keys);
+	free(buf);
+	return 0;
+
+err:
+	if (hidx)
+		hidx_free(hidx);
+	segf_cursor_free(cur);
+	free(keys);
+	free(buf);
+	return -1;
+}
+
+
+/*
+ * Appends the index and footer to a segment file and flags its header,
+ * the shared part of segf_finish_sorted and segf_finish_hashed. The
+ * memtable is emptied and the segment file is sealed.
+ *
+ * Parameters:
+ *	seg => segment file to finish
+ *	cur => cursor over every key of the segment file
+ *	index => encoded index, with room for SEGF_FOOTER_SZ more bytes
+ *	len => length of the encoded index
+ *	n => number of entries in the index
+ *	flag => SEGF_HDR_SORTED or SEGF_HDR_HASHED
+ *
+ * Returns:
+ *	-1 if there is an error (check errno), 0 otherwise
+ */
+static int finish_indexed(struct segment_file *seg, struct segf_cursor *cur,
+			  char *index, unsigned int len, int n, int flag)
+{
+	struct memtable    *empty;
+	struct record_hdr  hdr;
+	unsigned int       data_end = SEGF_HDR_SZ;
+	uint32_t           footer[4];
+
+	if (cur->n > 0) { // key value pairs end after the last one
+		if (segf_read_rec(seg, cur->entries[cur->n - 1].offset, &hdr, NULL) < 0)
+			return -1;
+		data_end = cur->entries[cur->n - 1].offset + rec_size(&hdr);
+	}
+
+	footer[0] = data_end;
+	footer[1] = seg->size; // range tombstones end where the index starts
+	footer[2] = n;
+	footer[3] = rec_crc32(0, index, len);
+	memcpy(index + len, footer, sizeof(footer));
+	memcpy(index + len + sizeof(footer), &seg->max_seq, sizeof(seg->max_seq));
+	memcpy(index + len + SEGF_FOOTER_SZ - SEGF_MAGIC_LEN, SEGF_FOOTER_MAGIC,
+	       SEGF_MAGIC_LEN);
+	len += SEGF_FOOTER_SZ;
+
+	if ((empty = memtable_init()) == NULL)
+		return -1;
+
+	if (fd_acquire(seg) < 0)
+		goto err;
+
+	if (pwrite(seg->seg_fd, index, len, seg->size) != len) {
+		fd_release(seg);
+		goto err;
+	}
+
+	seg->flags |= flag;
+	if (pwrite(seg->seg_fd, &seg->flags, 1, SEGF_MAGIC_LEN + 1) != 1) {
+		seg->flags &= ~flag;
+		fd_release(seg);
+		goto err;
+	}
+	fd_release(seg);
+
+	memtable_free(seg->table);
+	seg->table = empty;
+	seg->data_end = data_end;
+	seg->size += len;
+	seg->sealed = 1;
+	return 0;
+
+err:
+	memtable_free(empty);
+	return -1;
+}
+
+
+/*
+ * Loads the index and range tombstones of a sorted or hashed segment
+ * file, see segf_finish_sorted and segf_finish_hashed for the layout.
+ */
+static int repop_indexed(struct segment_file *seg)
+{
+	struct record_hdr  hdr;
+	char               footer[SEGF_FOOTER_SZ];
+	char               *buf = NULL;
+	uint32_t           f[4];
+	unsigned int       len, pos;
+	off_t              end;
+	int                hi, res;
+
+	if ((seg->flags & SEGF_HDR_INDEXED) == SEGF_HDR_INDEXED)
+		goto corrupt; // one index or the other
+
+	if ((end = lseek(seg->seg_fd, 0, SEEK_END)) < 0)
+		return -1;
+
+	if (end < SEGF_HDR_SZ + SEGF_FOOTER_SZ ||
+	    pread(seg->seg_fd, footer, SEGF_FOOTER_SZ, end - SEGF_FOOTER_SZ)
+			!= SEGF_FOOTER_SZ ||
+	    memcmp(footer + SEGF_FOOTER_SZ - SEGF_MAGIC_LEN, SEGF_FOOTER_MAGIC,
+		   SEGF_MAGIC_LEN) != 0)
+		goto corrupt;
+
+	memcpy(f, footer, sizeof(f));
+	memcpy(&seg->max_seq, footer + sizeof(f), sizeof(seg->max_seq));
+	if (f[0] < SEGF_HDR_SZ || f[0] > f[1] || f[1] > end - SEGF_FOOTER_SZ)
+		goto corrupt;
+
+	// range tombstones and index are read in one go
+	len = end - SEGF_FOOTER_SZ - f[0];
+	if ((buf = malloc(len + 1)) == NULL)
+		return -1;
+	if (pread(seg->seg_fd, buf, len, f[0]) != len)
+		goto corrupt;
+
+	for (pos = 0; pos < f[1] - f[0]; pos += rec_size(&hdr)) {
+		if (rec_decode_hdr(buf + pos, f[1] - f[0] - pos, &hdr) < 0 ||
+		    !(hdr.flags & REC_RANGE_DEL) ||
+		    rec_decode_range_end(buf + pos + hdr.hdr_len, hdr.val_len,
+					 &hi) < 0)
+			goto corrupt;
+		if (add_range_del(seg, hdr.key, hi, hdr.seq) < 0)
+			goto err;
+	}
+
+	pos = f[1] - f[0];
+	if (rec_crc32(0, buf + pos, len - pos) != f[3])
+		goto corrupt;
+
+	seg->data_end = f[0];
+	if (seg->flags & SEGF_HDR_SORTED)
+		res = load_fences(seg, buf + pos, len - pos, f[2]);
+	else
+		res = load_hash_index(seg, buf + pos, len - pos, f[2], f[1]);
+	if (res < 0)
+		goto err;
+
+	seg->size = end;
+	seg->sealed = 1;
+	free(buf);
+	return 0;
+
+corrupt:
+	errno = EIO;
+err:
+	free(buf);
+	return -1;
+}
+
+
+/*
+ * Decodes the n fences of a sorted segment file
+ */
+static int load_fences(struct segment_file *seg, const char *buf,
+		       unsigned int len, unsigned int n)
+{
+	unsigned int  pos = 0, i;
+	uint64_t      v;
+	int           k;
+
+	if ((seg->fences = malloc((n + 1) * sizeof(struct segf_fence))) == NULL)
+		return -1;
+
+	for (i = 0; i < n; ++i) {
+		if ((k = varint_decode(buf + pos, len - pos, &v)) < 0)
+			goto corrupt;
+		seg->fences[i].key = zigzag_decode(v);
+		pos += k;
+		if ((k = varint_decode(buf + pos, len - pos, &v)) < 0)
+			goto corrupt;
+		seg->fences[i].offset = v;
+		pos += k;
+	}
+
+	seg->nfences = n;
+	return 0;
+
+corrupt:
+	errno = EIO;
+	return -1;
+}
+
+
+/*
+ * Decodes the minimal perfect hash function of a hashed segment file,
+ * which follows its slot table, and reads the slot table into RAM. off is
+ * where the slot table starts in the file.
+ */
+static int load_hash_index(struct segment_file *seg, const char *buf,
+			   unsigned int len, unsigned int n, unsigned int off)
+{
+	struct segf_hash_index *hidx;
+
+	if ((uint64_t)n * SEGF_SLOT_SZ > len) {
+		errno = EIO;
+		return -1;
+	}
+
+	if ((hidx = hidx_init(n)) == NULL)
+		return -1;
+	hidx->slots_off = off;
+
+	if ((hidx->mph = mph_decode(buf + n * SEGF_SLOT_SZ,
+				    len - n * SEGF_SLOT_SZ)) == NULL)
+		goto err;
+	if (hidx->mph->nkeys != n) {
+		errno = EIO;
+		goto err;
+	}
+
+	if (hidx_fill(seg, hidx, buf) < 0)
+		goto err;
+
+	seg->hidx = hidx;
+	return 0;
+
+err:
+	hidx_free(hidx);
+	return -1;
+}
+
+
+/*
+ * Allocates a hash index for n keys, the minimal perfect hash function and
+ * slots are left for the caller
+ */
+static struct segf_hash_index *hidx_init(unsigned int n)
+{
+	struct segf_hash_index *hidx;
+
+	if ((hidx = calloc(1, sizeof(struct segf_hash_index))) == NULL)
+		return NULL;
+
+	hidx->n = n;
+	return hidx;
+}
+
+
+/*
+ * Reads the slot table of a hash index into RAM, the keys and tombstone
+ * bits are copied and the offsets Elias-Fano encoded. Every key must map
+ * to its own slot and every offset must be in the key value pairs of the
+ * segment file.
+ *
+ * Returns:
+ *	-1 if there is an error (check errno, EIO if the slot table is
+ *	corrupt), 0 otherwise
+ */
+static int hidx_fill(struct segment_file *seg, struct segf_hash_index *hidx,
+		     const char *slots)
+{
+	unsigned int  *offsets, n = hidx->n, i;
+	uint32_t      v;
+	int           key;
+
+	hidx->keys = malloc((n + 1) * sizeof(int));
+	hidx->dels = calloc(n / 64 + 1, sizeof(uint64_t));
+	offsets = malloc((n + 1) * sizeof(unsigned int));
+	if (hidx->keys == NULL || hidx->dels == NULL || offsets == NULL)
+		goto err;
+
+	for (i = 0; i < n; ++i) {
+		read_slot(slots, i, &key, &v);
+		offsets[i] = v & ~SEGF_SLOT_DEL;
+		if (mph_lookup(hidx->mph, key) != (int)i ||
+		    offsets[i] < SEGF_HDR_SZ || offsets[i] >= seg->data_end) {
+			errno = EIO;
+			goto err;
+		}
+
+		hidx->keys[i] = key;
+		if (v & SEGF_SLOT_DEL)
+			hidx->dels[i / 64] |= 1ULL << (i % 64);
+	}
+
+	// records are in slot order, ef_build only fails on a corrupt table
+	if ((hidx->offsets = ef_build(offsets, n)) == NULL) {
+		if (errno == EINVAL)
+			errno = EIO;
+		goto err;
+	}
+
+	hidx->mem = (n + 1) * sizeof(int) + (n / 64 + 1) * sizeof(uint64_t)
+		  + ((uint64_t)hidx->offsets->nhigh
+		     + ((uint64_t)n * hidx->offsets->low_len) / 64 + 1)
+		    * sizeof(uint64_t)
+		  + (n / EF_SAMPLE + 1) * sizeof(uint32_t);
+	free(offsets);
+	return 0;
+
+err:
+	hidx_drop_slots(hidx);
+	free(offsets);
+	return -1;
+}
+
+
+/*
+ * Frees the in RAM slots of a hash index
+ */
+static void hidx_drop_slots(struct segf_hash_index *hidx)
+{
+	if (hidx->offsets)
+		ef_free(hidx->offsets);
+	free(hidx->keys);
+	free(hidx->dels);
+	hidx->offsets = NULL;
+	hidx->keys = NULL;
+	hidx->dels = NULL;
+}
+
+
+/*
+ * Frees a hash index, unmapping its slot table if it is mapped
+ */
+static void hidx_free(struct segf_hash_index *hidx)
+{
+	if (hidx->mph)
+		mph_free(hidx->mph);
+	if (hidx->map)
+		munmap(hidx->map, hidx->map_len);
+	hidx_drop_slots(hidx);
+	free(hidx);
+}
+
+
+/*
+ * Reads the key and offset, with the SEGF_SLOT_DEL bit, of slot i of an
+ * encoded slot table
+ */
+static void read_slot(const char *slots, unsigned int i, int *key,
+		      uint32_t *v)
+{
+	memcpy(key, slots + i * SEGF_SLOT_SZ, sizeof(int));
+	memcpy(v, slots + i * SEGF_SLOT_SZ + sizeof(int), sizeof(uint32_t));
+}
+
+
+/*
+ * Finds the key in a hashed segment file. The slot is read from RAM, or
+ * from the mapped slot table if the index has been demoted, which may
+ * fault in a page of the file.
+ *
+ * Returns:
+ *	see segf_read_memtable
+ */
+static int hashed_find(struct segment_file *seg, int key, uint64_t *offset)
+{
+	struct segf_hash_index  *hidx = seg->hidx;
+	int                     slot = mph_lookup(hidx->mph, key), k;
+	uint32_t                v;
+
+	if (slot < 0)
+		return MEMTE_MISSING;
+
+	if (hidx->slots) {
+		read_slot(hidx->slots, slot, &k, &v);
+		if (k != key)
+			return MEMTE_MISSING;
+		*offset = v & ~SEGF_SLOT_DEL;
+		return (v & SEGF_SLOT_DEL) ? MEMTE_DELETED : MEMTE_LIVE;
+	}
+
+	if (hidx->keys[slot] != key)
+		return MEMTE_MISSING;
+
+	*offset = ef_get(hidx->offsets, slot);
+	if (hidx->dels[slot / 64] & (1ULL << (slot % 64)))
+		return MEMTE_DELETED;
+	return MEMTE_LIVE;
+}
+
+
+/*
+ * Fills the cursor with the entries of a hashed segment file, slot order
+ * is offset order so the offsets are decoded one after the other
+ */
+static int load_hashed_entries(struct segf_cursor *cur)
+{
+	struct segf_hash_index  *hidx = cur->seg->hidx;
+	struct memtable_entry   *e;
+	struct ef_iter          it;
+	uint32_t                v;
+	unsigned int            off;
+
+	cur->n = hidx->n;
+	if ((cur->entries = malloc((cur->n + 1) * sizeof(struct memtable_entry))) == NULL)
+		return -1;
+
+	if (hidx->slots) {
+		for (int slot = 0; slot < cur->n; ++slot) {
+			e = &cur->entries[slot];
+			read_slot(hidx->slots, slot, &e->key, &v);
+			e->offset = v & ~SEGF_SLOT_DEL;
+			e->deleted = (v & SEGF_SLOT_DEL) != 0;
+			e->next = NULL;
+		}
+		return 0;
+	}
+
+	ef_iter_init(hidx->offsets, &it);
+	for (int slot = 0; slot < cur->n; ++slot) {
+		e = &cur->entries[slot];
+		e->key = hidx->keys[slot];
+		ef_next(&it, &off);
+		e->offset = off;
+		e->deleted = (hidx->dels[slot / 64] >> (slot % 64)) & 1;
+		e->next = NULL;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Finds the key in a sorted segment file. Only the block the key would
+ * be in is read.
+ *
+ * Returns:
+ *	see segf_read_memtable
+ */
+static int sorted_find(struct segment_file *seg, int key, uint64_t *offset)
+{
+	struct record_hdr  hdr;
+	unsigned int       start, len, pos;
+	char               *block;
+	int                lo = 0, hi = seg->nfences, res = MEMTE_MISSING;
+
+	// the last block that starts at or before the key
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (seg->fences[mid].key <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return MEMTE_MISSING;
+
+	if ((block = read_block(seg, lo - 1, &start, &len)) == NULL)
+		return -1;
+
+	for (pos = 0; pos < len; pos += rec_size(&hdr)) {
+		if (rec_decode_hdr(block + pos, len - pos, &hdr) < 0) {
+			errno = EIO;
+			res = -1;
+			break;
+		}
+
+		if (hdr.key >= key) { // keys are sorted, stop at the first match
+			if (hdr.key == key) {
+				*offset = start + pos;
+				res = (hdr.flags & REC_DEL) ? MEMTE_DELETED : MEMTE_LIVE;
+			}
+			break;
+		}
+	}
+
+	free(block);
+	return res;
+}
+
+
+/*
+ * Reads the i'th block of a sorted segment file
+ *
+ * Parameters:
+ *	seg => sorted segment file
+ *	i => index of the block's fence
+ *	start => where to store the offset of the block
+ *	len => where to store the length of the block
+ *
+ * Returns:
+ *	The block (caller must free it), or NULL if there is an error (check
+ *	errno)
+ */
+static char *read_block(struct segment_file *seg, int i, unsigned int *start,
+			unsigned int *len)
+{
+	char     *block;
+	ssize_t  n;
+
+	*start = seg->fences[i].offset;
+	*len = ((i + 1 < seg->nfences) ? seg->fences[i + 1].offset
+				       : seg->data_end) - *start;
+
+	if ((block = malloc(*len)) == NULL)
+		return NULL;
+
+	if (fd_acquire(seg) < 0) {
+		free(block);
+		return NULL;
+	}
+
+	n = pread(seg->seg_fd, block, *len, *start);
+	fd_release(seg);
+	if (n != (ssize_t)*len) {
+		if (n >= 0)
+			errno = EIO;
+		free(block);
+		return NULL;
+	}
+
+	return block;
+}
+
+
+/*
+ * Fills the cursor with the entries of a sorted segment file, reading it
+ * block by block
+ */
+static int load_sorted_entries(struct segf_cursor *cur)
+{
+	struct segment_file    *seg = cur->seg;
+	struct memtable_entry  *entries = NULL, *e;
+	struct record_hdr      hdr;
+	unsigned int           start, len, pos;
+	char                   *block;
+	int                    cap = 0;
+
+	cur->n = 0;
+	for (int i = 0; i < seg->nfences; ++i) {
+		if ((block = read_block(seg, i, &start, &len)) == NULL)
+			goto err;
+
+		for (pos = 0; pos < len; pos += rec_size(&hdr)) {
+			if (rec_decode_hdr(block + pos, len - pos, &hdr) < 0) {
+				free(block);
+				errno = EIO;
+				goto err;
+			}
+
+			if (cur->n == cap) {
+				cap = (cap) ? cap * 2 : 16;
+				e = realloc(entries, cap * sizeof(struct memtable_entry));
+				if (e == NULL) {
+					free(block);
+					goto err;
+				}
+				entries = e;
+			}
+
+			e = &entries[cur->n++];
+			e->key = hdr.key;
+			e->offset = start + pos;
+			e->deleted = (hdr.flags & REC_DEL) ? 1 : 0;
+			e->next = NULL;
+		}
+
+		free(block);
+	}
+
+	cur->entries = entries;
+	return 0;
 
-	seg->next = NULL;	
+err:
+	free(entries);
+	return -1;
 }
@@ -1,7 +1,12 @@
 #ifndef _HASHDB_SEGMENT_FILE_H_
 #define _HASHDB_SEGMENT_FILE_H_
 
+#include <pthread.h>
+
+#include "eliasfano.h"
 #include "memtable.h"
+#include "mph.h"
+#include "record.h"
 
 // Use a small max segment file size when running tests
 #ifdef TESTING
@@ -10,75 +15,350 @@
 #define MAX_SEG_FILE_SIZE 1024
 #endif
 
+// Size in bytes a block of a sorted segment file grows to before the next
+// key starts a new block, every block costs one fence in memory
+#ifdef TESTING
+#define SEGF_BLOCK_SZ 32
+#else
+#define SEGF_BLOCK_SZ 256
+#endif
+
+// Max number of segment file descriptors the descriptor cache keeps open,
+// see segf_fd_cache_limit. Build with -DSEGF_FD_CACHE_SZ=<n> to change it.
+#ifndef SEGF_FD_CACHE_SZ
+#ifdef TESTING
+#define SEGF_FD_CACHE_SZ 8
+#else
+#define SEGF_FD_CACHE_SZ 512
+#endif
+#endif
+
+// Records of segf_read_batch whose offsets are this many bytes apart or
+// closer are read with one op, along with the bytes between them. A run
+// of such records spans no more than SEGF_BATCH_SPAN bytes, and the read
+// goes SEGF_BATCH_READAHEAD bytes past the header of the last one in the
+// hope of getting its value too.
+#ifdef TESTING
+#define SEGF_BATCH_GAP       64
+#define SEGF_BATCH_SPAN      256
+#define SEGF_BATCH_READAHEAD 8
+#else
+#define SEGF_BATCH_GAP       4096
+#define SEGF_BATCH_SPAN      (1 << 16)
+#define SEGF_BATCH_READAHEAD 512
+#endif
+
+// Max number of records segf_append_batch writes with one writev, each
+// takes up to 3 iovecs (header, value, checksum) of the IOV_MAX of 1024
+#define SEGF_APPEND_BATCH 256
+
+// Header flags given to newly created segment files. Build with
+// -DSEGF_CHECKSUMS to store a crc32 after every record.
+#ifdef SEGF_CHECKSUMS
+#define SEGF_DEFAULT_FLAGS SEGF_HDR_CHECKSUM
+#else
+#define SEGF_DEFAULT_FLAGS 0
+#endif
+
+
+// Range tombstone held in memory by the segment file it was read from
+struct segf_range_del {
+	int lo;       // first key in the range
+	int hi;       // last key in the range
+	uint64_t seq; // sequence number of the range tombstone
+};
+
+
+// First key and offset of a block in a sorted segment file
+struct segf_fence {
+	int key;             // first key in the block
+	unsigned int offset; // offset of the first record in the block
+};
+
+
+// Index of a hashed segment file (SEGF_HDR_HASHED), every key has a slot
+// given by the minimal perfect hash function. The slot table is stored in
+// the file (see record.h). It is either held in RAM, where the records
+// being in slot order lets the offsets be kept Elias-Fano encoded, or
+// demoted and probed in place through a read only mapping of the file.
+struct segf_hash_index {
+	struct mph *mph;          // maps each key of the segment file to its slot
+	unsigned int n;           // number of slots
+	int *keys;                // key of every slot, tells unknown keys apart
+	struct ef *offsets;       // memtable offset of every slot
+	uint64_t *dels;           // bit set for every slot holding a tombstone
+	size_t mem;               // bytes keys, offsets and dels take
+	unsigned int slots_off;   // offset of the slot table in the file
+	const char *slots;        // mapped slot table, NULL while in RAM
+	void *map;                // start of the mapping of the slot table
+	size_t map_len;           // length of the mapping
+};
+
 
 // Represents a segment file that stores the databases key value pairs
 struct segment_file {
 	// size in bytes of the segment file
-	unsigned int size;
+	uint64_t size;
 
 	// name of the segment file (allocated on heap)
 	char *name;
 
-	// file descriptor of open segment file
+	// file descriptor of open segment file, -1 while the descriptor
+	// cache has it closed
 	int seg_fd;
 
-	// index of the next hash bucket used by segf_next_key
-	int next_bucket;
+	// number of calls using seg_fd right now, the descriptor cache only
+	// closes it while there are none
+	int fd_users;
+
+	// neighbors in the descriptor cache LRU list, which holds the open
+	// segment files with no fd_users, most recently used first
+	struct segment_file *lru_prev;
+	struct segment_file *lru_next;
+
+	// on disk format of the segment file (SEGF_V1 or SEGF_V2)
+	int version;
+
+	// SEGF_HDR_* flags from the segment file header
+	unsigned char flags;
+
+	// 1 once a newer segment file has taken over as the head, sealed
+	// segment files and their memtables never change again
+	int sealed;
+
+	// largest sequence number of any record in the segment file
+	uint64_t max_seq;
+
+	// ID of the segment file in the database manifest, 0 if it is in
+	// none
+	uint64_t id;
+
+	// number of holders of the struct, the database list and any
+	// snapshots, see segf_ref and segf_unref
+	int refs;
+
+	// 1 once the memtable or index has been read from the file, 0 for a
+	// segment file opened with segf_open_lazy until segf_load
+	int loaded;
 
-	// next entry in the bucket chain used by segf_next_key
-	struct memtable_entry *next_entry;
+	// held while loading, so a background loader and a reader never
+	// load the same segment file twice
+	pthread_mutex_t load_lock;
 
 	// pointer to segment files memtable
 	struct memtable *table;
 
-	// pointer to the next (older) segment file struct
-	struct segment_file *next;
+	// range tombstones in the segment file sorted by the start of their
+	// range, range tombstones are kept out of the memtable
+	struct segf_range_del *range_dels;
+
+	// number of range tombstones
+	int nrange_dels;
+
+	// fence index of a sorted segment file (SEGF_HDR_SORTED), its keys
+	// are found through the fences and the memtable stays empty
+	struct segf_fence *fences;
+
+	// number of fences
+	int nfences;
+
+	// hash index of a hashed segment file (SEGF_HDR_HASHED), NULL for
+	// other segment files
+	struct segf_hash_index *hidx;
+
+	// number of lookups that reached the segment file since the index
+	// budget was last balanced, see hashDB_balance_indexes
+	unsigned int hits;
+
+	// end of the key value pairs in a sorted or hashed segment file
+	uint64_t data_end;
+
+	// records with an expiry time indexed so far (see hashDB_put_ttl),
+	// the bytes they take, and the earliest and latest expiry time
+	// among them. Sorted and hashed segment files only have these when
+	// they were written since the database was opened.
+	unsigned int nttl;
+	uint64_t ttl_bytes;
+	uint64_t ttl_min;
+	uint64_t ttl_max;
+};
+
+
+// Segment files of a database in one array, newest first. A hash table
+// from segment file ID to position finds any segment file without
+// walking the array. The table is changed in place, a reader that needs
+// a stable view (a snapshot, the background loader) copies the array on
+// the thread that owns the database and references the segment files.
+struct segf_table {
+	struct segment_file **segs; // segment files, newest first
+	int n;                      // number of segment files
+	int cap;                    // number of segment files segs can hold
+	int *pos;                   // open addressing hash table of positions
+	                            // in segs by ID, -1 for empty slots
+	unsigned int npos;          // number of slots, twice cap
+};
+
+
+// Walks the keys of a segment file in the order their records appear in
+// the file. The cursor works on its own copy of the memtable entries (for
+// sorted segment files they are read from the file), so any number of
+// cursors can walk the same segment file and appends made while walking
+// are not seen.
+struct segf_cursor {
+	// segment file the records are read from
+	struct segment_file *seg;
+
+	// memtable entries sorted by offset (next pointers are unused)
+	struct memtable_entry *entries;
+
+	// number of entries
+	int n;
+
+	// index of the next entry to return, pos - 1 is the current one
+	int pos;
+};
+
+
+// Counters of the descriptor cache, see segf_fd_cache_stats
+struct segf_fd_stats {
+	uint64_t hits;      // accesses that found the descriptor open
+	uint64_t misses;    // accesses that had to open the file
+	uint64_t evictions; // descriptors closed to stay within the limit
+	int open;           // descriptors open now
+	int limit;          // max descriptors kept open
+};
+
+
+// A record for segf_read_batch to read
+struct segf_read {
+	struct segment_file *seg; // segment file holding the record
+	uint64_t offset;          // memtable offset of the record
+	struct record_hdr hdr;    // header of the record, set by the read
+	char *val;                // value in the arena (null terminated),
+	                          // set by the read
 };
 
 
 #define TOMBSTONE_INS 0 // tombstone for inserting a kv pair
 #define TOMBSTONE_DEL 1 // tombstone for deleting a kv pair
 
+// Returned by segf_read_file when the key has a tombstone in the segment
+#define SEGF_DELETED MEMTE_DELETED
+
 
 /* Struct constructors and destructors */
 struct segment_file *segf_init(char *name);
 
 void segf_free(struct segment_file *seg);
 
+void segf_ref(struct segment_file *seg);
+
+void segf_unref(struct segment_file *seg);
+
 
 /* Segment file IO functions */
 int segf_create_file(struct segment_file *seg);
 
 int segf_open_file(struct segment_file *seg);
 
+int segf_open_lazy(struct segment_file *seg);
+
+void segf_open_known(struct segment_file *seg, int version,
+		     unsigned char flags, uint64_t size);
+
 void segf_close_file(struct segment_file *seg);
 
 int segf_delete_file(struct segment_file *seg);
 
+int segf_retire_file(struct segment_file *seg);
+
 int segf_rename_file(struct segment_file *seg, char *name);
 
 int segf_read_file(struct segment_file *seg, int key, char **val);
 
 int segf_append(struct segment_file *seg, int key, char *val, char tombstone);
 
+int segf_append_rec(struct segment_file *seg, struct record_hdr *hdr,
+		    char *val);
+
+int segf_append_batch(struct segment_file *seg, struct record_hdr *hdrs,
+		      char **vals, int n);
+
+int segf_lookup(struct segment_file *seg, int key, struct record_hdr *hdr,
+		char **val);
+
+int segf_read_rec(struct segment_file *seg, uint64_t offset,
+		  struct record_hdr *hdr, char **val);
+
+int segf_read_batch(struct segf_read *reads, int n, char *arena, size_t len,
+		    size_t *used);
+
 int segf_remove_pair(struct segment_file *seg, int key);
 
+uint64_t segf_kv_size(struct segment_file *seg, int key, int val_len,
+		      uint64_t seq);
+
+uint64_t segf_range_cover(struct segment_file *seg, int key, uint64_t max_seq);
+
+int segf_finish_sorted(struct segment_file *seg);
+
+int segf_finish_hashed(struct segment_file *seg);
+
 
 /* Segment file memtable functions */
 int segf_repop_memtable(struct segment_file *seg);
 
-int segf_update_memtable(struct segment_file *seg, int key, unsigned int offset);
+int segf_load(struct segment_file *seg);
+
+int segf_loaded(struct segment_file *seg);
+
+uint64_t segf_size(struct segment_file *seg);
+
+int segf_update_memtable(struct segment_file *seg, int key, uint64_t offset);
+
+int segf_read_memtable(struct segment_file *seg, int key, uint64_t *offset);
+
+int segf_demote_index(struct segment_file *seg);
+
+int segf_promote_index(struct segment_file *seg);
+
+size_t segf_index_mem(struct segment_file *seg);
+
+
+
+/* Segment file descriptor cache functions */
+void segf_fd_cache_limit(int limit);
+
+void segf_fd_cache_stats(struct segf_fd_stats *stats);
+
+
+/* Segment file cursor functions */
+struct segf_cursor *segf_cursor_init(struct segment_file *seg,
+				     struct memtable *tbl);
+
+int segf_cursor_next(struct segf_cursor *cur, int *key);
+
+struct memtable_entry *segf_cursor_entry(struct segf_cursor *cur);
+
+int segf_cursor_read(struct segf_cursor *cur, struct record_hdr *hdr,
+		     char **val);
+
+void segf_cursor_free(struct segf_cursor *cur);
+
+
+/* Segment file table functions */
+int segf_table_init(struct segf_table *t);
 
-int segf_read_memtable(struct segment_file *seg, int key, unsigned int *offset);
+void segf_table_free(struct segf_table *t);
 
-int segf_next_key(struct segment_file *seg);
+int segf_table_insert(struct segf_table *t, int i, struct segment_file *seg);
 
-void segf_reset_next_key(struct segment_file *seg);
+void segf_table_replace(struct segf_table *t, int i, struct segment_file *seg);
 
+void segf_table_remove(struct segf_table *t, int i);
 
-/* Segment file linked list functions */
-void segf_link_before(struct segment_file *s1, struct segment_file *s2);
+int segf_table_find(struct segf_table *t, uint64_t id);
 
-void segf_unlink(struct segment_file **head, struct segment_file *seg);
+int segf_table_pos(struct segf_table *t, struct segment_file *seg);
 
 #endif
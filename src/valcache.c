@@ -0,0 +1,497 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "valcache.h"
+
+/* 'Private' helper functions */
+static unsigned int bucket_of(struct vcache *, uint64_t, uint64_t);
+
+static struct vcache_entry *find_entry(struct vcache *, uint64_t, uint64_t);
+
+static size_t entry_size(unsigned int);
+
+static void leave_window(struct vcache *, struct vcache_entry *);
+
+static struct vcache_entry *clock_victim(struct vcache *);
+
+static void drop(struct vcache *, struct vcache_entry *);
+
+static void ring_insert(struct vcache_entry **, struct vcache_entry *);
+
+static void ring_remove(struct vcache_entry **, struct vcache_entry *);
+
+static void grow(struct vcache *);
+
+static uint64_t key_hash(int);
+
+static void sketch_add(struct vcache_sketch *, int);
+
+static unsigned int sketch_estimate(struct vcache_sketch *, int);
+
+
+/*
+ * Allocates an empty value cache
+ *
+ * Parameters:
+ *	budget => max bytes the cached values, and the entries holding
+ *	          them, may take
+ *	policy => VCACHE_CLOCK or VCACHE_TINYLFU
+ *
+ * Returns:
+ *	Pointer to a vcache struct, caller must free it by calling
+ *	vcache_free, or NULL if there is no memory available
+ */
+struct vcache *vcache_init(size_t budget, int policy)
+{
+	struct vcache  *c;
+	unsigned int   width = 64;
+
+	if ((c = calloc(1, sizeof(struct vcache))) == NULL)
+		return NULL;
+
+	c->nbuckets = VCACHE_MIN_BUCKETS;
+	if ((c->buckets = calloc(c->nbuckets, sizeof(*c->buckets))) == NULL) {
+		free(c);
+		return NULL;
+	}
+
+	if (policy == VCACHE_TINYLFU) {
+		c->win_budget = budget * VCACHE_WINDOW_PCT / 100;
+		while (width < budget / VCACHE_SKETCH_RATIO)
+			width *= 2;
+		c->sketch.width = width;
+		c->sketch.counts = calloc((size_t)width * VCACHE_SKETCH_DEPTH, 1);
+		if (c->sketch.counts == NULL) {
+			free(c->buckets);
+			free(c);
+			return NULL;
+		}
+	}
+
+	c->policy = policy;
+	c->budget = budget;
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+}
+
+
+/*
+ * Deallocates the value cache and every entry in it
+ *
+ * Parameter:
+ *	c => pointer to the value cache to free
+ *
+ * Returns:
+ *	void
+ */
+void vcache_free(struct vcache *c)
+{
+	struct vcache_entry *e, *next;
+
+	for (unsigned int b = 0; b < c->nbuckets; ++b) {
+		for (e = c->buckets[b]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+
+	pthread_mutex_destroy(&c->lock);
+	free(c->sketch.counts);
+	free(c->buckets);
+	free(c);
+}
+
+
+/*
+ * Looks up the value of a record. The lookup is counted for the key
+ * whether the value is found or not. A hit marks the entry so the clock
+ * hand passes over it once before it can be evicted, a window entry keeps
+ * the mark when it moves to the clock and goes to the back of the window.
+ *
+ * Parameters:
+ *	c => value cache to look in
+ *	key => key of the record
+ *	seg_id => ID of the segment file the record is in
+ *	offset => memtable offset of the record
+ *	seq => where to store the sequence number of the record
+ *	val => where to store a copy of the value (null terminated, caller
+ *	       must free it)
+ *
+ * Returns:
+ *	1 if the value was found, 0 if it was not, or -1 if there is no
+ *	memory available for the copy
+ */
+int vcache_get(struct vcache *c, int key, uint64_t seg_id, uint64_t offset,
+	       uint64_t *seq, char **val)
+{
+	struct vcache_entry  *e;
+	int                  res = 0;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->policy == VCACHE_TINYLFU)
+		sketch_add(&c->sketch, key);
+
+	if ((e = find_entry(c, seg_id, offset)) == NULL) {
+		c->stats.misses += 1;
+	} else if ((*val = malloc(e->val_len + 1)) == NULL) {
+		res = -1;
+	} else {
+		memcpy(*val, e->val, e->val_len + 1);
+		*seq = e->seq;
+		c->stats.hits += 1;
+		res = 1;
+
+		e->ref = 1;
+		if (e->in_window) {
+			ring_remove(&c->win, e);
+			ring_insert(&c->win, e);
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	return res;
+}
+
+
+/*
+ * Adds the value of a record to the admission window, and admits or
+ * drops the values the window pushes out (see struct vcache). A value
+ * that would take more than the whole budget is not cached.
+ *
+ * Parameters:
+ *	c => value cache to add to
+ *	key => key of the record
+ *	seg_id => ID of the segment file the record is in
+ *	offset => memtable offset of the record
+ *	seq => sequence number of the record
+ *	val => value of the record
+ *	val_len => length of the value, not including the null char
+ *
+ * Returns:
+ *	1 if the value was added, 0 if it was already cached or is too
+ *	large, or -1 if there is no memory available
+ */
+int vcache_put(struct vcache *c, int key, uint64_t seg_id, uint64_t offset,
+	       uint64_t seq, const char *val, unsigned int val_len)
+{
+	struct vcache_entry  *e;
+	size_t               sz = entry_size(val_len);
+	unsigned int         b;
+
+	if (sz > c->budget)
+		return 0;
+
+	if ((e = malloc(sz)) == NULL)
+		return -1;
+
+	e->seg_id = seg_id;
+	e->offset = offset;
+	e->seq = seq;
+	e->key = key;
+	e->val_len = val_len;
+	e->ref = 0;
+	e->in_window = 1;
+	memcpy(e->val, val, val_len);
+	e->val[val_len] = '\0';
+
+	pthread_mutex_lock(&c->lock);
+	if (find_entry(c, seg_id, offset)) { // another reader got here first
+		pthread_mutex_unlock(&c->lock);
+		free(e);
+		return 0;
+	}
+
+	b = bucket_of(c, seg_id, offset);
+	e->next = c->buckets[b];
+	c->buckets[b] = e;
+	c->stats.bytes += sz;
+	c->stats.entries += 1;
+	if (c->stats.entries > c->nbuckets)
+		grow(c);
+
+	ring_insert(&c->win, e);
+	c->win_bytes += sz;
+	while (c->win_bytes > c->win_budget)
+		leave_window(c, c->win);
+
+	pthread_mutex_unlock(&c->lock);
+	return 1;
+}
+
+
+/*
+ * Copies the counters of the value cache
+ *
+ * Parameters:
+ *	c => value cache to read
+ *	s => where to store the counters
+ *
+ * Returns:
+ *	void
+ */
+void vcache_stats(struct vcache *c, struct vcache_stats *s)
+{
+	pthread_mutex_lock(&c->lock);
+	*s = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+/*
+ * Estimates how often the key has been looked up recently
+ *
+ * Parameters:
+ *	c => value cache to ask
+ *	key => key to estimate
+ *
+ * Returns:
+ *	The estimate, at most VCACHE_SKETCH_MAX, or 0 for a VCACHE_CLOCK
+ *	cache
+ */
+unsigned int vcache_estimate(struct vcache *c, int key)
+{
+	unsigned int est = 0;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->policy == VCACHE_TINYLFU)
+		est = sketch_estimate(&c->sketch, key);
+	pthread_mutex_unlock(&c->lock);
+	return est;
+}
+
+
+/*
+ * Returns the bucket of the record with the given segment file ID and
+ * offset
+ */
+static unsigned int bucket_of(struct vcache *c, uint64_t seg_id,
+			      uint64_t offset)
+{
+	uint64_t h = (seg_id * 0x9E3779B97F4A7C15ULL) ^ offset;
+
+	h *= 0xBF58476D1CE4E5B9ULL;
+	return (h ^ (h >> 31)) & (c->nbuckets - 1);
+}
+
+
+/*
+ * Returns the entry of the record with the given segment file ID and
+ * offset, or NULL if it is not cached
+ */
+static struct vcache_entry *find_entry(struct vcache *c, uint64_t seg_id,
+				       uint64_t offset)
+{
+	struct vcache_entry *e = c->buckets[bucket_of(c, seg_id, offset)];
+
+	while (e && (e->seg_id != seg_id || e->offset != offset))
+		e = e->next;
+	return e;
+}
+
+
+/*
+ * Returns the number of bytes an entry holding a value of the given
+ * length takes
+ */
+static size_t entry_size(unsigned int val_len)
+{
+	return sizeof(struct vcache_entry) + val_len + 1;
+}
+
+
+/*
+ * Moves an entry out of the admission window onto the clock, right
+ * behind the hand, and evicts entries until the cache is within its
+ * budget. If the cache is full, a VCACHE_TINYLFU cache first checks the
+ * entry's key has been looked up more often than the key of the entry the
+ * clock would evict, and drops the entry instead if not.
+ */
+static void leave_window(struct vcache *c, struct vcache_entry *e)
+{
+	struct vcache_entry *victim;
+
+	if (c->policy == VCACHE_TINYLFU && c->hand &&
+	    c->stats.bytes > c->budget) {
+		victim = clock_victim(c);
+		if (sketch_estimate(&c->sketch, e->key) <=
+		    sketch_estimate(&c->sketch, victim->key)) {
+			drop(c, e);
+			c->stats.rejections += 1;
+			return;
+		}
+	}
+
+	ring_remove(&c->win, e);
+	c->win_bytes -= entry_size(e->val_len);
+	e->in_window = 0;
+
+	// only the window is left once the clock is empty, it fits
+	ring_insert(&c->hand, e);
+	while (c->stats.bytes > c->budget && c->hand) {
+		drop(c, clock_victim(c));
+		c->stats.evictions += 1;
+	}
+}
+
+
+/*
+ * Moves the clock hand to the first entry that has not been hit since the
+ * hand last passed it, clearing the marks it passes, and returns that
+ * entry. The clock must not be empty.
+ */
+static struct vcache_entry *clock_victim(struct vcache *c)
+{
+	while (c->hand->ref) {
+		c->hand->ref = 0;
+		c->hand = c->hand->clk_next;
+	}
+	return c->hand;
+}
+
+
+/*
+ * Removes the entry from the cache and frees it
+ */
+static void drop(struct vcache *c, struct vcache_entry *e)
+{
+	struct vcache_entry **pp;
+
+	if (e->in_window) {
+		ring_remove(&c->win, e);
+		c->win_bytes -= entry_size(e->val_len);
+	} else {
+		ring_remove(&c->hand, e);
+	}
+
+	pp = &c->buckets[bucket_of(c, e->seg_id, e->offset)];
+	while (*pp != e)
+		pp = &(*pp)->next;
+	*pp = e->next;
+
+	c->stats.bytes -= entry_size(e->val_len);
+	c->stats.entries -= 1;
+	free(e);
+}
+
+
+/*
+ * Adds the entry to a circular list just before the given head, which
+ * is the last place going around from the head reaches
+ */
+static void ring_insert(struct vcache_entry **head, struct vcache_entry *e)
+{
+	if (*head == NULL) {
+		e->clk_next = e->clk_prev = e;
+		*head = e;
+		return;
+	}
+
+	e->clk_next = *head;
+	e->clk_prev = (*head)->clk_prev;
+	e->clk_prev->clk_next = e;
+	(*head)->clk_prev = e;
+}
+
+
+/*
+ * Removes the entry from a circular list, the entry after it becomes
+ * the head if it was the head
+ */
+static void ring_remove(struct vcache_entry **head, struct vcache_entry *e)
+{
+	if (e->clk_next == e) {
+		*head = NULL;
+		return;
+	}
+
+	e->clk_prev->clk_next = e->clk_next;
+	e->clk_next->clk_prev = e->clk_prev;
+	if (*head == e)
+		*head = e->clk_next;
+}
+
+
+/*
+ * Doubles the number of buckets. The cache keeps working with the old
+ * buckets if there is no memory available.
+ */
+static void grow(struct vcache *c)
+{
+	struct vcache_entry  **old = c->buckets, *e, *next;
+	unsigned int         nold = c->nbuckets, b;
+
+	if ((c->buckets = calloc(nold * 2, sizeof(*c->buckets))) == NULL) {
+		c->buckets = old;
+		return;
+	}
+
+	c->nbuckets = nold * 2;
+	for (unsigned int i = 0; i < nold; ++i) {
+		for (e = old[i]; e; e = next) {
+			next = e->next;
+			b = bucket_of(c, e->seg_id, e->offset);
+			e->next = c->buckets[b];
+			c->buckets[b] = e;
+		}
+	}
+
+	free(old);
+}
+
+
+/*
+ * Mixes the bits of the key, the two halves of the result give the
+ * counters of the key in every row of the sketch
+ */
+static uint64_t key_hash(int key)
+{
+	uint64_t h = (uint32_t)key;
+
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+	return h ^ (h >> 31);
+}
+
+
+/*
+ * Counts a lookup of the key, halving every counter once the sketch has
+ * counted 10 lookups per counter in a row
+ */
+static void sketch_add(struct vcache_sketch *sk, int key)
+{
+	uint64_t      h = key_hash(key);
+	uint32_t      h1 = h, h2 = (h >> 32) | 1;
+	unsigned int  mask = sk->width - 1;
+	uint8_t       *cnt;
+
+	for (unsigned int i = 0; i < VCACHE_SKETCH_DEPTH; ++i) {
+		cnt = &sk->counts[i * sk->width + ((h1 + i * h2) & mask)];
+		if (*cnt < VCACHE_SKETCH_MAX)
+			*cnt += 1;
+	}
+
+	if (++sk->adds >= 10 * sk->width) {
+		for (size_t i = 0; i < (size_t)sk->width * VCACHE_SKETCH_DEPTH; ++i)
+			sk->counts[i] >>= 1;
+		sk->adds /= 2;
+	}
+}
+
+
+/*
+ * Returns the estimate of how often the key was looked up, the smallest
+ * of its counters
+ */
+static unsigned int sketch_estimate(struct vcache_sketch *sk, int key)
+{
+	uint64_t      h = key_hash(key);
+	uint32_t      h1 = h, h2 = (h >> 32) | 1;
+	unsigned int  mask = sk->width - 1;
+	unsigned int  est = VCACHE_SKETCH_MAX, cnt;
+
+	for (unsigned int i = 0; i < VCACHE_SKETCH_DEPTH; ++i) {
+		cnt = sk->counts[i * sk->width + ((h1 + i * h2) & mask)];
+		if (cnt < est)
+			est = cnt;
+	}
+	return est;
+}
@@ -0,0 +1,117 @@
+#ifndef _HASHDB_VALCACHE_H_
+#define _HASHDB_VALCACHE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of buckets a value cache starts with, doubled whenever there are
+// more entries than buckets
+#define VCACHE_MIN_BUCKETS 64
+
+// Admission and eviction policies of a value cache
+#define VCACHE_CLOCK   0 // every value is admitted, evicted by CLOCK
+#define VCACHE_TINYLFU 1 // W-TinyLFU, see struct vcache
+
+// Percent of the budget the admission window of VCACHE_TINYLFU gets
+#define VCACHE_WINDOW_PCT 1
+
+// Rows of the count-min sketch, and bytes of budget per counter in a row
+#define VCACHE_SKETCH_DEPTH 4
+#define VCACHE_SKETCH_RATIO 256
+
+// Counters of the sketch saturate at this (they would fit in 4 bits)
+#define VCACHE_SKETCH_MAX 15
+
+
+// Value of a record held by the value cache. Records never move or change
+// once written and segment file IDs are never reused, so the ID of the
+// segment file and the offset of the record name the value for good.
+struct vcache_entry {
+	uint64_t seg_id;                // ID of the segment file of the record
+	uint64_t offset;                // memtable offset of the record
+	uint64_t seq;                   // sequence number of the record
+	int key;                        // key of the record
+	unsigned int val_len;           // length of the value
+	int ref;                        // set by every hit, cleared by the
+	                                // clock hand as it passes
+	int in_window;                  // 1 while in the admission window
+	struct vcache_entry *next;      // next entry in the bucket chain
+	struct vcache_entry *clk_prev;  // neighbors on the window or clock
+	struct vcache_entry *clk_next;
+	char val[];                     // value, null terminated
+};
+
+
+// Count-min sketch of how often keys were looked up. A key's estimate is
+// the smallest of its counters, one per row. Every counter is halved
+// once there have been 10 lookups per counter in a row, so the estimates
+// follow what is popular now.
+struct vcache_sketch {
+	uint8_t *counts;     // VCACHE_SKETCH_DEPTH rows of width counters
+	unsigned int width;  // counters per row, a power of 2
+	unsigned int adds;   // lookups counted since the last halving
+};
+
+
+// Counters of a value cache, see vcache_stats
+struct vcache_stats {
+	uint64_t hits;        // lookups that found the value
+	uint64_t misses;      // lookups that did not
+	uint64_t evictions;   // entries evicted to stay within the budget
+	uint64_t rejections;  // values the admission policy kept out
+	size_t bytes;         // bytes the entries take, with their values
+	unsigned int entries; // number of entries
+};
+
+
+// Cache of the values of recently read records with a byte budget.
+//
+// With VCACHE_TINYLFU new values go to a small admission window, kept in
+// LRU order. The value the window pushes out only gets into the rest of
+// the cache if its key has been looked up more often than the key of the
+// entry the clock would evict for it (estimated by the sketch), otherwise
+// it is dropped. A scan touches every key once and can't push out keys
+// that are looked up all the time. With VCACHE_CLOCK there is no window
+// and every value is admitted.
+//
+// The rest of the cache is a circular list, the clock. Entries are
+// evicted in the order the clock hand reaches them, unless they have
+// been hit since it last passed. Entries of segment files that
+// compaction or merging removed are never looked up again and are
+// evicted like any other cold entry.
+struct vcache {
+	int policy;                    // VCACHE_CLOCK or VCACHE_TINYLFU
+	size_t budget;                 // max bytes the entries may take
+	size_t win_budget;             // bytes of it for the window
+	size_t win_bytes;              // bytes the window entries take
+	struct vcache_entry **buckets; // hash table of the entries
+	unsigned int nbuckets;         // number of buckets, a power of 2
+	struct vcache_entry *win;      // least recently used window entry,
+	                               // NULL while the window is empty
+	struct vcache_entry *hand;     // next entry the clock hand reaches,
+	                               // NULL while the clock is empty
+	struct vcache_sketch sketch;   // lookup counts, VCACHE_TINYLFU only
+	struct vcache_stats stats;     // counters, bytes, and entries
+	pthread_mutex_t lock;          // held by every call
+};
+
+
+/* Struct constructors and destructors */
+struct vcache *vcache_init(size_t budget, int policy);
+
+void vcache_free(struct vcache *c);
+
+
+/* Value cache functions */
+int vcache_get(struct vcache *c, int key, uint64_t seg_id, uint64_t offset,
+	       uint64_t *seq, char **val);
+
+int vcache_put(struct vcache *c, int key, uint64_t seg_id, uint64_t offset,
+	       uint64_t seq, const char *val, unsigned int val_len);
+
+void vcache_stats(struct vcache *c, struct vcache_stats *s);
+
+unsigned int vcache_estimate(struct vcache *c, int key);
+
+#endif
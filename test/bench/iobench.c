@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../src/hashDB.h"
+#include "../../src/ioengine.h"
+
+// Defaults of the options
+#define DEFAULT_KEYS   20000
+#define DEFAULT_VAL_SZ 200
+#define DEFAULT_READS  20000
+
+// Queue depths measured, every batch of reads is this many records
+static const int depths[] = {1, 32};
+
+
+static int fill_db(const char *, int, int);
+
+static struct segf_read *find_records(struct hashDB *, int *);
+
+static void drop_cache(struct hashDB *);
+
+static void drop_batch(struct segf_read *, int);
+
+static double run(struct segf_read *, int, int, int, struct ioe_engine *);
+
+static double now(void);
+
+
+/*
+ * Random read benchmark of the I/O engines. Fills a database with keys,
+ * then reads random records of it through segf_read_batch in batches of
+ * one record (queue depth 1) and of 32 records (queue depth up to 32),
+ * with the POSIX and the io_uring engine. The segment files are synced
+ * before every run, and the cached pages of the segment files a batch
+ * reads are dropped before the batch, so every read goes to the device.
+ * Only the reads are timed.
+ */
+int main(int argc, char *argv[])
+{
+	struct hashDB      *db;
+	struct segf_read   *recs;
+	struct ioe_engine  *engines[2];
+	int                nkeys = DEFAULT_KEYS, val_sz = DEFAULT_VAL_SZ;
+	int                nreads = DEFAULT_READS, nrecs, opt;
+
+	while ((opt = getopt(argc, argv, "k:s:r:")) != -1) {
+		switch (opt) {
+		case 'k':
+			nkeys = atoi(optarg);
+			break;
+		case 's':
+			val_sz = atoi(optarg);
+			break;
+		case 'r':
+			nreads = atoi(optarg);
+			break;
+		default:
+			optind = argc + 1;
+		}
+	}
+
+	if (optind != argc - 1 || nkeys <= 0 || val_sz <= 0 || nreads <= 0) {
+		printf("Usage: %s [-k keys] [-s value size] [-r reads] "
+		       "[data_dir]\n", argv[0]);
+		exit(1);
+	}
+
+	// every segment file stays open, so the runs measure reads only
+	segf_fd_cache_limit(1 << 20);
+
+	if (fill_db(argv[optind], nkeys, val_sz) < 0 ||
+	    (db = hashDB_init(argv[optind])) == NULL ||
+	    (recs = find_records(db, &nrecs)) == NULL) {
+		printf("[!] Could not set up the database: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	engines[0] = ioe_posix_init();
+	if ((engines[1] = ioe_uring_init(IOE_DEFAULT_DEPTH)) == NULL)
+		printf("[!] io_uring engine not available: %s\n", strerror(errno));
+
+	printf("%d records in %d segment files, %d random reads per run\n",
+	       nrecs, db->segs.n, nreads);
+	printf("%-10s %6s %12s\n", "engine", "depth", "reads/s");
+	srand(1);
+	for (int e = 0; e < 2; ++e) {
+		if (engines[e] == NULL)
+			continue;
+		for (unsigned int d = 0; d < sizeof(depths) / sizeof(*depths); ++d) {
+			drop_cache(db);
+			printf("%-10s %6d %12.0f\n", engines[e]->name, depths[d],
+			       run(recs, nrecs, nreads, depths[d], engines[e]));
+		}
+	}
+
+	ioe_set_default(NULL);
+	ioe_free(engines[0]);
+	ioe_free(engines[1]);
+	free(recs);
+	hashDB_free(db);
+	exit(0);
+}
+
+
+/*
+ * Creates an empty database in data_dir and puts nkeys keys in it, each
+ * with a value of val_sz bytes
+ *
+ * Returns:
+ *	0 if successful, -1 otherwise (check errno)
+ */
+static int fill_db(const char *data_dir, int nkeys, int val_sz)
+{
+	struct hashDB  *db;
+	char           *val;
+	int            res = 0;
+
+	if ((val = malloc(val_sz + 1)) == NULL)
+		return -1;
+	memset(val, 'v', val_sz);
+	val[val_sz] = '\0';
+
+	if ((db = hashDB_mkempty(data_dir)) == NULL) {
+		free(val);
+		return -1;
+	}
+
+	for (int key = 0; key < nkeys && res == 0; ++key) {
+		if (hashDB_put(db, key, val_sz, val) < 0)
+			res = -1;
+	}
+
+	hashDB_free(db);
+	free(val);
+	return res;
+}
+
+
+/*
+ * Finds the record of every key in the database by walking the segment
+ * files with cursors
+ *
+ * Returns:
+ *	The records (caller must free them), or NULL if there is an error
+ */
+static struct segf_read *find_records(struct hashDB *db, int *nrecs)
+{
+	struct segf_cursor  *cur;
+	struct segf_read    *recs = NULL, *tmp;
+	int                 n = 0, cap = 0, key;
+
+	for (int i = 0; i < db->segs.n; ++i) {
+		struct segment_file *seg = db->segs.segs[i];
+
+		if ((cur = segf_cursor_init(seg, seg->table)) == NULL)
+			goto err;
+
+		while (segf_cursor_next(cur, &key)) {
+			if (segf_cursor_entry(cur)->deleted)
+				continue;
+			if (n == cap) {
+				cap = (cap) ? cap * 2 : 1024;
+				if ((tmp = realloc(recs, cap * sizeof(*recs))) == NULL) {
+					segf_cursor_free(cur);
+					goto err;
+				}
+				recs = tmp;
+			}
+			recs[n].seg = seg;
+			recs[n].offset = segf_cursor_entry(cur)->offset;
+			n += 1;
+		}
+		segf_cursor_free(cur);
+	}
+
+	*nrecs = n;
+	return recs;
+
+err:
+	free(recs);
+	return NULL;
+}
+
+
+/*
+ * Asks the kernel to drop the cached pages of every segment file
+ */
+static void drop_cache(struct hashDB *db)
+{
+	int fd;
+
+	for (int i = 0; i < db->segs.n; ++i) {
+		if ((fd = open(db->segs.segs[i]->name, O_RDONLY)) < 0)
+			continue;
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+
+/*
+ * Asks the kernel to drop the cached pages of the segment files of a
+ * batch of reads, the segment files must have been synced
+ */
+static void drop_batch(struct segf_read *batch, int n)
+{
+	int fd;
+
+	for (int i = 0; i < n; ++i) {
+		if (i > 0 && batch[i].seg == batch[i - 1].seg)
+			continue;
+		if ((fd = open(batch[i].seg->name, O_RDONLY)) < 0)
+			continue;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+
+/*
+ * Reads nreads random records in batches of depth records with the
+ * engine, the records of a batch sorted the way hashDB_multi_get sorts
+ * them. The pages of a batch are dropped from the page cache before it
+ * is read, the time that takes is not counted.
+ *
+ * Returns:
+ *	Records read per second
+ */
+static double run(struct segf_read *recs, int nrecs, int nreads, int depth,
+		  struct ioe_engine *engine)
+{
+	struct segf_read  batch[32], tmp;
+	char              *arena;
+	size_t            len = 1 << 20, used;
+	double            start, elapsed = 0;
+	int               done, i, j;
+
+	if ((arena = malloc(len)) == NULL)
+		return 0;
+
+	ioe_set_default(engine);
+	for (done = 0; done < nreads; done += depth) {
+		for (i = 0; i < depth; ++i)
+			batch[i] = recs[rand() % nrecs];
+
+		// group by segment file in the order of db->segs, then offset
+		for (i = 1; i < depth; ++i) {
+			tmp = batch[i];
+			for (j = i; j > 0 && (batch[j - 1].seg->id < tmp.seg->id ||
+			     (batch[j - 1].seg == tmp.seg &&
+			      batch[j - 1].offset > tmp.offset)); --j)
+				batch[j] = batch[j - 1];
+			batch[j] = tmp;
+		}
+
+		drop_batch(batch, depth);
+		used = 0;
+		start = now();
+		if (segf_read_batch(batch, depth, arena, len, &used) < 0) {
+			printf("[!] Read failed: %s\n", strerror(errno));
+			break;
+		}
+		elapsed += now() - start;
+	}
+
+	free(arena);
+	return done / elapsed;
+}
+
+
+/*
+ * Returns the time of CLOCK_MONOTONIC in seconds
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../../src/committer.h"
+
+// Defaults of the options
+#define DEFAULT_PUTS   40000
+#define DEFAULT_VAL_SZ 100
+
+// Numbers of putting threads measured
+static const int nthreads[] = {1, 2, 4, 8};
+
+// Job of one putting thread
+struct put_job {
+	struct hashDB *db;          // database of the mutex run
+	pthread_mutex_t *lock;      // serializes hashDB_put in the mutex run
+	struct hashDB_committer *c; // committer of the committer run
+	int first;                  // first key to put
+	int n;                      // number of keys to put
+	char *val;                  // value of every key
+	int fails;                  // puts that failed
+};
+
+
+static double run(const char *, int, int, int, int, double *);
+
+static void *put_locked(void *);
+
+static void *put_committed(void *);
+
+static double now(void);
+
+
+/*
+ * Put throughput benchmark of the committer. Runs puts from 1, 2, 4 and 8
+ * threads, once with hashDB_put behind a global mutex and once through a
+ * hashDB_committer, each run into a new database in data_dir.
+ */
+int main(int argc, char *argv[])
+{
+	int nputs = DEFAULT_PUTS, val_sz = DEFAULT_VAL_SZ, opt;
+
+	while ((opt = getopt(argc, argv, "p:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			nputs = atoi(optarg);
+			break;
+		case 's':
+			val_sz = atoi(optarg);
+			break;
+		default:
+			optind = argc + 1;
+		}
+	}
+
+	if (optind != argc - 1 || nputs <= 0 || val_sz <= 0) {
+		printf("Usage: %s [-p puts] [-s value size] data_dir\n", argv[0]);
+		exit(1);
+	}
+
+	if (mkdir(argv[optind], 0775) < 0) {
+		printf("[!] Could not create %s: %s\n", argv[optind],
+		       strerror(errno));
+		exit(1);
+	}
+
+	printf("%d puts of %d byte values per run\n", nputs, val_sz);
+	printf("%-10s %8s %12s %10s\n", "mode", "threads", "puts/s",
+	       "puts/batch");
+	for (unsigned int t = 0; t < sizeof(nthreads) / sizeof(*nthreads); ++t) {
+		for (int committed = 0; committed < 2; ++committed) {
+			double rate, batch;
+
+			rate = run(argv[optind], nputs, val_sz, nthreads[t],
+				   committed, &batch);
+			printf("%-10s %8d %12.0f %10.1f\n",
+			       (committed) ? "committer" : "mutex", nthreads[t],
+			       rate, batch);
+		}
+	}
+
+	exit(0);
+}
+
+
+/*
+ * Puts nputs keys into a new database from nthreads threads. batch is set
+ * to the average number of puts the committer wrote together, 1 for the
+ * mutex run.
+ *
+ * Returns:
+ *	Puts per second, 0 if there is an error
+ */
+static double run(const char *dir, int nputs, int val_sz, int nthreads,
+		  int committed, double *batch)
+{
+	struct hashDB_commit_stats  s;
+	struct put_job              jobs[8];
+	pthread_t                   threads[8];
+	pthread_mutex_t             lock = PTHREAD_MUTEX_INITIALIZER;
+	struct hashDB               *db;
+	char                        path[256], *val;
+	double                      start, elapsed;
+	int                         i, fails = 0;
+
+	snprintf(path, sizeof(path), "%s/%s-%d", dir,
+		 (committed) ? "committer" : "mutex", nthreads);
+	if ((val = malloc(val_sz + 1)) == NULL ||
+	    (db = hashDB_mkempty(path)) == NULL) {
+		free(val);
+		return 0;
+	}
+	memset(val, 'v', val_sz);
+	val[val_sz] = '\0';
+
+	for (i = 0; i < nthreads; ++i) {
+		jobs[i].db = db;
+		jobs[i].lock = &lock;
+		jobs[i].c = NULL;
+		jobs[i].first = i * (nputs / nthreads);
+		jobs[i].n = nputs / nthreads;
+		jobs[i].val = val;
+		jobs[i].fails = 0;
+	}
+	if (committed && (jobs[0].c = hashDB_committer_init(db)) == NULL) {
+		hashDB_free(db);
+		free(val);
+		return 0;
+	}
+
+	start = now();
+	for (i = 0; i < nthreads; ++i) {
+		jobs[i].c = jobs[0].c;
+		pthread_create(&threads[i], NULL,
+			       (committed) ? put_committed : put_locked, &jobs[i]);
+	}
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+		fails += jobs[i].fails;
+	}
+	elapsed = now() - start;
+
+	*batch = 1;
+	if (committed) {
+		hashDB_committer_stats(jobs[0].c, &s);
+		*batch = (double)s.puts / s.batches;
+		hashDB_committer_free(jobs[0].c);
+	}
+	hashDB_free(db);
+	free(val);
+
+	if (fails) {
+		printf("[!] %d puts failed\n", fails);
+		return 0;
+	}
+	return (nputs / nthreads) * nthreads / elapsed;
+}
+
+
+/*
+ * Puts the keys of the job with hashDB_put, holding the lock of the job
+ * around every put
+ */
+static void *put_locked(void *arg)
+{
+	struct put_job *job = arg;
+	int val_len = strlen(job->val);
+
+	for (int key = job->first; key < job->first + job->n; ++key) {
+		pthread_mutex_lock(job->lock);
+		if (hashDB_put(job->db, key, val_len, job->val) < 0)
+			job->fails += 1;
+		pthread_mutex_unlock(job->lock);
+	}
+	return NULL;
+}
+
+
+/*
+ * Puts the keys of the job through its committer
+ */
+static void *put_committed(void *arg)
+{
+	struct put_job *job = arg;
+	int val_len = strlen(job->val);
+
+	for (int key = job->first; key < job->first + job->n; ++key) {
+		if (hashDB_committer_put(job->c, key, val_len, job->val) < 0)
+			job->fails += 1;
+	}
+	return NULL;
+}
+
+
+/*
+ * Returns the time of CLOCK_MONOTONIC in seconds
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
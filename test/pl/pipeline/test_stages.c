@@ -210,15 +210,9 @@ int test_hashdb_compact(struct stage *s)
 	}
 
 	struct segment_file *segf = NULL;
-	struct segment_file *curr = tdb->head;
-	while (curr) {
-		int curr_id = get_id_from_fname(curr->name);
-		if (curr_id == id_one(s)) {
-			segf = curr;	
-			break;
-		}
-		curr = curr->next;
-	}
+	int i = segf_table_find(&tdb->segs, id_one(s));
+	if (i >= 0)
+		segf = tdb->segs.segs[i];
 
 	if (segf == NULL) {
 		printf("[!]: test_hashdb_compact: could not find ID\n");
@@ -251,17 +245,11 @@ int test_hashdb_merge(struct stage *s)
 	}
 
 	struct segment_file *one = NULL, *two = NULL;
-	struct segment_file *curr = tdb->head;
-	while (curr) {
-		int curr_id = get_id_from_fname(curr->name);
-		if (curr_id == id_one(s)) {
-			one = curr;
-		}
-		if (curr_id == id_two(s)) {
-			two = curr;
-		}
-		curr = curr->next;
-	}
+	int i;
+	if ((i = segf_table_find(&tdb->segs, id_one(s))) >= 0)
+		one = tdb->segs.segs[i];
+	if ((i = segf_table_find(&tdb->segs, id_two(s))) >= 0)
+		two = tdb->segs.segs[i];
 
 	if (one == NULL || two == NULL) {
 		printf("[!]: test_hashdb_compact: could not find ID\n");
@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../src/valcache.h"
+
+// Value size of trace lines that only give a key
+#define DEFAULT_VAL_SZ 100
+
+// Budget of the simulated caches when -b is not given
+#define DEFAULT_BUDGET (1 << 20)
+
+
+// One lookup of a recorded trace
+struct trace_op {
+	int key;
+	unsigned int val_len;
+};
+
+
+static struct trace_op *read_trace(const char *, unsigned int, size_t *);
+
+static int simulate(struct trace_op *, size_t, size_t, int);
+
+
+/*
+ * Value cache simulator. Replays a recorded trace of hashDB_get keys
+ * against the value cache policies, without any segment files or I/O,
+ * and prints the hit rate of each.
+ */
+int main(int argc, char *argv[])
+{
+	struct trace_op  *ops;
+	size_t           nops, budget = DEFAULT_BUDGET;
+	unsigned int     val_sz = DEFAULT_VAL_SZ;
+	int              opt, res = 0;
+
+	while ((opt = getopt(argc, argv, "b:s:")) != -1) {
+		switch (opt) {
+		case 'b':
+			budget = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			val_sz = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			optind = argc;
+		}
+	}
+
+	if (optind != argc - 1) {
+		printf("Usage: %s [-b budget] [-s value size] [trace_file]\n",
+		       argv[0]);
+		exit(1);
+	}
+
+	if ((ops = read_trace(argv[optind], val_sz, &nops)) == NULL) {
+		printf("[!] Could not read '%s': %s\n", argv[optind],
+		       strerror(errno));
+		exit(1);
+	}
+
+	printf("%zu lookups, %zu byte budget\n", nops, budget);
+	printf("%-8s %10s %10s %8s %10s %10s\n", "policy", "hits", "misses",
+	       "hit rate", "evictions", "rejections");
+	if (simulate(ops, nops, budget, VCACHE_CLOCK) < 0 ||
+	    simulate(ops, nops, budget, VCACHE_TINYLFU) < 0) {
+		printf("No memory\n");
+		res = 1;
+	}
+
+	free(ops);
+	exit(res);
+}
+
+
+/*
+ * Reads a trace file, one lookup per line: the key, optionally followed
+ * by the size of its value. Blank lines and lines starting with '#' are
+ * skipped.
+ *
+ * Parameters:
+ *	path => path of the trace file
+ *	val_sz => value size of lines that do not give one
+ *	nops => where to store the number of lookups
+ *
+ * Returns:
+ *	The lookups (caller must free them), or NULL if there is an error
+ *	(check errno, EINVAL if a line is not a key)
+ */
+static struct trace_op *read_trace(const char *path, unsigned int val_sz,
+				   size_t *nops)
+{
+	FILE             *f;
+	struct trace_op  *ops = NULL, *tmp;
+	size_t           n = 0, cap = 0;
+	char             line[128];
+	int              key, len, fields;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return NULL;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if ((fields = sscanf(line, "%d %d", &key, &len)) < 1 ||
+		    (fields == 2 && len < 0)) {
+			errno = EINVAL;
+			goto err;
+		}
+
+		if (n == cap) {
+			cap = (cap) ? cap * 2 : 1024;
+			if ((tmp = realloc(ops, cap * sizeof(*ops))) == NULL)
+				goto err;
+			ops = tmp;
+		}
+
+		ops[n].key = key;
+		ops[n].val_len = (fields == 2) ? len : val_sz;
+		n += 1;
+	}
+
+	fclose(f);
+	*nops = n;
+	return ops;
+
+err:
+	fclose(f);
+	free(ops);
+	return NULL;
+}
+
+
+/*
+ * Replays the trace against a value cache with the given policy the way
+ * hashDB_get uses it, a miss puts the value in the cache, and prints the
+ * counters of the cache. The key of every lookup stands in for the
+ * offset of its record, all in one segment file.
+ *
+ * Returns:
+ *	0 if successful, -1 if there is no memory available
+ */
+static int simulate(struct trace_op *ops, size_t nops, size_t budget,
+		    int policy)
+{
+	struct vcache        *c;
+	struct vcache_stats  s;
+	unsigned int         max_len = 0;
+	uint64_t             seq;
+	char                 *val, *buf;
+	size_t               i;
+
+	for (i = 0; i < nops; ++i) {
+		if (ops[i].val_len > max_len)
+			max_len = ops[i].val_len;
+	}
+
+	if ((c = vcache_init(budget, policy)) == NULL)
+		return -1;
+	if ((buf = calloc(max_len + 1, 1)) == NULL) {
+		vcache_free(c);
+		return -1;
+	}
+
+	for (i = 0; i < nops; ++i) {
+		int key = ops[i].key;
+
+		if (vcache_get(c, key, 1, (uint32_t)key, &seq, &val) == 1) {
+			free(val);
+			continue;
+		}
+		if (vcache_put(c, key, 1, (uint32_t)key, 0, buf,
+			       ops[i].val_len) < 0)
+			break;
+	}
+
+	vcache_stats(c, &s);
+	printf("%-8s %10llu %10llu %7.2f%% %10llu %10llu\n",
+	       (policy == VCACHE_CLOCK) ? "clock" : "tinylfu",
+	       (unsigned long long)s.hits, (unsigned long long)s.misses,
+	       (nops) ? 100.0 * s.hits / nops : 0.0,
+	       (unsigned long long)s.evictions,
+	       (unsigned long long)s.rejections);
+
+	free(buf);
+	vcache_free(c);
+	return (i == nops) ? 0 : -1;
+}
@@ -0,0 +1,171 @@
+/*
+ * Tests for async.c
+ */
+#include <check.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../src/async.h"
+#include "testdb.h"
+
+#define TEST_DB_DIR "tadb"
+
+// Completions seen by record_completion, in the order it was called
+static struct hashDB_completion seen[256];
+static int nseen;
+
+
+static void record_completion(struct hashDB_completion *c)
+{
+	seen[nseen++] = *c;
+}
+
+
+START_TEST(test_async_order)
+{
+	struct hashDB *db;
+	struct hashDB_async *a;
+	char val[32];
+	int i;
+
+	rm_test_db(TEST_DB_DIR);
+	nseen = 0;
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	if ((a = hashDB_async_init(db)) == NULL)
+		ck_abort_msg("ERROR: hashDB_async_init failed\n");
+
+	// puts and gets of the same keys interleaved, every get must see the
+	// put right before it
+	for (i = 0; i < 100; ++i) {
+		snprintf(val, sizeof(val), "value %d", i);
+		ck_assert_int_eq(hashDB_put_async(a, i % 10, strlen(val), val,
+						  record_completion, NULL), 0);
+		ck_assert_int_eq(hashDB_get_async(a, i % 10, record_completion,
+						  (void *)(long)i), 0);
+	}
+	ck_assert_int_eq(hashDB_get_async(a, 42, record_completion, NULL), 0);
+	hashDB_async_free(a);
+
+	ck_assert_int_eq(nseen, 201);
+	for (i = 0; i < 100; ++i) {
+		ck_assert_int_eq(seen[2 * i].op, HASHDB_ASYNC_PUT);
+		ck_assert_int_eq(seen[2 * i].res, 0);
+		ck_assert_int_eq(seen[2 * i + 1].op, HASHDB_ASYNC_GET);
+		ck_assert_int_eq(seen[2 * i + 1].key, i % 10);
+		ck_assert_int_eq(seen[2 * i + 1].res, 1);
+		ck_assert_ptr_eq(seen[2 * i + 1].arg, (void *)(long)i);
+		snprintf(val, sizeof(val), "value %d", i);
+		ck_assert_str_eq(seen[2 * i + 1].val, val);
+		free(seen[2 * i + 1].val);
+	}
+	ck_assert_int_eq(seen[200].res, 0);
+	ck_assert_ptr_null(seen[200].val);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+START_TEST(test_async_completion_queue)
+{
+	struct hashDB *db;
+	struct hashDB_async *a;
+	struct hashDB_completion out[64];
+	struct pollfd pfd;
+	char val[32];
+	int i, n, got = 0;
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	if ((a = hashDB_async_init(db)) == NULL)
+		ck_abort_msg("ERROR: hashDB_async_init failed\n");
+
+	ck_assert_int_eq(hashDB_async_poll(a, out, 64), 0);
+	pfd = (struct pollfd){hashDB_async_fd(a), POLLIN, 0};
+	ck_assert_int_eq(poll(&pfd, 1, 0), 0);
+
+	for (i = 0; i < 40; ++i) {
+		snprintf(val, sizeof(val), "v%d", i);
+		ck_assert_int_eq(hashDB_put_async(a, i, strlen(val), val, NULL,
+						  NULL), 0);
+	}
+	// more gets than fit in one batch
+	for (i = 0; i < 80; ++i)
+		ck_assert_int_eq(hashDB_get_async(a, i, NULL, NULL), 0);
+
+	// the eventfd stays readable until the queue is empty
+	while (got < 120) {
+		ck_assert_int_eq(poll(&pfd, 1, 5000), 1);
+		n = hashDB_async_poll(a, out, 7);
+		ck_assert_int_gt(n, 0);
+		for (i = 0; i < n; ++i, ++got) {
+			if (got < 40) {
+				ck_assert_int_eq(out[i].op, HASHDB_ASYNC_PUT);
+				ck_assert_int_eq(out[i].key, got);
+				continue;
+			}
+			ck_assert_int_eq(out[i].op, HASHDB_ASYNC_GET);
+			ck_assert_int_eq(out[i].key, got - 40);
+			ck_assert_int_eq(out[i].res, got < 80);
+			if (got < 80) {
+				snprintf(val, sizeof(val), "v%d", got - 40);
+				ck_assert_str_eq(out[i].val, val);
+			}
+			free(out[i].val);
+		}
+	}
+	ck_assert_int_eq(poll(&pfd, 1, 0), 0);
+
+	ck_assert_int_eq(hashDB_get_async(a, 3, NULL, NULL), 0);
+	ck_assert_int_eq(hashDB_async_wait(a, out, 64), 1);
+	ck_assert_str_eq(out[0].val, "v3");
+	free(out[0].val);
+
+	// completions left in the queue are freed with it
+	ck_assert_int_eq(hashDB_get_async(a, 4, NULL, NULL), 0);
+	hashDB_async_free(a);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+/*
+ * Creates and returns a test suite for the async API
+ */
+Suite *async_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Async");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_async_order);
+	tcase_add_test(tc, test_async_completion_queue);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
+int main(void)
+{
+	int fail = 0;
+	Suite *s;
+	SRunner *runner;
+
+	s = async_suite();
+	runner = srunner_create(s);
+
+	srunner_run_all(runner, CK_NORMAL);
+	fail = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,242 @@
+/*
+ * Tests for committer.c
+ */
+#include <check.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../src/committer.h"
+#include "testdb.h"
+
+#define TEST_DB_DIR "tcdb"
+
+#define NTHREADS 8
+#define NPUTS    200
+#define NINCRS   50
+
+
+struct putter {
+	struct hashDB_committer *c;
+	int id;
+	int fails;
+};
+
+
+/*
+ * Puts keys id, id + NTHREADS, ... twice, the second value must win
+ */
+static void *put_keys(void *arg)
+{
+	struct putter *p = arg;
+	char val[32];
+
+	for (int i = 0; i < NPUTS; ++i) {
+		int key = p->id + (i / 2) * NTHREADS;
+		snprintf(val, sizeof(val), "%s %d", (i % 2) ? "new" : "old", key);
+		if (hashDB_committer_put(p->c, key, strlen(val), val) < 0)
+			p->fails += 1;
+	}
+	return NULL;
+}
+
+
+START_TEST(test_committer_threads)
+{
+	struct hashDB *db;
+	struct hashDB_committer *c;
+	struct hashDB_commit_stats s;
+	struct putter putters[NTHREADS];
+	pthread_t threads[NTHREADS];
+	char want[32], *val;
+	int i;
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	if (hashDB_enable_index(db) < 0)
+		ck_abort_msg("ERROR: hashDB_enable_index failed\n");
+	if ((c = hashDB_committer_init(db)) == NULL)
+		ck_abort_msg("ERROR: hashDB_committer_init failed\n");
+
+	for (i = 0; i < NTHREADS; ++i) {
+		putters[i] = (struct putter){c, i, 0};
+		pthread_create(&threads[i], NULL, put_keys, &putters[i]);
+	}
+	for (i = 0; i < NTHREADS; ++i) {
+		pthread_join(threads[i], NULL);
+		ck_assert_int_eq(putters[i].fails, 0);
+	}
+
+	hashDB_committer_stats(c, &s);
+	ck_assert_uint_eq(s.puts, NTHREADS * NPUTS);
+	ck_assert_uint_le(s.batches, s.puts);
+	ck_assert_uint_ge(s.max_batch, 1);
+	ck_assert_uint_le(s.max_batch, NTHREADS);
+	hashDB_committer_free(c);
+
+	for (i = 0; i < NTHREADS * NPUTS / 2; ++i) {
+		snprintf(want, sizeof(want), "new %d", i);
+		ck_assert_int_eq(hashDB_get(db, i, &val), 1);
+		ck_assert_str_eq(val, want);
+		free(val);
+	}
+	ck_assert_int_eq(db->next_seq, NTHREADS * NPUTS + 1);
+
+	// everything made it to the files
+	hashDB_free(db);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	for (i = 0; i < NTHREADS * NPUTS / 2; i += 7) {
+		snprintf(want, sizeof(want), "new %d", i);
+		ck_assert_int_eq(hashDB_get(db, i, &val), 1);
+		ck_assert_str_eq(val, want);
+		free(val);
+	}
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+struct incrementer {
+	struct hashDB_committer *c;
+	int id;
+	int fails;
+	int retries;
+};
+
+
+/*
+ * Adds one to the counter in key 0 and to the one in key id + 1 NINCRS
+ * times, each time in one transaction that is run again until it commits
+ */
+static void *increment_keys(void *arg)
+{
+	struct incrementer *p = arg;
+	struct hashDB_txn *txn;
+	int keys[2] = {0, p->id + 1};
+	char *val, buf[32];
+	int res, i, k;
+
+	for (i = 0; i < NINCRS; ++i) {
+		do {
+			if ((txn = hashDB_committer_txn_begin(p->c)) == NULL) {
+				p->fails += 1;
+				return NULL;
+			}
+			for (k = 0; k < 2; ++k) {
+				res = hashDB_committer_txn_get(p->c, txn, keys[k],
+							       &val);
+				if (res < 0)
+					p->fails += 1;
+				snprintf(buf, sizeof(buf), "%d",
+					 (res == 1) ? atoi(val) + 1 : 1);
+				if (res == 1)
+					free(val);
+				if (hashDB_txn_put(txn, keys[k], strlen(buf),
+						   buf) < 0)
+					p->fails += 1;
+			}
+			res = hashDB_committer_txn_commit(p->c, txn);
+			p->retries += (res == HASHDB_TXN_RETRY);
+		} while (res == HASHDB_TXN_RETRY);
+
+		if (res < 0)
+			p->fails += 1;
+	}
+	return NULL;
+}
+
+
+START_TEST(test_committer_txns)
+{
+	struct hashDB *db;
+	struct hashDB_committer *c;
+	struct hashDB_txn *txn;
+	struct incrementer incs[NTHREADS];
+	pthread_t threads[NTHREADS];
+	char want[32], *val;
+	int i;
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	if ((c = hashDB_committer_init(db)) == NULL)
+		ck_abort_msg("ERROR: hashDB_committer_init failed\n");
+
+	// no increment is lost, conflicting ones were run again
+	for (i = 0; i < NTHREADS; ++i) {
+		incs[i] = (struct incrementer){c, i, 0, 0};
+		pthread_create(&threads[i], NULL, increment_keys, &incs[i]);
+	}
+	for (i = 0; i < NTHREADS; ++i) {
+		pthread_join(threads[i], NULL);
+		ck_assert_int_eq(incs[i].fails, 0);
+	}
+
+	// puts made through the committer conflict too
+	txn = hashDB_committer_txn_begin(c);
+	ck_assert_int_eq(hashDB_committer_txn_get(c, txn, 1, &val), 1);
+	free(val);
+	ck_assert_int_eq(hashDB_committer_put(c, 1, 1, "0"), 0);
+	ck_assert_int_eq(hashDB_txn_put(txn, 2, 1, "0"), 0);
+	ck_assert_int_eq(hashDB_committer_txn_commit(c, txn), HASHDB_TXN_RETRY);
+
+	txn = hashDB_committer_txn_begin(c);
+	ck_assert_int_eq(hashDB_txn_put(txn, 2, 1, "0"), 0);
+	hashDB_committer_txn_abort(c, txn);
+	hashDB_committer_free(c);
+
+	snprintf(want, sizeof(want), "%d", NTHREADS * NINCRS);
+	ck_assert_int_eq(hashDB_get(db, 0, &val), 1);
+	ck_assert_str_eq(val, want);
+	free(val);
+	snprintf(want, sizeof(want), "%d", NINCRS);
+	for (i = 2; i <= NTHREADS; ++i) {
+		ck_assert_int_eq(hashDB_get(db, i, &val), 1);
+		ck_assert_str_eq(val, want);
+		free(val);
+	}
+	ck_assert_ptr_null(db->txns);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+/*
+ * Creates and returns a test suite for the committer
+ */
+Suite *committer_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Committer");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_committer_threads);
+	tcase_add_test(tc, test_committer_txns);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
+int main(void)
+{
+	int fail = 0;
+	Suite *s;
+	SRunner *runner;
+
+	s = committer_suite();
+	runner = srunner_create(s);
+
+	srunner_run_all(runner, CK_NORMAL);
+	fail = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
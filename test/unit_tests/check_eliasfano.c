@@ -0,0 +1,106 @@
+/*
+ * Tests for eliasfano.c
+ */
+#include <check.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "../../src/eliasfano.h"
+
+#define NVALS 10000
+
+
+START_TEST(test_ef_get)
+{
+	static unsigned int vals[NVALS];
+	struct ef *ef;
+
+	// gaps of every size, repeats included
+	vals[0] = 8;
+	for (int i = 1; i < NVALS; ++i)
+		vals[i] = vals[i - 1] + (i * 37) % 300;
+
+	if ((ef = ef_build(vals, NVALS)) == NULL)
+		ck_abort_msg("ERROR: ef_build failed\n");
+
+	for (int i = 0; i < NVALS; ++i)
+		ck_assert_uint_eq(ef_get(ef, i), vals[i]);
+
+	// under 3 bits plus the low bits per value
+	ck_assert_int_eq(ef->low_len, 7);
+	ck_assert_uint_le(ef->nhigh * 64, NVALS * 3);
+
+	// sequential decode gives the same values
+	struct ef_iter it;
+	unsigned int v;
+	ef_iter_init(ef, &it);
+	for (int i = 0; i < NVALS; ++i) {
+		ck_assert_int_eq(ef_next(&it, &v), 1);
+		ck_assert_uint_eq(v, vals[i]);
+	}
+	ck_assert_int_eq(ef_next(&it, &v), 0);
+	ef_free(ef);
+
+	// values have to be in order
+	vals[5] = 0;
+	errno = 0;
+	ck_assert_ptr_eq(ef_build(vals, NVALS), NULL);
+	ck_assert_int_eq(errno, EINVAL);
+} END_TEST
+
+
+START_TEST(test_ef_edges)
+{
+	unsigned int vals[] = {0, 0, 1, 0xfffffff0, 0xffffffff};
+	struct ef_iter it;
+	struct ef *ef;
+	unsigned int v;
+
+	if ((ef = ef_build(vals, 5)) == NULL)
+		ck_abort_msg("ERROR: ef_build failed\n");
+	for (int i = 0; i < 5; ++i)
+		ck_assert_uint_eq(ef_get(ef, i), vals[i]);
+	ef_free(ef);
+
+	if ((ef = ef_build(vals, 0)) == NULL)
+		ck_abort_msg("ERROR: ef_build failed\n");
+	ef_iter_init(ef, &it);
+	ck_assert_int_eq(ef_next(&it, &v), 0);
+	ef_free(ef);
+} END_TEST
+
+
+/*
+ * Creates and returns a test suite for Elias-Fano encoding
+ */
+Suite *eliasfano_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Elias-Fano");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_ef_get);
+	tcase_add_test(tc, test_ef_edges);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
+int main(void)
+{
+	int fail = 0;
+	Suite *s;
+	SRunner *runner;
+
+	s = eliasfano_suite();
+	runner = srunner_create(s);
+
+	srunner_run_all(runner, CK_NORMAL);
+	fail = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
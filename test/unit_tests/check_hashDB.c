@@ -5,17 +5,20 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include "../../src/hashDB.h"
+#include "testdb.h"
+
+#define TEST_DB_DIR "tdb"
 
 
 START_TEST(test_get_id_from_fname)
 {
-	extern int get_id_from_fname(const char *);	
+	extern int64_t get_id_from_fname(const char *);	
 
 	int res;
 
@@ -37,6 +40,1120 @@ START_TEST(test_get_id_from_fname)
 } END_TEST
 
 
+START_TEST(test_compact_rewrites_v1)
+{
+	rm_test_db(TEST_DB_DIR);
+	mkdir(TEST_DB_DIR, 0755);
+
+	// hand write a v1 segment file with an overwritten key
+	int fd = open(TEST_DB_DIR "/1.dat", O_CREAT|O_TRUNC|O_RDWR, 0664);
+	if (fd < 0)
+		ck_abort_msg("ERROR: could not create v1 file\n");
+
+	struct { int key; char *val; } pairs[] = {
+		{1, "one"}, {2, "two"}, {1, "uno"},
+	};
+	for (int i = 0; i < 3; ++i) {
+		char ts = TOMBSTONE_INS;
+		int val_len = strlen(pairs[i].val) + 1;
+		int key_len = sizeof(int);
+		write(fd, &ts, 1);
+		write(fd, &val_len, sizeof(val_len));
+		write(fd, pairs[i].val, val_len);
+		write(fd, &key_len, sizeof(key_len));
+		write(fd, &pairs[i].key, key_len);
+	}
+	close(fd);
+
+	struct hashDB *db;
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+
+	// v1 file is sealed behind a new v2 head
+	ck_assert_int_eq(db->head->version, SEGF_V2);
+	ck_assert_int_eq(db->segs.segs[1]->version, SEGF_V1);
+	ck_assert_int_eq(db->segs.segs[1]->sealed, 1);
+
+	// compacted file is small enough to be merged into the empty head
+	if (hashDB_compact(db, db->segs.segs[1]) < 0)
+		ck_abort_msg("ERROR: hashDB_compact failed\n");
+	ck_assert_int_eq(db->segs.n, 1);
+	ck_assert_int_eq(db->head->version, SEGF_V2);
+	ck_assert_uint_eq(db->head->size, SEGF_HDR_SZ + 6 + 6);
+
+	char *val;
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 1);
+	ck_assert_str_eq(val, "uno");
+	free(val);
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 1);
+	ck_assert_str_eq(val, "two");
+	free(val);
+	hashDB_free(db);
+
+	// the v1 file was given a manifest, and compaction replaced it
+	ck_assert_int_eq(access(TEST_DB_DIR "/" MANIFEST_NAME, F_OK), 0);
+	ck_assert_int_eq(access(TEST_DB_DIR "/1.dat", F_OK), -1);
+
+	// segment files missing from the manifest are removed on open
+	close(open(TEST_DB_DIR "/9.dat", O_CREAT|O_RDWR, 0664));
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	ck_assert_int_eq(access(TEST_DB_DIR "/9.dat", F_OK), -1);
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 1);
+	ck_assert_str_eq(val, "uno");
+	free(val);
+	hashDB_free(db);
+
+	// unless the open dropped an edit cut short at the end of the
+	// manifest, then they wait for the next one
+	close(open(TEST_DB_DIR "/9.dat", O_CREAT|O_RDWR, 0664));
+	fd = open(TEST_DB_DIR "/" MANIFEST_NAME, O_WRONLY|O_APPEND);
+	write(fd, "abc", 3);
+	close(fd);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	ck_assert_int_eq(access(TEST_DB_DIR "/9.dat", F_OK), 0);
+	hashDB_free(db);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	ck_assert_int_eq(access(TEST_DB_DIR "/9.dat", F_OK), -1);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+/*
+ * Creates a database with two segment files, key 1 and 2 live in the
+ * older one (1.dat) and the newer one (2.dat) is the head. 1.dat is
+ * large enough that compacting the head does not merge the two.
+ */
+static struct hashDB *make_two_segment_db(void)
+{
+	struct hashDB *db;
+	char          big[80]; // most of a segment file in TESTING builds
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	if (hashDB_put(db, 1, 3, "one") < 0 ||
+	    hashDB_put(db, 2, strlen(big), big) < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+
+	struct segment_file *seg;
+	if ((seg = segf_init(strdup(TEST_DB_DIR "/2.dat"))) == NULL ||
+	    segf_create_file(seg) < 0)
+		ck_abort_msg("ERROR: could not create second segment\n");
+	seg->id = 2;
+
+	struct manifest_edit edit;
+	struct manifest_seg ms = {2, SEGF_V2, seg->flags, seg->size, 0, 0};
+	edit.nops = 0;
+	manifest_edit_add(&edit, &ms, db->head->id);
+	if (manifest_commit(db->manifest, &edit) < 0)
+		ck_abort_msg("ERROR: could not add second segment\n");
+
+	db->head->sealed = 1;
+	if (segf_table_insert(&db->segs, 0, seg) < 0)
+		ck_abort_msg("ERROR: could not add second segment\n");
+	db->head = seg;
+	db->next_id = 3;
+
+	return db;
+}
+
+
+START_TEST(test_delete_shadows_older)
+{
+	struct hashDB *db = make_two_segment_db();
+
+	// newer value in the head, then delete it
+	if (hashDB_put(db, 1, 3, "uno") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+	ck_assert_int_eq(hashDB_delete(db, 1), 1);
+	ck_assert_int_eq(hashDB_delete(db, 1), 0);
+
+	// the older value of 1 must not come back
+	char *val;
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 0);
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 1);
+	free(val);
+
+	// tombstone is kept by compaction while 1.dat still holds key 1
+	if (hashDB_compact(db, db->head) < 0)
+		ck_abort_msg("ERROR: hashDB_compact failed\n");
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 0);
+	ck_assert_uint_eq(db->head->size, SEGF_HDR_SZ + 4); // with seq
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+START_TEST(test_delete_goes_to_head)
+{
+	struct hashDB *db = make_two_segment_db();
+	struct segment_file *older = db->segs.segs[1];
+	uint64_t older_size = older->size;
+	uint64_t head_size = db->head->size;
+	uint64_t seq = db->next_seq;
+
+	// key 2 only lives in the sealed segment file
+	ck_assert_int_eq(hashDB_delete(db, 2), 1);
+	ck_assert_uint_eq(older->size, older_size);
+	ck_assert_uint_eq(db->head->size, head_size + 4); // with seq
+	ck_assert_uint_eq(db->next_seq, seq + 1);
+
+	// sealed segment files can't be appended to
+	errno = 0;
+	ck_assert_int_eq(segf_append(older, 5, "five", TOMBSTONE_INS), -1);
+	ck_assert_int_eq(errno, EPERM);
+
+	char *val;
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 0);
+	hashDB_free(db);
+
+	// delete and sequence numbers survive a restart
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 0);
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 1);
+	free(val);
+	ck_assert_uint_eq(db->next_seq, seq + 1);
+	ck_assert_int_eq(db->head->sealed, 0);
+	ck_assert_int_eq(db->segs.segs[1]->sealed, 1);
+
+	struct record_hdr hdr;
+	ck_assert_int_eq(segf_lookup(db->head, 2, &hdr, NULL), SEGF_DELETED);
+	ck_assert_uint_eq(hdr.seq, seq);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+START_TEST(test_compact_drops_tombstones)
+{
+	struct hashDB *db = make_two_segment_db();
+
+	if (hashDB_put(db, 3, 5, "three") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+	ck_assert_int_eq(hashDB_delete(db, 3), 1);
+
+	// no older segment file has key 3, the tombstone is dropped
+	if (hashDB_compact(db, db->head) < 0)
+		ck_abort_msg("ERROR: hashDB_compact failed\n");
+	ck_assert_uint_eq(db->head->size, SEGF_HDR_SZ);
+
+	char *val;
+	ck_assert_int_eq(hashDB_get(db, 3, &val), 0);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+START_TEST(test_snapshot_get)
+{
+	struct hashDB *db = make_two_segment_db();
+	struct hashDB_snapshot *snap;
+	char *val;
+
+	if (hashDB_put(db, 3, 5, "three") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+
+	if ((snap = hashDB_snapshot(db)) == NULL)
+		ck_abort_msg("ERROR: hashDB_snapshot failed\n");
+	ck_assert_uint_eq(snap->seq, db->next_seq - 1);
+	ck_assert_int_eq(snap->nsegs, 2);
+
+	// writes after the snapshot, in the head it copied and in new ones
+	if (hashDB_put(db, 1, 3, "uno") < 0 ||
+	    hashDB_put(db, 4, 4, "four") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+	ck_assert_int_eq(hashDB_delete(db, 3), 1);
+	ck_assert_int_eq(hashDB_delete(db, 2), 1);
+
+	// fill up the head so it is compacted behind a new head, then
+	// compact the oldest segment file too
+	char big[60];
+	memset(big, 'y', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	if (hashDB_put(db, 5, strlen(big), big) < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+
+	struct segment_file *oldest = db->segs.segs[db->segs.n - 1];
+	if (hashDB_compact(db, oldest) < 0)
+		ck_abort_msg("ERROR: hashDB_compact failed\n");
+
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 1);
+	ck_assert_str_eq(val, "uno");
+	free(val);
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 0);
+	ck_assert_int_eq(hashDB_get(db, 3, &val), 0);
+
+	// the snapshot outlives the database handler
+	hashDB_free(db);
+
+	ck_assert_int_eq(hashDB_snapshot_get(snap, 1, &val), 1);
+	ck_assert_str_eq(val, "one");
+	free(val);
+	ck_assert_int_eq(hashDB_snapshot_get(snap, 2, &val), 1);
+	ck_assert_uint_eq(strlen(val), 79);
+	free(val);
+	ck_assert_int_eq(hashDB_snapshot_get(snap, 3, &val), 1);
+	ck_assert_str_eq(val, "three");
+	free(val);
+	ck_assert_int_eq(hashDB_snapshot_get(snap, 4, &val), 0);
+
+	hashDB_release_snapshot(snap);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+START_TEST(test_sealed_indexes)
+{
+	struct hashDB *db;
+	char val[8], *v;
+	int key;
+
+	// sorted segment files first, then hashed ones
+	for (int sorted = 1; sorted >= 0; --sorted) {
+		int flag = (sorted) ? SEGF_HDR_SORTED : SEGF_HDR_HASHED;
+
+		rm_test_db(TEST_DB_DIR);
+		if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+			ck_abort_msg("ERROR: hashDB_init failed\n");
+		db->sort_sealed = sorted;
+		db->hash_sealed = 1;
+
+		// keys are put in descending order across several segment files
+		for (key = 39; key >= 0; --key) {
+			snprintf(val, sizeof(val), "v%d", key);
+			if (hashDB_put(db, key, strlen(val), val) < 0)
+				ck_abort_msg("ERROR: hashDB_put failed\n");
+		}
+		ck_assert_int_eq(hashDB_delete(db, 7), 1);
+
+		// every sealed segment file has an index instead of a memtable
+		int nindexed = 0;
+		for (int i = 0; i < db->segs.n; ++i) {
+			struct segment_file *seg = db->segs.segs[i];
+			if (!seg->sealed)
+				continue;
+			ck_assert_int_eq(seg->flags & SEGF_HDR_INDEXED, flag);
+			ck_assert_uint_eq(seg->table->entries, 0);
+			nindexed += 1;
+		}
+		ck_assert_int_gt(nindexed, 1);
+
+		// the indexes are read back after a restart
+		hashDB_free(db);
+		if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+			ck_abort_msg("ERROR: hashDB_init failed\n");
+		ck_assert_int_eq(db->head->sealed, 0);
+
+		for (key = 0; key < 40; ++key) {
+			if (key == 7) {
+				ck_assert_int_eq(hashDB_get(db, key, &v), 0);
+				continue;
+			}
+			snprintf(val, sizeof(val), "v%d", key);
+			ck_assert_int_eq(hashDB_get(db, key, &v), 1);
+			ck_assert_str_eq(v, val);
+			free(v);
+		}
+
+		if (sorted) {
+			hashDB_free(db);
+			continue;
+		}
+
+		// a budget too small for any index demotes every one
+		db->index_budget = 1;
+		ck_assert_int_eq(hashDB_balance_indexes(db), 0);
+		for (int i = 0; i < db->segs.n; ++i) {
+			struct segment_file *seg = db->segs.segs[i];
+			ck_assert(seg->hidx == NULL || seg->hidx->slots != NULL);
+		}
+		ck_assert_int_eq(hashDB_get(db, 7, &v), 0);
+		for (key = 0; key < 40; key += 3) {
+			snprintf(val, sizeof(val), "v%d", key);
+			ck_assert_int_eq(hashDB_get(db, key, &v), 1);
+			ck_assert_str_eq(v, val);
+			free(v);
+		}
+
+		// the most looked up segment file is the first to come back
+		struct segment_file *hot = db->segs.segs[1];
+		db->index_budget = segf_index_mem(hot);
+		for (int i = 0; i < db->segs.n; ++i)
+			db->segs.segs[i]->hits = (i == 1) ? 100 : 0;
+		ck_assert_int_eq(hashDB_balance_indexes(db), 0);
+		ck_assert_ptr_null(hot->hidx->slots);
+
+		hashDB_free(db);
+	}
+
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+/*
+ * Scan callback that counts the keys it is called with, arg is an int
+ * array indexed by key
+ */
+static int count_key(int key, char *val, void *arg)
+{
+	int *seen = arg;
+
+	if (key < 0 || key >= 20)
+		ck_abort_msg("Unknown key: %d\n", key);
+	seen[key] += 1;
+	return 0;
+}
+
+
+START_TEST(test_scan)
+{
+	struct hashDB *db = make_two_segment_db();
+	char val[8];
+
+	// overwrite and delete some of the keys in the older segment file
+	for (int key = 3; key < 20; ++key) {
+		snprintf(val, sizeof(val), "v%d", key);
+		if (hashDB_put(db, key, strlen(val), val) < 0)
+			ck_abort_msg("ERROR: hashDB_put failed\n");
+	}
+	if (hashDB_put(db, 1, 3, "uno") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+	ck_assert_int_eq(hashDB_delete(db, 2), 1);
+	ck_assert_int_eq(hashDB_delete(db, 7), 1);
+
+	// every live key once, none of the deleted ones
+	int seen[20] = {0};
+	ck_assert_int_eq(hashDB_scan(db, count_key, seen), 0);
+	for (int key = 0; key < 20; ++key) {
+		int want = (key == 0 || key == 2 || key == 7) ? 0 : 1;
+		ck_assert_int_eq(seen[key], want);
+	}
+
+	// partitions split the keys between them
+	int part_seen[3][20] = {{0}};
+	void *args[3] = {part_seen[0], part_seen[1], part_seen[2]};
+	ck_assert_int_eq(hashDB_scan_parallel(db, 3, count_key, args), 0);
+	for (int key = 0; key < 20; ++key) {
+		int total = 0;
+		for (int p = 0; p < 3; ++p)
+			total += part_seen[p][key];
+		ck_assert_int_eq(total, seen[key]);
+	}
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+START_TEST(test_range)
+{
+	struct hashDB *db = make_two_segment_db();
+	struct hashDB_range *range;
+	char val[8], *v;
+	int key;
+
+	errno = 0;
+	ck_assert_ptr_null(hashDB_range(db, 0, 10));
+	ck_assert_int_eq(errno, EINVAL);
+
+	for (key = 3; key < 20; ++key) {
+		snprintf(val, sizeof(val), "v%d", key);
+		if (hashDB_put(db, key, strlen(val), val) < 0)
+			ck_abort_msg("ERROR: hashDB_put failed\n");
+	}
+	ck_assert_int_eq(hashDB_delete(db, 7), 1);
+
+	// index is built from what is already there, then kept up to date
+	if (hashDB_enable_index(db) < 0)
+		ck_abort_msg("ERROR: hashDB_enable_index failed\n");
+	ck_assert_uint_eq(db->index->entries, 18);
+	if (hashDB_put(db, -1, 3, "neg") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+	ck_assert_int_eq(hashDB_delete(db, 4), 1);
+
+	if ((range = hashDB_range(db, -5, 10)) == NULL)
+		ck_abort_msg("ERROR: hashDB_range failed\n");
+
+	// changes made after the range was created are not seen
+	if (hashDB_put(db, 5, 3, "new") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+	ck_assert_int_eq(hashDB_delete(db, 6), 1);
+
+	int want[] = {-1, 1, 2, 3, 5, 6, 8, 9, 10};
+	for (int i = 0; i < 9; ++i) {
+		ck_assert_int_eq(hashDB_range_next(range, &key, &v), 1);
+		ck_assert_int_eq(key, want[i]);
+		if (key == -1)
+			ck_assert_str_eq(v, "neg");
+		else if (key == 1)
+			ck_assert_str_eq(v, "one");
+		else if (key == 2)
+			ck_assert_uint_eq(strlen(v), 79);
+		else {
+			snprintf(val, sizeof(val), "v%d", key);
+			ck_assert_str_eq(v, val);
+		}
+		free(v);
+	}
+	ck_assert_int_eq(hashDB_range_next(range, &key, &v), 0);
+	hashDB_range_free(range);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+START_TEST(test_delete_range)
+{
+	struct hashDB *db = make_two_segment_db();
+	char *val;
+
+	if (hashDB_put(db, 3, 5, "three") < 0 ||
+	    hashDB_put(db, 10, 3, "ten") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+
+	errno = 0;
+	ck_assert_int_eq(hashDB_delete_range(db, 5, 2), -1);
+	ck_assert_int_eq(errno, EINVAL);
+
+	// one small record, no matter where the keys in the range live
+	uint64_t head_size = db->head->size;
+	ck_assert_int_eq(hashDB_delete_range(db, 2, 5), 0);
+	ck_assert_uint_eq(db->head->size, head_size + 5);
+	ck_assert_int_eq(db->head->nrange_dels, 1);
+
+	// keys put after the range tombstone are not deleted by it
+	if (hashDB_put(db, 4, 4, "four") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+
+	for (int restart = 0; restart < 2; ++restart) {
+		ck_assert_int_eq(hashDB_get(db, 2, &val), 0);
+		ck_assert_int_eq(hashDB_get(db, 3, &val), 0);
+		ck_assert_int_eq(hashDB_delete(db, 3), 0);
+		ck_assert_int_eq(hashDB_get(db, 1, &val), 1);
+		ck_assert_str_eq(val, "one");
+		free(val);
+		ck_assert_int_eq(hashDB_get(db, 4, &val), 1);
+		ck_assert_str_eq(val, "four");
+		free(val);
+		ck_assert_int_eq(hashDB_get(db, 10, &val), 1);
+		free(val);
+
+		hashDB_free(db);
+		if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+			ck_abort_msg("ERROR: hashDB_init failed\n");
+	}
+
+	// compacting drops the covered value of key 2, after that both
+	// segment files fit in one and the merged file is the oldest, so
+	// the range tombstone is dropped as well
+	if (hashDB_compact(db, db->segs.segs[1]) < 0)
+		ck_abort_msg("ERROR: hashDB_compact failed\n");
+	ck_assert_int_eq(db->segs.n, 1);
+	ck_assert_int_eq(db->head->nrange_dels, 0);
+
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 0);
+	ck_assert_int_eq(hashDB_get(db, 3, &val), 0);
+	ck_assert_int_eq(hashDB_get(db, 4, &val), 1);
+	ck_assert_str_eq(val, "four");
+	free(val);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+START_TEST(test_lazy_open)
+{
+	struct hashDB *db;
+	struct hashDB_progress p;
+	char val[8], *v;
+	int key;
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	for (key = 0; key < 30; ++key) {
+		snprintf(val, sizeof(val), "v%d", key);
+		if (hashDB_put(db, key, strlen(val), val) < 0)
+			ck_abort_msg("ERROR: hashDB_put failed\n");
+	}
+	ck_assert_int_eq(hashDB_delete(db, 3), 1);
+	uint64_t next_seq = db->next_seq;
+	hashDB_free(db);
+
+	// only the head has to be loaded before opening returns
+	if ((db = hashDB_init_lazy(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init_lazy failed\n");
+	ck_assert_uint_eq(db->next_seq, next_seq);
+	ck_assert_int_eq(segf_loaded(db->head), 1);
+	hashDB_load_progress(db, &p);
+	ck_assert_int_gt(p.nsegs, 1);
+	ck_assert_uint_gt(p.open_ns, 0);
+	ck_assert_uint_eq(p.first_query_ns, 0);
+
+	// gets load what they need while the loader runs
+	ck_assert_int_eq(hashDB_get(db, 3, &v), 0);
+	for (key = 29; key >= 0; key -= 4) {
+		snprintf(val, sizeof(val), "v%d", key);
+		ck_assert_int_eq(hashDB_get(db, key, &v), 1);
+		ck_assert_str_eq(v, val);
+		free(v);
+	}
+	hashDB_load_progress(db, &p);
+	ck_assert_uint_ge(p.first_query_ns, p.open_ns);
+
+	while (p.loaded_ns == 0) {
+		usleep(1000);
+		hashDB_load_progress(db, &p);
+	}
+	ck_assert_int_eq(p.nloaded, p.nsegs);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+START_TEST(test_value_cache)
+{
+	struct hashDB *db = make_two_segment_db();
+	struct vcache_stats s;
+	char *val;
+
+	if (hashDB_enable_cache(db, 4096) < 0)
+		ck_abort_msg("ERROR: hashDB_enable_cache failed\n");
+
+	for (int i = 0; i < 2; ++i) {
+		ck_assert_int_eq(hashDB_get(db, 1, &val), 1);
+		ck_assert_str_eq(val, "one");
+		free(val);
+	}
+	hashDB_cache_stats(db, &s);
+	ck_assert_uint_eq(s.misses, 1);
+	ck_assert_uint_eq(s.hits, 1);
+
+	// the new record has an offset of its own, the old one is not used
+	if (hashDB_put(db, 1, 3, "uno") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 1);
+	ck_assert_str_eq(val, "uno");
+	free(val);
+
+	// a cached value is still covered by a newer range tombstone
+	if (hashDB_put(db, 5, 4, "five") < 0)
+		ck_abort_msg("ERROR: hashDB_put failed\n");
+	ck_assert_int_eq(hashDB_get(db, 5, &val), 1);
+	free(val);
+	ck_assert_int_eq(hashDB_delete_range(db, 5, 5), 0);
+	ck_assert_int_eq(hashDB_get(db, 5, &val), 0);
+
+	// compaction gives the value a new segment file and offset
+	if (hashDB_compact(db, db->segs.segs[1]) < 0)
+		ck_abort_msg("ERROR: hashDB_compact failed\n");
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 1);
+	ck_assert_int_eq(strlen(val), 79);
+	free(val);
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 1);
+	ck_assert_str_eq(val, "uno");
+	free(val);
+
+	if (hashDB_enable_cache(db, 0) < 0)
+		ck_abort_msg("ERROR: hashDB_enable_cache failed\n");
+	hashDB_cache_stats(db, &s);
+	ck_assert_uint_eq(s.hits + s.misses + s.entries, 0);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+START_TEST(test_multi_get)
+{
+	struct hashDB *db;
+	struct hashDB_result res[8];
+	struct hashDB_arena arena;
+	char buf[512], val[64];
+	int key;
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	for (key = 0; key < 30; ++key) {
+		// every third value runs past the read ahead of its run
+		snprintf(val, sizeof(val), (key % 3) ? "v%d" : "long value %d", key);
+		if (hashDB_put(db, key, strlen(val), val) < 0)
+			ck_abort_msg("ERROR: hashDB_put failed\n");
+	}
+	ck_assert_int_eq(hashDB_delete(db, 7), 1);
+	ck_assert_int_eq(hashDB_delete_range(db, 20, 21), 0);
+
+	int keys[8] = {29, 7, 3, 100, 0, 20, 14, 3};
+	const char *want[8] = {"v29", NULL, "long value 3", NULL,
+			       "long value 0", NULL, "v14", "long value 3"};
+
+	arena.buf = buf;
+	arena.len = sizeof(buf);
+	arena.used = 0;
+	ck_assert_int_eq(hashDB_multi_get(db, keys, 8, res, &arena), 5);
+	for (int i = 0; i < 8; ++i) {
+		ck_assert_int_eq(res[i].found, want[i] != NULL);
+		if (want[i]) {
+			ck_assert_str_eq(res[i].val, want[i]);
+			ck_assert_uint_eq(res[i].val_len, strlen(want[i]));
+		}
+	}
+
+	// values must fit in the arena
+	arena.len = arena.used = 10;
+	errno = 0;
+	ck_assert_int_eq(hashDB_multi_get(db, keys, 8, res, &arena), -1);
+	ck_assert_int_eq(errno, ENOBUFS);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+START_TEST(test_put_batch)
+{
+	struct hashDB *db;
+	int keys[40], val_lens[40], key;
+	char *vals[40], buf[40][16], *val;
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	if (hashDB_enable_index(db) < 0)
+		ck_abort_msg("ERROR: hashDB_enable_index failed\n");
+
+	// more than fits in one head segment file, keys 0 to 9 twice
+	for (int i = 0; i < 40; ++i) {
+		keys[i] = (i < 10) ? i : i - 10;
+		snprintf(buf[i], sizeof(buf[i]), "v%d.%d", keys[i], i);
+		vals[i] = buf[i];
+		val_lens[i] = strlen(buf[i]);
+	}
+	ck_assert_int_eq(hashDB_put_batch(db, keys, val_lens, vals, 40), 40);
+	ck_assert_int_gt(db->segs.n, 1);
+	ck_assert_int_eq(db->next_seq, 41);
+
+	for (int i = 10; i < 40; ++i) {
+		ck_assert_int_eq(hashDB_get(db, keys[i], &val), 1);
+		ck_assert_str_eq(val, buf[i]);
+		free(val);
+	}
+
+	struct hashDB_range *r = hashDB_range(db, 0, 100);
+	for (int i = 0; i < 30; ++i) {
+		ck_assert_int_eq(hashDB_range_next(r, &key, &val), 1);
+		ck_assert_int_eq(key, i);
+		free(val);
+	}
+	ck_assert_int_eq(hashDB_range_next(r, &key, &val), 0);
+	hashDB_range_free(r);
+
+	// the records read back the same after reopening
+	hashDB_free(db);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	ck_assert_int_eq(db->next_seq, 41);
+	ck_assert_int_eq(hashDB_get(db, 5, &val), 1);
+	ck_assert_str_eq(val, "v5.15");
+	free(val);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+START_TEST(test_txn)
+{
+	struct hashDB *db;
+	struct hashDB_txn *t1, *t2;
+	char *val, name[256];
+	struct stat st;
+	int fd;
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	ck_assert_int_eq(hashDB_put(db, 1, 2, "a1"), 0);
+	ck_assert_int_eq(hashDB_put(db, 2, 2, "b1"), 0);
+
+	// t1 reads a key that is put before it commits, t2 only reads keys
+	// left alone and sees its own put
+	if ((t1 = hashDB_txn_begin(db)) == NULL ||
+	    (t2 = hashDB_txn_begin(db)) == NULL)
+		ck_abort_msg("ERROR: hashDB_txn_begin failed\n");
+	ck_assert_int_eq(hashDB_txn_get(t1, 1, &val), 1);
+	free(val);
+	ck_assert_int_eq(hashDB_txn_put(t1, 3, 2, "c1"), 0);
+	ck_assert_int_eq(hashDB_txn_get(t2, 2, &val), 1);
+	ck_assert_str_eq(val, "b1");
+	free(val);
+	ck_assert_int_eq(hashDB_txn_get(t2, 9, &val), 0);
+	ck_assert_int_eq(hashDB_txn_put(t2, 2, 2, "b2"), 0);
+	ck_assert_int_eq(hashDB_txn_put(t2, 4, 2, "d1"), 0);
+	ck_assert_int_eq(hashDB_txn_put(t2, 2, 2, "b3"), 0);
+	ck_assert_int_eq(hashDB_txn_get(t2, 2, &val), 1);
+	ck_assert_str_eq(val, "b3");
+	free(val);
+
+	ck_assert_int_eq(hashDB_put(db, 1, 2, "a2"), 0);
+	ck_assert_int_eq(hashDB_txn_commit(t1), HASHDB_TXN_RETRY);
+	ck_assert_int_eq(hashDB_get(db, 3, &val), 0);
+	ck_assert_int_eq(hashDB_txn_commit(t2), 0);
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 1);
+	ck_assert_str_eq(val, "b3");
+	free(val);
+
+	// a key deleted since the transaction began conflicts too
+	t1 = hashDB_txn_begin(db);
+	ck_assert_int_eq(hashDB_txn_get(t1, 4, &val), 1);
+	free(val);
+	ck_assert_int_eq(hashDB_delete_range(db, 4, 5), 0);
+	ck_assert_int_eq(hashDB_txn_commit(t1), HASHDB_TXN_RETRY);
+
+	// a batch cut short by a crash is dropped as a whole
+	t1 = hashDB_txn_begin(db);
+	ck_assert_int_eq(hashDB_txn_put(t1, 5, 2, "e1"), 0);
+	ck_assert_int_eq(hashDB_txn_put(t1, 6, 2, "f1"), 0);
+	ck_assert_int_eq(hashDB_txn_commit(t1), 0);
+	ck_assert_int_eq(hashDB_get(db, 5, &val), 1);
+	free(val);
+	snprintf(name, sizeof(name), "%s", db->head->name);
+	hashDB_free(db);
+
+	if ((fd = open(name, O_WRONLY)) < 0 || fstat(fd, &st) < 0 ||
+	    ftruncate(fd, st.st_size - 1) < 0)
+		ck_abort_msg("ERROR: could not cut the segment file\n");
+	close(fd);
+
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	ck_assert_int_eq(hashDB_get(db, 5, &val), 0);
+	ck_assert_int_eq(hashDB_get(db, 6, &val), 0);
+	ck_assert_int_eq(hashDB_get(db, 4, &val), 0);
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 1);
+	ck_assert_str_eq(val, "a2");
+	free(val);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+START_TEST(test_txn_compacted_delete)
+{
+	struct hashDB *db;
+	struct hashDB_txn *t1, *t2;
+	uint64_t offset, head_id;
+	char *val;
+	int key = 100;
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	ck_assert_int_eq(hashDB_put(db, 1, 2, "a1"), 0);
+	ck_assert_int_eq(hashDB_put(db, 7, 2, "g1"), 0);
+
+	// the deletes are the only records of their keys, compacting the
+	// head when it fills up would drop them if not for the transactions
+	t1 = hashDB_txn_begin(db);
+	t2 = hashDB_txn_begin(db);
+	ck_assert_int_eq(hashDB_txn_get(t1, 1, &val), 1);
+	free(val);
+	ck_assert_int_eq(hashDB_txn_get(t2, 7, &val), 1);
+	free(val);
+	ck_assert_int_eq(hashDB_delete(db, 1), 1);
+	ck_assert_int_eq(hashDB_delete_range(db, 7, 8), 0);
+
+	head_id = db->head->id;
+	while (db->head->id == head_id)
+		ck_assert_int_eq(hashDB_put(db, key++, 2, "x1"), 0);
+	ck_assert_int_eq(db->segs.n, 2);
+
+	ck_assert_int_eq(hashDB_txn_put(t1, 2, 2, "b1"), 0);
+	ck_assert_int_eq(hashDB_txn_commit(t1), HASHDB_TXN_RETRY);
+	ck_assert_int_eq(hashDB_txn_put(t2, 2, 2, "b1"), 0);
+	ck_assert_int_eq(hashDB_txn_commit(t2), HASHDB_TXN_RETRY);
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 0);
+
+	// with no transaction open they go with the next compaction, which
+	// may merge the last segment file into the head
+	ck_assert_int_eq(hashDB_compact(db, db->segs.segs[1]), 1);
+	for (int i = 0; i < db->segs.n; ++i) {
+		ck_assert_int_eq(db->segs.segs[i]->nrange_dels, 0);
+		ck_assert_int_eq(segf_read_memtable(db->segs.segs[i], 1,
+						    &offset), MEMTE_MISSING);
+	}
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 0);
+	ck_assert_int_eq(hashDB_get(db, 7, &val), 0);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+START_TEST(test_merge_value)
+{
+	struct hashDB *db;
+	struct hashDB_snapshot *snap;
+	struct hashDB_result res[2];
+	struct hashDB_arena arena;
+	struct hashDB_range *range;
+	struct record_hdr hdr;
+	uint64_t offset;
+	char buf[64], *val;
+	int key, i;
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL ||
+	    hashDB_enable_index(db) < 0)
+		ck_abort_msg("ERROR: could not open the database\n");
+	ck_assert_int_eq(hashDB_merge_value(db, 1, 1, "5"), -1);
+	ck_assert_int_eq(errno, EINVAL);
+	hashDB_set_merge_op(db, &mergeop_add);
+
+	// operands apply to no value, a value, and a deleted value
+	ck_assert_int_eq(hashDB_merge_value(db, 1, 1, "5"), 0);
+	ck_assert_int_eq(hashDB_put(db, 2, 2, "10"), 0);
+	ck_assert_int_eq(hashDB_merge_value(db, 2, 1, "3"), 0);
+	ck_assert_int_eq(hashDB_merge_value(db, 2, 2, "-1"), 0);
+	ck_assert_int_eq(hashDB_put(db, 3, 1, "7"), 0);
+	ck_assert_int_eq(hashDB_delete(db, 3), 1);
+	ck_assert_int_eq(hashDB_merge_value(db, 3, 1, "2"), 0);
+	ck_assert_int_eq(hashDB_delete_range(db, 1, 1), 0);
+	ck_assert_int_eq(hashDB_merge_value(db, 1, 1, "4"), 0);
+
+	const char *want[] = {"4", "12", "2"};
+	for (key = 1; key <= 3; ++key) {
+		ck_assert_int_eq(hashDB_get(db, key, &val), 1);
+		ck_assert_str_eq(val, want[key - 1]);
+		free(val);
+	}
+
+	snap = hashDB_snapshot(db);
+	ck_assert_int_eq(hashDB_merge_value(db, 2, 3, "100"), 0);
+	ck_assert_int_eq(hashDB_snapshot_get(snap, 2, &val), 1);
+	ck_assert_str_eq(val, "12");
+	free(val);
+	hashDB_release_snapshot(snap);
+
+	// chains run across head segment files until compaction folds them
+	for (i = 0; i < 60; ++i)
+		ck_assert_int_eq(hashDB_merge_value(db, 4, 1, "1"), 0);
+	ck_assert_int_eq(hashDB_get(db, 4, &val), 1);
+	ck_assert_str_eq(val, "60");
+	free(val);
+
+	int keys[2] = {2, 4};
+	arena.buf = buf;
+	arena.len = sizeof(buf);
+	arena.used = 0;
+	ck_assert_int_eq(hashDB_multi_get(db, keys, 2, res, &arena), 2);
+	ck_assert_str_eq(res[0].val, "112");
+	ck_assert_str_eq(res[1].val, "60");
+
+	if ((range = hashDB_range(db, 2, 4)) == NULL)
+		ck_abort_msg("ERROR: hashDB_range failed\n");
+	const char *in_range[] = {"112", "2", "60"};
+	for (i = 0; hashDB_range_next(range, &key, &val) == 1; ++i) {
+		ck_assert_int_eq(key, i + 2);
+		ck_assert_str_eq(val, in_range[i]);
+		free(val);
+	}
+	ck_assert_int_eq(i, 3);
+	hashDB_range_free(range);
+
+	ck_assert_int_eq(hashDB_compact(db, db->head), 1);
+	ck_assert_int_eq(segf_read_memtable(db->head, 4, &offset), MEMTE_LIVE);
+	ck_assert_int_eq(segf_read_rec(db->head, offset, &hdr, &val), 1);
+	ck_assert_str_eq(val, "60");
+	ck_assert_int_eq(hdr.flags & REC_MERGE, 0);
+	free(val);
+
+	// operands left in the head are folded after a reopen
+	ck_assert_int_eq(hashDB_merge_value(db, 2, 2, "-2"), 0);
+	hashDB_free(db);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	hashDB_set_merge_op(db, &mergeop_add);
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 1);
+	ck_assert_str_eq(val, "110");
+	free(val);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+
+static uint64_t test_now;
+
+/*
+ * Clock of the database in test_put_ttl, set by the test
+ */
+static uint64_t test_clock(void)
+{
+	return test_now;
+}
+
+
+START_TEST(test_put_ttl)
+{
+	struct hashDB *db;
+	struct hashDB_snapshot *snap;
+	struct hashDB_result res[2];
+	struct hashDB_arena arena;
+	struct hashDB_range *range;
+	struct record_hdr hdr;
+	uint64_t offset;
+	char buf[64], *val;
+	int key, nsegs, i;
+
+	rm_test_db(TEST_DB_DIR);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL ||
+	    hashDB_enable_index(db) < 0)
+		ck_abort_msg("ERROR: could not open the database\n");
+	db->clock = test_clock;
+	test_now = 1000;
+	ck_assert_int_eq(hashDB_put_ttl(db, 1, 1, "a", 0), -1);
+	ck_assert_int_eq(errno, EINVAL);
+
+	// an expired pair shadows the older value of its key
+	ck_assert_int_eq(hashDB_put_ttl(db, 1, 1, "a", 100), 0);
+	ck_assert_int_eq(hashDB_put(db, 2, 1, "b"), 0);
+	ck_assert_int_eq(hashDB_put_ttl(db, 2, 1, "c", 5), 0);
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 1);
+	ck_assert_str_eq(val, "c");
+	free(val);
+	snap = hashDB_snapshot(db);
+
+	test_now = 1005;
+	ck_assert_int_eq(hashDB_get(db, 2, &val), 0);
+	ck_assert_int_eq(hashDB_snapshot_get(snap, 2, &val), 1);
+	ck_assert_str_eq(val, "c");
+	free(val);
+	hashDB_release_snapshot(snap);
+
+	int keys[2] = {1, 2};
+	arena.buf = buf;
+	arena.len = sizeof(buf);
+	arena.used = 0;
+	ck_assert_int_eq(hashDB_multi_get(db, keys, 2, res, &arena), 1);
+	ck_assert_str_eq(res[0].val, "a");
+	ck_assert_int_eq(res[1].found, 0);
+
+	if ((range = hashDB_range(db, 1, 2)) == NULL)
+		ck_abort_msg("ERROR: hashDB_range failed\n");
+	ck_assert_int_eq(hashDB_range_next(range, &key, &val), 1);
+	ck_assert_int_eq(key, 1);
+	free(val);
+	ck_assert_int_eq(hashDB_range_next(range, &key, &val), 0);
+	hashDB_range_free(range);
+	ck_assert_int_eq(hashDB_delete(db, 2), 0);
+
+	// operands written before the value expired go with it
+	hashDB_set_merge_op(db, &mergeop_add);
+	ck_assert_int_eq(hashDB_put_ttl(db, 3, 2, "10", 10), 0);
+	ck_assert_int_eq(hashDB_merge_value(db, 3, 1, "1"), 0);
+	ck_assert_int_eq(hashDB_get(db, 3, &val), 1);
+	ck_assert_str_eq(val, "11");
+	free(val);
+	test_now = 1015;
+	ck_assert_int_eq(hashDB_get(db, 3, &val), 0);
+	ck_assert_int_eq(hashDB_merge_value(db, 3, 1, "2"), 0);
+	ck_assert_int_eq(hashDB_get(db, 3, &val), 1);
+	ck_assert_str_eq(val, "2");
+	free(val);
+
+	// compaction drops expired records and keeps expiry times
+	ck_assert_int_eq(hashDB_compact(db, db->head), 1);
+	ck_assert_int_eq(segf_read_memtable(db->head, 2, &offset), MEMTE_MISSING);
+	ck_assert_int_eq(segf_read_memtable(db->head, 1, &offset), MEMTE_LIVE);
+	ck_assert_int_eq(segf_read_rec(db->head, offset, &hdr, &val), 1);
+	ck_assert_int_eq(hdr.expires, 1100);
+	free(val);
+	ck_assert_int_eq(segf_read_memtable(db->head, 3, &offset), MEMTE_LIVE);
+	ck_assert_int_eq(segf_read_rec(db->head, offset, &hdr, &val), 1);
+	ck_assert_str_eq(val, "2");
+	ck_assert_int_eq(hdr.expires, 0);
+	free(val);
+
+	// an expired pair with a value in an older segment file is
+	// compacted into a tombstone, the fill keeps the files from being
+	// merged
+	memset(buf, 'x', 60);
+	buf[60] = '\0';
+	ck_assert_int_eq(hashDB_put(db, 5, 3, "old"), 0);
+	for (i = 0, nsegs = db->segs.n; db->segs.n == nsegs && i < 100; ++i)
+		ck_assert_int_eq(hashDB_put(db, 10, 60, buf), 0);
+	ck_assert_int_eq(hashDB_put_ttl(db, 5, 3, "new", 1), 0);
+	test_now = 1020;
+	ck_assert_int_eq(hashDB_compact(db, db->head), 1);
+	ck_assert_int_eq(segf_read_memtable(db->head, 5, &offset), MEMTE_DELETED);
+	ck_assert_int_eq(hashDB_get(db, 5, &val), 0);
+
+	// the sweep compacts sealed segment files that have mostly expired
+	for (i = 0; i < 20; ++i)
+		ck_assert_int_eq(hashDB_put_ttl(db, 100 + i, 4, "temp", 5), 0);
+	test_now = 1030;
+	ck_assert_int_gt(hashDB_sweep(db), 0);
+	ck_assert_int_eq(hashDB_sweep(db), 0);
+	ck_assert_int_eq(hashDB_get(db, 100, &val), 0);
+
+	hashDB_free(db);
+	if ((db = hashDB_init(TEST_DB_DIR)) == NULL)
+		ck_abort_msg("ERROR: hashDB_init failed\n");
+	db->clock = test_clock;
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 1);
+	ck_assert_str_eq(val, "a");
+	free(val);
+	test_now = 1100;
+	ck_assert_int_eq(hashDB_get(db, 1, &val), 0);
+
+	hashDB_free(db);
+	rm_test_db(TEST_DB_DIR);
+} END_TEST
+
+Suite *hashDB_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("HashDB");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_compact_rewrites_v1);
+	tcase_add_test(tc, test_delete_shadows_older);
+	tcase_add_test(tc, test_delete_goes_to_head);
+	tcase_add_test(tc, test_compact_drops_tombstones);
+	tcase_add_test(tc, test_sealed_indexes);
+	tcase_add_test(tc, test_snapshot_get);
+	tcase_add_test(tc, test_scan);
+	tcase_add_test(tc, test_range);
+	tcase_add_test(tc, test_delete_range);
+	tcase_add_test(tc, test_lazy_open);
+	tcase_add_test(tc, test_value_cache);
+	tcase_add_test(tc, test_multi_get);
+	tcase_add_test(tc, test_put_batch);
+	tcase_add_test(tc, test_txn);
+	tcase_add_test(tc, test_txn_compacted_delete);
+	tcase_add_test(tc, test_merge_value);
+	tcase_add_test(tc, test_put_ttl);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
 Suite *util_suite(void)
 {
 	Suite *s;
@@ -60,6 +1177,7 @@ int main(void)
 
 	s = util_suite();
 	runner = srunner_create(s);
+	srunner_add_suite(runner, hashDB_suite());
 
 	srunner_run_all(runner, CK_NORMAL);
 	fail = srunner_ntests_failed(runner);
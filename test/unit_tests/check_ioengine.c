@@ -0,0 +1,162 @@
+/*
+ * Tests for ioengine.c
+ */
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "../../src/ioengine.h"
+
+#define TEST_FILE "tioe.dat"
+
+
+/*
+ * Writes, syncs, and reads back a file through the engine
+ */
+static void run_ops(struct ioe_engine *e)
+{
+	struct ioe_op ops[4];
+	struct iovec iov[2];
+	char a[6] = {0}, b[6] = {0}, c[4] = {0};
+	int fd;
+
+	unlink(TEST_FILE);
+	if ((fd = open(TEST_FILE, O_CREAT | O_RDWR, 0664)) < 0)
+		ck_abort_msg("ERROR: open failed\n");
+
+	// a write linked to a sync
+	memset(ops, 0, sizeof(ops));
+	ops[0] = (struct ioe_op){IOE_WRITE, fd, IOE_LINK, "hello world", 11, 0, 0};
+	ops[1] = (struct ioe_op){IOE_DSYNC, fd, 0, NULL, 0, 0, 0};
+	ck_assert_int_eq(ioe_submit(e, ops, 2), 0);
+	ck_assert_int_eq(ops[0].res, 11);
+	ck_assert_int_eq(ops[1].res, 0);
+
+	// reads in one batch, one of them scattered
+	iov[0] = (struct iovec){b, 5};
+	iov[1] = (struct iovec){c, 3};
+	ops[0] = (struct ioe_op){IOE_READ, fd, 0, a, 5, 6, 0};
+	ops[1] = (struct ioe_op){IOE_READV, fd, 0, iov, 2, 0, 0};
+	ck_assert_int_eq(ioe_submit(e, ops, 2), 0);
+	ck_assert_int_eq(ops[0].res, 5);
+	ck_assert_str_eq(a, "world");
+	ck_assert_int_eq(ops[1].res, 8);
+	ck_assert_str_eq(b, "hello");
+	ck_assert_str_eq(c, " wo");
+
+	// a short read breaks the link, the next op never runs
+	ops[0] = (struct ioe_op){IOE_READ, fd, IOE_LINK, a, 5, 9, 0};
+	ops[1] = (struct ioe_op){IOE_WRITE, fd, 0, "x", 1, 0, 0};
+	ops[2] = (struct ioe_op){IOE_READ, -1, 0, a, 5, 0, 0};
+	ck_assert_int_eq(ioe_submit(e, ops, 3), 0);
+	ck_assert_int_eq(ops[0].res, 2);
+	ck_assert_int_eq(ops[1].res, -ECANCELED);
+	ck_assert_int_eq(ops[2].res, -EBADF);
+
+	ops[0].op = 42;
+	errno = 0;
+	ck_assert_int_eq(ioe_submit(e, ops, 1), -1);
+	ck_assert_int_eq(errno, EINVAL);
+
+	close(fd);
+	unlink(TEST_FILE);
+}
+
+
+START_TEST(test_ioe_posix)
+{
+	struct ioe_engine *e;
+	struct ioe_stats s;
+
+	if ((e = ioe_posix_init()) == NULL)
+		ck_abort_msg("ERROR: ioe_posix_init failed\n");
+
+	run_ops(e);
+	ioe_stats(e, &s);
+	ck_assert_uint_eq(s.submits, 3);
+	ck_assert_uint_eq(s.ops, 7);
+	ck_assert_uint_eq(s.max_batch, 1);
+
+	// the default engine starts as POSIX and is never freed
+	struct ioe_engine *posix = ioe_default();
+	ck_assert_str_eq(posix->name, "posix");
+	ck_assert_ptr_eq(ioe_set_default(e), posix);
+	ck_assert_ptr_eq(ioe_default(), e);
+	ck_assert_ptr_eq(ioe_set_default(NULL), e);
+	ck_assert_ptr_eq(ioe_default(), posix);
+	ioe_free(posix);
+	ck_assert_str_eq(ioe_default()->name, "posix");
+	ioe_free(e);
+} END_TEST
+
+
+START_TEST(test_ioe_uring)
+{
+	struct ioe_engine *e;
+	struct ioe_stats s;
+
+	if ((e = ioe_uring_init(2)) == NULL) {
+		// not built in, or not allowed by the kernel
+		ck_assert_int_eq(errno, ENOSYS);
+		return;
+	}
+	ck_assert_str_eq(e->name, "io_uring");
+
+	run_ops(e);
+	ioe_stats(e, &s);
+	ck_assert_uint_eq(s.submits, 3);
+	ck_assert_uint_eq(s.max_batch, 2);
+	ioe_free(e);
+
+	// a chain of linked ops longer than the ring
+	struct ioe_op ops[8];
+	char buf[8];
+	if ((e = ioe_uring_init(2)) == NULL)
+		ck_abort_msg("ERROR: ioe_uring_init failed\n");
+	for (int i = 0; i < 8; ++i)
+		ops[i] = (struct ioe_op){IOE_READ, 0, IOE_LINK, buf, 0, 0, 0};
+	errno = 0;
+	ck_assert_int_eq(ioe_submit(e, ops, 8), -1);
+	ck_assert_int_eq(errno, EINVAL);
+	ioe_free(e);
+} END_TEST
+
+
+/*
+ * Creates and returns a test suite for the I/O engines
+ */
+Suite *ioengine_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("I/O Engine");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_ioe_posix);
+	tcase_add_test(tc, test_ioe_uring);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
+int main(void)
+{
+	int fail = 0;
+	Suite *s;
+	SRunner *runner;
+
+	s = ioengine_suite();
+	runner = srunner_create(s);
+
+	srunner_run_all(runner, CK_NORMAL);
+	fail = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,105 @@
+/*
+ * Tests for keyindex.c
+ */
+#include <check.h>
+#include <stdlib.h>
+
+#include "../../src/keyindex.h"
+
+
+START_TEST(test_keyidx_insert_remove)
+{
+	struct key_index *idx;
+
+	if ((idx = keyidx_init()) == NULL)
+		ck_abort_msg("ERROR: keyidx_init failed\n");
+
+	ck_assert_int_eq(keyidx_insert(idx, 5), 1);
+	ck_assert_int_eq(keyidx_insert(idx, 5), 0);
+	ck_assert_int_eq(keyidx_insert(idx, -3), 1);
+	ck_assert_uint_eq(idx->entries, 2);
+
+	ck_assert_int_eq(keyidx_contains(idx, 5), 1);
+	ck_assert_int_eq(keyidx_contains(idx, 4), 0);
+
+	ck_assert_int_eq(keyidx_remove(idx, 5), 1);
+	ck_assert_int_eq(keyidx_remove(idx, 5), 0);
+	ck_assert_int_eq(keyidx_contains(idx, 5), 0);
+	ck_assert_uint_eq(idx->entries, 1);
+
+	keyidx_free(idx);
+} END_TEST
+
+
+START_TEST(test_keyidx_seek)
+{
+	struct key_index   *idx;
+	struct keyidx_iter it;
+	int                key, n = 5000;
+
+	if ((idx = keyidx_init()) == NULL)
+		ck_abort_msg("ERROR: keyidx_init failed\n");
+
+	// even keys in a scrambled order, enough for a few levels of nodes
+	for (int i = 0; i < n; ++i) {
+		if (keyidx_insert(idx, ((i * 7919) % n) * 2) != 1)
+			ck_abort_msg("ERROR: keyidx_insert failed\n");
+	}
+	ck_assert_int_eq(idx->root->leaf, 0);
+
+	// every key from the seek point on comes back in order
+	keyidx_seek(idx, 1001, &it);
+	for (int want = 1002; want < n * 2; want += 2) {
+		ck_assert_int_eq(keyidx_next(&it, &key), 1);
+		ck_assert_int_eq(key, want);
+	}
+	ck_assert_int_eq(keyidx_next(&it, &key), 0);
+
+	// iterators skip over leaves that were emptied by removes
+	for (int k = 2000; k < 4000; k += 2)
+		ck_assert_int_eq(keyidx_remove(idx, k), 1);
+	keyidx_seek(idx, 2000, &it);
+	ck_assert_int_eq(keyidx_next(&it, &key), 1);
+	ck_assert_int_eq(key, 4000);
+
+	keyidx_seek(idx, n * 2, &it);
+	ck_assert_int_eq(keyidx_next(&it, &key), 0);
+
+	keyidx_free(idx);
+} END_TEST
+
+
+/*
+ * Creates and returns a test suite for key index functions
+ */
+Suite *keyindex_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Key Index");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_keyidx_insert_remove);
+	tcase_add_test(tc, test_keyidx_seek);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
+int main(void)
+{
+	int fail = 0;
+	Suite *s;
+	SRunner *runner;
+
+	s = keyindex_suite();
+	runner = srunner_create(s);
+
+	srunner_run_all(runner, CK_NORMAL);
+	fail = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
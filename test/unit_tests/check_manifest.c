@@ -0,0 +1,248 @@
+/*
+ * Tests for manifest.c
+ */
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../../src/manifest.h"
+
+#define TEST_DIR "tmdir"
+
+
+/*
+ * Removes the test directory and the manifest in it
+ */
+static void rm_test_dir(void)
+{
+	unlink(TEST_DIR "/" MANIFEST_NAME);
+	unlink(TEST_DIR "/" MANIFEST_TMP_NAME);
+	rmdir(TEST_DIR);
+}
+
+
+/*
+ * Commits an edit adding a segment file with the given ID in front of
+ * before, its size is ten times its ID
+ */
+static void add_seg(struct manifest *m, uint64_t id, uint64_t before)
+{
+	struct manifest_edit edit;
+	struct manifest_seg seg = {id, 2, 0, id * 10, id * 10 - 8, 0};
+
+	edit.nops = 0;
+	manifest_edit_add(&edit, &seg, before);
+	if (manifest_commit(m, &edit) < 0)
+		ck_abort_msg("ERROR: manifest_commit failed\n");
+}
+
+
+/*
+ * Checks the IDs of the segment files in the manifest, newest first
+ */
+static void check_ids(struct manifest *m, uint64_t *ids, int n)
+{
+	ck_assert_int_eq(m->nsegs, n);
+	for (int i = 0; i < n; ++i)
+		ck_assert_uint_eq(m->segs[i].id, ids[i]);
+}
+
+
+START_TEST(test_manifest_edits)
+{
+	struct manifest *m;
+	struct manifest_edit edit;
+
+	rm_test_dir();
+	mkdir(TEST_DIR, 0755);
+
+	errno = 0;
+	ck_assert_ptr_null(manifest_open(TEST_DIR));
+	ck_assert_int_eq(errno, ENOENT);
+
+	if ((m = manifest_create(TEST_DIR, NULL, 0)) == NULL)
+		ck_abort_msg("ERROR: manifest_create failed\n");
+
+	// each new head goes in front of the old one
+	add_seg(m, 1, 0);
+	add_seg(m, 2, 1);
+	add_seg(m, 3, 2);
+
+	// 4 replaces 2, then 5 merges 4 and 1
+	struct manifest_seg seg = {4, 2, 0x04, 60, 52, 0};
+	edit.nops = 0;
+	manifest_edit_add(&edit, &seg, 2);
+	manifest_edit_del(&edit, 2);
+	if (manifest_commit(m, &edit) < 0)
+		ck_abort_msg("ERROR: manifest_commit failed\n");
+
+	seg.id = 5;
+	edit.nops = 0;
+	manifest_edit_add(&edit, &seg, 4);
+	manifest_edit_del(&edit, 4);
+	manifest_edit_del(&edit, 1);
+	if (manifest_commit(m, &edit) < 0)
+		ck_abort_msg("ERROR: manifest_commit failed\n");
+
+	uint64_t ids[] = {3, 5};
+	check_ids(m, ids, 2);
+	ck_assert_uint_eq(m->next_id, 6);
+
+	// edits naming missing or existing segment files change nothing
+	edit.nops = 0;
+	manifest_edit_del(&edit, 3);
+	manifest_edit_del(&edit, 4);
+	errno = 0;
+	ck_assert_int_eq(manifest_commit(m, &edit), -1);
+	ck_assert_int_eq(errno, EINVAL);
+	check_ids(m, ids, 2);
+
+	seg.size = 70;
+	edit.nops = 0;
+	manifest_edit_set(&edit, &seg);
+	if (manifest_commit(m, &edit) < 0)
+		ck_abort_msg("ERROR: manifest_commit failed\n");
+	int nedits = m->nedits;
+	manifest_free(m);
+
+	// replaying gives the same segment files
+	if ((m = manifest_open(TEST_DIR)) == NULL)
+		ck_abort_msg("ERROR: manifest_open failed\n");
+	check_ids(m, ids, 2);
+	ck_assert_int_eq(m->nedits, nedits);
+	ck_assert_uint_eq(m->next_id, 6);
+	ck_assert_uint_eq(manifest_find(m, 5)->size, 70);
+	ck_assert_uint_eq(manifest_find(m, 5)->flags, 0x04);
+	ck_assert_uint_eq(manifest_find(m, 3)->live, 22);
+	ck_assert_ptr_null(manifest_find(m, 4));
+
+	// a long manifest is rewritten as a single edit
+	for (uint64_t id = 6; m->nedits > 1; ++id)
+		add_seg(m, id, 0);
+	int nsegs = m->nsegs;
+	manifest_free(m);
+
+	if ((m = manifest_open(TEST_DIR)) == NULL)
+		ck_abort_msg("ERROR: manifest_open failed\n");
+	ck_assert_int_eq(m->nedits, 1);
+	ck_assert_int_eq(m->nsegs, nsegs);
+	ck_assert_uint_eq(m->segs[0].id, 3);
+	ck_assert_uint_eq(m->segs[nsegs - 1].id, nsegs + 3);
+
+	manifest_free(m);
+	rm_test_dir();
+} END_TEST
+
+
+START_TEST(test_manifest_torn_edit)
+{
+	struct manifest *m;
+	struct stat st;
+
+	rm_test_dir();
+	mkdir(TEST_DIR, 0755);
+
+	if ((m = manifest_create(TEST_DIR, NULL, 0)) == NULL)
+		ck_abort_msg("ERROR: manifest_create failed\n");
+	add_seg(m, 1, 0);
+	add_seg(m, 2, 1);
+	manifest_free(m);
+
+	// the last edit is cut short by a crash
+	stat(TEST_DIR "/" MANIFEST_NAME, &st);
+	truncate(TEST_DIR "/" MANIFEST_NAME, st.st_size - 3);
+
+	if ((m = manifest_open(TEST_DIR)) == NULL)
+		ck_abort_msg("ERROR: manifest_open failed\n");
+	uint64_t ids[] = {1};
+	check_ids(m, ids, 1);
+	ck_assert_uint_eq(m->next_id, 2);
+
+	// the next edit takes its place
+	add_seg(m, 3, 1);
+	manifest_free(m);
+
+	if ((m = manifest_open(TEST_DIR)) == NULL)
+		ck_abort_msg("ERROR: manifest_open failed\n");
+	uint64_t ids2[] = {3, 1};
+	check_ids(m, ids2, 2);
+
+	// a flipped bit fails the crc32 of the edit
+	manifest_free(m);
+	int fd = open(TEST_DIR "/" MANIFEST_NAME, O_RDWR);
+	char c;
+	stat(TEST_DIR "/" MANIFEST_NAME, &st);
+	pread(fd, &c, 1, st.st_size - 1);
+	c ^= 0x01;
+	pwrite(fd, &c, 1, st.st_size - 1);
+	close(fd);
+
+	if ((m = manifest_open(TEST_DIR)) == NULL)
+		ck_abort_msg("ERROR: manifest_open failed\n");
+	check_ids(m, ids, 1);
+	ck_assert_int_eq(m->truncated, 1);
+
+	// an edit with more after it was not cut short, the manifest is
+	// corrupt and left as it is
+	add_seg(m, 4, 1);
+	stat(TEST_DIR "/" MANIFEST_NAME, &st);
+	off_t edit_end = st.st_size;
+	add_seg(m, 5, 4);
+	manifest_free(m);
+
+	fd = open(TEST_DIR "/" MANIFEST_NAME, O_RDWR);
+	pread(fd, &c, 1, edit_end - 1);
+	c ^= 0x01;
+	pwrite(fd, &c, 1, edit_end - 1);
+	close(fd);
+	stat(TEST_DIR "/" MANIFEST_NAME, &st);
+
+	errno = 0;
+	ck_assert_ptr_null(manifest_open(TEST_DIR));
+	ck_assert_int_eq(errno, EIO);
+	struct stat st2;
+	stat(TEST_DIR "/" MANIFEST_NAME, &st2);
+	ck_assert_int_eq(st2.st_size, st.st_size);
+
+	rm_test_dir();
+} END_TEST
+
+
+/*
+ * Creates and returns a test suite for the manifest
+ */
+Suite *manifest_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Manifest");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_manifest_edits);
+	tcase_add_test(tc, test_manifest_torn_edit);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
+int main(void)
+{
+	int fail = 0;
+	Suite *s;
+	SRunner *runner;
+
+	s = manifest_suite();
+	runner = srunner_create(s);
+
+	srunner_run_all(runner, CK_NORMAL);
+	fail = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
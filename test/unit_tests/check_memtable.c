@@ -9,11 +9,11 @@
 
 START_TEST(test_memte_init)
 {
-	extern struct memtable_entry *memte_init(int, unsigned int);
+	extern struct memtable_entry *memte_init(int, uint64_t);
 	extern   void memte_free(struct memtable_entry*);
 	
 	int tkey = 1;
-	unsigned int toffset = 10;
+	uint64_t toffset = (1ULL << 32) + 10; // past the end of a 4 GB file
 	struct memtable_entry *e;
 
 	if ((e = memte_init(tkey, toffset)) == NULL)
@@ -88,8 +88,8 @@ START_TEST(test_memtable_read_write)
 {
 	extern struct memtable *memtable_init();
 	extern   void memtable_free(struct memtable*);
-	extern    int memtable_write(struct memtable*, int, unsigned int);
-	extern    int memtable_read(struct memtable*, int, unsigned int*);
+	extern    int memtable_write(struct memtable*, int, uint64_t);
+	extern    int memtable_read(struct memtable*, int, uint64_t*);
 
 	struct memtable *tbl;
 	if ((tbl = memtable_init()) == NULL)
@@ -98,7 +98,7 @@ START_TEST(test_memtable_read_write)
 	const int kv_pairs = 50;
 	
 	// add to the db
-	unsigned int offset;
+	uint64_t offset;
 	for (int key = 1; key < kv_pairs; key++) {
 		offset = key + 1;
 		if (memtable_write(tbl, key, offset) < 0)
@@ -120,15 +120,15 @@ START_TEST(test_memtable_write_with_update)
 {
 	extern struct memtable *memtable_init();	
 	extern   void memtable_free(struct memtable*);
-	extern    int memtable_write(struct memtable*, int, unsigned int);
-	extern    int memtable_read(struct memtable*, int, unsigned int*);
+	extern    int memtable_write(struct memtable*, int, uint64_t);
+	extern    int memtable_read(struct memtable*, int, uint64_t*);
 
 	struct memtable *tbl;
 	if ((tbl = memtable_init()) == NULL)
 		ck_abort_msg("Could not create memtable\n");
 
 	const int kv_pairs = 5;
-	unsigned int offset = 0;
+	uint64_t offset = 0;
 	for (int i = 0; i < kv_pairs; ++i) {
 		if (memtable_write(tbl, i, offset) < 0)
 			ck_abort_msg("Could not write to memtable\n");
@@ -148,7 +148,7 @@ START_TEST(test_memtable_write_with_update)
 	ck_assert_uint_eq(tbl->entries, kv_pairs);
 	
 	offset = 1;
-	unsigned int returned_offset = 0;
+	uint64_t returned_offset = 0;
 	for (int i = 0; i < kv_pairs; i += 2) {
 		if (memtable_read(tbl, i, &returned_offset) == 0)
 			ck_abort_msg("Could not read memtable\n");	
@@ -164,8 +164,8 @@ START_TEST(test_memtable_remove)
 {
 	extern struct memtable *memtable_init();
 	extern   void memtable_free(struct memtable*);
-	extern    int memtable_write(struct memtable*, int, unsigned int);
-	extern    int memtable_read(struct memtable*, int, unsigned int*);
+	extern    int memtable_write(struct memtable*, int, uint64_t);
+	extern    int memtable_read(struct memtable*, int, uint64_t*);
 
 	struct memtable *tbl;
 	if ((tbl = memtable_init()) == NULL)
@@ -173,7 +173,7 @@ START_TEST(test_memtable_remove)
 
 	// add testing data
 	const int kv_pairs = 5;
-	unsigned int offset;
+	uint64_t offset;
 	for (int key = 1; key < kv_pairs; key++) {
 		offset = key + 1;		
 		if (memtable_write(tbl, key, offset) < 0)
@@ -196,6 +196,39 @@ START_TEST(test_memtable_remove)
 } END_TEST
 
 
+START_TEST(test_memtable_write_tombstone)
+{
+	struct memtable *tbl;
+	if ((tbl = memtable_init()) == NULL)
+		ck_abort_msg("Could not create memtable\n");
+
+	uint64_t offset = 0;
+	if (memtable_write(tbl, 1, 10) < 0)
+		ck_abort_msg("Could not write to memtable\n");
+	ck_assert_int_eq(memtable_read(tbl, 1, &offset), MEMTE_LIVE);
+
+	// tombstone replaces the value
+	if (memtable_write_tombstone(tbl, 1, 20) < 0)
+		ck_abort_msg("Could not write tombstone\n");
+	ck_assert_int_eq(memtable_read(tbl, 1, &offset), MEMTE_DELETED);
+	ck_assert_uint_eq(offset, 20);
+	ck_assert_uint_eq(tbl->entries, 1);
+
+	// writing the key again brings it back
+	if (memtable_write(tbl, 1, 30) < 0)
+		ck_abort_msg("Could not write to memtable\n");
+	ck_assert_int_eq(memtable_read(tbl, 1, &offset), MEMTE_LIVE);
+	ck_assert_uint_eq(offset, 30);
+
+	// tombstones for unknown keys are added
+	if (memtable_write_tombstone(tbl, 2, 40) < 0)
+		ck_abort_msg("Could not write tombstone\n");
+	ck_assert_int_eq(memtable_read(tbl, 2, &offset), MEMTE_DELETED);
+	ck_assert_uint_eq(tbl->entries, 2);
+
+	memtable_free(tbl);
+} END_TEST
+
 /*
  * Creates and returns a test suite for memtable functions
  */
@@ -211,6 +244,7 @@ Suite *memtable_suite(void)
 	tcase_add_test(tc, test_memtable_read_write);
 	tcase_add_test(tc, test_memtable_write_with_update);
 	tcase_add_test(tc, test_memtable_remove);
+	tcase_add_test(tc, test_memtable_write_tombstone);
 	/* Future memtable test cases */
 
 	suite_add_tcase(s, tc);
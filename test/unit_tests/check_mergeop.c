@@ -0,0 +1,90 @@
+/*
+ * Tests for mergeop.c
+ */
+#include <check.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "../../src/mergeop.h"
+
+
+START_TEST(test_mergeop_add)
+{
+	char *out;
+
+	// a key with no value counts as 0
+	ck_assert_int_eq(mergeop_add.merge(NULL, "5", &out), 0);
+	ck_assert_str_eq(out, "5");
+	free(out);
+
+	ck_assert_int_eq(mergeop_add.merge("40", "-42", &out), 0);
+	ck_assert_str_eq(out, "-2");
+	free(out);
+
+	ck_assert_int_eq(mergeop_add.merge("-9223372036854775807", "-1",
+					   &out), 0);
+	ck_assert_str_eq(out, "-9223372036854775808");
+	free(out);
+
+	ck_assert_int_eq(mergeop_add.merge("9223372036854775807", "1", &out),
+			 -1);
+	ck_assert_int_eq(errno, ERANGE);
+	ck_assert_int_eq(mergeop_add.merge("12abc", "1", &out), -1);
+	ck_assert_int_eq(errno, EINVAL);
+	ck_assert_int_eq(mergeop_add.merge("1", "", &out), -1);
+	ck_assert_int_eq(errno, EINVAL);
+} END_TEST
+
+
+START_TEST(test_mergeop_append)
+{
+	char *out;
+
+	ck_assert_int_eq(mergeop_append.merge(NULL, "abc", &out), 0);
+	ck_assert_str_eq(out, "abc");
+	free(out);
+
+	ck_assert_int_eq(mergeop_append.merge("abc", "de", &out), 0);
+	ck_assert_str_eq(out, "abcde");
+	free(out);
+
+	ck_assert_int_eq(mergeop_append.merge("abc", "", &out), 0);
+	ck_assert_str_eq(out, "abc");
+	free(out);
+} END_TEST
+
+
+/*
+ * Creates and returns a test suite for the merge operators
+ */
+Suite *mergeop_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Merge Operator");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_mergeop_add);
+	tcase_add_test(tc, test_mergeop_append);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
+int main(void)
+{
+	int fail = 0;
+	Suite *s;
+	SRunner *runner;
+
+	s = mergeop_suite();
+	runner = srunner_create(s);
+
+	srunner_run_all(runner, CK_NORMAL);
+	fail = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
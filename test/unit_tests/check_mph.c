@@ -0,0 +1,135 @@
+/*
+ * Tests for mph.c
+ */
+#include <check.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../src/mph.h"
+
+#define NKEYS 5000
+
+
+START_TEST(test_mph_build)
+{
+	static int  keys[NKEYS];
+	static char seen[NKEYS];
+	struct mph  *mph;
+
+	// spread out keys, negative ones included
+	for (int i = 0; i < NKEYS; ++i)
+		keys[i] = (i - NKEYS / 2) * 7919;
+
+	if ((mph = mph_build(keys, NKEYS)) == NULL)
+		ck_abort_msg("ERROR: mph_build failed\n");
+
+	// every key gets a slot of its own
+	memset(seen, 0, sizeof(seen));
+	for (int i = 0; i < NKEYS; ++i) {
+		int slot = mph_lookup(mph, keys[i]);
+		ck_assert_int_ge(slot, 0);
+		ck_assert_int_lt(slot, NKEYS);
+		ck_assert_int_eq(seen[slot], 0);
+		seen[slot] = 1;
+	}
+
+	// a few bits per key
+	ck_assert_uint_lt(mph->nwords * 64, NKEYS * 5);
+
+	// unknown keys map to no slot or some slot in range
+	for (int key = 1; key < 1000; ++key) {
+		int slot = mph_lookup(mph, key);
+		ck_assert(slot >= -1 && slot < NKEYS);
+	}
+
+	mph_free(mph);
+
+	// an empty set has no slots
+	if ((mph = mph_build(keys, 0)) == NULL)
+		ck_abort_msg("ERROR: mph_build failed\n");
+	ck_assert_int_eq(mph_lookup(mph, 5), -1);
+	mph_free(mph);
+
+	// a key given twice can't get a slot of its own
+	keys[1] = keys[0];
+	errno = 0;
+	ck_assert_ptr_eq(mph_build(keys, NKEYS), NULL);
+	ck_assert_int_eq(errno, EINVAL);
+} END_TEST
+
+
+START_TEST(test_mph_encode)
+{
+	int         keys[300];
+	struct mph  *mph, *mph2;
+	char        *buf;
+	unsigned int len;
+
+	for (int i = 0; i < 300; ++i)
+		keys[i] = i * i;
+
+	if ((mph = mph_build(keys, 300)) == NULL)
+		ck_abort_msg("ERROR: mph_build failed\n");
+
+	len = mph_encoded_len(mph);
+	if ((buf = malloc(len)) == NULL)
+		ck_abort_msg("ERROR: malloc failed\n");
+	mph_encode(mph, buf);
+
+	if ((mph2 = mph_decode(buf, len)) == NULL)
+		ck_abort_msg("ERROR: mph_decode failed\n");
+	for (int i = 0; i < 300; ++i)
+		ck_assert_int_eq(mph_lookup(mph2, keys[i]), mph_lookup(mph, keys[i]));
+	mph_free(mph2);
+
+	// truncated or damaged input is rejected
+	errno = 0;
+	ck_assert_ptr_eq(mph_decode(buf, len - 1), NULL);
+	ck_assert_int_eq(errno, EIO);
+	buf[len - 1] ^= 0x10; // flips a bit of the bit arrays or fallback
+	if (mph->nfallback == 0) {
+		errno = 0;
+		ck_assert_ptr_eq(mph_decode(buf, len), NULL);
+		ck_assert_int_eq(errno, EIO);
+	}
+
+	free(buf);
+	mph_free(mph);
+} END_TEST
+
+
+/*
+ * Creates and returns a test suite for minimal perfect hash functions
+ */
+Suite *mph_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Minimal Perfect Hash");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_mph_build);
+	tcase_add_test(tc, test_mph_encode);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
+int main(void)
+{
+	int fail = 0;
+	Suite *s;
+	SRunner *runner;
+
+	s = mph_suite();
+	runner = srunner_create(s);
+
+	srunner_run_all(runner, CK_NORMAL);
+	fail = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,150 @@
+/*
+ * Tests for record.c
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../src/record.h"
+
+
+START_TEST(test_varint_round_trip)
+{
+	uint64_t tvals[] = {0, 1, 127, 128, 300, 16383, 16384, 0xffffffff,
+	                    UINT64_MAX};
+	int      tlens[] = {1, 1,   1,   2,   2,     2,     3,          5,
+	                    10};
+	char     buf[REC_MAX_VARINT64_SZ];
+	uint64_t v;
+
+	for (int i = 0; i < 9; ++i) {
+		int n = varint_encode(buf, tvals[i]);
+		ck_assert_int_eq(n, tlens[i]);
+		ck_assert_int_eq(varint_len(tvals[i]), tlens[i]);
+		ck_assert_int_eq(varint_decode(buf, n, &v), n);
+		ck_assert_uint_eq(v, tvals[i]);
+	}
+
+	// truncated varint
+	varint_encode(buf, 300);
+	ck_assert_int_eq(varint_decode(buf, 1, &v), -1);
+} END_TEST
+
+
+START_TEST(test_zigzag)
+{
+	ck_assert_uint_eq(zigzag_encode(0), 0);
+	ck_assert_uint_eq(zigzag_encode(-1), 1);
+	ck_assert_uint_eq(zigzag_encode(1), 2);
+	ck_assert_uint_eq(zigzag_encode(-2), 3);
+
+	int tkeys[] = {0, 1, -1, 1000, -1000, 2147483647, -2147483647 - 1};
+	for (int i = 0; i < 7; ++i)
+		ck_assert_int_eq(zigzag_decode(zigzag_encode(tkeys[i])), tkeys[i]);
+} END_TEST
+
+
+START_TEST(test_rec_hdr_round_trip)
+{
+	struct record_hdr  in, out;
+	char               buf[REC_MAX_HDR_SZ];
+
+	in.flags = REC_DEL | REC_CHECKSUM;
+	in.key = -42;
+	in.val_len = 200;
+
+	int n = rec_encode_hdr(buf, &in);
+	ck_assert_int_eq(n, 1 + 1 + 2);
+	ck_assert_uint_eq(in.hdr_len, n);
+
+	ck_assert_int_eq(rec_decode_hdr(buf, n, &out), n);
+	ck_assert_uint_eq(out.flags, in.flags);
+	ck_assert_int_eq(out.key, in.key);
+	ck_assert_uint_eq(out.val_len, in.val_len);
+	ck_assert_uint_eq(out.hdr_len, n);
+
+	// header + value + checksum
+	ck_assert_uint_eq(rec_size(&in), n + 200 + REC_CRC_SZ);
+
+	// not enough bytes for the whole header
+	ck_assert_int_eq(rec_decode_hdr(buf, n - 1, &out), -1);
+
+	// records without a sequence number decode as sequence number 0
+	ck_assert_uint_eq(out.seq, 0);
+
+	in.flags = REC_SEQ;
+	in.seq = 1ULL << 40;
+	n = rec_encode_hdr(buf, &in);
+	ck_assert_int_eq(n, 1 + 1 + 2 + 6);
+	ck_assert_int_eq(rec_decode_hdr(buf, n, &out), n);
+	ck_assert_uint_eq(out.seq, in.seq);
+	ck_assert_uint_eq(rec_size(&in), n + 200);
+	ck_assert_uint_eq(out.expires, 0);
+
+	// the expiry time follows the sequence number
+	in.flags = REC_SEQ | REC_TTL;
+	in.expires = 1700000000;
+	n = rec_encode_hdr(buf, &in);
+	ck_assert_int_eq(n, 1 + 1 + 2 + 6 + 5);
+	ck_assert_int_eq(rec_decode_hdr(buf, n, &out), n);
+	ck_assert_uint_eq(out.seq, in.seq);
+	ck_assert_uint_eq(out.expires, in.expires);
+	ck_assert_uint_eq(rec_size(&in), n + 200);
+
+	// value of a range tombstone
+	int hi;
+	n = rec_encode_range_end(buf, -70000);
+	ck_assert_int_eq(rec_decode_range_end(buf, n, &hi), n);
+	ck_assert_int_eq(hi, -70000);
+	ck_assert_int_eq(rec_decode_range_end(buf, n - 1, &hi), -1);
+} END_TEST
+
+
+START_TEST(test_rec_crc32)
+{
+	const char *check = "123456789";
+
+	ck_assert_uint_eq(rec_crc32(0, check, 9), 0xcbf43926);
+
+	// checksum can be built up in pieces
+	uint32_t crc = rec_crc32(0, check, 4);
+	ck_assert_uint_eq(rec_crc32(crc, check + 4, 5), 0xcbf43926);
+} END_TEST
+
+
+/*
+ * Creates and returns a test suite for record encoding functions
+ */
+Suite *record_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Record");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_varint_round_trip);
+	tcase_add_test(tc, test_zigzag);
+	tcase_add_test(tc, test_rec_hdr_round_trip);
+	tcase_add_test(tc, test_rec_crc32);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
+int main(void)
+{
+	int fail = 0;
+	Suite *s;
+	SRunner *runner;
+
+	s = record_suite();
+	runner = srunner_create(s);
+
+	srunner_run_all(runner, CK_NORMAL);
+	fail = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
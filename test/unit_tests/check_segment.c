@@ -8,6 +8,9 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "../../src/segment.h"
 
@@ -32,79 +35,91 @@ START_TEST(test_segf_init)
 	ck_assert_int_eq(seg->size, 0);
 	ck_assert_str_eq(seg->name, tname);
 	ck_assert_int_eq(seg->seg_fd, -1);
-	ck_assert_int_eq(seg->next_bucket, 0);
-	ck_assert_ptr_null(seg->next_entry);
+	ck_assert_int_eq(seg->refs, 1);
 	ck_assert_ptr_nonnull(seg->table);
-	ck_assert_ptr_null(seg->next);
 
 	segf_free(seg);
 } END_TEST
 
 
-START_TEST(test_segf_link_before)
+START_TEST(test_segf_table)
 {
-	extern void segf_link_before(struct segment_file*, struct segment_file*);
+	struct segf_table t;
+	struct segment_file s[20];
 
-	struct segment_file s1, s2;
+	if (segf_table_init(&t) < 0)
+		ck_abort_msg("ERROR: segf_table_init failed\n");
 
-	s1.name = "s1.dat";
-	s1.next = NULL;
-
-	s2.name = "s2.dat";
-	s2.next = NULL;
-
-	segf_link_before(&s1, &s2);
-	ck_assert_ptr_eq(s1.next, &s2);
-	ck_assert_ptr_null(s2.next);
+	// newest first, each new segment file goes in front
+	for (int i = 0; i < 20; ++i) {
+		s[i].id = i + 1;
+		if (segf_table_insert(&t, 0, &s[i]) < 0)
+			ck_abort_msg("ERROR: segf_table_insert failed\n");
+	}
+	ck_assert_int_eq(t.n, 20);
+	for (int i = 0; i < 20; ++i)
+		ck_assert_int_eq(segf_table_find(&t, i + 1), 19 - i);
+	ck_assert_int_eq(segf_table_find(&t, 21), -1);
+
+	// 21 takes the place of 10, then 11 goes and everything after it shifts
+	struct segment_file r = {.id = 21};
+	segf_table_replace(&t, segf_table_pos(&t, &s[9]), &r);
+	ck_assert_int_eq(segf_table_find(&t, 10), -1);
+	ck_assert_int_eq(segf_table_pos(&t, &r), 10);
+
+	segf_table_remove(&t, segf_table_pos(&t, &s[10]));
+	ck_assert_int_eq(t.n, 19);
+	ck_assert_int_eq(segf_table_find(&t, 11), -1);
+	ck_assert_int_eq(segf_table_pos(&t, &r), 9);
+	ck_assert_int_eq(segf_table_find(&t, 1), 18);
+	ck_assert_ptr_eq(t.segs[18], &s[0]);
+
+	segf_table_free(&t);
 } END_TEST
 
 
-START_TEST(test_segf_next_key)
+START_TEST(test_segf_cursor)
 {
 	extern struct segment_file *segf_init(char*);
-	extern int segf_next_key(struct segment_file*);
 	extern void segf_free(struct segment_file*);
 
 	struct segment_file *seg;
 	if ((seg = segf_init("test")) == NULL)
 		ck_abort_msg("ERROR: segf_init failed\n");
 
-	struct key_found_pair {
-		int key;     // testing key
-		char found;  // flag = 1 if key was found, flag = 0 if not
-	};
-
-	struct key_found_pair test_data[] = {
-		{0, 0},	
-		{1, 0},	
-		{2, 0},	
-		{3, 0},	
-		{4, 0},	
-	};
-
-	// Add some testing key offset data
+	// keys are added out of offset order
+	int tkeys[]    = {0, 1, 2, 3, 4};
+	int toffsets[] = {30, 10, 50, 20, 40};
 	for (int i = 0; i < 5; ++i) {
-		int key = test_data[i].key;
-		if (segf_update_memtable(seg, key, key+1) < 0)
+		if (segf_update_memtable(seg, tkeys[i], toffsets[i]) < 0)
 			ck_abort_msg("ERROR: segf_update_memtable failed\n");
 	}
 
-	int key, cnt = 5;
-	while ((key = segf_next_key(seg)) != -1) {
-		if (key > 5)
-			ck_abort_msg("Unknown key: %d\n", key);
+	struct segf_cursor *c1, *c2;
+	if ((c1 = segf_cursor_init(seg, seg->table)) == NULL ||
+	    (c2 = segf_cursor_init(seg, seg->table)) == NULL)
+		ck_abort_msg("ERROR: segf_cursor_init failed\n");
 
-		if (test_data[key].found)
-			ck_abort_msg("Key read twice: %d\n", key);
-
-		ck_assert_int_eq(key, test_data[key].key);
-		test_data[key].found = 1;
-		cnt -= 1;
+	// keys come back in offset order, and two cursors do not get in
+	// each others way
+	int key, want[] = {1, 3, 0, 4, 2};
+	ck_assert_int_eq(segf_cursor_next(c2, &key), 1);
+	ck_assert_int_eq(key, want[0]);
+	for (int i = 0; i < 5; ++i) {
+		ck_assert_int_eq(segf_cursor_next(c1, &key), 1);
+		ck_assert_int_eq(key, want[i]);
 	}
+	ck_assert_int_eq(segf_cursor_next(c1, &key), 0);
+	ck_assert_int_eq(segf_cursor_next(c2, &key), 1);
+	ck_assert_int_eq(key, want[1]);
 
-	ck_assert_int_eq(cnt, 0); // check that 5 keys were read
-	ck_assert_int_eq(seg->next_bucket, 0);
+	// keys added after the cursor was created are not seen
+	if (segf_update_memtable(seg, 5, 60) < 0)
+		ck_abort_msg("ERROR: segf_update_memtable failed\n");
+	ck_assert_int_eq(segf_cursor_next(c1, &key), 0);
 
+	segf_cursor_free(c1);
+	segf_cursor_free(c2);
 	memtable_free(seg->table);
 	free(seg);
 } END_TEST
@@ -122,8 +137,8 @@ Suite *segment_file_suite(void)
 	tc = tcase_create("Core");
 
 	tcase_add_test(tc, test_segf_init);
-	tcase_add_test(tc, test_segf_link_before);
-	tcase_add_test(tc, test_segf_next_key);
+	tcase_add_test(tc, test_segf_table);
+	tcase_add_test(tc, test_segf_cursor);
 	/* Add future segment_file struct test cases */
 	
 	suite_add_tcase(s, tc);
@@ -138,6 +153,8 @@ START_TEST(test_segf_create_file)
 	struct segment_file seg;
 	seg.size = 0;
 	seg.seg_fd = -1;
+	seg.fd_users = 0;
+	seg.lru_prev = seg.lru_next = NULL;
 	seg.name = "test.dat";
 	seg.table = NULL;
 	
@@ -189,6 +206,7 @@ START_TEST(test_segf_delete_file)
 	
 	struct segment_file seg;
 	seg.seg_fd = -1;
+	seg.fd_users = 0;
 	seg.name = "test2.dat";
 	seg.table = NULL;
 
@@ -205,6 +223,603 @@ START_TEST(test_segf_delete_file)
 } END_TEST
 
 
+START_TEST(test_segf_append_read_v2)
+{
+	struct segment_file *seg;
+	if ((seg = segf_init(strdup("test_v2.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+
+	if (segf_create_file(seg) < 0)
+		ck_abort_msg("ERROR: segf_create_file failed\n");
+
+	ck_assert_int_eq(seg->version, SEGF_V2);
+	ck_assert_uint_eq(seg->size, SEGF_HDR_SZ);
+
+	if (segf_append(seg, 1, "one", TOMBSTONE_INS) < 0 ||
+	    segf_append(seg, -7, "minus seven", TOMBSTONE_INS) < 0)
+		ck_abort_msg("ERROR: segf_append failed\n");
+
+	// flags + 1 byte key + 1 byte length + value, no null char
+	ck_assert_uint_eq(seg->size, SEGF_HDR_SZ + (3 + 3) + (3 + 11));
+	ck_assert_uint_eq(segf_kv_size(seg, 1, 3, 0), 3 + 3);
+
+	// read back through a freshly repopulated segment file
+	struct segment_file *seg2;
+	if ((seg2 = segf_init(strdup("test_v2.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_open_file(seg2) < 0 || segf_repop_memtable(seg2) < 0)
+		ck_abort_msg("ERROR: could not reopen segment file\n");
+
+	ck_assert_int_eq(seg2->version, SEGF_V2);
+	ck_assert_uint_eq(seg2->size, seg->size);
+
+	char *val;
+	ck_assert_int_eq(segf_read_file(seg2, 1, &val), 1);
+	ck_assert_str_eq(val, "one");
+	free(val);
+	ck_assert_int_eq(segf_read_file(seg2, -7, &val), 1);
+	ck_assert_str_eq(val, "minus seven");
+	free(val);
+
+	segf_free(seg2);
+	segf_delete_file(seg);
+	segf_free(seg);
+} END_TEST
+
+
+/*
+ * Returns the size of the file at path, or -1 if it can't be read
+ */
+static off_t file_size(const char *path)
+{
+	struct stat st;
+
+	return (stat(path, &st) < 0) ? -1 : st.st_size;
+}
+
+
+START_TEST(test_segf_torn_tail)
+{
+	struct segment_file *seg, *seg2;
+	char val[16], c = (char)0xff, *got;
+	uint64_t size, last;
+	int fd;
+
+	if ((seg = segf_init(strdup("test_torn.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_create_file(seg) < 0)
+		ck_abort_msg("ERROR: segf_create_file failed\n");
+	for (int key = 1; key <= 6; ++key) {
+		last = seg->size;
+		snprintf(val, sizeof(val), "value %d", key);
+		if (segf_append(seg, key, val, TOMBSTONE_INS) < 0)
+			ck_abort_msg("ERROR: segf_append failed\n");
+	}
+	size = seg->size - 1;
+	if (truncate("test_torn.dat", size) < 0)
+		ck_abort_msg("ERROR: truncate failed\n");
+
+	// a sealed segment file is never appended to, nothing is cut off
+	if ((seg2 = segf_init(strdup("test_torn.dat"))) == NULL ||
+	    segf_open_file(seg2) < 0)
+		ck_abort_msg("ERROR: could not reopen segment file\n");
+	seg2->sealed = 1;
+	errno = 0;
+	ck_assert_int_eq(segf_repop_memtable(seg2), -1);
+	ck_assert_int_eq(errno, EIO);
+	segf_free(seg2);
+	ck_assert_int_eq(file_size("test_torn.dat"), size);
+
+	// the last record of the head was cut short by a crash
+	if ((seg2 = segf_init(strdup("test_torn.dat"))) == NULL ||
+	    segf_open_file(seg2) < 0 || segf_repop_memtable(seg2) < 0)
+		ck_abort_msg("ERROR: could not reopen segment file\n");
+	ck_assert_uint_eq(seg2->size, last);
+	ck_assert_int_eq(segf_read_file(seg2, 6, &got), 0);
+	ck_assert_int_eq(segf_read_file(seg2, 5, &got), 1);
+	free(got);
+	segf_free(seg2);
+
+	// a header that does not decode with more records after it
+	if ((fd = open("test_torn.dat", O_WRONLY)) < 0)
+		ck_abort_msg("ERROR: open failed\n");
+	for (int i = 1; i <= 5; ++i)
+		pwrite(fd, &c, 1, SEGF_HDR_SZ + i);
+	close(fd);
+
+	if ((seg2 = segf_init(strdup("test_torn.dat"))) == NULL ||
+	    segf_open_file(seg2) < 0)
+		ck_abort_msg("ERROR: could not reopen segment file\n");
+	errno = 0;
+	ck_assert_int_eq(segf_repop_memtable(seg2), -1);
+	ck_assert_int_eq(errno, EIO);
+	segf_free(seg2);
+	ck_assert_int_eq(file_size("test_torn.dat"), last);
+
+	segf_delete_file(seg);
+	segf_free(seg);
+} END_TEST
+
+
+/*
+ * Appends a batch to seg with the file size limited to size + grow bytes,
+ * which must make it fail, and checks the batch was taken back off.
+ */
+static void check_batch_rollback(struct segment_file *seg, const char *path,
+				 rlim_t grow)
+{
+	struct record_hdr hdrs[3];
+	struct rlimit old, lim;
+	char *vals[3] = {"two", "a value too long to fit", "three"}, *val;
+	uint64_t size = seg->size;
+
+	memset(hdrs, 0, sizeof(hdrs));
+	for (int i = 0; i < 3; ++i)
+		hdrs[i].key = i + 1;
+
+	signal(SIGXFSZ, SIG_IGN);
+	getrlimit(RLIMIT_FSIZE, &old);
+	lim = old;
+	lim.rlim_cur = size + grow;
+	if (setrlimit(RLIMIT_FSIZE, &lim) < 0)
+		ck_abort_msg("ERROR: setrlimit failed\n");
+	ck_assert_int_eq(segf_append_batch(seg, hdrs, vals, 3), -1);
+	setrlimit(RLIMIT_FSIZE, &old);
+
+	ck_assert_uint_eq(seg->size, size);
+	ck_assert_int_eq(file_size(path), size);
+	ck_assert_int_eq(segf_read_file(seg, 1, &val), 1);
+	ck_assert_str_eq(val, "one");
+	free(val);
+	ck_assert_int_eq(segf_read_file(seg, 2, &val), 0);
+	ck_assert_int_eq(segf_read_file(seg, 3, &val), 0);
+
+	ck_assert_int_eq(segf_append_batch(seg, hdrs, vals, 3), 0);
+	ck_assert_int_eq(segf_read_file(seg, 3, &val), 1);
+	ck_assert_str_eq(val, "three");
+	free(val);
+}
+
+
+START_TEST(test_segf_batch_rollback)
+{
+	struct segment_file *seg;
+	int fd, key = 1, val_len = 4, key_len = sizeof(int);
+	char ts = TOMBSTONE_INS;
+
+	// the write of a v2 batch comes up short
+	if ((seg = segf_init(strdup("test_batch.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_create_file(seg) < 0 ||
+	    segf_append(seg, 1, "one", TOMBSTONE_INS) < 0)
+		ck_abort_msg("ERROR: could not fill segment file\n");
+	check_batch_rollback(seg, "test_batch.dat", 8);
+	segf_delete_file(seg);
+	segf_free(seg);
+
+	// a v1 file is appended to a record at a time, the first one fits
+	if ((fd = open("test_batch.dat", O_CREAT|O_TRUNC|O_RDWR, 0664)) < 0)
+		ck_abort_msg("ERROR: could not create v1 file\n");
+	write(fd, &ts, 1);
+	write(fd, &val_len, sizeof(val_len));
+	write(fd, "one", val_len);
+	write(fd, &key_len, sizeof(key_len));
+	write(fd, &key, key_len);
+	close(fd);
+
+	if ((seg = segf_init(strdup("test_batch.dat"))) == NULL ||
+	    segf_open_file(seg) < 0 || segf_repop_memtable(seg) < 0)
+		ck_abort_msg("ERROR: could not open v1 file\n");
+	ck_assert_int_eq(seg->version, SEGF_V1);
+	check_batch_rollback(seg, "test_batch.dat", 20);
+	segf_delete_file(seg);
+	segf_free(seg);
+} END_TEST
+
+
+START_TEST(test_segf_read_v1)
+{
+	// hand write a v1 file: tombstone, val_len, val, key_len, key
+	int fd = open("test_v1.dat", O_CREAT|O_TRUNC|O_RDWR, 0664);
+	if (fd < 0)
+		ck_abort_msg("ERROR: could not create v1 file\n");
+
+	struct { char ts; int key; char *val; } pairs[] = {
+		{TOMBSTONE_INS, 1, "one"},
+		{TOMBSTONE_INS, 2, "two"},
+		{TOMBSTONE_DEL, 1, "one"},
+		{TOMBSTONE_INS, 3, "three"},
+	};
+	for (int i = 0; i < 4; ++i) {
+		int val_len = strlen(pairs[i].val) + 1;
+		int key_len = sizeof(int);
+		write(fd, &pairs[i].ts, 1);
+		write(fd, &val_len, sizeof(val_len));
+		write(fd, pairs[i].val, val_len);
+		write(fd, &key_len, sizeof(key_len));
+		write(fd, &pairs[i].key, key_len);
+	}
+	close(fd);
+
+	struct segment_file *seg;
+	if ((seg = segf_init(strdup("test_v1.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_open_file(seg) < 0 || segf_repop_memtable(seg) < 0)
+		ck_abort_msg("ERROR: could not open v1 file\n");
+
+	ck_assert_int_eq(seg->version, SEGF_V1);
+
+	char *val;
+	ck_assert_int_eq(segf_read_file(seg, 1, &val), SEGF_DELETED);
+	ck_assert_int_eq(segf_read_file(seg, 2, &val), 1);
+	ck_assert_str_eq(val, "two");
+	free(val);
+	ck_assert_int_eq(segf_read_file(seg, 3, &val), 1);
+	ck_assert_str_eq(val, "three");
+	free(val);
+
+	segf_delete_file(seg);
+	segf_free(seg);
+} END_TEST
+
+
+START_TEST(test_segf_remove_pair)
+{
+	struct segment_file *seg;
+	if ((seg = segf_init(strdup("test_del.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_create_file(seg) < 0)
+		ck_abort_msg("ERROR: segf_create_file failed\n");
+
+	char big[512];
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	if (segf_append(seg, 9, big, TOMBSTONE_INS) < 0)
+		ck_abort_msg("ERROR: segf_append failed\n");
+
+	uint64_t size = seg->size;
+	ck_assert_int_eq(segf_remove_pair(seg, 9), 1);
+
+	// tombstone is just flags, key, and an empty value length
+	ck_assert_uint_eq(seg->size, size + 3);
+	ck_assert_int_eq(segf_remove_pair(seg, 9), 0);
+	ck_assert_int_eq(segf_remove_pair(seg, 10), 0);
+
+	char *val;
+	ck_assert_int_eq(segf_read_file(seg, 9, &val), SEGF_DELETED);
+
+	// tombstone survives repopulating the memtable
+	struct segment_file *seg2;
+	if ((seg2 = segf_init(strdup("test_del.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_open_file(seg2) < 0 || segf_repop_memtable(seg2) < 0)
+		ck_abort_msg("ERROR: could not reopen segment file\n");
+	ck_assert_int_eq(segf_read_file(seg2, 9, &val), SEGF_DELETED);
+	ck_assert_uint_eq(seg2->size, seg->size);
+
+	segf_free(seg2);
+	segf_delete_file(seg);
+	segf_free(seg);
+} END_TEST
+
+START_TEST(test_segf_large_offsets)
+{
+	struct segment_file *seg;
+	if ((seg = segf_init(strdup("test_large.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_create_file(seg) < 0)
+		ck_abort_msg("ERROR: segf_create_file failed\n");
+
+	// a hole takes the file past 4 GB without writing to the disk
+	uint64_t hole = (5ULL << 30);
+	if (truncate("test_large.dat", hole) < 0)
+		ck_abort_msg("ERROR: truncate failed\n");
+	seg->size = hole;
+
+	if (segf_append(seg, 7, "seven", TOMBSTONE_INS) < 0)
+		ck_abort_msg("ERROR: segf_append failed\n");
+	ck_assert_uint_eq(seg->size, hole + 3 + 5);
+
+	uint64_t offset;
+	ck_assert_int_eq(segf_read_memtable(seg, 7, &offset), MEMTE_LIVE);
+	ck_assert_uint_eq(offset, hole);
+
+	char *val;
+	ck_assert_int_eq(segf_read_file(seg, 7, &val), 1);
+	ck_assert_str_eq(val, "seven");
+	free(val);
+
+	// offsets this large do not fit an index, the memtable stays
+	errno = 0;
+	ck_assert_int_eq(segf_finish_sorted(seg), -1);
+	ck_assert_int_eq(errno, EFBIG);
+	ck_assert_int_eq(segf_read_file(seg, 7, &val), 1);
+	free(val);
+
+	segf_delete_file(seg);
+	segf_free(seg);
+} END_TEST
+
+
+START_TEST(test_segf_checksum)
+{
+	struct segment_file *seg;
+	if ((seg = segf_init(strdup("test_crc.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+
+	seg->flags = SEGF_HDR_CHECKSUM;
+	if (segf_create_file(seg) < 0)
+		ck_abort_msg("ERROR: segf_create_file failed\n");
+
+	if (segf_append(seg, 5, "five", TOMBSTONE_INS) < 0)
+		ck_abort_msg("ERROR: segf_append failed\n");
+	ck_assert_uint_eq(seg->size, SEGF_HDR_SZ + 3 + 4 + REC_CRC_SZ);
+
+	char *val;
+	ck_assert_int_eq(segf_read_file(seg, 5, &val), 1);
+	ck_assert_str_eq(val, "five");
+	free(val);
+
+	// flip a byte of the value
+	pwrite(seg->seg_fd, "F", 1, SEGF_HDR_SZ + 3);
+	errno = 0;
+	ck_assert_int_eq(segf_read_file(seg, 5, &val), -1);
+	ck_assert_int_eq(errno, EIO);
+
+	segf_delete_file(seg);
+	segf_free(seg);
+} END_TEST
+
+
+START_TEST(test_segf_sorted)
+{
+	struct segment_file *seg;
+	if ((seg = segf_init(strdup("test_sorted.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_create_file(seg) < 0)
+		ck_abort_msg("ERROR: segf_create_file failed\n");
+
+	// even keys from -20 to 20, a tombstone, then a range tombstone
+	struct record_hdr hdr = {0};
+	for (int key = -20; key <= 20; key += 2) {
+		hdr.flags = 0;
+		hdr.key = key;
+		hdr.val_len = 5;
+		hdr.seq += 1;
+		if (segf_append_rec(seg, &hdr, "value") < 0)
+			ck_abort_msg("ERROR: segf_append_rec failed\n");
+	}
+	hdr.flags = REC_DEL;
+	hdr.key = 21;
+	hdr.val_len = 0;
+	hdr.seq += 1;
+	char end[REC_MAX_VARINT_SZ];
+	struct record_hdr rd = {REC_RANGE_DEL, 30, 0, hdr.seq + 1, 0};
+	rd.val_len = rec_encode_range_end(end, 40);
+	if (segf_append_rec(seg, &hdr, NULL) < 0 ||
+	    segf_append_rec(seg, &rd, end) < 0)
+		ck_abort_msg("ERROR: segf_append_rec failed\n");
+
+	ck_assert_int_eq(segf_finish_sorted(seg), 0);
+	ck_assert(seg->flags & SEGF_HDR_SORTED);
+	ck_assert_int_eq(seg->sealed, 1);
+	ck_assert_uint_eq(seg->table->entries, 0);
+	ck_assert_int_gt(seg->nfences, 1);
+	ck_assert_int_eq(seg->fences[0].key, -20);
+
+	// reopening loads the fences and range tombstone but no keys
+	struct segment_file *seg2;
+	if ((seg2 = segf_init(strdup("test_sorted.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_open_file(seg2) < 0 || segf_repop_memtable(seg2) < 0)
+		ck_abort_msg("ERROR: could not reopen segment file\n");
+
+	ck_assert(seg2->flags & SEGF_HDR_SORTED);
+	ck_assert_int_eq(seg2->sealed, 1);
+	ck_assert_uint_eq(seg2->size, seg->size);
+	ck_assert_uint_eq(seg2->max_seq, rd.seq);
+	ck_assert_uint_eq(seg2->table->entries, 0);
+	ck_assert_int_eq(seg2->nfences, seg->nfences);
+	ck_assert_int_eq(seg2->nrange_dels, 1);
+	ck_assert_uint_eq(segf_range_cover(seg2, 35, UINT64_MAX), rd.seq);
+
+	char *val;
+	for (int key = -22; key <= 22; ++key) {
+		int want = (key == 21) ? SEGF_DELETED : 0;
+		if (key >= -20 && key <= 20 && key % 2 == 0)
+			want = 1;
+
+		ck_assert_int_eq(segf_read_file(seg2, key, &val), want);
+		if (want == 1) {
+			ck_assert_str_eq(val, "value");
+			free(val);
+		}
+	}
+
+	// cursors read the keys back in ascending order
+	struct segf_cursor *cur;
+	if ((cur = segf_cursor_init(seg2, seg2->table)) == NULL)
+		ck_abort_msg("ERROR: segf_cursor_init failed\n");
+	int key, want = -20;
+	while (segf_cursor_next(cur, &key)) {
+		ck_assert_int_eq(key, want);
+		want += (want == 20) ? 1 : 2;
+	}
+	ck_assert_int_eq(want, 23); // one past the tombstone
+	segf_cursor_free(cur);
+
+	// sealed segment files can't be finished again
+	errno = 0;
+	ck_assert_int_eq(segf_finish_sorted(seg2), -1);
+	ck_assert_int_eq(errno, EINVAL);
+
+	segf_free(seg2);
+	segf_delete_file(seg);
+	segf_free(seg);
+} END_TEST
+
+
+START_TEST(test_segf_hashed)
+{
+	struct segment_file *seg;
+	if ((seg = segf_init(strdup("test_hashed.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_create_file(seg) < 0)
+		ck_abort_msg("ERROR: segf_create_file failed\n");
+
+	// keys have to be appended in slot order
+	int tkeys[] = {40, -3, 17, 8};
+	char *tvals[] = {"forty", "minus three", "seventeen", NULL};
+	int order[4];
+	struct mph *mph = mph_build(tkeys, 4);
+	if (mph == NULL)
+		ck_abort_msg("ERROR: mph_build failed\n");
+	for (int i = 0; i < 4; ++i)
+		order[mph_lookup(mph, tkeys[i])] = i;
+	mph_free(mph);
+
+	// out of order keys are turned down
+	if (segf_append(seg, tkeys[order[1]], "x", TOMBSTONE_INS) < 0 ||
+	    segf_append(seg, tkeys[order[0]], "x", TOMBSTONE_INS) < 0)
+		ck_abort_msg("ERROR: segf_append failed\n");
+	errno = 0;
+	ck_assert_int_eq(segf_finish_hashed(seg), -1);
+	ck_assert_int_eq(errno, EINVAL);
+	segf_delete_file(seg);
+	segf_free(seg);
+
+	if ((seg = segf_init(strdup("test_hashed.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_create_file(seg) < 0)
+		ck_abort_msg("ERROR: segf_create_file failed\n");
+
+	// key 8 is a tombstone
+	for (int i = 0; i < 4; ++i) {
+		int j = order[i];
+		if (segf_append(seg, tkeys[j], tvals[j],
+				(tvals[j]) ? TOMBSTONE_INS : TOMBSTONE_DEL) < 0)
+			ck_abort_msg("ERROR: segf_append failed\n");
+	}
+
+	ck_assert_int_eq(segf_finish_hashed(seg), 0);
+	ck_assert(seg->flags & SEGF_HDR_HASHED);
+	ck_assert_int_eq(seg->sealed, 1);
+	ck_assert_uint_eq(seg->table->entries, 0);
+
+	// reopening reads the hash function back, the keys get their slots
+	struct segment_file *seg2;
+	if ((seg2 = segf_init(strdup("test_hashed.dat"))) == NULL)
+		ck_abort_msg("ERROR: segf_init failed\n");
+	if (segf_open_file(seg2) < 0 || segf_repop_memtable(seg2) < 0)
+		ck_abort_msg("ERROR: could not reopen segment file\n");
+
+	ck_assert(seg2->flags & SEGF_HDR_HASHED);
+	ck_assert_int_eq(seg2->sealed, 1);
+	ck_assert_uint_eq(seg2->size, seg->size);
+	ck_assert_uint_eq(seg2->hidx->mph->nkeys, 4);
+
+	char *val;
+	ck_assert_int_eq(segf_read_file(seg2, 17, &val), 1);
+	ck_assert_str_eq(val, "seventeen");
+	free(val);
+	ck_assert_int_eq(segf_read_file(seg2, -3, &val), 1);
+	ck_assert_str_eq(val, "minus three");
+	free(val);
+	ck_assert_int_eq(segf_read_file(seg2, 8, &val), SEGF_DELETED);
+	for (int key = 100; key < 200; ++key)
+		ck_assert_int_eq(segf_read_file(seg2, key, &val), 0);
+
+	// cursors see the keys in file order
+	struct segf_cursor *cur;
+	if ((cur = segf_cursor_init(seg2, seg2->table)) == NULL)
+		ck_abort_msg("ERROR: segf_cursor_init failed\n");
+	int key;
+	for (int i = 0; i < 4; ++i) {
+		ck_assert_int_eq(segf_cursor_next(cur, &key), 1);
+		ck_assert_int_eq(key, tkeys[order[i]]);
+	}
+	ck_assert_int_eq(segf_cursor_next(cur, &key), 0);
+	segf_cursor_free(cur);
+
+	// a demoted index probes the mapped slot table and finds the same
+	ck_assert_uint_gt(segf_index_mem(seg2), 0);
+	ck_assert_int_eq(segf_demote_index(seg2), 0);
+	ck_assert_ptr_nonnull(seg2->hidx->slots);
+	ck_assert_ptr_null(seg2->hidx->keys);
+	ck_assert_int_eq(segf_read_file(seg2, 40, &val), 1);
+	ck_assert_str_eq(val, "forty");
+	free(val);
+	ck_assert_int_eq(segf_read_file(seg2, 8, &val), SEGF_DELETED);
+	for (int key = 100; key < 200; ++key)
+		ck_assert_int_eq(segf_read_file(seg2, key, &val), 0);
+
+	if ((cur = segf_cursor_init(seg2, seg2->table)) == NULL)
+		ck_abort_msg("ERROR: segf_cursor_init failed\n");
+	for (int i = 0; i < 4; ++i) {
+		ck_assert_int_eq(segf_cursor_next(cur, &key), 1);
+		ck_assert_int_eq(key, tkeys[order[i]]);
+		ck_assert_int_eq(segf_cursor_entry(cur)->deleted, key == 8);
+	}
+	segf_cursor_free(cur);
+
+	ck_assert_int_eq(segf_promote_index(seg2), 0);
+	ck_assert_ptr_null(seg2->hidx->slots);
+	ck_assert_int_eq(segf_read_file(seg2, 17, &val), 1);
+	ck_assert_str_eq(val, "seventeen");
+	free(val);
+
+	segf_free(seg2);
+	segf_delete_file(seg);
+	segf_free(seg);
+} END_TEST
+
+
+START_TEST(test_segf_fd_cache)
+{
+	struct segment_file *segs[4];
+	struct segf_fd_stats before, after;
+	char name[32], *val;
+
+	segf_fd_cache_limit(2);
+	for (int i = 0; i < 4; ++i) {
+		snprintf(name, sizeof(name), "test_fd%d.dat", i);
+		if ((segs[i] = segf_init(strdup(name))) == NULL ||
+		    segf_create_file(segs[i]) < 0 ||
+		    segf_append(segs[i], i, "val", TOMBSTONE_INS) < 0)
+			ck_abort_msg("ERROR: could not create segment file\n");
+	}
+
+	// only the two most recently used stay open
+	segf_fd_cache_stats(&before);
+	ck_assert_int_eq(before.open, 2);
+	ck_assert_int_eq(segs[0]->seg_fd, -1);
+	ck_assert_int_ne(segs[3]->seg_fd, -1);
+
+	// a retired file can't be reopened, it is kept open instead
+	ck_assert_int_eq(segf_retire_file(segs[1]), 0);
+	for (int i = 0; i < 4; ++i) {
+		ck_assert_int_eq(segf_read_file(segs[i], i, &val), 1);
+		ck_assert_str_eq(val, "val");
+		free(val);
+	}
+	ck_assert_int_ne(segs[1]->seg_fd, -1);
+
+	segf_fd_cache_stats(&after);
+	ck_assert_uint_gt(after.misses, before.misses);
+	ck_assert_uint_gt(after.evictions, before.evictions);
+	ck_assert_int_le(after.open, 3);
+
+	for (int i = 0; i < 4; ++i) {
+		if (i != 1)
+			segf_delete_file(segs[i]);
+		segf_free(segs[i]);
+	}
+	segf_fd_cache_stats(&after);
+	ck_assert_int_eq(after.open, 0);
+	segf_fd_cache_limit(SEGF_FD_CACHE_SZ);
+} END_TEST
+
+
 /*
  * Creates and returns a test suite for segment_file IO functions
  */
@@ -219,6 +834,16 @@ Suite *segment_file_io_suite(void)
 	tcase_add_test(tc, test_segf_create_file);
 	tcase_add_test(tc, test_segf_rename_file);
 	tcase_add_test(tc, test_segf_delete_file);
+	tcase_add_test(tc, test_segf_append_read_v2);
+	tcase_add_test(tc, test_segf_torn_tail);
+	tcase_add_test(tc, test_segf_batch_rollback);
+	tcase_add_test(tc, test_segf_read_v1);
+	tcase_add_test(tc, test_segf_remove_pair);
+	tcase_add_test(tc, test_segf_large_offsets);
+	tcase_add_test(tc, test_segf_checksum);
+	tcase_add_test(tc, test_segf_sorted);
+	tcase_add_test(tc, test_segf_hashed);
+	tcase_add_test(tc, test_segf_fd_cache);
 
 	suite_add_tcase(s, tc);
 	return s;
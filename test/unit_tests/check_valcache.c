@@ -0,0 +1,177 @@
+/*
+ * Tests for valcache.c
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../src/valcache.h"
+
+
+START_TEST(test_vcache_get_put)
+{
+	struct vcache *c;
+	struct vcache_stats s;
+	uint64_t seq;
+	char *val;
+
+	if ((c = vcache_init(1 << 16, VCACHE_TINYLFU)) == NULL)
+		ck_abort_msg("ERROR: vcache_init failed\n");
+
+	ck_assert_int_eq(vcache_get(c, 8, 1, 8, &seq, &val), 0);
+	ck_assert_int_eq(vcache_put(c, 8, 1, 8, 3, "one", 3), 1);
+	ck_assert_int_eq(vcache_put(c, 8, 1, 8, 3, "one", 3), 0);
+
+	// the same offset in another segment file is another record
+	ck_assert_int_eq(vcache_get(c, 8, 2, 8, &seq, &val), 0);
+	ck_assert_int_eq(vcache_get(c, 8, 1, 8, &seq, &val), 1);
+	ck_assert_str_eq(val, "one");
+	ck_assert_uint_eq(seq, 3);
+	free(val);
+
+	// enough entries to grow the buckets
+	for (uint64_t off = 100; off < 100 + VCACHE_MIN_BUCKETS * 2; ++off)
+		vcache_put(c, (int)off, 1, off, off, "", 0);
+	ck_assert_int_eq(vcache_get(c, 100, 1, 100, &seq, &val), 1);
+	ck_assert_uint_eq(seq, 100);
+	free(val);
+
+	vcache_stats(c, &s);
+	ck_assert_uint_eq(s.hits, 2);
+	ck_assert_uint_eq(s.misses, 2);
+	ck_assert_uint_eq(s.evictions, 0);
+	ck_assert_uint_eq(s.entries, 1 + VCACHE_MIN_BUCKETS * 2);
+
+	// larger than the whole budget
+	char big[1 << 17];
+	memset(big, 'x', sizeof(big));
+	ck_assert_int_eq(vcache_put(c, 8, 3, 8, 1, big, sizeof(big)), 0);
+
+	vcache_free(c);
+} END_TEST
+
+
+START_TEST(test_vcache_clock)
+{
+	struct vcache *c;
+	struct vcache_stats s;
+	uint64_t seq;
+	char *val;
+
+	// room for three entries with 4 byte values
+	size_t entry = sizeof(struct vcache_entry) + 5;
+	if ((c = vcache_init(entry * 3, VCACHE_CLOCK)) == NULL)
+		ck_abort_msg("ERROR: vcache_init failed\n");
+
+	vcache_put(c, 10, 1, 10, 1, "aaaa", 4);
+	vcache_put(c, 20, 1, 20, 2, "bbbb", 4);
+	vcache_put(c, 30, 1, 30, 3, "cccc", 4);
+
+	// a hit keeps the oldest entry, the next one goes instead
+	ck_assert_int_eq(vcache_get(c, 10, 1, 10, &seq, &val), 1);
+	free(val);
+	ck_assert_int_eq(vcache_put(c, 40, 1, 40, 4, "dddd", 4), 1);
+
+	ck_assert_int_eq(vcache_get(c, 20, 1, 20, &seq, &val), 0);
+	ck_assert_int_eq(vcache_get(c, 10, 1, 10, &seq, &val), 1);
+	free(val);
+	ck_assert_int_eq(vcache_get(c, 40, 1, 40, &seq, &val), 1);
+	ck_assert_str_eq(val, "dddd");
+	free(val);
+
+	vcache_stats(c, &s);
+	ck_assert_uint_eq(s.evictions, 1);
+	ck_assert_uint_eq(s.entries, 3);
+	ck_assert_uint_eq(s.bytes, entry * 3);
+
+	vcache_free(c);
+} END_TEST
+
+
+/*
+ * Looks the key up in the cache, and puts it there on a miss, the way
+ * hashDB_get does. The offset of a key's record is the key.
+ */
+static int lookup(struct vcache *c, int key, const char *val, int val_len)
+{
+	uint64_t seq;
+	char *v;
+
+	if (vcache_get(c, key, 1, key, &seq, &v) == 1) {
+		free(v);
+		return 1;
+	}
+	vcache_put(c, key, 1, key, 0, val, val_len);
+	return 0;
+}
+
+
+START_TEST(test_vcache_tinylfu)
+{
+	struct vcache *c;
+	struct vcache_stats s;
+	char val[200];
+	int key;
+
+	// room for 100 entries
+	memset(val, 'v', sizeof(val));
+	size_t entry = sizeof(struct vcache_entry) + sizeof(val) + 1;
+	if ((c = vcache_init(entry * 100, VCACHE_TINYLFU)) == NULL)
+		ck_abort_msg("ERROR: vcache_init failed\n");
+
+	for (int i = 0; i < 5; ++i) {
+		for (key = 0; key < 50; ++key)
+			lookup(c, key, val, sizeof(val));
+	}
+	ck_assert_uint_ge(vcache_estimate(c, 0), 5);
+
+	// a scan of keys that are looked up once
+	for (key = 1000; key < 1200; ++key)
+		lookup(c, key, val, sizeof(val));
+
+	vcache_stats(c, &s);
+	ck_assert_uint_gt(s.rejections, 100);
+	for (key = 0; key < 50; ++key)
+		ck_assert_int_eq(lookup(c, key, val, sizeof(val)), 1);
+
+	vcache_stats(c, &s);
+	ck_assert_uint_le(s.bytes, entry * 100);
+	vcache_free(c);
+} END_TEST
+
+
+/*
+ * Creates and returns a test suite for the value cache
+ */
+Suite *valcache_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("Value Cache");
+	tc = tcase_create("Core");
+
+	tcase_add_test(tc, test_vcache_get_put);
+	tcase_add_test(tc, test_vcache_clock);
+	tcase_add_test(tc, test_vcache_tinylfu);
+
+	suite_add_tcase(s, tc);
+	return s;
+}
+
+
+int main(void)
+{
+	int fail = 0;
+	Suite *s;
+	SRunner *runner;
+
+	s = valcache_suite();
+	runner = srunner_create(s);
+
+	srunner_run_all(runner, CK_NORMAL);
+	fail = srunner_ntests_failed(runner);
+	srunner_free(runner);
+
+	return (fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -5,18 +5,48 @@
 
 echo "Building tests..."
 make check_memtable || { echo "ERROR: make check_memtable failed" ; exit 1; }
+make check_record   || { echo "ERROR: make check_record failed"   ; exit 1; }
+make check_keyindex || { echo "ERROR: make check_keyindex failed" ; exit 1; }
+make check_mph      || { echo "ERROR: make check_mph failed"      ; exit 1; }
+make check_eliasfano || { echo "ERROR: make check_eliasfano failed" ; exit 1; }
+make check_manifest || { echo "ERROR: make check_manifest failed" ; exit 1; }
+make check_valcache || { echo "ERROR: make check_valcache failed" ; exit 1; }
+make check_ioengine || { echo "ERROR: make check_ioengine failed" ; exit 1; }
+make check_mergeop  || { echo "ERROR: make check_mergeop failed"  ; exit 1; }
 make check_segment  || { echo "ERROR: make check_segment failed"  ; exit 1; }
 make check_hashDB   || { echo "ERROR: make check_hashDB failed"   ; exit 1; }
+make check_async    || { echo "ERROR: make check_async failed"    ; exit 1; }
+make check_committer || { echo "ERROR: make check_committer failed" ; exit 1; }
 echo
 
 # Run in a bottom up order
 echo "Running tests..."
 ./check_memtable || { exit 1; }
 echo 
+./check_record   || { exit 1; }
+echo 
+./check_keyindex || { exit 1; }
+echo 
+./check_mph      || { exit 1; }
+echo 
+./check_eliasfano || { exit 1; }
+echo 
+./check_manifest || { exit 1; }
+echo 
+./check_valcache || { exit 1; }
+echo 
+./check_ioengine || { exit 1; }
+echo 
+./check_mergeop  || { exit 1; }
+echo 
 ./check_segment  || { exit 1; }
 echo 
 ./check_hashDB   || { exit 1; }
 echo
+./check_async    || { exit 1; }
+echo
+./check_committer || { exit 1; }
+echo
 
 echo "Cleaning up after tests"
 make clean &> /dev/null
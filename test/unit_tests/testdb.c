@@ -0,0 +1,38 @@
+/*
+ * Helpers shared by the unit tests
+ */
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "testdb.h"
+
+
+/*
+ * Removes a test database directory and any files in it
+ *
+ * Parameter:
+ *	dir => path of the directory
+ *
+ * Returns:
+ *	void
+ */
+void rm_test_db(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	char path[256];
+
+	if (d == NULL)
+		return;
+
+	while ((e = readdir(d)) != NULL) {
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		remove(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
@@ -0,0 +1,7 @@
+#ifndef _HASHDB_TESTDB_H_
+#define _HASHDB_TESTDB_H_
+
+/* Helpers shared by the unit tests */
+void rm_test_db(const char *dir);
+
+#endif